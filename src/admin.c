@@ -0,0 +1,243 @@
+/*
+ * admin.c - admin control socket and the name sets of bulk commands
+ */
+
+#define _GNU_SOURCE // accept4
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "admin.h"
+
+static struct admin_conn g_conns[ADMIN_CONN_MAX] = {
+	[0 ... ADMIN_CONN_MAX - 1] = { .fd = -1 }
+};
+
+int admin_listen(const char *path) {
+	struct sockaddr_un addr;
+	int sockfd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	if ((sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+		perror("admin: socket");
+		return -1;
+	}
+	unlink(path); // left behind by a server that did not exit cleanly
+	if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+			listen(sockfd, ADMIN_CONN_MAX) == -1) {
+		perror("admin: bind");
+		close(sockfd);
+		return -1;
+	}
+	return sockfd;
+}
+
+int admin_accept(int listen_fd) {
+	struct timeval tv = { ADMIN_SEND_TIMEOUT, 0 };
+	int i, fd;
+
+	if ((fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC)) == -1) {
+		perror("admin: accept");
+		return -1;
+	}
+	for (i = 0; i < ADMIN_CONN_MAX; i++) {
+		if (g_conns[i].fd == -1) {
+			break;
+		}
+	}
+	if (i == ADMIN_CONN_MAX) {
+		dprintf(fd, "error too many admin connections\n");
+		close(fd);
+		return -1;
+	}
+	/* results are written blocking, but a reader that stops reading only holds us so long */
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	if ((g_conns[i].out = fdopen(fd, "w")) == NULL) {
+		perror("admin: fdopen");
+		close(fd);
+		return -1;
+	}
+	setvbuf(g_conns[i].out, NULL, _IOFBF, ADMIN_OUT_BUF);
+	g_conns[i].fd = fd;
+	g_conns[i].len = 0;
+	return fd;
+}
+
+struct admin_conn* admin_find(int fd) {
+	int i;
+
+	for (i = 0; i < ADMIN_CONN_MAX; i++) {
+		if (g_conns[i].fd != -1 && g_conns[i].fd == fd) {
+			return &g_conns[i];
+		}
+	}
+	return NULL;
+}
+
+int admin_fill(struct admin_conn *conn) {
+	ssize_t n;
+
+	if (conn->len == sizeof(conn->in)) {
+		/* a line longer than the buffer, drop it */
+		fprintf(conn->out, "error line longer than %d bytes\n", ADMIN_LINE_MAX);
+		fflush(conn->out);
+		conn->len = 0;
+	}
+	do {
+		n = recv(conn->fd, conn->in + conn->len, sizeof(conn->in) - conn->len, MSG_DONTWAIT);
+	} while (n == -1 && errno == EINTR);
+	if (n > 0) {
+		conn->len += n;
+	}
+	return n;
+}
+
+char* admin_next_line(struct admin_conn *conn) {
+	static char line[ADMIN_LINE_MAX];
+	char *end = memchr(conn->in, '\n', conn->len);
+	size_t n;
+
+	if (end == NULL) {
+		return NULL;
+	}
+	n = end - conn->in;
+	memcpy(line, conn->in, n);
+	line[n] = '\0';
+	if (n > 0 && line[n - 1] == '\r') {
+		line[n - 1] = '\0';
+	}
+	conn->len -= n + 1;
+	memmove(conn->in, end + 1, conn->len);
+	return line;
+}
+
+void admin_close(struct admin_conn *conn) {
+	if (conn->fd == -1) {
+		return;
+	}
+	fclose(conn->out); // flushes and closes fd
+	conn->out = NULL;
+	conn->fd = -1;
+	conn->len = 0;
+}
+
+void admin_close_all(int listen_fd) {
+	int i;
+
+	for (i = 0; i < ADMIN_CONN_MAX; i++) {
+		admin_close(&g_conns[i]);
+	}
+	if (listen_fd != -1) {
+		close(listen_fd);
+	}
+}
+
+/* FNV-1a */
+static size_t hash_name(const char *name) {
+	size_t h = 2166136261u;
+
+	while (*name) {
+		h = (h ^ (unsigned char)*name++) * 16777619u;
+	}
+	return h;
+}
+
+static struct name_entry* find_entry(struct name_entry *entries, size_t capacity, const char *name) {
+	size_t i = hash_name(name) & (capacity - 1);
+
+	while (entries[i].name[0] != '\0' && strcmp(entries[i].name, name) != 0) {
+		i = (i + 1) & (capacity - 1);
+	}
+	return &entries[i];
+}
+
+int name_set_init(struct name_set *set) {
+	set->capacity = 64;
+	set->count = 0;
+	if ((set->entries = calloc(set->capacity, sizeof(struct name_entry))) == NULL) {
+		perror("admin: name set");
+		return -1;
+	}
+	return 0;
+}
+
+/* double the table, return 0 if success, otherwise -1 */
+static int grow(struct name_set *set) {
+	struct name_entry *entries = calloc(set->capacity * 2, sizeof(struct name_entry));
+	size_t i;
+
+	if (entries == NULL) {
+		perror("admin: name set");
+		return -1;
+	}
+	for (i = 0; i < set->capacity; i++) {
+		if (set->entries[i].name[0] != '\0') {
+			*find_entry(entries, set->capacity * 2, set->entries[i].name) = set->entries[i];
+		}
+	}
+	free(set->entries);
+	set->entries = entries;
+	set->capacity *= 2;
+	return 0;
+}
+
+int name_set_add(struct name_set *set, const char *name) {
+	struct name_entry *entry;
+
+	if (name[0] == '\0' || strlen(name) >= NAME_LENGTH) {
+		return -1; // not a name a client can have
+	}
+	if ((set->count + 1) * 2 > set->capacity && grow(set) == -1) {
+		return -1;
+	}
+	entry = find_entry(set->entries, set->capacity, name);
+	if (entry->name[0] == '\0') {
+		strcpy(entry->name, name);
+		entry->found = 0;
+		set->count++;
+	}
+	return 0;
+}
+
+int name_set_load(struct name_set *set, const char *path) {
+	char line[BUF_MAX];
+	FILE *fp;
+	int count = 0;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (name_set_add(set, line) == 0) {
+			count++;
+		}
+	}
+	fclose(fp);
+	return count;
+}
+
+int name_set_take(struct name_set *set, const char *name) {
+	struct name_entry *entry = find_entry(set->entries, set->capacity, name);
+
+	if (entry->name[0] == '\0') {
+		return -1;
+	}
+	entry->found = 1;
+	return 0;
+}
+
+void name_set_free(struct name_set *set) {
+	free(set->entries);
+	set->entries = NULL;
+	set->capacity = set->count = 0;
+}
@@ -0,0 +1,451 @@
+/*
+ * banlist.c - hash set of banned addresses and trie of banned ranges
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "banlist.h"
+
+#define SLOT_FREE              0
+#define SLOT_USED              1
+#define SLOT_DELETED           2
+
+struct ban_slot {
+	struct in6_addr addr;
+	uint8_t state;
+};
+
+/* node 0 is the root, a child of 0 means there is none */
+struct ban_node {
+	uint32_t child[2];
+	uint8_t banned; /* the range ending here is banned */
+};
+
+static struct {
+	pthread_mutex_t lock; // admin and event loop threads
+	struct ban_slot *slots;
+	uint32_t capacity, used, count; /* used counts deleted slots too */
+	struct ban_node *nodes;
+	uint32_t node_count, node_capacity, ranges;
+	int dirty;
+	char path[256];
+} g_bans = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* parse "addr" or "addr/len" into an IPv6 address with the host bits cleared
+ * return 0 if success, otherwise -1 */
+static int parse(const char *text, struct in6_addr *addr, int *prefix) {
+	char buf[BAN_TEXT_MAX];
+	char *slash, *end;
+	struct in_addr v4;
+	int i, max = 128;
+
+	snprintf(buf, sizeof(buf), "%s", text);
+	if ((slash = strchr(buf, '/')) != NULL) {
+		*slash++ = '\0';
+	}
+	memset(addr, 0, sizeof(*addr));
+	if (inet_pton(AF_INET, buf, &v4) == 1) {
+		addr->s6_addr[10] = addr->s6_addr[11] = 0xff;
+		memcpy(&addr->s6_addr[12], &v4, 4);
+		max = 32;
+	} else if (inet_pton(AF_INET6, buf, addr) != 1) {
+		return -1;
+	}
+	*prefix = max;
+	if (slash) {
+		*prefix = strtol(slash, &end, 10);
+		if (*slash == '\0' || *end != '\0' || *prefix < 0 || *prefix > max) {
+			return -1;
+		}
+	}
+	*prefix += 128 - max;
+	for (i = *prefix; i < 128; i++) {
+		addr->s6_addr[i / 8] &= ~(0x80 >> (i % 8));
+	}
+	return 0;
+}
+
+static int bit(const struct in6_addr *addr, int i) {
+	return (addr->s6_addr[i / 8] >> (7 - i % 8)) & 1;
+}
+
+/* FNV-1a */
+static uint32_t hash_addr(const struct in6_addr *addr) {
+	uint32_t h = 2166136261u;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		h = (h ^ addr->s6_addr[i]) * 16777619u;
+	}
+	return h;
+}
+
+/* the slot holding addr, otherwise NULL */
+static struct ban_slot* find_slot(const struct in6_addr *addr) {
+	uint32_t mask = g_bans.capacity - 1;
+	uint32_t i = hash_addr(addr) & mask;
+
+	while (g_bans.slots[i].state != SLOT_FREE) {
+		if (g_bans.slots[i].state == SLOT_USED && memcmp(&g_bans.slots[i].addr, addr, 16) == 0) {
+			return &g_bans.slots[i];
+		}
+		i = (i + 1) & mask;
+	}
+	return NULL;
+}
+
+/* rebuild the set with capacity slots, dropping deleted ones
+ * return 0 if success, otherwise -1 */
+static int rehash(uint32_t capacity) {
+	struct ban_slot *old = g_bans.slots;
+	uint32_t old_capacity = g_bans.capacity, i, j;
+
+	if ((g_bans.slots = calloc(capacity, sizeof(struct ban_slot))) == NULL) {
+		perror("ban set");
+		g_bans.slots = old;
+		return -1;
+	}
+	g_bans.capacity = capacity;
+	g_bans.used = g_bans.count;
+	for (i = 0; i < old_capacity; i++) {
+		if (old[i].state == SLOT_USED) {
+			for (j = hash_addr(&old[i].addr) & (capacity - 1); g_bans.slots[j].state != SLOT_FREE;
+					j = (j + 1) & (capacity - 1));
+			g_bans.slots[j] = old[i];
+		}
+	}
+	free(old);
+	return 0;
+}
+
+static int add_address(const struct in6_addr *addr) {
+	uint32_t i;
+
+	if (find_slot(addr)) {
+		return 0;
+	}
+	if ((g_bans.used + 1) * 4 > g_bans.capacity * 3 &&
+			rehash(g_bans.count * 2 >= g_bans.capacity / 2 ? g_bans.capacity * 2 : g_bans.capacity) == -1) {
+		return -1;
+	}
+	for (i = hash_addr(addr) & (g_bans.capacity - 1); g_bans.slots[i].state == SLOT_USED;
+			i = (i + 1) & (g_bans.capacity - 1));
+	if (g_bans.slots[i].state == SLOT_FREE) {
+		g_bans.used++;
+	}
+	g_bans.slots[i].addr = *addr;
+	g_bans.slots[i].state = SLOT_USED;
+	g_bans.count++;
+	return 1;
+}
+
+/* the node of the range, created when create is set, otherwise 0 if missing */
+static uint32_t walk(const struct in6_addr *addr, int prefix, int create) {
+	uint32_t node = 0, next;
+	int i;
+
+	for (i = 0; i < prefix; i++) {
+		if ((next = g_bans.nodes[node].child[bit(addr, i)]) == 0) {
+			if (!create) {
+				return 0;
+			}
+			if (g_bans.node_count == g_bans.node_capacity) {
+				struct ban_node *nodes = realloc(g_bans.nodes,
+						g_bans.node_capacity * 2 * sizeof(struct ban_node));
+				if (nodes == NULL) {
+					perror("ban trie");
+					return 0;
+				}
+				g_bans.nodes = nodes;
+				g_bans.node_capacity *= 2;
+			}
+			next = g_bans.node_count++;
+			memset(&g_bans.nodes[next], 0, sizeof(struct ban_node));
+			g_bans.nodes[node].child[bit(addr, i)] = next;
+		}
+		node = next;
+	}
+	return node;
+}
+
+static int add_range(const struct in6_addr *addr, int prefix) {
+	uint32_t node = walk(addr, prefix, 1);
+
+	if (node == 0 && prefix > 0) {
+		return -1;
+	}
+	if (g_bans.nodes[node].banned) {
+		return 0;
+	}
+	g_bans.nodes[node].banned = 1;
+	g_bans.ranges++;
+	return 1;
+}
+
+/* return 1 if addr is banned, the lock is held */
+static int check(const struct in6_addr *addr) {
+	uint32_t node = 0;
+	int i;
+
+	if (g_bans.slots == NULL) {
+		return 0;
+	}
+	if (g_bans.count > 0 && find_slot(addr)) {
+		return 1;
+	}
+	for (i = 0; g_bans.ranges > 0; i++) {
+		if (g_bans.nodes[node].banned) {
+			return 1;
+		}
+		if (i == 128 || (node = g_bans.nodes[node].child[bit(addr, i)]) == 0) {
+			break;
+		}
+	}
+	return 0;
+}
+
+/* print an address, IPv4-mapped ones as IPv4 */
+static void print_ban(FILE *out, const struct in6_addr *addr, int prefix) {
+	char text[INET6_ADDRSTRLEN];
+	static const unsigned char mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+	if (prefix >= 96 && memcmp(addr->s6_addr, mapped, 12) == 0) {
+		inet_ntop(AF_INET, &addr->s6_addr[12], text, sizeof(text));
+		prefix -= 96;
+		fprintf(out, prefix == 32 ? "%s\n" : "%s/%d\n", text, prefix);
+	} else {
+		inet_ntop(AF_INET6, addr, text, sizeof(text));
+		fprintf(out, prefix == 128 ? "%s\n" : "%s/%d\n", text, prefix);
+	}
+}
+
+/* print the banned ranges below node, addr holds the bits down to depth */
+static int print_ranges(FILE *out, uint32_t node, struct in6_addr *addr, int depth) {
+	int count = 0, b;
+
+	if (g_bans.nodes[node].banned) {
+		print_ban(out, addr, depth);
+		count++;
+	}
+	for (b = 0; b < 2; b++) {
+		if (g_bans.nodes[node].child[b] != 0) {
+			if (b) {
+				addr->s6_addr[depth / 8] |= 0x80 >> (depth % 8);
+			}
+			count += print_ranges(out, g_bans.nodes[node].child[b], addr, depth + 1);
+			addr->s6_addr[depth / 8] &= ~(0x80 >> (depth % 8));
+		}
+	}
+	return count;
+}
+
+static int list_locked(FILE *out) {
+	struct in6_addr addr;
+	uint32_t i;
+	int count = 0;
+
+	for (i = 0; i < g_bans.capacity; i++) {
+		if (g_bans.slots[i].state == SLOT_USED) {
+			print_ban(out, &g_bans.slots[i].addr, 128);
+			count++;
+		}
+	}
+	if (g_bans.ranges > 0) {
+		memset(&addr, 0, sizeof(addr));
+		count += print_ranges(out, 0, &addr, 0);
+	}
+	return count;
+}
+
+static int save_locked() {
+	char tmp[sizeof(g_bans.path) + 8];
+	FILE *fp;
+
+	if (!g_bans.dirty) {
+		return 0;
+	}
+	snprintf(tmp, sizeof(tmp), "%s.tmp", g_bans.path);
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		perror("write bans fails");
+		return -1;
+	}
+	list_locked(fp);
+	if (fclose(fp) != 0 || rename(tmp, g_bans.path) == -1) {
+		perror("write bans fails");
+		return -1;
+	}
+	g_bans.dirty = 0;
+	return 0;
+}
+
+static int add_locked(const char *text) {
+	struct in6_addr addr;
+	int prefix, ret;
+
+	if (parse(text, &addr, &prefix) == -1) {
+		return -1;
+	}
+	ret = prefix == 128 ? add_address(&addr) : add_range(&addr, prefix);
+	if (ret == 1) {
+		g_bans.dirty = 1;
+	}
+	return ret;
+}
+
+int ban_open(const char *path) {
+	char line[BAN_TEXT_MAX + 2];
+	FILE *fp;
+	int count = 0;
+
+	pthread_mutex_lock(&g_bans.lock);
+	if (g_bans.slots) {
+		pthread_mutex_unlock(&g_bans.lock);
+		return 0;
+	}
+	snprintf(g_bans.path, sizeof(g_bans.path), "%s", path);
+	g_bans.slots = calloc(BAN_INITIAL_SLOTS, sizeof(struct ban_slot));
+	g_bans.nodes = calloc(BAN_INITIAL_SLOTS, sizeof(struct ban_node));
+	if (g_bans.slots == NULL || g_bans.nodes == NULL) {
+		perror("ban set");
+		free(g_bans.slots);
+		free(g_bans.nodes);
+		g_bans.slots = NULL;
+		g_bans.nodes = NULL;
+		pthread_mutex_unlock(&g_bans.lock);
+		return -1;
+	}
+	g_bans.capacity = g_bans.node_capacity = BAN_INITIAL_SLOTS;
+	g_bans.used = g_bans.count = g_bans.ranges = 0;
+	g_bans.node_count = 1; // the root
+
+	if ((fp = fopen(path, "r")) != NULL) {
+		while (fgets(line, sizeof(line), fp)) {
+			line[strcspn(line, "\r\n")] = '\0';
+			if (line[0] != '\0' && line[0] != '#' && add_locked(line) == 1) {
+				count++;
+			}
+		}
+		fclose(fp);
+	}
+	g_bans.dirty = 0;
+	pthread_mutex_unlock(&g_bans.lock);
+	return count;
+}
+
+void ban_close() {
+	pthread_mutex_lock(&g_bans.lock);
+	if (g_bans.slots) {
+		save_locked();
+		free(g_bans.slots);
+		free(g_bans.nodes);
+		g_bans.slots = NULL;
+		g_bans.nodes = NULL;
+	}
+	pthread_mutex_unlock(&g_bans.lock);
+}
+
+int ban_add(const char *text) {
+	int ret = -1;
+
+	pthread_mutex_lock(&g_bans.lock);
+	if (g_bans.slots) {
+		ret = add_locked(text);
+	}
+	pthread_mutex_unlock(&g_bans.lock);
+	return ret;
+}
+
+int ban_remove(const char *text) {
+	struct in6_addr addr;
+	struct ban_slot *slot;
+	uint32_t node;
+	int prefix, ret = -1;
+
+	if (parse(text, &addr, &prefix) == -1) {
+		return -1;
+	}
+	pthread_mutex_lock(&g_bans.lock);
+	if (g_bans.slots) {
+		ret = 0;
+		if (prefix == 128) {
+			if ((slot = find_slot(&addr)) != NULL) {
+				slot->state = SLOT_DELETED;
+				g_bans.count--;
+				ret = 1;
+			}
+		} else {
+			/* the node stays, a later ban of the range reuses it */
+			node = walk(&addr, prefix, 0);
+			if ((node != 0 || prefix == 0) && g_bans.nodes[node].banned) {
+				g_bans.nodes[node].banned = 0;
+				g_bans.ranges--;
+				ret = 1;
+			}
+		}
+		if (ret == 1) {
+			g_bans.dirty = 1;
+		}
+	}
+	pthread_mutex_unlock(&g_bans.lock);
+	return ret;
+}
+
+int ban_check(const struct sockaddr *sa) {
+	struct in6_addr addr;
+	int ret;
+
+	if (sa->sa_family == AF_INET) {
+		memset(&addr, 0, sizeof(addr));
+		addr.s6_addr[10] = addr.s6_addr[11] = 0xff;
+		memcpy(&addr.s6_addr[12], &((const struct sockaddr_in *)sa)->sin_addr, 4);
+	} else if (sa->sa_family == AF_INET6) {
+		addr = ((const struct sockaddr_in6 *)sa)->sin6_addr;
+	} else {
+		return 0; // a local socket has no address to ban
+	}
+	pthread_mutex_lock(&g_bans.lock);
+	ret = check(&addr);
+	pthread_mutex_unlock(&g_bans.lock);
+	return ret;
+}
+
+int ban_check_text(const char *text) {
+	struct in6_addr addr;
+	int prefix, ret;
+
+	if (parse(text, &addr, &prefix) == -1) {
+		return 0;
+	}
+	pthread_mutex_lock(&g_bans.lock);
+	ret = check(&addr);
+	pthread_mutex_unlock(&g_bans.lock);
+	return ret;
+}
+
+int ban_list(FILE *out) {
+	int count = 0;
+
+	pthread_mutex_lock(&g_bans.lock);
+	if (g_bans.slots) {
+		count = list_locked(out);
+	}
+	pthread_mutex_unlock(&g_bans.lock);
+	return count;
+}
+
+int ban_save() {
+	int ret = -1;
+
+	pthread_mutex_lock(&g_bans.lock);
+	if (g_bans.slots) {
+		ret = save_locked();
+	}
+	pthread_mutex_unlock(&g_bans.lock);
+	return ret;
+}
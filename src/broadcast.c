@@ -0,0 +1,117 @@
+/*
+ * broadcast.c - one notice to every client, written as sockets have room
+ */
+
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "broadcast.h"
+
+static struct {
+	pthread_mutex_t lock; /* started by the admin thread, run by the event loop */
+	struct frame_prepared frame;
+	struct slot_set pending;
+	struct frame_stream *stream[CLIENT_MAX];
+	int cursor; /* slot to start the next batch at */
+	struct broadcast_status st;
+	double started;
+} g_cast = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static double now_sec() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* a socket is done with, lock held */
+static void finish(int slot, int told) {
+	slot_set_del(&g_cast.pending, slot);
+	g_cast.stream[slot] = NULL;
+	if (told) {
+		g_cast.st.told++;
+	} else {
+		g_cast.st.failed++;
+	}
+	if (--g_cast.st.pending == 0) {
+		g_cast.st.seconds = now_sec() - g_cast.started;
+	}
+}
+
+int broadcast_start(const char *msg, const struct slot_set *to, struct frame_stream *streams[]) {
+	int slot;
+
+	pthread_mutex_lock(&g_cast.lock);
+	if (frame_prepare(&g_cast.frame, msg, strlen(msg)) == -1) {
+		pthread_mutex_unlock(&g_cast.lock);
+		return -1;
+	}
+	g_cast.pending = *to;
+	memset(&g_cast.st, 0, sizeof(g_cast.st));
+	SLOT_SET_FOREACH(slot, &g_cast.pending) {
+		g_cast.stream[slot] = streams[slot];
+	}
+	g_cast.st.total = g_cast.st.pending = slot_set_count(&g_cast.pending);
+	g_cast.cursor = 0;
+	g_cast.started = now_sec();
+	pthread_mutex_unlock(&g_cast.lock);
+	return 0;
+}
+
+int broadcast_run(int wait_ms) {
+	struct pollfd pfd[BROADCAST_BATCH];
+	int slots[BROADCAST_BATCH];
+	int i, n = 0, slot, first, pending;
+
+	pthread_mutex_lock(&g_cast.lock);
+	if (g_cast.st.pending == 0) {
+		pthread_mutex_unlock(&g_cast.lock);
+		return 0;
+	}
+
+	// the next batch goes on from where the last one stopped and wraps around once
+	if ((slot = slot_set_next(&g_cast.pending, g_cast.cursor)) == -1) {
+		slot = slot_set_next(&g_cast.pending, 0);
+	}
+	first = slot;
+	do {
+		pfd[n].fd = g_cast.stream[slot]->sockfd;
+		pfd[n].events = POLLOUT;
+		pfd[n].revents = 0;
+		slots[n++] = slot;
+		if ((slot = slot_set_next(&g_cast.pending, slot + 1)) == -1) {
+			slot = slot_set_next(&g_cast.pending, 0);
+		}
+	} while (slot != first && n < BROADCAST_BATCH);
+	g_cast.cursor = slot;
+
+	if (poll(pfd, n, wait_ms) > 0) {
+		for (i = 0; i < n; i++) {
+			if (pfd[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+				finish(slots[i], 0);
+			} else if (pfd[i].revents & POLLOUT) {
+				finish(slots[i], frame_send_prepared(g_cast.stream[slots[i]], &g_cast.frame) == 0);
+			}
+		}
+	}
+	pending = g_cast.st.pending;
+	pthread_mutex_unlock(&g_cast.lock);
+	return pending;
+}
+
+void broadcast_forget(int slot) {
+	pthread_mutex_lock(&g_cast.lock);
+	if (slot_set_has(&g_cast.pending, slot)) {
+		finish(slot, 0);
+	}
+	pthread_mutex_unlock(&g_cast.lock);
+}
+
+int broadcast_status(struct broadcast_status *st) {
+	pthread_mutex_lock(&g_cast.lock);
+	*st = g_cast.st;
+	pthread_mutex_unlock(&g_cast.lock);
+	return st->pending > 0;
+}
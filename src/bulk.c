@@ -0,0 +1,289 @@
+/*
+ * bulk.c - deficit round robin over the file data queued for each connection
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+
+#include "bulk.h"
+
+struct bulk_config g_bulk_config;
+struct bulk_stats g_bulk_stats;
+
+/* one queued message */
+struct bulk_chunk {
+	struct bulk_chunk *next;
+	size_t len;
+	int flags;
+	unsigned char data[];
+};
+
+struct bulk_queue {
+	struct frame_stream *fs;
+	struct bulk_chunk *head, *tail;
+	size_t queued; /* bytes in the chunks */
+	long deficit; /* bytes this queue may still send in the round */
+	double tokens, last; /* per connection share */
+	struct bulk_queue *prev, *next; /* in the active ring while something is queued */
+};
+
+static struct bulk_queue *g_active = NULL; // the queue served next
+static double g_tokens = 0, g_last = 0; // global share
+
+int bulk_configure(const char *spec) {
+	char *line = strdup(spec);
+	char *cursor = line;
+	char *token, *value;
+
+	while ((token = strsep(&cursor, ",")) != NULL) {
+		if ((value = strchr(token, '=')) == NULL) {
+			goto fail;
+		}
+		*value++ = '\0';
+		if (strcmp(token, "per") == 0) {
+			g_bulk_config.per_connection = atof(value);
+		} else if (strcmp(token, "total") == 0) {
+			g_bulk_config.total = atof(value);
+		} else {
+			goto fail;
+		}
+	}
+	if (g_bulk_config.per_connection < 0 || g_bulk_config.total < 0) {
+		goto fail;
+	}
+	free(line);
+	return 0;
+fail:
+	fprintf(stderr, "file rate: cannot parse '%s'\n", spec);
+	free(line);
+	return -1;
+}
+
+/* bucket size of a share, at least one frame */
+static double burst(double rate) {
+	double size = rate * BULK_BURST_SECONDS;
+	return size < FRAME_PAYLOAD_MAX ? FRAME_PAYLOAD_MAX : size;
+}
+
+static void refill(double *tokens, double *last, double rate, double now) {
+	if (rate > 0) {
+		*tokens += (now - *last) * rate;
+		if (*tokens > burst(rate)) {
+			*tokens = burst(rate);
+		}
+	}
+	*last = now;
+}
+
+/* seconds until a share has len tokens, 0 if it has them now */
+static double shortfall(double tokens, double rate, size_t len) {
+	if (rate == 0 || tokens >= len) {
+		return 0;
+	}
+	return (len - tokens) / rate;
+}
+
+static void activate(struct bulk_queue *q) {
+	if (q->next) {
+		return;
+	}
+	if (g_active == NULL) {
+		q->prev = q->next = q;
+		g_active = q;
+	} else {
+		/* join at the end of the round */
+		q->next = g_active;
+		q->prev = g_active->prev;
+		g_active->prev->next = q;
+		g_active->prev = q;
+	}
+	q->deficit = 0;
+}
+
+static void deactivate(struct bulk_queue *q) {
+	if (q->next == NULL) {
+		return;
+	}
+	if (q->next == q) {
+		g_active = NULL;
+	} else {
+		q->prev->next = q->next;
+		q->next->prev = q->prev;
+		if (g_active == q) {
+			g_active = q->next;
+		}
+	}
+	q->prev = q->next = NULL;
+}
+
+struct bulk_queue* bulk_queue_new(struct frame_stream *fs) {
+	struct bulk_queue *q = calloc(1, sizeof(struct bulk_queue));
+
+	if (q == NULL) {
+		return NULL;
+	}
+	q->fs = fs;
+	q->tokens = burst(g_bulk_config.per_connection);
+	return q;
+}
+
+static void drop(struct bulk_queue *q) {
+	struct bulk_chunk *c;
+
+	while ((c = q->head) != NULL) {
+		q->head = c->next;
+		free(c);
+	}
+	q->tail = NULL;
+	q->queued = 0;
+	deactivate(q);
+}
+
+void bulk_queue_clear(struct bulk_queue *q) {
+	if (q) {
+		drop(q);
+	}
+}
+
+void bulk_queue_free(struct bulk_queue *q) {
+	if (q == NULL) {
+		return;
+	}
+	drop(q);
+	free(q);
+}
+
+int bulk_enqueue(struct bulk_queue *q, const void *buf, size_t len, int flags) {
+	struct bulk_chunk *c = malloc(sizeof(struct bulk_chunk) + len);
+
+	if (c == NULL) {
+		return -1;
+	}
+	c->next = NULL;
+	c->len = len;
+	c->flags = flags;
+	memcpy(c->data, buf, len);
+	if (q->tail) {
+		q->tail->next = c;
+	} else {
+		q->head = c;
+	}
+	q->tail = c;
+	q->queued += len;
+	if (q->queued > g_bulk_stats.max_queued) {
+		g_bulk_stats.max_queued = q->queued;
+	}
+	activate(q);
+	return 0;
+}
+
+size_t bulk_pending(const struct bulk_queue *q) {
+	return q ? q->queued : 0;
+}
+
+/* send the head of the queue and take it off, return 0 if success, otherwise -1 */
+static int send_head(struct bulk_queue *q) {
+	struct bulk_chunk *c = q->head;
+	int ret = frame_send_flags(q->fs, c->data, c->len, c->flags);
+
+	q->head = c->next;
+	if (q->head == NULL) {
+		q->tail = NULL;
+	}
+	q->queued -= c->len;
+	if (c->flags & FRAME_F_BULK) {
+		g_bulk_stats.bytes += c->len;
+		g_bulk_stats.frames++;
+	}
+	free(c);
+	return ret;
+}
+
+/* serve one queue for a round, return seconds until it can go on */
+static double serve(struct bulk_queue *q, double now) {
+	struct bulk_chunk *c;
+	int unsent;
+
+	refill(&q->tokens, &q->last, g_bulk_config.per_connection, now);
+	q->deficit += BULK_QUANTUM;
+	if (q->deficit > 2 * BULK_QUANTUM) {
+		q->deficit = 2 * BULK_QUANTUM; // no bursts after waiting for the socket
+	}
+	while ((c = q->head) != NULL) {
+		if (c->flags & FRAME_F_BULK) {
+			if ((long)c->len > q->deficit) {
+				return 0; // next round
+			}
+			if (shortfall(q->tokens, g_bulk_config.per_connection, c->len) > 0 ||
+					shortfall(g_tokens, g_bulk_config.total, c->len) > 0) {
+				double a = shortfall(q->tokens, g_bulk_config.per_connection, c->len);
+				double b = shortfall(g_tokens, g_bulk_config.total, c->len);
+				return a > b ? a : b;
+			}
+			if (frame_unsent(q->fs) > 0 ||
+					(ioctl(q->fs->sockfd, SIOCOUTQNSD, &unsent) == 0 && unsent >= BULK_OUTQ_MAX)) {
+				g_bulk_stats.outq_waits++;
+				return BULK_POLL_SECONDS;
+			}
+			q->deficit -= c->len;
+			q->tokens -= c->len;
+			g_tokens -= c->len;
+		}
+		if (send_head(q) == -1) {
+			perror("send file data fails");
+			drop(q); // the connection is going away
+			return 0;
+		}
+	}
+	q->deficit = 0;
+	return 0;
+}
+
+double bulk_run(double now) {
+	struct bulk_queue *q, *next;
+	double wait, next_wait = -1;
+	int n = 0, i;
+
+	if (g_active == NULL) {
+		refill(&g_tokens, &g_last, g_bulk_config.total, now);
+		return -1;
+	}
+	refill(&g_tokens, &g_last, g_bulk_config.total, now);
+	for (q = g_active; n == 0 || q != g_active; q = q->next) {
+		n++;
+	}
+	g_bulk_stats.rounds++;
+	for (q = g_active, i = 0; i < n; i++, q = next) {
+		next = q->next;
+		wait = serve(q, now);
+		if (q->head == NULL) {
+			deactivate(q);
+		} else if (next_wait < 0 || wait < next_wait) {
+			next_wait = wait;
+		}
+		if (g_active == NULL) {
+			break;
+		}
+	}
+	/* the next round starts where this one stopped */
+	if (g_active && next && next->next) {
+		g_active = next;
+	}
+	return next_wait;
+}
+
+void bulk_flush() {
+	struct bulk_queue *q;
+
+	while ((q = g_active) != NULL) {
+		while (q->head) {
+			if (send_head(q) == -1) {
+				break;
+			}
+		}
+		drop(q);
+	}
+}
@@ -12,231 +12,384 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <libgen.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <poll.h>
+#include <time.h>
 
 #include "common.h"
 #include "control_msg.h"
+#include "frame.h"
+#include "dial.h"
+#include "recvfile.h"
+#include "tlsconn.h"
+
+#define RECONNECT_BASE_MS      500    // backoff before the first reconnect
+#define RECONNECT_MAX_MS       30000  // backoff stops doubling here
+#define RECONNECT_ATTEMPTS     10     // then the client gives up
+#define FILE_OUTQ_MAX          (32 * 1024) // unsent bytes in the socket before file data waits
+#define FILE_POLL_US           1000   // how often a waiting file chunk looks again
 
 /* global variables for the client */
 client_state_t g_state = INIT;
 int g_sockfd = 0;
+struct frame_stream *g_stream = NULL; // framing and compression state of g_sockfd
+pthread_mutex_t g_stream_lock = PTHREAD_MUTEX_INITIALIZER; // held to send on g_stream or to replace it
 char *g_partner_name = NULL;
 char *g_client_name = NULL;
-FILE *g_FP;
-
-/* get sockaddr, IPv4 or IPv6 */
-void *get_in_addr(struct sockaddr *sa) {
-    if (sa->sa_family == AF_INET) {
-        return &(((struct sockaddr_in*)sa)->sin_addr);
-    }
-    return &(((struct sockaddr_in6*)sa)->sin6_addr);
+struct recv_file g_recv = { .fd = -1 }; // the file being received
+int g_receiving = 0; // we are the receiving side of a transfer
+char *g_host = NULL; // server of the last /connect, dialed again when the connection drops
+char *g_port = NULL;
+volatile int g_reconnecting = 0;
+volatile int g_urgent = 0; // chat and control frames being sent, file data lets them go first
+volatile int g_sending = 0; // a file is being sent
+
+int open_file(const char * input_file, const char *size);
+int receive_file(char * filebuf, int len, int transfer_complete);
+int reconnect();
+
+/* frame and send a nul terminated message to the server */
+int send_msg(const char *msg) {
+	int ret;
+
+	__sync_fetch_and_add(&g_urgent, 1);
+	pthread_mutex_lock(&g_stream_lock);
+	ret = g_stream ? frame_send(g_stream, msg, strlen(msg)) : -1;
+	pthread_mutex_unlock(&g_stream_lock);
+	__sync_fetch_and_sub(&g_urgent, 1);
+	return ret;
 }
 
-/* handles messages recieved from the server and contains state machine for the client */
-void* receiver_thread(void* args) {
-	int numbytes;
+/* handles one message from the server, contains state machine for the client,
+ * bulk is set for file data. return -1 if the connection is gone, otherwise 0 */
+int handle_server_message(char *buf, int len, int bulk) {
 	char *token[PARAMS_MAX];
 	char *str;
-	int sockfd = *(int *)args;
+	char *line;
+	char *cursor;
 	int is_control_msg = 1; /* flag */
+	int count = 0;
 
-	while(1) {
-		char * buf = malloc(BUF_MAX + 1);
-    	if ((numbytes = recv(sockfd, buf, BUF_MAX, 0)) == -1) {
-			perror("recv IN_SESSION fails");
-			exit(1);
+	/* file data of a transfer that was stopped is dropped */
+	if (bulk) {
+		if (g_state == TRANSFERING && g_receiving) {
+			receive_file(buf, len, 0);
 		}
-    	buf[numbytes + 1] = '\0';
+		return 0;
+	}
 
-		int count = 0;
-		while ((str = strsep(&buf, ":")) != NULL) {
-			token[count++] = strdup(str);
+	line = cursor = strdup(buf);
+
+	while (count < PARAMS_MAX && (str = strsep(&cursor, ":")) != NULL) {
+		token[count++] = str;
+	}
+	/* the server checks that we are still there, in any state */
+	if (strcmp(token[0], MSG_PING) == 0) {
+		if (send_msg(MSG_PONG) == -1) {
+			perror("heartbeat fails");
 		}
-    	switch (g_state) {
-    	case CONNECTING:
-    		if (strcmp(token[0], MSG_SERVER_STOP) == 0 ||
-					strcmp(token[0], MSG_SERVER_SHUTDOWN) == 0) {
-				close(g_sockfd); // close server socket
-				g_sockfd = 0;
-				g_state = INIT;
-				printf("Client quits because server shutdown\n");
-				return NULL;
-			} else if (strcmp(token[0], MSG_IN_SESSION) == 0) {
-				/* server returns [IN_SESSION:user_name] */
-				g_state = CHATTING;
-				g_partner_name = strdup(token[1]);
-				printf("You are chatting with %s\n", g_partner_name);
-			} else if (strcmp(token[0], MSG_BLOCK) == 0) {
-				printf("You are banned to start a new chat by admin");
-			} else if (strcmp(token[0], MSG_UNBLOCK) == 0) {
-				printf("Your name is removed from block list");
-			} else if (strcmp(token[0], MSG_GRACE_PERIOD) == 0) {
-				printf("Server will be shutdown in 10 seconds!\n");
-			} else {
-				is_control_msg = 0;
-			}
-			break;
-    	case CHATTING:
-    		if (strcmp(token[0], MSG_SERVER_STOP) == 0 ||
-					strcmp(token[0], MSG_SERVER_SHUTDOWN) == 0) {
-				close(g_sockfd); // close server socket
-				g_sockfd = 0;
-				g_state = INIT;
-				printf("Client quits because server shutdown\n");
-				return NULL;
-			}
-    		else if (strcmp(token[0], MSG_QUIT) == 0) {
-    			g_state = CONNECTING;
-    			printf("You quit your current chat channel\n");
-    		} else if (strcmp(token[0], MSG_BE_KICKOUT) == 0) {
-    			g_state = CONNECTING;
-    			printf("You are kicked out from current channel by admin\n");
-    		} else if (strcmp(token[0], MSG_PARTNER_BE_KICKOUT) == 0) {
-    			g_state = CONNECTING;
-    			printf("Your partner be kicked out from current channel by admin\n");
-    		} else if (strcmp(token[0], MSG_BLOCK) == 0) {
-    			g_state = CONNECTING;
-    			printf("You are banned to start a new chat by admin");
-    		} else if (strcmp(token[0], MSG_TRANSFER_ACK) == 0) {
-    			g_state = TRANSFERING;
-			} else if(strcmp(token[0], MSG_RECEIVING_FILE) == 0) {
-    			g_state = TRANSFERING;
-
-    			if(count != 2) {
-    				printf("Incorrect file name\n");
-    			}
-    			open_file(token[1]);
-    		} else if (strcmp(token[0], MSG_GRACE_PERIOD) == 0) {
-				printf("Server will be shutdown in 10 seconds!\n");
-			} else {
-    			is_control_msg = 0;
+		free(line);
+		return 0;
+	}
+    switch (g_state) {
+    case CONNECTING:
+    	if (strcmp(token[0], MSG_SERVER_STOP) == 0 ||
+				strcmp(token[0], MSG_SERVER_SHUTDOWN) == 0) {
+			close(g_sockfd); // close server socket
+			g_sockfd = 0;
+			g_state = INIT;
+			printf("Client quits because server shutdown\n");
+			free(line);
+			return -1;
+		} else if (strcmp(token[0], MSG_IN_SESSION) == 0) {
+			/* server returns [IN_SESSION:user_name] */
+			g_state = CHATTING;
+			g_partner_name = strdup(token[1]);
+			printf("You are chatting with %s\n", g_partner_name);
+		} else if (strcmp(token[0], MSG_BLOCK) == 0) {
+			printf("You are banned to start a new chat by admin");
+		} else if (strcmp(token[0], MSG_UNBLOCK) == 0) {
+			printf("Your name is removed from block list");
+		} else if (strcmp(token[0], MSG_GRACE_PERIOD) == 0) {
+			printf("Server will be shutdown in 10 seconds!\n");
+		} else {
+			is_control_msg = 0;
+		}
+		break;
+    case CHATTING:
+    	if (strcmp(token[0], MSG_SERVER_STOP) == 0 ||
+				strcmp(token[0], MSG_SERVER_SHUTDOWN) == 0) {
+			close(g_sockfd); // close server socket
+			g_sockfd = 0;
+			g_state = INIT;
+			printf("Client quits because server shutdown\n");
+			free(line);
+			return -1;
+		}
+    	else if (strcmp(token[0], MSG_QUIT) == 0) {
+    		g_state = CONNECTING;
+    		printf("You quit your current chat channel\n");
+    	} else if (strcmp(token[0], MSG_BE_KICKOUT) == 0) {
+    		g_state = CONNECTING;
+    		printf("You are kicked out from current channel by admin\n");
+    	} else if (strcmp(token[0], MSG_PARTNER_BE_KICKOUT) == 0) {
+    		g_state = CONNECTING;
+    		printf("Your partner be kicked out from current channel by admin\n");
+    	} else if (strcmp(token[0], MSG_BLOCK) == 0) {
+    		g_state = CONNECTING;
+    		printf("You are banned to start a new chat by admin");
+    	} else if (strcmp(token[0], MSG_TRANSFER_ACK) == 0) {
+    		g_state = TRANSFERING;
+		} else if(strcmp(token[0], MSG_RECEIVING_FILE) == 0) {
+    		/* [RECEIVING_FILE:file_name:size], older senders leave out the size */
+    		if(count < 2) {
+    			printf("Incorrect file name\n");
+    			break;
     		}
-    		break;
-    	case TRANSFERING:
-    		if (strcmp(token[0], MSG_SERVER_SHUTDOWN) == 0) {
-    			close(g_sockfd); // close server socket
-				g_sockfd = 0;
-				g_state = INIT;
-				printf("Client quits because server shutdown\n");
-				return NULL;
-    		} else {
-    			if (count == 1) {
-    				receive_file(token[0], NULL);
-    			} else if (count == 2) {
-    				receive_file(token[0], token[1]);
-    			}
+    		g_state = TRANSFERING;
+    		g_receiving = 1;
+    		open_file(token[1], count > 2 ? token[2] : NULL);
+    	} else if (strcmp(token[0], MSG_GRACE_PERIOD) == 0) {
+			printf("Server will be shutdown in 10 seconds!\n");
+		} else {
+    		is_control_msg = 0;
+    	}
+    	break;
+    case TRANSFERING:
+    	if (strcmp(token[0], MSG_SERVER_SHUTDOWN) == 0) {
+    		close(g_sockfd); // close server socket
+			g_sockfd = 0;
+			g_state = INIT;
+			printf("Client quits because server shutdown\n");
+			free(line);
+			return -1;
+    	} else if (g_receiving && strcmp(buf, MSG_TRANSFER_COMPLETE) == 0) {
+    		receive_file(NULL, 0, 1);
+    	} else if (strcmp(token[0], MSG_QUIT) == 0 ||
+    			strcmp(token[0], MSG_BE_KICKOUT) == 0 ||
+    			strcmp(token[0], MSG_PARTNER_BE_KICKOUT) == 0) {
+    		/* the channel ended, a sending thread sees the state and stops */
+    		if (g_receiving) {
+    			recv_file_abort(&g_recv);
+    			g_receiving = 0;
     		}
-    		break;
-    	default:
-    		break;
+    		g_state = CONNECTING;
+    		printf("The chat channel ended, file transfer stopped\n");
+    	} else if (strcmp(token[0], MSG_GRACE_PERIOD) == 0) {
+			printf("Server will be shutdown in 10 seconds!\n");
+    	} else {
+    		/* chat goes on during a transfer, both ways */
+    		is_control_msg = 0;
     	}
+    	break;
+    default:
+    	break;
+    }
+
+    /* skip empty message */
+	if (!is_control_msg && strcmp(buf, "") != 0) {
+		printf("\n%s\n", buf);
+	}
+	free(line);
+	return 0;
+}
+
+/* reads frames from the server and hands them to the state machine */
+void* receiver_thread(void* args) {
+	int numbytes, len;
+	char buf[FRAME_PAYLOAD_MAX + 1];
 
-    	/* skip empty message */
-		if (!is_control_msg && strcmp(token[0], "") != 0) {
-			printf("\n%s\n", token[0]);
+	while(1) {
+		if ((numbytes = frame_fill(g_stream)) <= 0) {
+			if (numbytes == 0) {
+				printf("Server closed the connection\n");
+			} else {
+				perror("recv IN_SESSION fails");
+			}
+			if (reconnect() == -1) {
+				exit(1);
+			}
+			continue;
+		}
+		while ((len = frame_next(g_stream, buf)) >= 0) {
+			if (handle_server_message(buf, len, g_stream->rflags & FRAME_F_BULK) == -1) {
+				return NULL;
+			}
 		}
-		int i;
-		for (i = 0; i < count; i++) {
-			free(token[i]);
+		if (len == FRAME_ERROR) {
+			printf("Malformed frame from server\n");
+			exit(1);
 		}
-		free(buf);
     }
 	return 0;
 }
 
-/* handler for the connnect command
- * return sockfd if success, otherwise -1 */
-int handle_connect(char *hostname, char *port) {
-    // TODO: use hostname instead of ip address
-	int sockfd, numbytes;
-	struct addrinfo hints, *servinfo, *p;
-	int rv;
-	char s[INET6_ADDRSTRLEN];
-	fd_set fdset;
-	struct timeval tv;
+/* picks a codec advertised by the server and turns it on for our side of fs */
+void negotiate_codec(struct frame_stream *fs, const char *codecs) {
+	char msg[BUF_MAX];
 
-	memset(&hints, 0, sizeof hints);
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
+	if (strcmp(codecs, CODEC_LZ_NAME) != 0) {
+		return;
+	}
+	sprintf(msg, "%s:%s", MSG_COMPRESS, CODEC_LZ_NAME);
+	if (frame_send(fs, msg, strlen(msg)) == -1) {
+		perror("send compress request fails");
+		return;
+	}
+	if (frame_set_codec(fs, CODEC_LZ) == -1) {
+		perror("enable compression fails");
+	}
+}
 
-    if ((rv = getaddrinfo(hostname, port, &hints, &servinfo)) != 0) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-        return -1;
-    }
+/* wait until sockfd is readable or the deadline passes, return 1 if readable */
+static int wait_readable(int sockfd, long long deadline) {
+	struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+	long long left;
+	int rv;
 
-    // loop through all the results and connect to the first we can
-    for(p = servinfo; p != NULL; p = p->ai_next) {
-        if ((sockfd = socket(p->ai_family, p->ai_socktype,
-                        p->ai_protocol)) == -1) {
-            perror("client: socket");
-            continue;
-        }
-
-        if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
-            close(sockfd);
-            perror("client: connect");
-            continue;
-        }
-
-        break;
-    }
+	while ((left = deadline - dial_now_ms()) > 0) {
+		if ((rv = poll(&pfd, 1, left)) == -1 && errno == EINTR) {
+			continue;
+		}
+		return rv > 0;
+	}
+	return 0;
+}
 
-    if (p == NULL) {
+/* handler for the connnect command, connecting and the server's ack share
+ * one deadline so an unreachable or silent server cannot hang the shell
+ * return sockfd if success, otherwise -1 */
+int handle_connect(char *hostname, char *port) {
+	int sockfd, len;
+	long long deadline = dial_now_ms() + DIAL_TIMEOUT_MS;
+	char s[128]; // an address or a socket path
+	char buf[FRAME_PAYLOAD_MAX + 1];
+
+    if ((sockfd = dial(hostname, port, DIAL_TIMEOUT_MS, s, sizeof s)) == -1) {
+        perror("client: connect");
         printf("failed to connect server\n");
         return -1;
     }
-
-    inet_ntop(p->ai_family, get_in_addr((struct sockaddr *)p->ai_addr),
-            s, sizeof s);
     printf("client: connecting to %s\n", s);
-
-    freeaddrinfo(servinfo); // all done with this structure
-
-    char * buf = malloc(BUF_MAX);
-    if ((numbytes = recv(sockfd, buf, BUF_MAX-1, 0)) == -1) {
-        perror("recv");
-        exit(1);
+    /* every frame is a whole message, Nagle would hold a chat line back for an ack */
+    int yes = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+    /* a UNIX socket never leaves the machine, it is not encrypted */
+    struct tls_conn *tls = NULL;
+    if (tls_enabled() && !dial_is_unix(hostname) && (tls = tls_connect(sockfd, hostname)) == NULL) {
+    	printf("TLS handshake with the server failed\n");
+    	close(sockfd);
+    	return -1;
     }
 
-    buf[numbytes] = '\0';
+    /* other threads may still send on g_stream, it is replaced only once this one is ready */
+    struct frame_stream *fs = frame_stream_new(sockfd);
+    if (tls) {
+    	frame_set_tls(fs, tls);
+    }
+    while ((len = frame_next(fs, buf)) == FRAME_AGAIN) {
+    	if ((!frame_buffered(fs) && !wait_readable(sockfd, deadline)) ||
+    			frame_fill(fs) <= 0) {
+    		printf("server did not answer\n");
+    		frame_stream_free(fs);
+    		close(sockfd);
+    		return -1;
+    	}
+    }
 
-    /* server returns [ACK:user_name] */
+    /* server returns [ACK:user_name:codecs] */
     char *token[PARAMS_MAX];
-    char *str;
+    char *cursor = buf;
     int count = 0;
-    while ((token[count++] = strsep(&buf, ":")) != NULL);
+    while (count < PARAMS_MAX && (token[count] = strsep(&cursor, ":")) != NULL) {
+    	count++;
+    }
 
-	if (strcmp(token[0], MSG_ACK) != 0) {
+	if (len < 0 || count < 2 || strcmp(token[0], MSG_ACK) != 0) {
 		printf("expected %s but recv invalid control message: %s \n", MSG_ACK, buf);
-		free(buf);
+		frame_stream_free(fs);
+		close(sockfd);
 		return -1;
 	}
 
 	g_client_name = strdup(token[1]);
+	if (count > 2) {
+		negotiate_codec(fs, token[2]);
+	}
+	pthread_mutex_lock(&g_stream_lock);
+	struct frame_stream *old = g_stream; // left over from a previous connection
+	g_stream = fs;
+	pthread_mutex_unlock(&g_stream_lock);
+	frame_stream_free(old);
+	if (tls) {
+		tls_remember(tls); // the tickets came before the ack, the next connect resumes
+		printf("client: %s\n", tls_describe(tls));
+	}
 	printf("Connect to server successfully. Your user name is %s. Type '%s' to start chatting\n",
 			g_client_name, CHAT);
 	g_state = CONNECTING;
-	free(buf);
 	return sockfd;
 
 }
 
-/* handler for the chat command
+/* the connection was lost, dial the same server again. the delay before each
+ * attempt is random up to a backoff that doubles every time, so clients that
+ * lost a server together do not come back together
+ * return 0 if success, otherwise -1 */
+int reconnect() {
+	int backoff = RECONNECT_BASE_MS;
+	int attempt, delay, sockfd, old;
+
+	g_reconnecting = 1;
+	g_state = INIT;
+	old = g_sockfd;
+	shutdown(old, SHUT_RDWR); // a sender on the old stream fails, the fd stays ours until the swap
+	if (g_receiving) {
+		recv_file_abort(&g_recv); // the partner is gone with the session
+		g_receiving = 0;
+	}
+	for (attempt = 1; attempt <= RECONNECT_ATTEMPTS; attempt++) {
+		delay = rand() % (backoff + 1);
+		printf("Reconnecting in %.1f seconds (attempt %d of %d)\n", delay / 1000.0,
+				attempt, RECONNECT_ATTEMPTS);
+		usleep(delay * 1000);
+		if ((sockfd = handle_connect(g_host, g_port)) != -1) {
+			g_sockfd = sockfd;
+			close(old);
+			g_reconnecting = 0;
+			return 0;
+		}
+		backoff = backoff * 2 > RECONNECT_MAX_MS ? RECONNECT_MAX_MS : backoff * 2;
+	}
+	printf("Giving up on the server\n");
+	close(old);
+	g_reconnecting = 0;
+	return -1;
+}
+
+/* handler for the chat command, the words after it are interest tags
  * return 0 for success, otherwise -1 */
-int handle_chat(int sockfd) {
-	int numbytes;
-	char buf[BUF_MAX];
-	char *token;
+int handle_chat(int sockfd, int count, char *params[]) {
+	char msg[BUF_MAX];
+	int i, len;
 
     if (sockfd == -1) {
 		printf("Error: You need connect to server first.\n");
 		return -1;
 	}
-	if (send(sockfd, MSG_CHAT_REQUEST, strlen(MSG_CHAT_REQUEST), 0) == -1) {
+	len = snprintf(msg, sizeof(msg), "%s", MSG_CHAT_REQUEST);
+	for (i = 1; i < count && len < (int)sizeof(msg); i++) {
+		len += snprintf(msg + len, sizeof(msg) - len, ":%s", params[i]);
+	}
+	if (send_msg(msg) == -1) {
         perror("send Chat request fails");
 		return -1;
 	}
@@ -249,7 +402,7 @@ int send_text(int sockfd, char * text) {
 		printf("Error: You need connect to server first.\n");
 		return -1;
 	}
-	if (send(sockfd, text, strlen(text), 0) == -1) {
+	if (send_msg(text) == -1) {
 		perror("send text fails");
 		return -1;
 	}
@@ -258,18 +411,32 @@ int send_text(int sockfd, char * text) {
 
 /* request help messages from server */
 void request_help() {
-	if (send(g_sockfd, MSG_HELP, sizeof(MSG_HELP), 0) == 0) {
+	if (send_msg(MSG_HELP) == -1) {
 		perror("send help request fails");
 	}
 }
 
+/* asks the server to replay the last lines of the channel */
+void request_history(int count, char *params[]) {
+	char msg[BUF_MAX];
+
+	if (count > 2) {
+		printf("Usage: %s [lines]\n", HISTORY);
+		return;
+	}
+	snprintf(msg, sizeof(msg), "%s:%s", MSG_HISTORY, count == 2 ? params[1] : "");
+	if (send_msg(msg) == -1) {
+		perror("send history request fails");
+	}
+}
+
 /* handler for the client quitting the chat channel */
 int handle_quit(int sockfd) {
 	if (sockfd == -1) {
 		printf("Error: You need connect to server first.\n");
 		return -1;
 	}
-	if (send(sockfd, QUIT, strlen(QUIT), 0) == -1) {
+	if (send_msg(QUIT) == -1) {
 		perror("send QUIT fails");
 		return -1;
 	}
@@ -277,7 +444,7 @@ int handle_quit(int sockfd) {
 }
 
 int handle_flag() {
-	if (send(g_sockfd, MSG_FLAG, sizeof(MSG_FLAG), 0) == -1) {
+	if (send_msg(MSG_FLAG) == -1) {
 		perror("send flag fails");
 		return -1;
 	}
@@ -285,40 +452,52 @@ int handle_flag() {
 	return 0;
 }
 
-/* handler for opening a file */
-int open_file(const char * input_file) {
+/* handler for opening a file announced by the partner, size is NULL if not given.
+ * the data of a file that cannot be opened is dropped */
+int open_file(const char * input_file, const char *size) {
+	long long bytes = -1;
+	char *end;
 
-	int bytesReceived = 0;
-	char recvBuff[BUF_MAX + 1];
-
-	char filepath[BUF_MAX];
-	sprintf(filepath, "recv/%s", input_file);
-	g_FP = fopen(filepath, "w");
-	if (NULL == g_FP) {
-		printf("Error opening file");
+	if (size) {
+		bytes = strtoll(size, &end, 10);
+		if (*size == '\0' || *end != '\0' || bytes < 0) {
+			bytes = -1;
+		}
+	}
+	if (recv_file_open(&g_recv, RECV_DIR, input_file, bytes) == -1) {
+		printf("Cannot receive file '%s': %s\n", input_file, strerror(errno));
 		return -1;
 	}
-
 	return 0;
 }
 
-int receive_file(char * filebuf, char * msg_transfer_complete) {
+int receive_file(char * filebuf, int len, int transfer_complete) {
 
-	/* Receive data in chunks of 256 bytes */
+	/* Receive data one frame at a time, a failed write is reported at the end */
 	if (filebuf) {
-		fwrite(filebuf, 1, strlen(filebuf), g_FP);
-		/* search for completion flag inside chunk */
-		if (msg_transfer_complete) {
-			fclose(g_FP);
-			g_FP = NULL;
-			g_state = CHATTING;
-			if (send(g_sockfd, MSG_RECEIVE_SUCCESS, strlen(MSG_RECEIVE_SUCCESS), 0) == -1) {
-				perror("response receive success fails");
-			}
-			printf("File transfer success!\n");
+		recv_file_write(&g_recv, filebuf, len);
+	}
+	if (transfer_complete) {
+		g_receiving = 0;
+		g_state = CHATTING;
+		if (g_recv.fd == -1) {
+			printf("File transfer failed, the file was not opened\n");
+			return -1;
+		}
+		if (!g_recv.error && g_recv.size >= 0 && g_recv.offset != g_recv.size) {
+			printf("File transfer failed, received %lld of %lld bytes\n",
+					(long long)g_recv.offset, (long long)g_recv.size);
+			recv_file_abort(&g_recv);
+			return -1;
 		}
-	} else {
-		printf("\n Read Error \n");
+		if (recv_file_commit(&g_recv) == -1) {
+			printf("File transfer failed: %s\n", strerror(errno));
+			return -1;
+		}
+		if (send_msg(MSG_RECEIVE_SUCCESS) == -1) {
+			perror("response receive success fails");
+		}
+		printf("File transfer success!\n");
 	}
 
 	return 0;
@@ -329,11 +508,23 @@ int send_file(const char * input_file) {
 
 	/* check file size */
 	struct stat st;
-	stat(input_file, &st);
-	int size = st.st_size; // size in bytes
+	if (stat(input_file, &st) == -1 || !S_ISREG(st.st_mode)) {
+		printf("%s is not a file\n", input_file);
+		return -1;
+	}
+	off_t size = st.st_size; // size in bytes
+
+	if (size > FILE_SIZE_MAX) {
+		printf("Size of file > %lld GB. Must send a smaller file.\n", FILE_SIZE_MAX >> 30);
+		return -1;
+	}
 
-	if (size > 10000000) {
-		printf("Size of file > 100 MB. Must send a smaller file.");
+	char buf[BUF_MAX];
+	char * file_name= strdup(input_file);
+	char * name = basename(file_name);
+	if (strchr(name, ':') || strlen(name) > RECV_NAME_MAX) {
+		printf("Cannot send a file named '%s'\n", name);
+		free(file_name);
 		return -1;
 	}
 
@@ -341,19 +532,20 @@ int send_file(const char * input_file) {
 	FILE *fp = fopen(input_file, "rb");
 	if (fp == NULL) {
 		printf("File open error");
+		free(file_name);
 		return -1;
 	}
-	char buf[BUF_MAX];
-	char * file_name= strdup(input_file);
-	sprintf(buf, "%s:%s", MSG_SENDING_FILE, basename(file_name));
-	if(send(g_sockfd, buf, strlen(buf), 0) == -1) {
+	/* [SENDING_FILE:file_name:size], the receiver allocates the file up front */
+	snprintf(buf, sizeof(buf), "%s:%s:%lld", MSG_SENDING_FILE, name, (long long)size);
+	free(file_name);
+	if(send_msg(buf) == -1) {
 		printf("Could not send the file.\n");
 	}
 
 	/* wait for server response with 50 sec timeout */
 	int loop = 0;
-	if (g_state != TRANSFERING && loop < 100) {
-		usleep(500);
+	while (g_state != TRANSFERING && loop < 100) {
+		usleep(500000);
 		loop++;
 	}
 
@@ -363,18 +555,30 @@ int send_file(const char * input_file) {
 
 	/* Read data from file and send it */
 	while (1) {
-		/* First read file in chunks of 256 bytes */
-		unsigned char buff[BUF_MAX] = { 0 };
-		int nread = fread(buff, 1, BUF_MAX, fp);
-		// printf("Bytes read %d \n", nread);
+		/* First read file in chunks of one frame */
+		unsigned char buff[FRAME_CHUNK_MAX];
+		int nread = fread(buff, 1, FRAME_CHUNK_MAX, fp);
+		int unsent;
+
+		/* chat and control go first, and the socket never holds much file data for them to wait behind */
+		while (g_state == TRANSFERING && (g_urgent > 0 ||
+				(ioctl(g_sockfd, SIOCOUTQ, &unsent) == 0 && unsent >= FILE_OUTQ_MAX))) {
+			usleep(FILE_POLL_US);
+		}
+		if (g_state != TRANSFERING) {
+			printf("File transfer stopped\n");
+			fclose(fp);
+			return -1;
+		}
 
 		/* If read was success, send data. */
 		if (nread > 0) {
-			// printf("Sending '%s'\n", buff);
-			write(g_sockfd, buff, nread);
+			pthread_mutex_lock(&g_stream_lock);
+			frame_send_flags(g_stream, buff, nread, FRAME_F_BULK);
+			pthread_mutex_unlock(&g_stream_lock);
 		}
 
-		if (nread < BUF_MAX) {
+		if (nread < FRAME_CHUNK_MAX) {
 			if (feof(fp)) {
 				printf("End of file\n");
 			} if (ferror(fp)) {
@@ -385,15 +589,29 @@ int send_file(const char * input_file) {
 	}
 
 	fclose(fp);
-	if (send(g_sockfd, MSG_TRANSFER_COMPLETE, sizeof(MSG_TRANSFER_COMPLETE), 0) == -1) {
+	if (send_msg(MSG_TRANSFER_COMPLETE) == -1) {
 		perror("MSG_TRANSFER_COMPLETE fails");
 	}
 
-	g_state = CHATTING;
+	if (g_state == TRANSFERING) {
+		g_state = CHATTING;
+	}
 
 	return 0;
 }
 
+/* sends a file on its own thread, so chat and /quit are not stuck behind it */
+void* sender_thread(void *arg) {
+	char *input_file = arg;
+
+	if (send_file(input_file) == 0) {
+		printf("Sent file %s successfully! \n", input_file);
+	}
+	free(input_file);
+	g_sending = 0;
+	return NULL;
+}
+
 /* parses commands entered by the client */
 void parse_control_command(char * cmd) {
 	char *params[PARAMS_MAX];
@@ -402,22 +620,38 @@ void parse_control_command(char * cmd) {
 	int count = 0;
 	pthread_t sender, receiver;
 
-	while ((token = strsep(&cmd, delim)) != NULL) {
+	while (count < PARAMS_MAX && (token = strsep(&cmd, delim)) != NULL) {
 		params[count] = strdup(token);
 		count++;
 	}
+	if (cmd != NULL) { // words past PARAMS_MAX are not kept
+		if (strcmp(params[0], CHAT) == 0) {
+			printf("Usage: %s [tag ...], at most %d tags\n", CHAT, PARAMS_MAX - 1);
+		} else {
+			printf("%s: too many words. Type '%s' for more information.\n", params[0], HELP);
+		}
+		return;
+	}
 
 	switch (g_state) {
 	case INIT:
 		if (strcmp(params[0], CONNECT) == 0) {
-			if (count != 2) {
-				printf("Usage: %s [hostname]\n", CONNECT);
+			if (count != 2 && count != 3) {
+				printf("Usage: %s [hostname] [port]\n", CONNECT);
 				return;
 			}
-			g_sockfd = handle_connect(params[1], PORT);
+			if (g_reconnecting) {
+				printf("Error: Reconnecting to the server, please wait\n");
+				return;
+			}
+			g_sockfd = handle_connect(params[1], count == 3 ? params[2] : PORT);
 			if (g_sockfd == -1) {
 				return;
 			}
+			free(g_host);
+			free(g_port);
+			g_host = strdup(params[1]);
+			g_port = strdup(count == 3 ? params[2] : PORT);
 			pthread_create(&receiver, NULL, &receiver_thread, (void *)&g_sockfd);
 		} else if (strcmp(params[0], CHAT) == 0) {
 			printf("Error: You need connect to server first.\n");
@@ -429,6 +663,8 @@ void parse_control_command(char * cmd) {
 			exit(1);
 		} else if (strcmp(params[0], HELP) == 0) {
 			printf("Error: You need connect to server first.\n");
+		} else if (strcmp(params[0], HISTORY) == 0) {
+			printf("Error: You need connect to server first.\n");
 		} else if (strcmp(params[0], FLAG) == 0) {
 			printf("Error: You are not in a chat session\n");
 		} else {
@@ -439,7 +675,7 @@ void parse_control_command(char * cmd) {
 		if (strcmp(params[0], CONNECT) == 0) {
 			printf("Error: You are already connected to the server\n");
 		} else if (strcmp(params[0], CHAT) == 0) {
-			handle_chat(g_sockfd);
+			handle_chat(g_sockfd, count, params);
 		} else if (strcmp(params[0], TRANSFER) == 0) {
 			printf("Error: You are not in a chat session\n");
 		} else if (strcmp(params[0], QUIT) == 0) {
@@ -448,6 +684,8 @@ void parse_control_command(char * cmd) {
 			exit(1);
 		} else if (strcmp(params[0], HELP) == 0) {
 			request_help();
+		} else if (strcmp(params[0], HISTORY) == 0) {
+			request_history(count, params);
 		} else if (strcmp(params[0], FLAG) == 0) {
 			printf("Error: You are not in a chat session\n");
 		} else {
@@ -463,15 +701,22 @@ void parse_control_command(char * cmd) {
 			if (count != 2) {
 				printf("Usage: %s /this/is/a/file \n", TRANSFER);
 				return;
-			} if(send_file(params[1]) == 0) {
-				printf("Sent file %s successfully! \n", params[1]);
 			}
+			if (g_sending) {
+				printf("Error: A file is being sent already\n");
+				return;
+			}
+			g_sending = 1;
+			pthread_create(&sender, NULL, &sender_thread, strdup(params[1]));
+			pthread_detach(sender);
 		} else if (strcmp(params[0], QUIT) == 0) {
 			handle_quit(g_sockfd);
 		} else if (strcmp(params[0], EXIT) == 0) {
 			exit(1);
 		} else if (strcmp(params[0], HELP) == 0) {
 			request_help();
+		} else if (strcmp(params[0], HISTORY) == 0) {
+			request_history(count, params);
 		} else if (strcmp(params[0], FLAG) == 0) {
 			handle_flag();
 		} else {
@@ -484,13 +729,15 @@ void parse_control_command(char * cmd) {
 		} else if (strcmp(params[0], CHAT) == 0) {
 			printf("Error: You are in a chat session, type '%s' to quit current session\n", QUIT);
 		} else if (strcmp(params[0], TRANSFER) == 0) {
-			// to be implemented
+			printf("Error: A file is being transferred, wait for it to finish\n");
 		} else if (strcmp(params[0], QUIT) == 0) {
 			handle_quit(g_sockfd);
 		} else if (strcmp(params[0], EXIT) == 0) {
 			exit(1);
 		} else if (strcmp(params[0], HELP) == 0) {
 			request_help();
+		} else if (strcmp(params[0], HISTORY) == 0) {
+			request_history(count, params);
 		} else if (strcmp(params[0], FLAG) == 0) {
 			handle_flag();
 		} else {
@@ -513,7 +760,30 @@ int main(int argc, char *argv[])
 	int connected = 0; /* 0 means unconnected, 1 means connected*/
     struct thread_info *tinfo;
 
+    int tls = 0;
+    const char *tls_ca = NULL;
+    for (i = 1; i < argc; i++) {
+    	if (strcmp(argv[i], "--tls") == 0) {
+    		tls = 1;
+    	} else if (strcmp(argv[i], "--tls-ca") == 0 && i + 1 < argc) {
+    		tls = 1;
+    		tls_ca = argv[++i];
+    	} else {
+    		printf("usage: %s [--tls [--tls-ca file]]\n", argv[0]);
+    		exit(1);
+    	}
+    }
+    if (tls) {
+    	if (tls_client_init(tls_ca) == -1) {
+    		exit(1);
+    	}
+    	if (tls_ca == NULL) {
+    		printf("client: TLS without --tls-ca, the server certificate is not verified\n");
+    	}
+    }
+
     print_ascii_art();
+    srand(time(NULL) ^ getpid()); // reconnect jitter differs between clients
 
     while (1) {
 		printf("%s> ", g_client_name == NULL ? "" : g_client_name); // prompt
@@ -528,7 +798,7 @@ int main(int argc, char *argv[])
 			if (strcmp(strip(input_copy), "") == 0) {
 				continue;
 			}
-            if (g_state == CHATTING) {
+            if (g_state == CHATTING || g_state == TRANSFERING) {
             	send_text(g_sockfd, input_copy);
             } else {
             	printf("%s: Command not found. Type '%s' for more information.\n", input_copy, HELP);
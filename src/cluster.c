@@ -0,0 +1,386 @@
+/*
+ * cluster.c - node links, pool summaries and relaying between TRS server nodes
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include "cluster.h"
+#include "control_msg.h"
+#include "frame.h"
+#include "dial.h"
+
+struct node_link g_links[NODE_MAX] = { [0 ... NODE_MAX - 1] = { .sockfd = -1 } };
+int g_node_id = 0; // set with --node-id, keeps user names unique in the cluster
+static char g_secret[CLUSTER_SECRET_MAX]; // --node-secret-file
+static size_t g_secret_len = 0;
+
+static void to_hex(const unsigned char *bytes, size_t len, char *hex) {
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		sprintf(hex + 2 * i, "%02x", bytes[i]);
+	}
+	hex[2 * len] = '\0';
+}
+
+/* the answer of a node in role to the challenge nonce, after its own nonce, in hex */
+static void link_mac(const char *role, const char *challenge, const char *own, char hex[2 * EVP_MAX_MD_SIZE + 1]) {
+	char data[BUF_MAX];
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int md_len = 0;
+	int len = snprintf(data, sizeof(data), "%s:%s:%s", role, challenge, own);
+
+	HMAC(EVP_sha256(), g_secret, g_secret_len, (unsigned char *)data, len, md, &md_len);
+	to_hex(md, md_len, hex);
+}
+
+/* a frame writer that never blocks, what the socket does not take is kept for cluster_flush() */
+static int link_write(int sockfd, const void *data, size_t len) {
+	int link = cluster_find_link(sockfd);
+	struct node_link *node;
+	ssize_t n = 0;
+
+	if (link == -1) {
+		errno = EBADF;
+		return -1;
+	}
+	node = &g_links[link];
+	if (node->out_len == 0) {
+		while ((n = send(sockfd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT)) == -1 && errno == EINTR);
+		if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			return -1;
+		}
+		if (n == -1) {
+			n = 0;
+		}
+		if ((size_t)n == len) {
+			return 0;
+		}
+	}
+	if (node->out_len + len - n > CLUSTER_OUTQ_MAX) {
+		// the frame is cut short, the read side sees the link go down
+		fprintf(stderr, "cluster: node %d does not read, dropping it\n", node->node_id);
+		shutdown(sockfd, SHUT_RDWR);
+		errno = ENOBUFS;
+		return -1;
+	}
+	if (node->out_len + len - n > node->out_cap) {
+		size_t cap = node->out_cap ? node->out_cap : FRAME_PAYLOAD_MAX;
+		unsigned char *out;
+		while (cap < node->out_len + len - n) {
+			cap *= 2;
+		}
+		if ((out = realloc(node->out, cap)) == NULL) {
+			return -1;
+		}
+		node->out = out;
+		node->out_cap = cap;
+	}
+	memcpy(node->out + node->out_len, (const unsigned char *)data + n, len - n);
+	node->out_len += len - n;
+	return 0;
+}
+
+int cluster_set_secret(const char *path) {
+	FILE *fp = fopen(path, "r");
+
+	if (fp == NULL) {
+		perror("cluster: secret file");
+		return -1;
+	}
+	if (fgets(g_secret, sizeof(g_secret), fp) == NULL) {
+		g_secret[0] = '\0';
+	}
+	fclose(fp);
+	g_secret[strcspn(g_secret, "\r\n")] = '\0';
+	if ((g_secret_len = strlen(g_secret)) == 0) {
+		fprintf(stderr, "cluster: secret file %s is empty\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+/* put a connected socket into a free link slot and say hello */
+static int add_link(int sockfd, int dialed) {
+	char hello[BUF_MAX];
+	unsigned char nonce[CLUSTER_NONCE_LEN];
+	int i;
+
+	for (i = 0; i < NODE_MAX; i++) {
+		if (g_links[i].sockfd == -1) {
+			break;
+		}
+	}
+	if (i == NODE_MAX) {
+		fprintf(stderr, "cluster: too many nodes\n");
+		close(sockfd);
+		return -1;
+	}
+	memset(&g_links[i], 0, sizeof(struct node_link));
+	g_links[i].sockfd = sockfd;
+	g_links[i].stream = frame_stream_new(sockfd);
+	g_links[i].node_id = -1;
+	g_links[i].dialed = dialed;
+	frame_set_writer(g_links[i].stream, link_write);
+	if (RAND_bytes(nonce, sizeof(nonce)) != 1) {
+		fprintf(stderr, "cluster: no random nonce\n");
+		cluster_drop_link(i);
+		return -1;
+	}
+	to_hex(nonce, sizeof(nonce), g_links[i].nonce);
+
+	sprintf(hello, "%s:%d:%s", MSG_NODE_HELLO, g_node_id, g_links[i].nonce);
+	if (cluster_send(i, hello) == -1) {
+		perror("cluster: hello fails");
+		cluster_drop_link(i);
+		return -1;
+	}
+	return i;
+}
+
+int cluster_listen(const char *host, const char *port) {
+	struct addrinfo hints, *servinfo, *p;
+	int sockfd, rv;
+	int yes = 1;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	if ((rv = getaddrinfo(host, port, &hints, &servinfo)) != 0) {
+		fprintf(stderr, "cluster: getaddrinfo: %s\n", gai_strerror(rv));
+		return -1;
+	}
+	for (p = servinfo; p != NULL; p = p->ai_next) {
+		if ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
+			continue;
+		}
+		setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+		if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
+			close(sockfd);
+			continue;
+		}
+		break;
+	}
+	freeaddrinfo(servinfo);
+	if (p == NULL || listen(sockfd, NODE_MAX) == -1) {
+		perror("cluster: bind");
+		return -1;
+	}
+	printf("cluster: listening for nodes on %s port %s\n", host ? host : "every address", port);
+	return sockfd;
+}
+
+int cluster_connect(const char *hostport) {
+	char host[BUF_MAX];
+	char *port;
+	int sockfd;
+
+	snprintf(host, sizeof(host), "%s", hostport);
+	if ((port = strrchr(host, ':')) == NULL) {
+		fprintf(stderr, "cluster: peer '%s' is not host:port\n", hostport);
+		return -1;
+	}
+	*port++ = '\0';
+
+	if ((sockfd = dial(host, port, DIAL_TIMEOUT_MS, NULL, 0)) == -1) {
+		fprintf(stderr, "cluster: cannot reach node %s: %s\n", hostport, strerror(errno));
+		return -1;
+	}
+	return add_link(sockfd, 1);
+}
+
+int cluster_accept(int listener_fd) {
+	int sockfd = accept(listener_fd, NULL, NULL);
+	if (sockfd == -1) {
+		perror("cluster: accept");
+		return -1;
+	}
+	return add_link(sockfd, 0);
+}
+
+int cluster_find_link(int sockfd) {
+	int i;
+	for (i = 0; i < NODE_MAX; i++) {
+		if (g_links[i].sockfd == sockfd) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+void cluster_drop_link(int link) {
+	close(g_links[link].sockfd);
+	frame_stream_free(g_links[link].stream);
+	free(g_links[link].out);
+	memset(&g_links[link], 0, sizeof(struct node_link));
+	g_links[link].sockfd = -1;
+}
+
+int cluster_active() {
+	int i;
+	for (i = 0; i < NODE_MAX; i++) {
+		if (g_links[i].sockfd != -1) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int cluster_answer(int link, const char *nonce) {
+	struct node_link *node = &g_links[link];
+	char msg[BUF_MAX];
+	char mac[2 * EVP_MAX_MD_SIZE + 1];
+
+	if (node->answered || strlen(nonce) != 2 * CLUSTER_NONCE_LEN) {
+		return -1;
+	}
+	snprintf(node->peer_nonce, sizeof(node->peer_nonce), "%s", nonce);
+	node->answered = 1;
+	link_mac(node->dialed ? "dial" : "accept", node->peer_nonce, node->nonce, mac);
+	sprintf(msg, "%s:%s", MSG_NODE_AUTH, mac);
+	return cluster_send(link, msg);
+}
+
+int cluster_verify(int link, const char *mac) {
+	struct node_link *node = &g_links[link];
+	char expect[2 * EVP_MAX_MD_SIZE + 1];
+
+	if (!node->answered || node->authed) {
+		return -1; // the answer must come after the peer's hello, once
+	}
+	link_mac(node->dialed ? "accept" : "dial", node->nonce, node->peer_nonce, expect);
+	if (strlen(mac) != strlen(expect) || CRYPTO_memcmp(mac, expect, strlen(expect)) != 0) {
+		return -1;
+	}
+	node->authed = 1;
+	return 0;
+}
+
+int cluster_flush() {
+	int i, left = 0;
+	ssize_t n;
+
+	for (i = 0; i < NODE_MAX; i++) {
+		struct node_link *node = &g_links[i];
+		if (node->sockfd == -1 || node->out_len == 0) {
+			continue;
+		}
+		while ((n = send(node->sockfd, node->out, node->out_len, MSG_NOSIGNAL | MSG_DONTWAIT)) == -1 &&
+				errno == EINTR);
+		if (n > 0) {
+			memmove(node->out, node->out + n, node->out_len - n);
+			node->out_len -= n;
+		} else if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			shutdown(node->sockfd, SHUT_RDWR); // the read side sees the link go down
+			node->out_len = 0;
+		}
+		if (node->out_len > 0) {
+			left = 1;
+		}
+	}
+	return left;
+}
+
+int cluster_send(int link, const char *msg) {
+	if (g_links[link].sockfd == -1) {
+		return -1;
+	}
+	return frame_send(g_links[link].stream, msg, strlen(msg));
+}
+
+int cluster_broadcast(const char *msg) {
+	int i, reached = 0;
+	for (i = 0; i < NODE_MAX; i++) {
+		if (g_links[i].sockfd != -1 && g_links[i].authed && cluster_send(i, msg) == 0) {
+			reached++;
+		}
+	}
+	return reached;
+}
+
+int cluster_relay(int link, const char *to, const void *buf, size_t len) {
+	return cluster_relay_flags(link, to, buf, len, 0);
+}
+
+int cluster_relay_flags(int link, const char *to, const void *buf, size_t len, int flags) {
+	char frame[FRAME_PAYLOAD_MAX];
+	int header;
+
+	if (g_links[link].sockfd == -1) {
+		return -1;
+	}
+	/* [NODE_RELAY:user:payload], the payload is passed through untouched */
+	header = snprintf(frame, sizeof(frame), "%s:%s:", MSG_NODE_RELAY, to);
+	if (header + len > sizeof(frame)) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	memcpy(frame + header, buf, len);
+	return frame_send_flags(g_links[link].stream, frame, header + len, flags);
+}
+
+int cluster_send_state(int link, const char *name, int state) {
+	char msg[BUF_MAX];
+	sprintf(msg, "%s:%s:%d", MSG_NODE_STATE, name, state);
+	return cluster_send(link, msg);
+}
+
+void cluster_set_pool(int link, int count, char *names) {
+	struct node_link *node = &g_links[link];
+	char *name;
+
+	node->pool_count = count;
+	node->sample_count = 0;
+	while ((name = strsep(&names, ",")) != NULL && node->sample_count < CLUSTER_POOL_SAMPLE) {
+		if (*name != '\0') {
+			snprintf(node->sample[node->sample_count++], NAME_LENGTH, "%s", name);
+		}
+	}
+}
+
+size_t cluster_backlog(int link) {
+	return g_links[link].sockfd == -1 ? 0 : g_links[link].out_len;
+}
+
+int cluster_sample_count() {
+	int i, count = 0;
+	for (i = 0; i < NODE_MAX; i++) {
+		if (g_links[i].sockfd != -1 && g_links[i].authed) {
+			count += g_links[i].sample_count;
+		}
+	}
+	return count;
+}
+
+int cluster_take_sample(int r, int *link, char *name) {
+	int i;
+	for (i = 0; i < NODE_MAX; i++) {
+		struct node_link *node = &g_links[i];
+		if (node->sockfd == -1) {
+			continue;
+		}
+		if (r < node->sample_count) {
+			*link = i;
+			strcpy(name, node->sample[r]);
+			/* don't offer the same user twice before the next summary */
+			node->sample_count--;
+			memmove(node->sample[r], node->sample[r + 1], (node->sample_count - r) * NAME_LENGTH);
+			return 0;
+		}
+		r -= node->sample_count;
+	}
+	return -1;
+}
@@ -0,0 +1,230 @@
+/*
+ * compress.c - LZ77 stream codec with a sliding dictionary shared by both ends.
+ *
+ * A block is a sequence of [token][literal length][literals][offset][match length]
+ * records in the style of LZ4. The high nibble of the token holds the literal
+ * length and the low nibble the match length minus LZ_MIN_MATCH, 15 meaning more
+ * length bytes follow. The last record of a block carries literals only.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "compress.h"
+
+static uint32_t hash4(const unsigned char *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+struct lz_stream* lz_stream_new(int encoder) {
+	struct lz_stream *s = calloc(1, sizeof(struct lz_stream));
+	if (s) {
+		s->encoder = encoder;
+	}
+	return s;
+}
+
+void lz_stream_free(struct lz_stream *s) {
+	free(s);
+}
+
+/* keep at most LZ_DICT_SIZE bytes of history so a whole chunk fits behind it */
+static void lz_slide(struct lz_stream *s) {
+	if (s->hist > LZ_DICT_SIZE) {
+		size_t shift = s->hist - LZ_DICT_SIZE;
+		memmove(s->buf, s->buf + shift, LZ_DICT_SIZE);
+		s->base += shift;
+		s->hist = LZ_DICT_SIZE;
+	}
+}
+
+static void lz_insert(struct lz_stream *s, size_t pos) {
+	s->table[hash4(s->buf + pos)] = s->base + pos + 1;
+}
+
+void lz_append(struct lz_stream *s, const unsigned char *src, size_t n) {
+	while (n > 0) {
+		size_t len = n > LZ_CHUNK_MAX ? LZ_CHUNK_MAX : n;
+		size_t i;
+
+		lz_slide(s);
+		memcpy(s->buf + s->hist, src, len);
+		if (s->encoder) {
+			for (i = s->hist; i + LZ_MIN_MATCH <= s->hist + len; i++) {
+				lz_insert(s, i);
+			}
+		}
+		s->hist += len;
+		src += len;
+		n -= len;
+	}
+}
+
+/* write the extra bytes of a length that did not fit in its nibble */
+static unsigned char* put_length(unsigned char *op, size_t len) {
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (unsigned char)len;
+	return op;
+}
+
+static unsigned char* put_sequence(unsigned char *op, unsigned char *oend,
+		const unsigned char *lit, size_t lit_len, size_t offset, size_t match_len) {
+	size_t need = 1 + lit_len + lit_len / 255 + 1 + 2 + match_len / 255 + 1;
+	unsigned char *token = op;
+
+	if (op + need > oend) {
+		return NULL;
+	}
+	*op++ = 0;
+	if (lit_len >= 15) {
+		*token = 15 << 4;
+		op = put_length(op, lit_len - 15);
+	} else {
+		*token = lit_len << 4;
+	}
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+
+	if (offset == 0) { /* last literals */
+		return op;
+	}
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+	match_len -= LZ_MIN_MATCH;
+	if (match_len >= 15) {
+		*token |= 15;
+		op = put_length(op, match_len - 15);
+	} else {
+		*token |= match_len;
+	}
+	return op;
+}
+
+size_t lz_compress(struct lz_stream *s, const unsigned char *src, size_t n,
+		unsigned char *dst, size_t dstmax) {
+	size_t start, end, ip, anchor;
+	unsigned char *op = dst;
+	unsigned char *oend = dst + dstmax;
+
+	if (n > LZ_CHUNK_MAX || n <= LZ_MIN_MATCH) {
+		lz_append(s, src, n);
+		return 0;
+	}
+
+	lz_slide(s);
+	memcpy(s->buf + s->hist, src, n);
+	start = s->hist;
+	end = start + n;
+	s->hist = end; /* the block joins the history whether or not it shrinks */
+
+	ip = anchor = start;
+	while (ip + LZ_MIN_MATCH <= end) {
+		uint32_t h = hash4(s->buf + ip);
+		uint32_t ref = s->table[h];
+		size_t cand, match_len, i;
+
+		s->table[h] = s->base + ip + 1;
+		if (ref == 0 || ref - 1 < s->base) {
+			ip++;
+			continue;
+		}
+		cand = ref - 1 - s->base;
+		if (cand >= ip || ip - cand > 0xffff ||
+				memcmp(s->buf + cand, s->buf + ip, LZ_MIN_MATCH) != 0) {
+			ip++;
+			continue;
+		}
+
+		match_len = LZ_MIN_MATCH;
+		while (ip + match_len < end && s->buf[cand + match_len] == s->buf[ip + match_len]) {
+			match_len++;
+		}
+		op = put_sequence(op, oend, s->buf + anchor, ip - anchor, ip - cand, match_len);
+		if (!op) {
+			return 0;
+		}
+		for (i = ip + 1; i < ip + match_len && i + LZ_MIN_MATCH <= end; i++) {
+			lz_insert(s, i);
+		}
+		ip += match_len;
+		anchor = ip;
+	}
+
+	op = put_sequence(op, oend, s->buf + anchor, end - anchor, 0, 0);
+	if (!op || (size_t)(op - dst) >= n) {
+		return 0;
+	}
+	return op - dst;
+}
+
+int lz_decompress(struct lz_stream *s, const unsigned char *src, size_t n,
+		unsigned char *dst, size_t dstmax) {
+	const unsigned char *ip = src;
+	const unsigned char *iend = src + n;
+	size_t op, oend, len;
+
+	lz_slide(s);
+	op = s->hist;
+	oend = s->hist + (dstmax < LZ_CHUNK_MAX ? dstmax : LZ_CHUNK_MAX);
+
+	while (ip < iend) {
+		unsigned token = *ip++;
+		size_t lit_len = token >> 4;
+		size_t match_len = token & 15;
+		size_t offset;
+		unsigned b;
+
+		if (lit_len == 15) {
+			do {
+				if (ip >= iend) {
+					return -1;
+				}
+				b = *ip++;
+				lit_len += b;
+			} while (b == 255);
+		}
+		if (lit_len > (size_t)(iend - ip) || op + lit_len > oend) {
+			return -1;
+		}
+		memcpy(s->buf + op, ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+		if (ip == iend) {
+			break;
+		}
+
+		if (iend - ip < 2) {
+			return -1;
+		}
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (match_len == 15) {
+			do {
+				if (ip >= iend) {
+					return -1;
+				}
+				b = *ip++;
+				match_len += b;
+			} while (b == 255);
+		}
+		match_len += LZ_MIN_MATCH;
+		if (offset == 0 || offset > op || op + match_len > oend) {
+			return -1;
+		}
+		/* byte copy, the match may overlap its own output */
+		while (match_len-- > 0) {
+			s->buf[op] = s->buf[op - offset];
+			op++;
+		}
+	}
+
+	len = op - s->hist;
+	memcpy(dst, s->buf + s->hist, len);
+	s->hist = op;
+	return len;
+}
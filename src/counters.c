@@ -0,0 +1,81 @@
+/*
+ * counters.c - incremental state counts and the busiest channel table
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "counters.h"
+
+struct server_counters g_counters;
+
+/* the I/O thread fills current, the admin thread reads last */
+static struct top_table g_top_current, g_top_last;
+static pthread_mutex_t g_top_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void counters_state(client_state_t from, client_state_t to) {
+	if (from != INIT) {
+		g_counters.state[from]--;
+	}
+	g_counters.state[to]++;
+}
+
+void counters_leave(client_state_t state, int flagged) {
+	g_counters.state[state]--;
+	if (flagged) {
+		g_counters.flagged--;
+	}
+}
+
+void counters_forward(unsigned long long session, const char *from, const char *to, size_t len) {
+	struct top_table *t = &g_top_current;
+	time_t now = time(NULL);
+	int i, min = 0;
+
+	g_counters.messages++;
+	g_counters.bytes += len;
+
+	if (now != t->second) {
+		pthread_mutex_lock(&g_top_lock);
+		g_top_last = *t;
+		pthread_mutex_unlock(&g_top_lock);
+		t->second = now;
+		t->count = 0;
+	}
+	for (i = 0; i < t->count; i++) {
+		if (t->channel[i].session == session) {
+			t->channel[i].bytes += len;
+			return;
+		}
+		if (t->channel[i].bytes < t->channel[min].bytes) {
+			min = i;
+		}
+	}
+	if (t->count < COUNTERS_TOP) {
+		min = t->count++;
+		t->channel[min].bytes = 0;
+	}
+	t->channel[min].session = session;
+	t->channel[min].bytes += len;
+	snprintf(t->channel[min].names[0], NAME_LENGTH, "%s", from);
+	snprintf(t->channel[min].names[1], NAME_LENGTH, "%s", to);
+}
+
+static int by_bytes(const void *a, const void *b) {
+	const struct top_channel *x = a, *y = b;
+	return x->bytes < y->bytes ? 1 : x->bytes > y->bytes ? -1 : 0;
+}
+
+int counters_top(struct top_table *out) {
+	pthread_mutex_lock(&g_top_lock);
+	*out = g_top_last;
+	pthread_mutex_unlock(&g_top_lock);
+	/* nothing was forwarded for a while */
+	if (out->second < time(NULL) - 2) {
+		out->count = 0;
+	}
+	qsort(out->channel, out->count, sizeof(struct top_channel), by_bytes);
+	return out->count;
+}
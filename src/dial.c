@@ -0,0 +1,210 @@
+/*
+ * dial.c - racing non-blocking connects across the addresses of a host
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
+
+#include "dial.h"
+
+long long dial_now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* interleave the families, starting with the one the resolver put first */
+static int order_addresses(struct addrinfo *res, struct addrinfo **out) {
+	struct addrinfo *first[DIAL_ATTEMPTS_MAX], *other[DIAL_ATTEMPTS_MAX];
+	struct addrinfo *p;
+	int nfirst = 0, nother = 0, n = 0, i;
+
+	for (p = res; p != NULL; p = p->ai_next) {
+		if (p->ai_family == res->ai_family) {
+			if (nfirst < DIAL_ATTEMPTS_MAX) {
+				first[nfirst++] = p;
+			}
+		} else if (nother < DIAL_ATTEMPTS_MAX) {
+			other[nother++] = p;
+		}
+	}
+	for (i = 0; n < DIAL_ATTEMPTS_MAX && (i < nfirst || i < nother); i++) {
+		if (i < nfirst) {
+			out[n++] = first[i];
+		}
+		if (i < nother && n < DIAL_ATTEMPTS_MAX) {
+			out[n++] = other[i];
+		}
+	}
+	return n;
+}
+
+/* start one non-blocking connect, return 1 if it is in flight, 0 if it
+ * connected at once, otherwise -1 */
+static int start_attempt(struct addrinfo *ai, int *sockfd) {
+	if ((*sockfd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			ai->ai_protocol)) == -1) {
+		return -1;
+	}
+	if (connect(*sockfd, ai->ai_addr, ai->ai_addrlen) == 0) {
+		return 0;
+	}
+	if (errno == EINPROGRESS) {
+		return 1;
+	}
+	int err = errno;
+	close(*sockfd);
+	errno = err;
+	return -1;
+}
+
+static void format_address(struct addrinfo *ai, char *addr, size_t addrlen) {
+	void *in;
+
+	if (!addr) {
+		return;
+	}
+	if (ai->ai_family == AF_INET) {
+		in = &((struct sockaddr_in *)ai->ai_addr)->sin_addr;
+	} else {
+		in = &((struct sockaddr_in6 *)ai->ai_addr)->sin6_addr;
+	}
+	inet_ntop(ai->ai_family, in, addr, addrlen);
+}
+
+int dial_is_unix(const char *host) {
+	return strncmp(host, DIAL_UNIX_PREFIX, strlen(DIAL_UNIX_PREFIX)) == 0;
+}
+
+/* a local connect either succeeds or fails at once, there is nothing to race */
+static int dial_unix(const char *path, char *addr, size_t addrlen) {
+	struct sockaddr_un sun;
+	int sockfd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(sun.sun_path, path);
+	if ((sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+		return -1;
+	}
+	if (connect(sockfd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		int err = errno;
+		close(sockfd);
+		errno = err;
+		return -1;
+	}
+	if (addr) {
+		snprintf(addr, addrlen, "%s", path);
+	}
+	return sockfd;
+}
+
+int dial(const char *host, const char *port, int timeout_ms, char *addr, size_t addrlen) {
+	struct addrinfo hints, *servinfo;
+	struct addrinfo *order[DIAL_ATTEMPTS_MAX], *pending_ai[DIAL_ATTEMPTS_MAX];
+	struct pollfd pending[DIAL_ATTEMPTS_MAX];
+	long long now, deadline, next_start;
+	int n, next = 0, npending = 0, winner = -1, err = ETIMEDOUT;
+	int rv, i, fd, wait, soerr;
+	socklen_t len;
+
+	if (dial_is_unix(host)) {
+		return dial_unix(host + strlen(DIAL_UNIX_PREFIX), addr, addrlen);
+	}
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((rv = getaddrinfo(host, port, &hints, &servinfo)) != 0) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+		errno = EHOSTUNREACH;
+		return -1;
+	}
+	n = order_addresses(servinfo, order);
+
+	now = dial_now_ms();
+	deadline = now + timeout_ms;
+	next_start = now;
+	while (winner == -1 && (now = dial_now_ms()) < deadline) {
+		/* next address when the last one had its head start or nothing is left in flight */
+		if (next < n && (now >= next_start || npending == 0)) {
+			rv = start_attempt(order[next], &fd);
+			if (rv == 0) {
+				winner = fd;
+				format_address(order[next], addr, addrlen);
+			} else if (rv == 1) {
+				pending[npending].fd = fd;
+				pending[npending].events = POLLOUT;
+				pending_ai[npending++] = order[next];
+				next_start = now + DIAL_STAGGER_MS;
+			} else {
+				err = errno;
+			}
+			next++;
+			continue;
+		}
+		if (npending == 0) {
+			break; /* every address failed */
+		}
+
+		wait = deadline - now;
+		if (next < n && next_start - now < wait) {
+			wait = next_start - now;
+		}
+		if (poll(pending, npending, wait) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			err = errno;
+			break;
+		}
+		for (i = 0; i < npending; i++) {
+			if (!pending[i].revents) {
+				continue;
+			}
+			len = sizeof(soerr);
+			if (getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR, &soerr, &len) == -1) {
+				soerr = errno;
+			}
+			if (soerr == 0) {
+				winner = pending[i].fd;
+				format_address(pending_ai[i], addr, addrlen);
+				pending[i] = pending[--npending];
+				break;
+			}
+			/* a refused address hands its turn to the next one right away */
+			err = soerr;
+			close(pending[i].fd);
+			pending[i] = pending[npending - 1];
+			pending_ai[i] = pending_ai[--npending];
+			next_start = now;
+			i--;
+		}
+	}
+
+	for (i = 0; i < npending; i++) {
+		close(pending[i].fd);
+	}
+	freeaddrinfo(servinfo);
+	if (winner == -1) {
+		errno = err;
+		return -1;
+	}
+	fcntl(winner, F_SETFL, fcntl(winner, F_GETFL) & ~O_NONBLOCK);
+	return winner;
+}
@@ -0,0 +1,447 @@
+/*
+ * frame.c - framing and negotiated compression for client/server connections
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <poll.h>
+
+#include "frame.h"
+#include "tlsconn.h"
+
+/* keep sending until the whole buffer is out, a non-blocking socket
+ * waits up to FRAME_SEND_TIMEOUT ms each time its send buffer is full */
+static int send_all(int sockfd, const void *data, size_t len) {
+	struct pollfd pfd = { .fd = sockfd, .events = POLLOUT };
+	const unsigned char *buf = data;
+
+	while (len > 0) {
+		ssize_t n = send(sockfd, buf, len, MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (poll(&pfd, 1, FRAME_SEND_TIMEOUT) == 1) {
+				continue;
+			}
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		if (n < 1) {
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+struct frame_stream* frame_stream_new(int sockfd) {
+	struct frame_stream *fs = calloc(1, sizeof(struct frame_stream));
+	if (!fs) {
+		return NULL;
+	}
+	fs->sockfd = sockfd;
+	fs->codec = CODEC_NONE;
+	fs->writer = send_all;
+	pthread_mutex_init(&fs->tx_lock, NULL);
+	return fs;
+}
+
+void frame_stream_free(struct frame_stream *fs) {
+	if (!fs) {
+		return;
+	}
+	lz_stream_free(fs->tx);
+	lz_stream_free(fs->rx);
+	tls_free(fs->tls);
+	pthread_mutex_destroy(&fs->tx_lock);
+	free(fs->spill);
+	free(fs->out);
+	free(fs);
+}
+
+void frame_set_writer(struct frame_stream *fs, frame_writer_t writer) {
+	pthread_mutex_lock(&fs->tx_lock);
+	fs->writer = writer;
+	pthread_mutex_unlock(&fs->tx_lock);
+}
+
+void frame_set_tls(struct frame_stream *fs, struct tls_conn *tls) {
+	pthread_mutex_lock(&fs->tx_lock);
+	fs->tls = tls;
+	pthread_mutex_unlock(&fs->tx_lock);
+}
+
+int frame_raw(struct frame_stream *fs) {
+	return fs->tls == NULL || tls_offloaded(fs->tls);
+}
+
+int frame_buffered(struct frame_stream *fs) {
+	return fs->tls != NULL && tls_pending(fs->tls);
+}
+
+void frame_set_queue(struct frame_stream *fs, size_t max) {
+	pthread_mutex_lock(&fs->tx_lock);
+	fs->out_max = max;
+	pthread_mutex_unlock(&fs->tx_lock);
+}
+
+/* one write of what the socket takes now, return the bytes written, otherwise -1 */
+static ssize_t put_some(struct frame_stream *fs, const void *buf, size_t len) {
+	ssize_t n;
+
+	if (!frame_raw(fs)) {
+		return tls_write_some(fs->tls, buf, len);
+	}
+	while ((n = send(fs->sockfd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT)) == -1 && errno == EINTR);
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return 0;
+	}
+	return n;
+}
+
+/* part of a frame may be out, the stream carries nothing more */
+static int break_stream(struct frame_stream *fs, int err) {
+	fs->out_err = err;
+	fs->out_len = 0;
+	shutdown(fs->sockfd, SHUT_RDWR); // the read side sees the connection end
+	errno = err;
+	return -1;
+}
+
+/* send what the socket takes and keep the rest, behind bytes kept before */
+static int queue_wire(struct frame_stream *fs, const void *buf, size_t len) {
+	const unsigned char *p = buf;
+	ssize_t n = 0;
+
+	if (fs->out_err) {
+		errno = fs->out_err;
+		return -1;
+	}
+	if (fs->out_len == 0 && (n = put_some(fs, p, len)) == -1) {
+		return break_stream(fs, errno);
+	}
+	p += n;
+	len -= n;
+	if (len == 0) {
+		return 0;
+	}
+	if (fs->out_len + len > fs->out_max) {
+		return break_stream(fs, ENOBUFS);
+	}
+	if (fs->out_len + len > fs->out_cap) {
+		size_t cap = fs->out_cap ? fs->out_cap : FRAME_HEADER_LEN + FRAME_PAYLOAD_MAX;
+		unsigned char *out;
+		while (cap < fs->out_len + len) {
+			cap *= 2;
+		}
+		if ((out = realloc(fs->out, cap)) == NULL) {
+			return break_stream(fs, ENOMEM);
+		}
+		fs->out = out;
+		fs->out_cap = cap;
+	}
+	memcpy(fs->out + fs->out_len, p, len);
+	fs->out_len += len;
+	return 0;
+}
+
+int frame_flush(struct frame_stream *fs) {
+	ssize_t n = 0;
+	int left;
+
+	pthread_mutex_lock(&fs->tx_lock);
+	if (fs->out_len > 0 && (n = put_some(fs, fs->out, fs->out_len)) == -1) {
+		break_stream(fs, errno);
+	}
+	if (n > 0) {
+		memmove(fs->out, fs->out + n, fs->out_len - n);
+		fs->out_len -= n;
+	}
+	left = fs->out_err ? -1 : (int)fs->out_len;
+	pthread_mutex_unlock(&fs->tx_lock);
+	return left;
+}
+
+size_t frame_unsent(struct frame_stream *fs) {
+	size_t len;
+
+	pthread_mutex_lock(&fs->tx_lock);
+	len = fs->out_len;
+	pthread_mutex_unlock(&fs->tx_lock);
+	return len;
+}
+
+/* the writer, or OpenSSL when it does the crypto */
+static int put_wire(struct frame_stream *fs, const void *buf, size_t len) {
+	if (fs->out_max > 0 && (!frame_raw(fs) || fs->writer == send_all)) {
+		return queue_wire(fs, buf, len);
+	}
+	if (!frame_raw(fs)) {
+		return tls_write(fs->tls, buf, len);
+	}
+	return fs->writer(fs->sockfd, buf, len);
+}
+
+int frame_set_codec(struct frame_stream *fs, codec_t codec) {
+	if (codec == CODEC_NONE || fs->codec != CODEC_NONE) {
+		return codec == fs->codec ? 0 : -1;
+	}
+	pthread_mutex_lock(&fs->tx_lock);
+	fs->tx = lz_stream_new(1);
+	fs->rx = lz_stream_new(0);
+	if (!fs->tx || !fs->rx) {
+		lz_stream_free(fs->tx);
+		lz_stream_free(fs->rx);
+		fs->tx = fs->rx = NULL;
+		pthread_mutex_unlock(&fs->tx_lock);
+		return -1;
+	}
+	fs->codec = codec;
+	pthread_mutex_unlock(&fs->tx_lock);
+	return 0;
+}
+
+/* build the header in front of the payload and hand the frame to writer */
+static int write_frame(frame_writer_t writer, int sockfd, int flags, const void *buf, size_t len) {
+	unsigned char frame[FRAME_HEADER_LEN + FRAME_PAYLOAD_MAX];
+
+	if (len > FRAME_PAYLOAD_MAX) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	frame[0] = len >> 8;
+	frame[1] = len & 0xff;
+	frame[2] = flags;
+	frame[3] = 0;
+	memcpy(frame + FRAME_HEADER_LEN, buf, len);
+	return writer(sockfd, frame, FRAME_HEADER_LEN + len);
+}
+
+int frame_write(int sockfd, int flags, const void *buf, size_t len) {
+	return write_frame(send_all, sockfd, flags, buf, len);
+}
+
+/* compress buf if a codec is on and put the whole frame into out, which has room
+ * for FRAME_HEADER_LEN + len bytes. called with tx_lock held, return the frame length */
+static size_t encode_frame(struct frame_stream *fs, const void *buf, size_t len, int flags,
+		unsigned char *out) {
+	size_t wire_len = 0;
+
+	if (fs->codec == CODEC_LZ) {
+		flags |= FRAME_F_DICT;
+		if (fs->skip > 0) {
+			/* recent data was incompressible, don't waste cycles on it */
+			fs->skip--;
+			lz_append(fs->tx, buf, len);
+		} else {
+			wire_len = lz_compress(fs->tx, buf, len, out + FRAME_HEADER_LEN, len);
+			if (wire_len > 0) {
+				flags |= FRAME_F_COMPRESSED;
+				fs->misses = 0;
+			} else if (len >= FRAME_BYPASS_MIN && ++fs->misses >= FRAME_BYPASS_MISSES) {
+				fs->skip = FRAME_BYPASS_SKIP;
+				fs->misses = 0;
+			}
+		}
+	}
+	if (wire_len == 0) {
+		memcpy(out + FRAME_HEADER_LEN, buf, len);
+		wire_len = len;
+	}
+	out[0] = wire_len >> 8;
+	out[1] = wire_len & 0xff;
+	out[2] = flags;
+	out[3] = 0;
+	return FRAME_HEADER_LEN + wire_len;
+}
+
+int frame_send(struct frame_stream *fs, const void *buf, size_t len) {
+	return frame_send_flags(fs, buf, len, 0);
+}
+
+int frame_send_flags(struct frame_stream *fs, const void *buf, size_t len, int flags) {
+	unsigned char frame[FRAME_HEADER_LEN + FRAME_PAYLOAD_MAX];
+	size_t n;
+	int ret;
+
+	if (len > FRAME_PAYLOAD_MAX) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	pthread_mutex_lock(&fs->tx_lock);
+	n = encode_frame(fs, buf, len, flags & FRAME_F_BULK, frame);
+	ret = put_wire(fs, frame, n);
+	if (ret == 0) {
+		fs->payload_out += len;
+		fs->wire_out += n;
+	}
+	pthread_mutex_unlock(&fs->tx_lock);
+	return ret;
+}
+
+int frame_send_batch(struct frame_stream *fs, const struct iovec *msgs, int count) {
+	unsigned char *wire;
+	size_t payload = 0, n = 0;
+	int i, ret;
+
+	if (count <= 0) {
+		return 0; // nothing to send
+	}
+	for (i = 0; i < count; i++) {
+		if (msgs[i].iov_len > FRAME_PAYLOAD_MAX) {
+			errno = EMSGSIZE;
+			return -1;
+		}
+		payload += msgs[i].iov_len;
+	}
+	if ((wire = malloc(payload + (size_t)count * FRAME_HEADER_LEN)) == NULL) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&fs->tx_lock);
+	for (i = 0; i < count; i++) {
+		n += encode_frame(fs, msgs[i].iov_base, msgs[i].iov_len, 0, wire + n);
+	}
+	ret = put_wire(fs, wire, n);
+	if (ret == 0) {
+		fs->payload_out += payload;
+		fs->wire_out += n;
+	}
+	pthread_mutex_unlock(&fs->tx_lock);
+	free(wire);
+	return ret;
+}
+
+int frame_prepare(struct frame_prepared *fp, const void *buf, size_t len) {
+	if (len > FRAME_PAYLOAD_MAX) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	// without FRAME_F_DICT the receiver leaves its dictionary alone, as the sender does
+	fp->wire[0] = len >> 8;
+	fp->wire[1] = len & 0xff;
+	fp->wire[2] = 0;
+	fp->wire[3] = 0;
+	memcpy(fp->wire + FRAME_HEADER_LEN, buf, len);
+	fp->len = len;
+	fp->wire_len = FRAME_HEADER_LEN + len;
+	return 0;
+}
+
+int frame_send_prepared(struct frame_stream *fs, const struct frame_prepared *fp) {
+	int ret;
+
+	pthread_mutex_lock(&fs->tx_lock);
+	ret = put_wire(fs, fp->wire, fp->wire_len);
+	if (ret == 0) {
+		fs->payload_out += fp->len;
+		fs->wire_out += fp->wire_len;
+	}
+	pthread_mutex_unlock(&fs->tx_lock);
+	return ret;
+}
+
+int frame_fill(struct frame_stream *fs) {
+	int n;
+
+	if (fs->rlen == sizeof(fs->rbuf)) {
+		/* frame_next() leaves a full buffer only if the header is bogus */
+		errno = EPROTO;
+		return -1;
+	}
+	if (fs->tls) {
+		n = tls_read(fs->tls, fs->rbuf + fs->rlen, sizeof(fs->rbuf) - fs->rlen);
+	} else {
+		n = recv(fs->sockfd, fs->rbuf + fs->rlen, sizeof(fs->rbuf) - fs->rlen, 0);
+	}
+	if (n > 0) {
+		fs->rlen += n;
+	}
+	return n;
+}
+
+int frame_feed(struct frame_stream *fs, const void *buf, size_t len) {
+	size_t room = sizeof(fs->rbuf) - fs->rlen;
+
+	if (fs->spill_len == 0 && len <= room) {
+		memcpy(fs->rbuf + fs->rlen, buf, len);
+		fs->rlen += len;
+		return 0;
+	}
+	if (fs->spill_len + len > FRAME_SPILL_MAX) {
+		return -1;
+	}
+	if (!fs->spill && (fs->spill = malloc(FRAME_SPILL_MAX)) == NULL) {
+		return -1;
+	}
+	memcpy(fs->spill + fs->spill_len, buf, len);
+	fs->spill_len += len;
+	return 0;
+}
+
+/* move spilled bytes into the room frame_next() made in rbuf */
+static void unspill(struct frame_stream *fs) {
+	size_t n = sizeof(fs->rbuf) - fs->rlen;
+
+	if (n > fs->spill_len) {
+		n = fs->spill_len;
+	}
+	memcpy(fs->rbuf + fs->rlen, fs->spill, n);
+	fs->rlen += n;
+	fs->spill_len -= n;
+	memmove(fs->spill, fs->spill + n, fs->spill_len);
+}
+
+int frame_next(struct frame_stream *fs, char *out) {
+	size_t len, total;
+	int flags, n;
+	unsigned char *payload = fs->rbuf + FRAME_HEADER_LEN;
+
+	if (fs->spill_len > 0) {
+		unspill(fs);
+	}
+
+	if (fs->rlen < FRAME_HEADER_LEN) {
+		return FRAME_AGAIN;
+	}
+	len = (fs->rbuf[0] << 8) | fs->rbuf[1];
+	flags = fs->rbuf[2];
+	if (len > FRAME_PAYLOAD_MAX) {
+		return FRAME_ERROR;
+	}
+	total = FRAME_HEADER_LEN + len;
+	if (fs->rlen < total) {
+		return FRAME_AGAIN;
+	}
+
+	if ((flags & (FRAME_F_COMPRESSED | FRAME_F_DICT)) && !fs->rx) {
+		return FRAME_ERROR; /* peer uses a codec we never agreed on */
+	}
+	if (flags & FRAME_F_COMPRESSED) {
+		n = lz_decompress(fs->rx, payload, len, (unsigned char *)out, FRAME_PAYLOAD_MAX);
+		if (n < 0) {
+			return FRAME_ERROR;
+		}
+	} else {
+		memcpy(out, payload, len);
+		if (flags & FRAME_F_DICT) {
+			lz_append(fs->rx, payload, len);
+		}
+		n = len;
+	}
+	out[n] = '\0';
+
+	fs->rflags = flags & FRAME_F_BULK;
+	fs->payload_in += n;
+	fs->wire_in += total;
+	fs->rlen -= total;
+	memmove(fs->rbuf, fs->rbuf + total, fs->rlen);
+	return n;
+}
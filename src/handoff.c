@@ -0,0 +1,421 @@
+/*
+ * handoff.c - socket handoff between an old and a new server process
+ */
+
+#define _GNU_SOURCE // struct ucred
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "handoff.h"
+#include "frame.h"
+#include "modstore.h"
+#include "ratelimit.h"
+#include "bulk.h"
+#include "control_msg.h"
+
+#define HANDOFF_NAME_LEN 32
+
+/* first message, carries the listener fd */
+struct handoff_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count; /* client messages that follow */
+	uint32_t unix_listener; /* 1 if a message with the UNIX domain listener comes first */
+	uint32_t lz_size; /* sizeof(struct lz_stream), both ends must agree */
+	int64_t next_id; /* g_useid of the old process */
+};
+
+/* one per client, carries its sockfd, followed by rbuf, spill and the dictionaries */
+struct handoff_client {
+	int32_t index;
+	int32_t partner_index;
+	int32_t state;
+	int32_t blocked;
+	int32_t flag;
+	int32_t codec;
+	int32_t misses;
+	int32_t skip;
+	uint32_t rlen;
+	uint32_t spill_len;
+	uint64_t session;
+	uint64_t payload_in, wire_in, payload_out, wire_out;
+	char name[HANDOFF_NAME_LEN];
+	char addr[MOD_KEY_LEN];
+};
+
+#define HANDOFF_MSG_MAX (sizeof(struct handoff_client) + FRAME_PAYLOAD_MAX + \
+		FRAME_HEADER_LEN + FRAME_SPILL_MAX + 2 * sizeof(struct lz_stream))
+
+static struct sockaddr_un handoff_addr(const char *path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	return addr;
+}
+
+/* send one message with a file descriptor attached */
+static int send_with_fd(int sockfd, const void *buf, size_t len, int fd) {
+	struct msghdr msg;
+	struct iovec iov;
+	char control[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr *cmsg;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	iov.iov_base = (void *)buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	return sendmsg(sockfd, &msg, 0) == (ssize_t)len ? 0 : -1;
+}
+
+/* receive one message and the file descriptor attached to it,
+ * return message length or -1 */
+static ssize_t recv_with_fd(int sockfd, void *buf, size_t len, int *fd) {
+	struct msghdr msg;
+	struct iovec iov;
+	char control[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr *cmsg;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	*fd = -1;
+	n = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC);
+	if (n <= 0 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+		return -1;
+	}
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+		}
+	}
+	return *fd == -1 ? -1 : n;
+}
+
+int handoff_listen(const char *path) {
+	struct sockaddr_un addr = handoff_addr(path);
+	int sockfd, ret;
+	mode_t mask;
+
+	if ((sockfd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1) {
+		perror("handoff: socket");
+		return -1;
+	}
+	unlink(path); // left behind by a server that did not exit cleanly
+	mask = umask(0077); // only our user may connect, the socket hands out every client
+	ret = bind(sockfd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (ret == -1 || listen(sockfd, 1) == -1) {
+		perror("handoff: bind");
+		close(sockfd);
+		return -1;
+	}
+	return sockfd;
+}
+
+/* return 0 if the process on sockfd runs as our user, otherwise -1 */
+static int check_peer(int sockfd) {
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(sockfd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+		perror("handoff: peer credentials");
+		return -1;
+	}
+	if (cred.uid != geteuid()) {
+		fprintf(stderr, "handoff: refused uid %u, only %u may take over\n",
+				(unsigned)cred.uid, (unsigned)geteuid());
+		return -1;
+	}
+	return 0;
+}
+
+int handoff_send(int handoff_fd, int listener_fd, int unix_fd, struct client_table *table,
+		struct client_info *clients[], struct slot_set *bitmap, long next_id) {
+	struct handoff_header header;
+	unsigned char *msg;
+	int sockfd, i;
+	int size = HANDOFF_SNDBUF;
+	struct timeval wait = { .tv_sec = HANDOFF_ACK_SECONDS };
+	char ack;
+
+	if ((sockfd = accept(handoff_fd, NULL, NULL)) == -1) {
+		perror("handoff: accept");
+		return -1;
+	}
+	if (check_peer(sockfd) == -1) {
+		close(sockfd);
+		return -1;
+	}
+	setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+
+	memset(&header, 0, sizeof(header));
+	header.magic = HANDOFF_MAGIC;
+	header.version = HANDOFF_VERSION;
+	header.lz_size = sizeof(struct lz_stream);
+	header.next_id = next_id;
+	header.unix_listener = unix_fd != -1;
+	SLOT_SET_FOREACH(i, bitmap) {
+		if (!(table->flags[i] & CLIENT_F_REMOTE)) {
+			header.count++;
+		}
+	}
+	if (send_with_fd(sockfd, &header, sizeof(header), listener_fd) == -1) {
+		perror("handoff: send header");
+		close(sockfd);
+		return -1;
+	}
+	if (unix_fd != -1 && send_with_fd(sockfd, "U", 1, unix_fd) == -1) {
+		perror("handoff: send unix listener");
+		close(sockfd);
+		return -1;
+	}
+
+	msg = malloc(HANDOFF_MSG_MAX);
+	for (i = 0; i < CLIENT_MAX; i++) {
+		struct client_info *client = clients[i];
+		struct frame_stream *fs;
+		struct handoff_client rec;
+		size_t len = sizeof(rec);
+
+		if (!slot_set_has(bitmap, i) || (table->flags[i] & CLIENT_F_REMOTE)) {
+			continue; /* proxies of remote users go down with the node links */
+		}
+		fs = client->stream;
+		memset(&rec, 0, sizeof(rec));
+		rec.index = i;
+		rec.partner_index = table->partner[i];
+		rec.state = table->state[i];
+		rec.blocked = (table->flags[i] & CLIENT_F_BLOCKED) != 0;
+		rec.flag = client->flag;
+		rec.session = client->session;
+		rec.codec = fs->codec;
+		rec.misses = fs->misses;
+		rec.skip = fs->skip;
+		rec.rlen = fs->rlen;
+		rec.spill_len = fs->spill_len;
+		rec.payload_in = fs->payload_in;
+		rec.wire_in = fs->wire_in;
+		rec.payload_out = fs->payload_out;
+		rec.wire_out = fs->wire_out;
+		strncpy(rec.name, client->name, HANDOFF_NAME_LEN - 1);
+		strncpy(rec.addr, client->addr, MOD_KEY_LEN - 1);
+
+		/* record, partial frame, bytes read ahead, then both dictionaries if a codec is on */
+		memcpy(msg + len, fs->rbuf, fs->rlen);
+		len += fs->rlen;
+		memcpy(msg + len, fs->spill, fs->spill_len);
+		len += fs->spill_len;
+		if (fs->codec != CODEC_NONE) {
+			memcpy(msg + len, fs->tx, sizeof(struct lz_stream));
+			len += sizeof(struct lz_stream);
+			memcpy(msg + len, fs->rx, sizeof(struct lz_stream));
+			len += sizeof(struct lz_stream);
+		}
+		memcpy(msg, &rec, sizeof(rec));
+		if (send_with_fd(sockfd, msg, len, table->sockfd[i]) == -1) {
+			perror("handoff: send client");
+			free(msg);
+			close(sockfd);
+			return -1;
+		}
+	}
+	free(msg);
+
+	/* nothing is given up until the new server has all of it, without the ack
+	 * it closes its copies and this process carries on with the sockets */
+	if (recv(sockfd, &ack, 1, 0) != 1 || ack != HANDOFF_ACK) {
+		fprintf(stderr, "handoff: the new server did not take every session\n");
+		close(sockfd);
+		return -1;
+	}
+	mod_close(); // flushed before the new server sees EOF and maps the table
+	close(sockfd);
+	printf("Handed %u sessions to the new server\n", header.count);
+	return 0;
+}
+
+/* rebuild a client from its handoff message, return 0 if success, otherwise -1 */
+static int restore_client(const unsigned char *msg, ssize_t len, int sockfd,
+		struct client_table *table, struct client_info *clients[], struct slot_set *bitmap) {
+	struct handoff_client rec;
+	struct client_info *client;
+	struct frame_stream *fs;
+	ssize_t need;
+
+	if (len < (ssize_t)sizeof(rec)) {
+		return -1;
+	}
+	memcpy(&rec, msg, sizeof(rec));
+	need = sizeof(rec) + rec.rlen + rec.spill_len;
+	if (rec.codec != CODEC_NONE) {
+		need += 2 * sizeof(struct lz_stream);
+	}
+	if (rec.index < 0 || rec.index >= CLIENT_MAX || slot_set_has(bitmap, rec.index) ||
+			rec.rlen > sizeof(fs->rbuf) || rec.spill_len > FRAME_SPILL_MAX || len != need) {
+		return -1;
+	}
+	rec.name[HANDOFF_NAME_LEN - 1] = '\0';
+	rec.addr[MOD_KEY_LEN - 1] = '\0';
+	msg += sizeof(rec);
+
+	fs = frame_stream_new(sockfd);
+	if (rec.codec != CODEC_NONE && frame_set_codec(fs, rec.codec) == 0) {
+		const unsigned char *dict = msg + rec.rlen + rec.spill_len;
+		memcpy(fs->tx, dict, sizeof(struct lz_stream));
+		memcpy(fs->rx, dict + sizeof(struct lz_stream), sizeof(struct lz_stream));
+	}
+	memcpy(fs->rbuf, msg, rec.rlen);
+	fs->rlen = rec.rlen;
+	frame_feed(fs, msg + rec.rlen, rec.spill_len);
+	fs->misses = rec.misses;
+	fs->skip = rec.skip;
+	fs->payload_in = rec.payload_in;
+	fs->wire_in = rec.wire_in;
+	fs->payload_out = rec.payload_out;
+	fs->wire_out = rec.wire_out;
+
+	client = malloc(sizeof(struct client_info));
+	client->slot = rec.index;
+	memcpy(client->name, rec.name, NAME_LENGTH - 1); // names are shorter than the record's field
+	client->name[NAME_LENGTH - 1] = '\0';
+	client->addr = strdup(rec.addr);
+	client->stream = fs;
+	client->limit = rate_limit_new(rate_now()); /* buckets start full again */
+	client->history = NULL; /* scrollback stays with the old process */
+	client->node = -1;
+	client->flag = rec.flag;
+	client->session = rec.session;
+	client->channel_bytes = 0;
+	client->bulk = bulk_queue_new(fs); /* the old server sent what it had queued */
+	clients[rec.index] = client;
+	table->sockfd[rec.index] = sockfd;
+	table->partner[rec.index] = rec.partner_index;
+	table->state[rec.index] = rec.state;
+	table->flags[rec.index] = rec.blocked ? CLIENT_F_BLOCKED : 0;
+	slot_set_add(bitmap, rec.index);
+	return 0;
+}
+
+/* close what a failed takeover received, the old server still serves it */
+static void abort_receive(int sockfd, int listener_fd, int *unix_fd, struct client_table *table,
+		struct slot_set *bitmap) {
+	int slot;
+
+	SLOT_SET_FOREACH(slot, bitmap) {
+		close(table->sockfd[slot]);
+	}
+	slot_set_zero(bitmap);
+	close(listener_fd);
+	if (*unix_fd != -1) {
+		close(*unix_fd);
+		*unix_fd = -1;
+	}
+	close(sockfd);
+}
+
+int handoff_receive(const char *path, int *unix_fd, struct client_table *table,
+		struct client_info *clients[], struct slot_set *bitmap, long *next_id) {
+	struct sockaddr_un addr = handoff_addr(path);
+	struct handoff_header header;
+	unsigned char *msg;
+	int sockfd, listener_fd, fd, slot;
+	unsigned i;
+	ssize_t n;
+	char eof, tag, ack = HANDOFF_ACK;
+
+	*unix_fd = -1;
+	if ((sockfd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1) {
+		perror("takeover: socket");
+		return -1;
+	}
+	if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		perror("takeover: connect");
+		close(sockfd);
+		return -1;
+	}
+
+	if (recv_with_fd(sockfd, &header, sizeof(header), &listener_fd) != sizeof(header) ||
+			header.magic != HANDOFF_MAGIC || header.version != HANDOFF_VERSION ||
+			header.lz_size != sizeof(struct lz_stream)) {
+		fprintf(stderr, "takeover: running server speaks another handoff version\n");
+		if (listener_fd != -1) {
+			close(listener_fd);
+		}
+		close(sockfd);
+		return -1;
+	}
+	if (header.unix_listener && recv_with_fd(sockfd, &tag, 1, unix_fd) != 1) {
+		fprintf(stderr, "takeover: no UNIX domain listener\n");
+		*unix_fd = -1; // local clients reconnect to a fresh one
+	}
+
+	slot_set_zero(bitmap);
+	msg = malloc(HANDOFF_MSG_MAX);
+	for (i = 0; i < header.count; i++) {
+		n = recv_with_fd(sockfd, msg, HANDOFF_MSG_MAX, &fd);
+		if (n == -1 || restore_client(msg, n, fd, table, clients, bitmap) == -1) {
+			/* all or nothing, the old server keeps every socket without our ack */
+			fprintf(stderr, "takeover: bad client message %u, giving the sessions back\n", i);
+			if (fd != -1) {
+				close(fd);
+			}
+			free(msg);
+			abort_receive(sockfd, listener_fd, unix_fd, table, bitmap);
+			return -1;
+		}
+	}
+	free(msg);
+	if (send(sockfd, &ack, 1, MSG_NOSIGNAL) != 1) {
+		perror("takeover: ack");
+		abort_receive(sockfd, listener_fd, unix_fd, table, bitmap);
+		return -1;
+	}
+
+	/* a partner that was not handed over (a remote proxy) has left the session,
+	 * and remote pairings still in flight will never be answered */
+	SLOT_SET_FOREACH(slot, bitmap) {
+		if (table->partner[slot] != -1 &&
+				(table->partner[slot] < 0 || !slot_set_has(bitmap, table->partner[slot]))) {
+			table->partner[slot] = -1;
+			table->state[slot] = CONNECTING;
+			if (frame_send(clients[slot]->stream, MSG_QUIT, strlen(MSG_QUIT)) == -1) {
+				perror("takeover: quit channel");
+			}
+		}
+	}
+
+	/* old server closes its end once it is done with shared state */
+	while ((n = recv(sockfd, &eof, 1, 0)) == -1 && errno == EINTR);
+	close(sockfd);
+
+	*next_id = header.next_id;
+	printf("Took over %u sessions\n", header.count);
+	return listener_fd;
+}
@@ -0,0 +1,79 @@
+/*
+ * admin.h - admin control socket of the TRS server
+ *
+ * Besides the stdin shell, the server listens on a UNIX stream socket for
+ * scripts, e.g.
+ *     printf '/block --file spammers.txt\n/throwout --match guest_*\n' | nc -U log/admin.sock
+ * Every line is a command, run by the event loop when it arrives. A command may
+ * name any number of users, read them from a file or match them with a
+ * pattern; all of them are applied in a single pass over the clients, and one
+ * result line per user streams back, followed by a line starting with "ok" or
+ * "error".
+ */
+
+#ifndef __ADMIN_H__
+#define __ADMIN_H__
+
+#include <stdio.h>
+
+#include "common.h"
+
+#define ADMIN_CONN_MAX         4      // admin connections at a time
+#define ADMIN_LINE_MAX         4096   // longest command line
+#define ADMIN_OUT_BUF          65536  // results are written in chunks of this size
+#define ADMIN_SEND_TIMEOUT     1      // seconds a stalled reader may hold the event loop
+
+/* one connected admin script */
+struct admin_conn {
+	int fd; /* -1 for a free entry */
+	char in[ADMIN_LINE_MAX];
+	size_t len;
+	FILE *out; /* results, flushed after every command */
+};
+
+/* a set of user names, filled from a command and checked off by the pass */
+struct name_set {
+	struct name_entry {
+		char name[NAME_LENGTH];
+		int found;
+	} *entries;
+	size_t capacity; /* always a power of two */
+	size_t count;
+};
+
+/* create the UNIX socket scripts connect to, return fd or -1 */
+int admin_listen(const char *path);
+
+/* accept a script, return the new fd or -1 */
+int admin_accept(int listen_fd);
+
+/* the connection of fd, NULL if fd is not an admin connection */
+struct admin_conn* admin_find(int fd);
+
+/* read what arrived, return the bytes read, 0 on end of stream or -1 on error */
+int admin_fill(struct admin_conn *conn);
+
+/* the next complete line without its newline, NULL if none is buffered yet */
+char* admin_next_line(struct admin_conn *conn);
+
+/* flush the results and close the connection */
+void admin_close(struct admin_conn *conn);
+
+/* close every connection and the listener */
+void admin_close_all(int listen_fd);
+
+/* return 0 if success, otherwise -1 */
+int name_set_init(struct name_set *set);
+
+/* add a name once, return 0 if success, otherwise -1 */
+int name_set_add(struct name_set *set, const char *name);
+
+/* add every line of a file, return the number of names read or -1 */
+int name_set_load(struct name_set *set, const char *path);
+
+/* mark name as found, return 0 if it is in the set, otherwise -1 */
+int name_set_take(struct name_set *set, const char *name);
+
+void name_set_free(struct name_set *set);
+
+#endif /* __ADMIN_H__ */
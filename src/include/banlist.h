@@ -0,0 +1,45 @@
+/*
+ * banlist.h - addresses and address ranges that may not connect to the server
+ *
+ * A ban is an address ("203.0.113.7", "2001:db8::1") or a CIDR range
+ * ("203.0.113.0/24"). IPv4 is kept as IPv4-mapped IPv6, so both families
+ * share one table. Single addresses live in a hash set; ranges live in a
+ * binary trie over the address bits, so a check costs one hash probe plus at
+ * most 128 steps down the trie, whatever the number of bans. The bans are
+ * kept in a text file, one per line, rewritten after every change.
+ */
+
+#ifndef __BANLIST_H__
+#define __BANLIST_H__
+
+#include <stdio.h>
+#include <sys/socket.h>
+
+#define BAN_INITIAL_SLOTS      1024   // slots of the address set, always a power of two
+#define BAN_TEXT_MAX           64     // longest ban, an IPv6 range
+
+/* load the bans kept in path, return the number loaded or -1 */
+int ban_open(const char *path);
+
+/* write the bans if they changed and drop them */
+void ban_close();
+
+/* add an address or range, return 1 if added, 0 if it was there, -1 if text is not one */
+int ban_add(const char *text);
+
+/* return 1 if removed, 0 if it was not banned, -1 if text is not an address or range */
+int ban_remove(const char *text);
+
+/* return 1 if the address of a peer is banned, otherwise 0 */
+int ban_check(const struct sockaddr *sa);
+
+/* same for an address in text form */
+int ban_check_text(const char *addr);
+
+/* print every ban to out, one per line, return how many */
+int ban_list(FILE *out);
+
+/* rewrite the file if something changed, return 0 if success, otherwise -1 */
+int ban_save();
+
+#endif /* __BANLIST_H__ */
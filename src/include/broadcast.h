@@ -0,0 +1,46 @@
+/*
+ * broadcast.h - server-wide notices sent without blocking the event loop
+ *
+ * A notice is framed once with frame_prepare() and every local client is put
+ * in a pending set. broadcast_run() polls up to BROADCAST_BATCH pending
+ * sockets in one poll() call and writes the frame to those with room,
+ * starting after the socket it stopped at last time. A socket without room
+ * stays pending for a later call, so one stalled client delays nobody else.
+ * The event loop calls it every iteration until nothing is pending, which is
+ * how the grace period learns that everyone has been told.
+ */
+
+#ifndef __BROADCAST_H__
+#define __BROADCAST_H__
+
+#include "frame.h"
+#include "slotset.h"
+
+#define BROADCAST_BATCH        256    // sockets polled per call
+#define BROADCAST_POLL_SECONDS 0.01   // look again at sockets that had no room
+#define BROADCAST_DRAIN_SECONDS 2.0   // how long the stop notice waits for stalled sockets
+
+/* progress of the current or last broadcast */
+struct broadcast_status {
+	int total;
+	int told;
+	int failed; /* errors and hang ups */
+	int pending;
+	double seconds; /* from the start until the last socket was done */
+};
+
+/* start sending msg to the slots in to, whose streams are in streams[slot].
+ * one in progress is replaced. return 0 if success, otherwise -1 */
+int broadcast_start(const char *msg, const struct slot_set *to, struct frame_stream *streams[]);
+
+/* write to the pending sockets that have room, waiting up to wait_ms for one.
+ * return the number still pending */
+int broadcast_run(int wait_ms);
+
+/* the client in slot is going away, do not write to its stream */
+void broadcast_forget(int slot);
+
+/* fill st, return 1 while a broadcast is pending, otherwise 0 */
+int broadcast_status(struct broadcast_status *st);
+
+#endif /* __BROADCAST_H__ */
@@ -0,0 +1,79 @@
+/*
+ * bulk.h - scheduler for file data forwarded by the server
+ *
+ * Traffic to a client falls in three classes. Control messages and chat are
+ * sent as soon as they are handled. File data (frames with FRAME_F_BULK) goes
+ * into a queue per receiving connection instead, and bulk_run() drains the
+ * queues with deficit round robin: every round a queue may send up to
+ * BULK_QUANTUM bytes, within a per-connection and a global bandwidth share.
+ * File data is only written while the socket has less than BULK_OUTQ_MAX
+ * bytes unsent and the stream keeps none that the socket refused, so a chat
+ * line never waits behind more than that. A sender
+ * whose partner has BULK_QUEUE_MAX bytes queued, or whose partner's node link
+ * has that much unwritten, is not read until it drops under BULK_QUEUE_RESUME.
+ * This hold paces file data instead of the rate limits, which only count it
+ * when it comes outside a transfer.
+ */
+
+#ifndef __BULK_H__
+#define __BULK_H__
+
+#include <stddef.h>
+
+#include "frame.h"
+
+#define BULK_QUANTUM           (4 * FRAME_CHUNK_MAX) // bytes a queue may send per round
+#define BULK_OUTQ_MAX          (32 * 1024) // unsent bytes in a socket before file data waits
+#define BULK_QUEUE_MAX         (256 * 1024) // queued bytes before the sender is held
+#define BULK_QUEUE_RESUME      (64 * 1024)
+#define BULK_POLL_SECONDS      0.005  // look again at sockets that were full
+#define BULK_BURST_SECONDS     0.25   // bucket size, in seconds of the share
+
+/* file data queued for one connection */
+struct bulk_queue;
+
+/* bandwidth shares in bytes per second, 0 for no limit, set with --file-rate */
+struct bulk_config {
+	double per_connection;
+	double total;
+};
+
+/* totals reported by /stats */
+struct bulk_stats {
+	unsigned long long bytes; /* file data sent by the scheduler */
+	unsigned long frames;
+	unsigned long rounds;
+	unsigned long outq_waits; /* a socket had too much unsent */
+	unsigned long holds; /* senders not read for a full queue */
+	size_t max_queued;
+};
+
+extern struct bulk_config g_bulk_config;
+extern struct bulk_stats g_bulk_stats;
+
+/* parse "per=262144,total=1048576", return 0 if success, otherwise -1 */
+int bulk_configure(const char *spec);
+
+struct bulk_queue* bulk_queue_new(struct frame_stream *fs);
+
+/* drop what is queued and forget the queue */
+void bulk_queue_free(struct bulk_queue *q);
+
+/* drop what is queued, e.g. when the transfer ends early */
+void bulk_queue_clear(struct bulk_queue *q);
+
+/* queue a message behind the file data, flags is FRAME_F_BULK for file data
+ * or 0 for a message that must not overtake it. return 0 if success, otherwise -1 */
+int bulk_enqueue(struct bulk_queue *q, const void *buf, size_t len, int flags);
+
+/* bytes waiting in the queue */
+size_t bulk_pending(const struct bulk_queue *q);
+
+/* send what the shares and sockets allow, return seconds until more can be sent,
+ * -1 if every queue is empty */
+double bulk_run(double now);
+
+/* send everything queued regardless of the shares, e.g. before a handoff */
+void bulk_flush();
+
+#endif /* __BULK_H__ */
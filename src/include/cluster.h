@@ -0,0 +1,115 @@
+/*
+ * cluster.h - links between TRS server nodes for cross-node matchmaking
+ *
+ * Nodes talk over TCP with the same frames as clients. Each node publishes a
+ * sample of its waiting users every CLUSTER_POOL_INTERVAL seconds, so
+ * find_partner can pick a user on another node. A remote partner is represented
+ * locally by a proxy client_info whose messages are relayed over the link.
+ *
+ * Nodes share a secret given with --node-secret-file. Each side's hello carries
+ * a random nonce, and the other side answers with an HMAC-SHA256 of both nonces
+ * and its role (dialer or acceptor) under the secret. A link carries nothing
+ * else until the answer checks out. The role keeps a third party from passing
+ * one node's answer on to another. Links are not encrypted, so run them on a
+ * network you trust (--node-bind).
+ *
+ * A link never blocks the event loop. Frames go out with a non-blocking send,
+ * and whatever the socket does not take waits in a buffer per link.
+ * cluster_flush() writes the buffer as room appears. A node that leaves
+ * CLUSTER_OUTQ_MAX bytes unread is dropped.
+ */
+
+#ifndef __CLUSTER_H__
+#define __CLUSTER_H__
+
+#include <stddef.h>
+
+#include "common.h"
+
+#define NODE_MAX               16     // links one node keeps
+#define CLUSTER_POOL_SAMPLE    16     // waiting users published per node
+#define CLUSTER_POOL_INTERVAL  1      // seconds between pool summaries
+#define CLUSTER_PENDING        -2     // partner_index while a remote pairing is in flight
+#define CLUSTER_ID_STRIDE      1000000 // user ids of node n start at n * stride
+#define CLUSTER_NONCE_LEN      16     // random bytes in a hello
+#define CLUSTER_SECRET_MAX     256    // longest shared secret read from the file
+#define CLUSTER_OUTQ_MAX       (4 << 20) // bytes a node may leave unread before it is dropped
+#define CLUSTER_POLL_SECONDS   0.005  // look again at links with buffered output
+
+/* one link to another node */
+struct node_link {
+	int sockfd; /* -1 for a free slot */
+	struct frame_stream *stream;
+	int node_id; /* announced by the peer in its hello, -1 until then */
+	int pool_count; /* waiting users on that node */
+	int sample_count; /* names below that may still be picked */
+	char sample[CLUSTER_POOL_SAMPLE][NAME_LENGTH];
+	int dialed; /* 1 if we connected, 0 if the peer did */
+	int answered; /* we answered the peer's hello */
+	int authed; /* the peer answered ours */
+	char nonce[2 * CLUSTER_NONCE_LEN + 1]; /* hex, sent in our hello */
+	char peer_nonce[2 * CLUSTER_NONCE_LEN + 1]; /* hex, from the peer's hello */
+	unsigned char *out; /* frames the socket did not take yet */
+	size_t out_len, out_cap;
+};
+
+extern struct node_link g_links[NODE_MAX];
+extern int g_node_id;
+
+/* read the shared secret from the first line of path, return 0 if success, otherwise -1 */
+int cluster_set_secret(const char *path);
+
+/* listen for other nodes on port of host, every interface if host is NULL, return fd or -1 */
+int cluster_listen(const char *host, const char *port);
+
+/* connect to a node given as host:port, return link index or -1 */
+int cluster_connect(const char *hostport);
+
+/* accept a node on the cluster listener, return link index or -1 */
+int cluster_accept(int listener_fd);
+
+/* return the link index of sockfd, -1 if it is not a node link */
+int cluster_find_link(int sockfd);
+
+void cluster_drop_link(int link);
+
+/* return 1 if any link is up */
+int cluster_active();
+
+/* answer the hello of the node at link carrying nonce, return 0 if success, otherwise -1 */
+int cluster_answer(int link, const char *nonce);
+
+/* check the answer of the node at link to our hello, return 0 if it knows the secret, otherwise -1 */
+int cluster_verify(int link, const char *mac);
+
+/* write buffered output of every link, return 1 if some is left, otherwise 0 */
+int cluster_flush();
+
+/* return the bytes buffered for link and not yet written */
+size_t cluster_backlog(int link);
+
+/* send one link message, return 0 if success, otherwise -1 */
+int cluster_send(int link, const char *msg);
+
+/* send a link message to every authenticated node, return the number of nodes reached */
+int cluster_broadcast(const char *msg);
+
+/* deliver buf to the user called to on the node at link */
+int cluster_relay(int link, const char *to, const void *buf, size_t len);
+
+/* same, FRAME_F_BULK in flags marks file data */
+int cluster_relay_flags(int link, const char *to, const void *buf, size_t len, int flags);
+
+/* mirror the state of a remote user to its node */
+int cluster_send_state(int link, const char *name, int state);
+
+/* replace the sample of waiting users published by link */
+void cluster_set_pool(int link, int count, char *names);
+
+/* number of remote users that may be picked */
+int cluster_sample_count();
+
+/* take the r-th sampled remote user out of the samples */
+int cluster_take_sample(int r, int *link, char *name);
+
+#endif /* __CLUSTER_H__ */
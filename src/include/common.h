@@ -11,20 +11,57 @@ typedef enum { SERVER_INIT, SERVER_RUNNING,  GRACE_PERIOD } server_state_t;
 #define PORT                   "3490" // the port client will be connecting to
 #define BUF_MAX                256    // max size for client data
 #define CLIENT_MAX             64     // how many pending connections queue will hold
+#define CLIENT_OUTQ_MAX        (1 << 20) // bytes a client may leave unread before it is dropped
+#define LISTEN_BACKLOG         4096   // connections the kernel queues before accept, --backlog
 #define PARAMS_MAX             10     // maximum number of parameter
-#define NAME_LENGTH            10     // maximum characters for client name
+#define NAME_LENGTH            24     // maximum characters for client name
 #define GRACE_PERIOD_SECONDS   10     // grace period seconds for stopping the server
+#define HEARTBEAT_SECONDS      60     // a client silent this long is dropped, --heartbeat
+#define CONSOLE_QUEUE_MAX      16     // admin lines typed on stdin that wait for the event loop
+#define FILE_SIZE_MAX          (4LL << 30) // largest file a client sends
 
 #define STAT_FILEPATH       "log/stat.txt"
+#define MODERATION_DB_FILEPATH  "log/moderation.db"
+#define MODERATION_LOG_FILEPATH "log/moderation.log"
+#define BANS_FILEPATH       "log/bans.txt"
+#define HANDOFF_SOCKPATH    "log/handoff.sock" // where a new server asks for the sockets
+#define ADMIN_SOCKPATH      "log/admin.sock" // where admin scripts connect
+#define TRANSCRIPT_DIR      "log/transcript"
 
-/* represent client status on server side */
+struct frame_stream;
+struct rate_limit;
+struct scrollback;
+struct bulk_queue;
+
+#define CLIENT_F_BLOCKED       0x01   // may not start a chat
+#define CLIENT_F_HELD          0x02   // not read while the partner's file data queue is full
+#define CLIENT_F_REMOTE        0x04   // proxy of a user on another node
+#define CLIENT_F_PINGED        0x08   // sent a heartbeat since it was last heard from
+
+/* the client fields that scans over the whole queue read, one array per field
+ * indexed by slot, so a scan walks a few contiguous bytes per client instead of
+ * following a pointer to each client_info */
+struct client_table {
+   unsigned char state[CLIENT_MAX]; /* client_state_t */
+   unsigned char flags[CLIENT_MAX]; /* CLIENT_F_* */
+   int partner[CLIENT_MAX]; /* slot of the chat partner, -1 for none */
+   int sockfd[CLIENT_MAX]; /* -1 for a proxy */
+   double heard[CLIENT_MAX]; /* rate_now() when bytes last came in, for heartbeats */
+};
+
+/* the rest of a client on the server side, read once a slot was picked */
 struct client_info {
-   char *name;
-   int sockfd;
-   int partner_index;
-   client_state_t state;
-   int blocked; /*0 for not blocked, 1 for blocked */
+   int slot; /* index into the client table and the chat queue */
+   char name[NAME_LENGTH];
+   char *addr; /* source address, the identity moderation is keyed on */
+   struct frame_stream *stream; /* framing and compression state of sockfd */
+   struct rate_limit *limit; /* token buckets, NULL for a proxy */
+   struct scrollback *history; /* lines of the current or last channel, NULL before the first */
+   unsigned long long session; /* transcript id of the current or last channel, 0 before the first */
+   unsigned long long channel_bytes; /* carried by that channel through this node */
+   int node; /* node link of a remote user's proxy, -1 for a local user */
    int flag; /* number of flags received */
+   struct bulk_queue *bulk; /* file data waiting to be sent to the client, NULL for a proxy */
 };
 
 void print_ascii_art();
@@ -0,0 +1,43 @@
+/*
+ * compress.h - small LZ77 stream codec used to compress chat frames and file chunks
+ */
+
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum { CODEC_NONE, CODEC_LZ } codec_t;
+
+#define CODEC_LZ_NAME       "lz"   // codec name advertised in the handshake
+#define LZ_DICT_SIZE        16384  // bytes of history kept as streaming dictionary
+#define LZ_CHUNK_MAX        4096   // largest block compressed in one call
+#define LZ_HASH_BITS        12
+#define LZ_MIN_MATCH        4
+
+/* one direction of a compressed stream; encoder and decoder keep the same history */
+struct lz_stream {
+	int encoder; /* 1 for the sending side, 0 for the receiving side */
+	uint32_t base; /* stream offset of buf[0] */
+	size_t hist; /* bytes of history in buf */
+	uint32_t table[1 << LZ_HASH_BITS]; /* stream offset + 1 of last position per hash */
+	unsigned char buf[LZ_DICT_SIZE + LZ_CHUNK_MAX];
+};
+
+struct lz_stream* lz_stream_new(int encoder);
+void lz_stream_free(struct lz_stream *s);
+
+/* append data to the dictionary without compressing it */
+void lz_append(struct lz_stream *s, const unsigned char *src, size_t n);
+
+/* compress src into dst, return compressed size or 0 if it would not shrink.
+ * src is always added to the dictionary. */
+size_t lz_compress(struct lz_stream *s, const unsigned char *src, size_t n,
+		unsigned char *dst, size_t dstmax);
+
+/* decompress src into dst, return decoded size or -1 if corrupt */
+int lz_decompress(struct lz_stream *s, const unsigned char *src, size_t n,
+		unsigned char *dst, size_t dstmax);
+
+#endif /* __COMPRESS_H__ */
@@ -25,6 +25,21 @@
 #define MSG_RECEIVE_FLAG "##receive_flag"
 #define MSG_HELP "##request_help"
 #define MSG_SERVER_SHUTDOWN "##server_exit"
+#define MSG_COMPRESS "##compress"
+#define MSG_HISTORY "##history"
+#define MSG_PING "##ping"
+#define MSG_PONG "##pong"
+
+// messages between server nodes
+#define MSG_NODE_HELLO "##node_hello"
+#define MSG_NODE_AUTH "##node_auth"
+#define MSG_NODE_POOL "##node_pool"
+#define MSG_NODE_PAIR "##node_pair"
+#define MSG_NODE_PAIR_OK "##node_pair_ok"
+#define MSG_NODE_PAIR_FAIL "##node_pair_fail"
+#define MSG_NODE_RELAY "##node_relay"
+#define MSG_NODE_STATE "##node_state"
+#define MSG_NODE_ADMIN "##node_admin"
 
 // supported client commands
 #define CONNECT "/connect"
@@ -34,6 +49,7 @@
 #define HELP "/help"
 #define QUIT "/quit"
 #define EXIT "/exit"
+#define HISTORY "/history"
 
 // supported admin command
 #define STATS "/stats"
@@ -42,5 +58,9 @@
 #define UNBLOCK "/unblock"
 #define START "/start"
 #define END "/end"
+#define TOP "/top"
+#define BAN "/ban"
+#define UNBAN "/unban"
+#define BANS "/bans"
 
 #endif
@@ -0,0 +1,57 @@
+/*
+ * counters.h - server counters kept up to date as clients change state
+ *
+ * Every transition adjusts the counts, so reading them never walks the
+ * clients. The busiest channels are tracked with a space-saving table of
+ * COUNTERS_TOP entries per second: a channel already in the table adds its
+ * bytes, a new one replaces the smallest entry and inherits its count. The
+ * cost per message stays fixed however many users there are, at the price of
+ * overestimating a channel that just entered the table.
+ */
+
+#ifndef __COUNTERS_H__
+#define __COUNTERS_H__
+
+#include <time.h>
+
+#include "common.h"
+
+#define COUNTERS_TOP           10     // busiest channels shown by /top
+
+struct server_counters {
+	long state[TRANSFERING + 1]; /* local clients per client_state_t */
+	long flagged; /* local clients flagged at least once */
+	unsigned long long messages; /* forwarded between partners */
+	unsigned long long bytes;
+	unsigned long connections; /* admitted since start */
+	unsigned long pairings;
+};
+
+/* one channel of the busiest table */
+struct top_channel {
+	unsigned long long session;
+	unsigned long long bytes; /* in the second the table covers */
+	char names[2][NAME_LENGTH];
+};
+
+struct top_table {
+	time_t second;
+	int count;
+	struct top_channel channel[COUNTERS_TOP];
+};
+
+extern struct server_counters g_counters;
+
+/* a local client entered state from another one, INIT for a new client */
+void counters_state(client_state_t from, client_state_t to);
+
+/* a local client left */
+void counters_leave(client_state_t state, int flagged);
+
+/* a message of len bytes went through the channel session between from and to */
+void counters_forward(unsigned long long session, const char *from, const char *to, size_t len);
+
+/* copy the busiest channels of the last full second, sorted, return the count */
+int counters_top(struct top_table *out);
+
+#endif /* __COUNTERS_H__ */
@@ -0,0 +1,32 @@
+/*
+ * dial.h - outgoing TCP connections that race every address of a host
+ *
+ * A host may resolve to several IPv6 and IPv4 addresses, some unreachable. The
+ * attempts are started one after another without waiting for the previous one
+ * to time out (happy eyeballs, RFC 8305), alternating address families, and
+ * the first socket to connect wins. A host of the form "unix:/path" is a UNIX
+ * domain socket on this machine instead, for bots and gateways next to the server.
+ */
+
+#ifndef __DIAL_H__
+#define __DIAL_H__
+
+#include <stddef.h>
+
+#define DIAL_STAGGER_MS        250    // head start of one attempt before the next
+#define DIAL_ATTEMPTS_MAX      16     // addresses tried per dial
+#define DIAL_TIMEOUT_MS        10000  // default deadline for connecting
+#define DIAL_UNIX_PREFIX       "unix:" // host prefix of a UNIX domain socket path
+
+/* monotonic clock in milliseconds */
+long long dial_now_ms();
+
+/* return 1 if host names a UNIX domain socket, otherwise 0 */
+int dial_is_unix(const char *host);
+
+/* connect to host and port within timeout_ms, port is ignored for a UNIX socket. the winning socket is returned in
+ * blocking mode, and its address is written to addr when addr is not NULL.
+ * return sockfd, otherwise -1 with errno of the last failure or ETIMEDOUT */
+int dial(const char *host, const char *port, int timeout_ms, char *addr, size_t addrlen);
+
+#endif /* __DIAL_H__ */
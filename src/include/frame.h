@@ -0,0 +1,130 @@
+/*
+ * frame.h - length-prefixed frames carried over a client/server connection
+ *
+ * Every message is sent as [length:2][flags:1][reserved:1][payload]. Once a codec
+ * is negotiated the payload may be compressed against a per-direction dictionary.
+ */
+
+#ifndef __FRAME_H__
+#define __FRAME_H__
+
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "compress.h"
+
+#define FRAME_HEADER_LEN       4
+#define FRAME_PAYLOAD_MAX      LZ_CHUNK_MAX // largest message
+#define FRAME_CHUNK_MAX        (FRAME_PAYLOAD_MAX - 64) // file chunk, leaves room for relay headers
+#define FRAME_F_COMPRESSED     0x01   // payload is an lz block
+#define FRAME_F_DICT           0x02   // payload joins the sender's dictionary
+#define FRAME_F_BULK           0x04   // payload is file data, scheduled behind chat
+#define FRAME_BYPASS_MIN       64     // smaller frames never count as misses
+#define FRAME_BYPASS_MISSES    4      // incompressible frames before backing off
+#define FRAME_BYPASS_SKIP      32     // frames sent raw after backing off
+#define FRAME_SEND_TIMEOUT     5000   // ms a full send buffer may stall a frame
+#define FRAME_SPILL_MAX        (64 * 1024) // fed bytes waiting for room in rbuf
+
+/* a message framed by frame_prepare(), valid on any stream whatever its codec */
+struct frame_prepared {
+	size_t len; /* payload */
+	size_t wire_len;
+	unsigned char wire[FRAME_HEADER_LEN + FRAME_PAYLOAD_MAX];
+};
+
+/* return values of frame_next() */
+#define FRAME_AGAIN            -1     // no complete frame buffered yet
+#define FRAME_ERROR            -2     // malformed frame, connection must be closed
+
+/* puts a finished frame on the wire, return 0 if success, otherwise -1 */
+typedef int (*frame_writer_t)(int sockfd, const void *buf, size_t len);
+
+struct tls_conn;
+
+struct frame_stream {
+	int sockfd;
+	codec_t codec;
+	frame_writer_t writer; /* blocking send unless frame_set_writer() or frame_set_queue() */
+	struct tls_conn *tls; /* NULL for plaintext, freed with the stream */
+	struct lz_stream *tx; /* outgoing dictionary, NULL until negotiated */
+	struct lz_stream *rx; /* incoming dictionary, NULL until negotiated */
+	int misses; /* consecutive frames that did not shrink */
+	int skip; /* frames left to send raw before trying again */
+	pthread_mutex_t tx_lock; /* client sends from two threads */
+	unsigned char rbuf[FRAME_HEADER_LEN + FRAME_PAYLOAD_MAX];
+	size_t rlen;
+	int rflags; /* FRAME_F_BULK of the frame frame_next() returned last */
+	unsigned char *spill; /* bytes from frame_feed() that did not fit in rbuf */
+	size_t spill_len;
+	unsigned char *out; /* bytes the socket did not take yet, see frame_set_queue() */
+	size_t out_len, out_cap;
+	size_t out_max; /* 0 while sends wait for the socket */
+	int out_err; /* errno of the send that broke the stream, 0 if none */
+	unsigned long long payload_in, wire_in; /* bytes before and after decoding */
+	unsigned long long payload_out, wire_out; /* bytes before and after encoding */
+};
+
+struct frame_stream* frame_stream_new(int sockfd);
+void frame_stream_free(struct frame_stream *fs);
+
+/* replace the blocking send used by frame_send(), e.g. to queue frames on io_uring */
+void frame_set_writer(struct frame_stream *fs, frame_writer_t writer);
+
+/* sends never wait for a full socket: what it does not take is kept, up to max bytes,
+ * and written by frame_flush(). a send past max or a failed one leaves part of a frame
+ * on the wire, so the socket is shut down for the reader to see the connection end,
+ * and every later send fails. a writer from frame_set_writer() keeps its own queue */
+void frame_set_queue(struct frame_stream *fs, size_t max);
+
+/* write what the socket takes of the kept bytes, return how many are left, otherwise -1 */
+int frame_flush(struct frame_stream *fs);
+
+/* return the bytes kept by frame_set_queue() */
+size_t frame_unsent(struct frame_stream *fs);
+
+/* carry the stream over TLS after the handshake, reads and writes go through OpenSSL
+ * unless the kernel does the crypto */
+void frame_set_tls(struct frame_stream *fs, struct tls_conn *tls);
+
+/* return 1 if the socket carries the frames as they are, plaintext or kTLS, otherwise 0 */
+int frame_raw(struct frame_stream *fs);
+
+/* return 1 if bytes wait in OpenSSL that select() will not report, otherwise 0 */
+int frame_buffered(struct frame_stream *fs);
+
+/* turn on a codec for both directions, return 0 if success, otherwise -1 */
+int frame_set_codec(struct frame_stream *fs, codec_t codec);
+
+/* send one uncompressed frame on a socket that has no stream yet */
+int frame_write(int sockfd, int flags, const void *buf, size_t len);
+
+/* send one message, return 0 if success, otherwise -1 */
+int frame_send(struct frame_stream *fs, const void *buf, size_t len);
+
+/* same with FRAME_F_BULK or 0 in flags */
+int frame_send_flags(struct frame_stream *fs, const void *buf, size_t len, int flags);
+
+/* send several messages as frames with a single write, an empty batch sends nothing.
+ * return 0 if success, otherwise -1 */
+int frame_send_batch(struct frame_stream *fs, const struct iovec *msgs, int count);
+
+/* frame buf once, uncompressed and outside the dictionaries, for sending to many streams.
+ * return 0 if success, otherwise -1 */
+int frame_prepare(struct frame_prepared *fp, const void *buf, size_t len);
+
+/* send a frame made by frame_prepare(), return 0 if success, otherwise -1 */
+int frame_send_prepared(struct frame_stream *fs, const struct frame_prepared *fp);
+
+/* read available bytes from the socket, same return value as recv() */
+int frame_fill(struct frame_stream *fs);
+
+/* buffer bytes that were received elsewhere, e.g. by io_uring,
+ * return 0 if success, otherwise -1 if FRAME_SPILL_MAX would be exceeded */
+int frame_feed(struct frame_stream *fs, const void *buf, size_t len);
+
+/* decode the next buffered frame into out (FRAME_PAYLOAD_MAX + 1 bytes),
+ * return payload length, FRAME_AGAIN or FRAME_ERROR. out is nul terminated. */
+int frame_next(struct frame_stream *fs, char *out);
+
+#endif /* __FRAME_H__ */
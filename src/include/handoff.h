@@ -0,0 +1,40 @@
+/*
+ * handoff.h - hands the listening socket and live sessions to a new server process
+ *
+ * A running server listens on a UNIX socket. A server started with --takeover
+ * connects to it and receives the listeners and every client socket over
+ * SCM_RIGHTS, one SOCK_SEQPACKET message per socket, together with a snapshot
+ * of the client table. The new process acknowledges a complete transfer with
+ * one byte; only then does the old process exit without telling the clients.
+ * Without it the new process closes what it got and the old one keeps serving.
+ * Only a process of the same user may connect.
+ */
+
+#ifndef __HANDOFF_H__
+#define __HANDOFF_H__
+
+
+#include "common.h"
+#include "slotset.h"
+
+#define HANDOFF_MAGIC          0x48535254 // "TRSH"
+#define HANDOFF_VERSION        4
+#define HANDOFF_SNDBUF         (1 << 20)  // room for a client with both dictionaries
+#define HANDOFF_ACK            'A'        // the new server took every session
+#define HANDOFF_ACK_SECONDS    10         // how long the old server waits for it
+
+/* create the UNIX socket a new server connects to, return fd or -1 */
+int handoff_listen(const char *path);
+
+/* accept the new server on handoff_fd and send it everything, unix_fd -1 if there is
+ * no UNIX domain listener. return 0 if success, otherwise -1 and this process keeps serving */
+int handoff_send(int handoff_fd, int listener_fd, int unix_fd, struct client_table *table,
+		struct client_info *clients[], struct slot_set *bitmap, long next_id);
+
+/* take over from the server listening on path, fill the client table and the
+ * inherited UNIX domain listener (-1 if none), return the inherited listener fd or -1.
+ * it takes every session or none */
+int handoff_receive(const char *path, int *unix_fd, struct client_table *table,
+		struct client_info *clients[], struct slot_set *bitmap, long *next_id);
+
+#endif /* __HANDOFF_H__ */
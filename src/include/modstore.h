@@ -0,0 +1,48 @@
+/*
+ * modstore.h - persistent moderation state (blocks and flags) of the TRS server
+ *
+ * Records live in a memory mapped hash table. Every change is also appended to a
+ * log of whole records, which is replayed on open and truncated by compaction.
+ */
+
+#ifndef __MODSTORE_H__
+#define __MODSTORE_H__
+
+#include <stdint.h>
+
+#define MOD_KEY_LEN            48     // longest identity, fits an IPv6 address
+#define MOD_INITIAL_SLOTS      4096   // slots of a new table, always a power of two
+#define MOD_COMPACT_ENTRIES    1024   // log entries that trigger a compaction
+#define MOD_MAGIC              0x314d5254 // "TRM1"
+
+/* moderation state of one client identity */
+struct mod_record {
+	char key[MOD_KEY_LEN]; /* identity, empty for a free slot */
+	uint32_t blocked; /* 0 for not blocked, 1 for blocked */
+	uint32_t flags; /* number of flags received */
+	int64_t blocked_at; /* time of the last block, 0 if never */
+	int64_t last_flag_at; /* time of the last flag, 0 if never */
+};
+
+/* map the table and replay the log, return 0 if success, otherwise -1 */
+int mod_open(const char *db_path, const char *log_path);
+
+/* compact and unmap the table */
+void mod_close();
+
+/* copy the record of key into out, return 0 if found, otherwise -1 */
+int mod_lookup(const char *key, struct mod_record *out);
+
+/* return 0 if success, otherwise -1 */
+int mod_set_blocked(const char *key, int blocked);
+
+/* set blocked for count keys with one log append, return 0 if success, otherwise -1 */
+int mod_set_blocked_many(const char *keys[], int count, int blocked);
+
+/* return the new number of flags, -1 on failure */
+int mod_add_flag(const char *key);
+
+/* flush the table to disk and truncate the log, return 0 if success, otherwise -1 */
+int mod_compact();
+
+#endif /* __MODSTORE_H__ */
@@ -0,0 +1,75 @@
+/*
+ * ratelimit.h - per-connection token buckets that throttle flooding clients
+ *
+ * Every client has a bucket for messages, bytes, chat requests and flags. A
+ * message that was read is always handled, but when it leaves a bucket in
+ * deficit the server stops reading that socket until the bucket is half full,
+ * so the kernel buffers fill up and TCP pushes back on the sender. A client
+ * that is paused too often within RATE_STRIKE_WINDOW is disconnected.
+ */
+
+#ifndef __RATELIMIT_H__
+#define __RATELIMIT_H__
+
+typedef enum { RATE_MSG, RATE_BYTE, RATE_CHAT, RATE_FLAG, RATE_KINDS } rate_kind_t;
+
+#define RATE_MSG_DEFAULT       50     // messages per second
+#define RATE_BYTE_DEFAULT      (1 << 20) // payload bytes per second
+#define RATE_CHAT_DEFAULT      1      // chat requests per second
+#define RATE_FLAG_DEFAULT      0.2    // flags per second
+#define RATE_BURST_SECONDS     2      // default bucket size, in seconds of traffic
+#define RATE_RESUME_LEVEL      0.5    // part of a bucket refilled before reading again
+#define RATE_STRIKES_DEFAULT   5      // pauses within the window before disconnecting
+#define RATE_STRIKE_WINDOW     10     // seconds
+
+/* limits shared by every connection, set with --rate-limit */
+struct rate_config {
+	double rate[RATE_KINDS]; /* tokens per second, 0 for no limit */
+	double burst[RATE_KINDS]; /* bucket size */
+	int strikes;
+};
+
+struct token_bucket {
+	double tokens; /* negative while in deficit */
+	double last; /* time of the last refill */
+};
+
+struct rate_limit {
+	struct token_bucket bucket[RATE_KINDS];
+	double paused_until; /* 0 while the socket is read */
+	double window_start;
+	int strikes; /* pauses since window_start */
+	unsigned long pauses; /* pauses since connecting */
+};
+
+/* totals reported by /stats */
+struct rate_stats {
+	unsigned long pauses;
+	unsigned long kicks;
+};
+
+extern struct rate_config g_rate_config;
+extern struct rate_stats g_rate_stats;
+
+/* monotonic clock in seconds */
+double rate_now();
+
+/* parse "msgs=50,bytes=1048576,chats=1,flags=0.2/1,strikes=20",
+ * a rate may be followed by /burst. return 0 if success, otherwise -1 */
+int rate_configure(const char *spec);
+
+/* buckets of a new connection, full */
+struct rate_limit* rate_limit_new(double now);
+
+/* take n tokens of one kind, the bucket may go into deficit */
+void rate_charge(struct rate_limit *rl, rate_kind_t kind, double n, double now);
+
+/* 0 if the client may go on, otherwise seconds until every bucket in deficit
+ * is refilled to RATE_RESUME_LEVEL */
+double rate_delay(struct rate_limit *rl, double now);
+
+/* stop reading for delay seconds, return 0 if success,
+ * otherwise -1 and the client has to be disconnected */
+int rate_pause(struct rate_limit *rl, double now, double delay);
+
+#endif /* __RATELIMIT_H__ */
@@ -0,0 +1,48 @@
+/*
+ * recvfile.h - a file received from the chat partner
+ *
+ * The sender announces the size with the file name, so the whole file is
+ * allocated up front with fallocate() and every chunk is written with pwrite()
+ * at its offset, with no stdio buffering in between. Data goes to a hidden
+ * temporary file in the receive directory that is renamed over the final name
+ * once the transfer completes, so a partial file is never seen under that
+ * name. The name must be a single path component; anything that could leave
+ * the receive directory is refused.
+ */
+
+#ifndef __RECVFILE_H__
+#define __RECVFILE_H__
+
+#include <stddef.h>
+#include <limits.h>
+#include <sys/types.h>
+
+#define RECV_DIR               "recv"
+#define RECV_NAME_MAX          200    // longest file name, leaves room in a BUF_MAX control message
+
+struct recv_file {
+	int fd; /* temporary file, -1 when none is open */
+	off_t size; /* announced size, -1 if the sender did not say */
+	off_t offset; /* bytes written so far */
+	int error; /* errno of the first failure, 0 if none */
+	char tmp[PATH_MAX];
+	char path[PATH_MAX];
+};
+
+/* return 1 if name is a file name that stays inside the receive directory, otherwise 0 */
+int recv_name_ok(const char *name);
+
+/* create the temporary file for name in dir and allocate size bytes, size -1 if unknown.
+ * a size over FILE_SIZE_MAX is refused with EFBIG. return 0 if success, otherwise -1 with errno set */
+int recv_file_open(struct recv_file *rf, const char *dir, const char *name, long long size);
+
+/* write the next chunk, return 0 if success, otherwise -1. a failed file takes no more data */
+int recv_file_write(struct recv_file *rf, const void *buf, size_t len);
+
+/* check the size, flush and rename to the final name, return 0 if success, otherwise -1 */
+int recv_file_commit(struct recv_file *rf);
+
+/* close and remove the temporary file */
+void recv_file_abort(struct recv_file *rf);
+
+#endif /* __RECVFILE_H__ */
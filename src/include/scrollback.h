@@ -0,0 +1,53 @@
+/*
+ * scrollback.h - the last lines of a chat channel, kept in a fixed ring
+ *
+ * A channel gets one ring when its session starts, shared by both local
+ * partners. Lines are stored as [length:2][text] and the oldest are dropped
+ * when a new line does not fit, so a channel never holds more than
+ * SCROLLBACK_BYTES and adding a line never allocates.
+ */
+
+#ifndef __SCROLLBACK_H__
+#define __SCROLLBACK_H__
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define SCROLLBACK_BYTES       16384  // ring size per channel, a power of 2
+#define SCROLLBACK_LINE_MAX    512    // longer lines are cut
+#define SCROLLBACK_REPLAY      20     // lines /history replays by default
+#define SCROLLBACK_REPLAY_MAX  256    // most lines one /history asks for
+
+struct scrollback {
+	int refs; /* clients holding the ring */
+	unsigned head, tail; /* running byte offsets of the oldest line and the end */
+	unsigned lines;
+	unsigned char data[SCROLLBACK_BYTES];
+};
+
+/* totals reported by /stats */
+struct scrollback_stats {
+	unsigned long channels; /* rings alive */
+	unsigned long lines; /* lines added since start */
+	unsigned long dropped; /* lines pushed out of a full ring */
+};
+
+extern struct scrollback_stats g_scrollback_stats;
+
+/* empty ring held once, NULL if out of memory */
+struct scrollback* scrollback_new();
+
+/* one more holder */
+struct scrollback* scrollback_hold(struct scrollback *sb);
+
+/* drop a hold, the last one frees the ring. sb may be NULL */
+void scrollback_release(struct scrollback *sb);
+
+/* record "name: text", sb may be NULL */
+void scrollback_add(struct scrollback *sb, const char *name, const char *text, size_t len);
+
+/* copy the last n lines into out (SCROLLBACK_BYTES) and point lines[] (n entries)
+ * at them, oldest first, return the number of lines */
+int scrollback_copy(const struct scrollback *sb, int n, unsigned char *out, struct iovec *lines);
+
+#endif /* __SCROLLBACK_H__ */
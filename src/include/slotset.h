@@ -0,0 +1,53 @@
+/*
+ * slotset.h - sets of chat queue slots kept as 64-bit words
+ *
+ * The server used an fd_set as its slot occupancy bitmap and tested it one
+ * bit at a time. A slot set packs the slots in uint64_t words instead, so a
+ * free slot is the trailing zero count of the first word that is not full,
+ * the members are walked by clearing the lowest set bit of a copy of each
+ * word, and the size is a popcount per word. Besides occupancy the server
+ * keeps one set per client_state_t, so counting or walking the users in a
+ * state does not look at the others.
+ */
+
+#ifndef __SLOTSET_H__
+#define __SLOTSET_H__
+
+#include <stdint.h>
+
+#include "common.h"
+
+#define SLOT_SET_WORDS         ((CLIENT_MAX + 63) / 64)
+
+struct slot_set {
+	uint64_t word[SLOT_SET_WORDS];
+};
+
+/* visit each member in ascending order, removing the current one is allowed.
+ * i must be an int, slot_set_next() takes and returns one */
+#define SLOT_SET_FOREACH(i, set) \
+	for ((i) = slot_set_next((set), 0); (i) != -1; (i) = slot_set_next((set), (i) + 1))
+
+/* empty the set */
+void slot_set_zero(struct slot_set *set);
+
+void slot_set_add(struct slot_set *set, int slot);
+
+void slot_set_del(struct slot_set *set, int slot);
+
+/* return 1 if slot is a member, otherwise 0 */
+int slot_set_has(const struct slot_set *set, int slot);
+
+/* return the lowest member not below from, -1 if none */
+int slot_set_next(const struct slot_set *set, int from);
+
+/* add the lowest slot that is not a member and return it, -1 if all CLIENT_MAX are */
+int slot_set_take(struct slot_set *set);
+
+/* return the number of members */
+int slot_set_count(const struct slot_set *set);
+
+/* return 1 if all CLIENT_MAX slots are members, otherwise 0 */
+int slot_set_full(const struct slot_set *set);
+
+#endif /* __SLOTSET_H__ */
@@ -0,0 +1,45 @@
+/*
+ * tagindex.h - interest tags of the users waiting for a chat partner
+ *
+ * "/chat music films" pairs the user with someone waiting on one of those
+ * tags. The index maps each tag to the slot set of the users waiting on it,
+ * in an open addressing hash table, so a request looks up each of its tags
+ * once and intersects the set with the users who may be paired, a word at a
+ * time. A tag is in the table only while someone waits on it, so the table
+ * holds at most CLIENT_MAX * TAG_USER_MAX tags however many are ever used.
+ */
+
+#ifndef __TAGINDEX_H__
+#define __TAGINDEX_H__
+
+#include "slotset.h"
+
+#define TAG_USER_MAX           8      // tags kept per chat request
+#define TAG_LENGTH             24     // longest tag, with the terminating NUL
+#define TAG_TABLE_SIZE         1024   // buckets, a power of two over twice the tags that can be live
+#define TAG_WAIT_SECONDS       30     // a tagged user falls back to a random partner, --tag-wait
+
+/* make slot wait on the n tags, replacing the ones it waited on. tags are
+ * matched without case and cut to TAG_LENGTH - 1 characters, empty ones and
+ * those past TAG_USER_MAX are left out. return the number of tags kept */
+int tag_index_add(int slot, char *tags[], int n, double now);
+
+/* slot no longer waits, e.g. it is paired or gone */
+void tag_index_remove(int slot);
+
+/* return a random member of eligible waiting on one of the n tags, -1 if none */
+int tag_index_match(char *tags[], int n, const struct slot_set *eligible);
+
+/* return 1 if slot waits on tags, otherwise 0 */
+int tag_index_waiting(int slot);
+
+/* put the users waiting since before now - wait in out, return how many */
+int tag_index_expired(double now, double wait, struct slot_set *out);
+
+/* write the tags of slot to buf as "a, b", return buf */
+char *tag_index_list(int slot, char *buf, int size);
+
+/* return the number of users waiting on tags, and of distinct tags in *tags */
+int tag_index_count(int *tags);
+
+#endif /* __TAGINDEX_H__ */
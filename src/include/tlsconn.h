@@ -0,0 +1,87 @@
+/*
+ * tlsconn.h - TLS on the connections between clients and the server
+ *
+ * OpenSSL does the handshake and, where the kernel has kTLS and the cipher
+ * allows it, hands the record crypto to the socket (SSL_OP_ENABLE_KTLS). Once
+ * both directions are offloaded on the server, the socket carries our plaintext
+ * again, so the plain send/recv, io_uring and handoff paths work on it as they
+ * are. Otherwise every read and write goes through SSL_read/SSL_write under a
+ * lock, since the client reads and writes one connection from several threads.
+ * A client keeps the session of its last connection and offers it when it
+ * connects again, so a reconnect skips the certificate exchange.
+ */
+
+#ifndef __TLSCONN_H__
+#define __TLSCONN_H__
+
+#include <stddef.h>
+
+#define TLS_HANDSHAKE_MS       3000   // a handshake that takes longer fails
+#define TLS_WRITE_TIMEOUT_MS   5000   // a full send buffer may stall a record this long
+#define TLS_KTLS_TX            0x01   // the kernel encrypts what we send
+#define TLS_KTLS_RX            0x02   // the kernel decrypts what we receive
+
+struct tls_conn;
+
+/* totals reported by /stats */
+struct tls_stats {
+	unsigned long handshakes;
+	unsigned long resumed;
+	unsigned long failures;
+	unsigned long ktls_tx, ktls_rx; /* connections offloaded in each direction */
+};
+
+extern struct tls_stats g_tls_stats;
+
+/* server side, return 0 if success, otherwise -1 */
+int tls_server_init(const char *cert_file, const char *key_file);
+
+/* client side, ca_file NULL to accept any certificate. return 0 if success, otherwise -1 */
+int tls_client_init(const char *ca_file);
+
+/* return 1 if tls_server_init() or tls_client_init() succeeded, otherwise 0 */
+int tls_enabled();
+
+/* server side, start the handshake on an accepted socket, tls_handshake() carries it on.
+ * return NULL if it fails */
+struct tls_conn* tls_accept(int sockfd);
+
+/* one step of the handshake, return 0 once it is done, POLLIN or POLLOUT to call again
+ * when the socket is ready, otherwise -1 */
+int tls_handshake(struct tls_conn *conn);
+
+/* client side, handshake on a connected socket within TLS_HANDSHAKE_MS, return NULL if it fails */
+struct tls_conn* tls_connect(int sockfd, const char *host);
+
+/* keep the session for the next tls_connect(), once the first message was read */
+void tls_remember(struct tls_conn *conn);
+
+/* return 1 if the handshake resumed a session, otherwise 0 */
+int tls_resumed(struct tls_conn *conn);
+
+/* return TLS_KTLS_TX | TLS_KTLS_RX as offloaded */
+int tls_ktls(struct tls_conn *conn);
+
+/* return 1 if the socket may be read and written directly, otherwise 0 */
+int tls_offloaded(struct tls_conn *conn);
+
+/* protocol, cipher and offload, for messages */
+const char* tls_describe(struct tls_conn *conn);
+
+/* same return value as recv() on the socket, in its blocking mode */
+int tls_read(struct tls_conn *conn, void *buf, size_t len);
+
+/* write everything, return 0 if success, otherwise -1 */
+int tls_write(struct tls_conn *conn, const void *buf, size_t len);
+
+/* one write that does not wait for the socket, return the bytes taken, 0 if it is full,
+ * otherwise -1. once it returned 0 the same bytes come first in the next call */
+int tls_write_some(struct tls_conn *conn, const void *buf, size_t len);
+
+/* return 1 if decrypted bytes wait in OpenSSL, where select() cannot see them */
+int tls_pending(struct tls_conn *conn);
+
+/* forget the connection without touching the socket, which may live on elsewhere */
+void tls_free(struct tls_conn *conn);
+
+#endif /* __TLSCONN_H__ */
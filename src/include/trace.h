@@ -0,0 +1,68 @@
+/*
+ * trace.h - static tracepoints (USDT) of the TRS server
+ *
+ * TRACE(probe, fd, name, state, bytes) marks a spot perf or bpftrace can
+ * attach to in a running server, e.g.
+ *     bpftrace -e 'usdt:./server:trs:forward { printf("%s %d\n", str(arg1), arg3); }'
+ * Every probe carries the same four arguments: socket, user name (may be
+ * NULL), client state and a byte count (candidates for find_partner, ms for
+ * throttle). Unattached, a probe is a single nop.
+ *
+ * systemtap's <sys/sdt.h> is used when it is installed. Without it, x86-64
+ * builds emit the same .note.stapsdt entries themselves, and other targets
+ * compile the probes away.
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define TRACE_HAVE_SDT 1
+#endif
+#endif
+
+#if defined(TRACE_HAVE_SDT)
+
+#include <sys/sdt.h>
+#define TRACE(probe, fd, name, state, bytes) \
+	DTRACE_PROBE4(trs, probe, (int)(fd), (const char *)(name), (int)(state), \
+			(unsigned long long)(bytes))
+
+#elif defined(__x86_64__) && defined(__ELF__)
+
+/* the note layout of <sys/sdt.h>: probe address, base, semaphore (none),
+ * provider, name and where each argument lives, e.g. "-4@%eax 8@8(%rsp)" */
+#define TRACE(probe, fd, name, state, bytes) \
+	__asm__ __volatile__ ("990: nop\n" \
+		".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+		".balign 4\n" \
+		".4byte 992f-991f, 994f-993f, 3\n" \
+		"991: .asciz \"stapsdt\"\n" \
+		"992: .balign 4\n" \
+		"993: .8byte 990b\n" \
+		".8byte _.stapsdt.base\n" \
+		".8byte 0\n" \
+		".asciz \"trs\"\n" \
+		".asciz \"" #probe "\"\n" \
+		".asciz \"-4@%0 8@%1 -4@%2 8@%3\"\n" \
+		"994: .balign 4\n" \
+		".popsection\n" \
+		".ifndef _.stapsdt.base\n" \
+		".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+		".weak _.stapsdt.base\n" \
+		".hidden _.stapsdt.base\n" \
+		"_.stapsdt.base: .space 1\n" \
+		".size _.stapsdt.base, 1\n" \
+		".popsection\n" \
+		".endif\n" \
+		:: "nor"((int)(fd)), "nor"((const char *)(name)), "nor"((int)(state)), \
+		"nor"((unsigned long long)(bytes)))
+
+#else
+
+#define TRACE(probe, fd, name, state, bytes) do { } while (0)
+
+#endif
+
+#endif /* __TRACE_H__ */
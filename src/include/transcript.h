@@ -0,0 +1,78 @@
+/*
+ * transcript.h - durable, append-only transcripts of chat sessions
+ *
+ * The I/O thread only copies a record into a memory buffer. A writer thread
+ * swaps the buffer out every TRANSCRIPT_COMMIT_MS (or sooner once it is half
+ * full) and commits the whole batch with one write and one fdatasync, so the
+ * cost of durability is shared by every message of the interval.
+ *
+ * Records go to numbered segments "<dir>/NNNNNN.seg", a new one every
+ * TRANSCRIPT_SEGMENT_MAX bytes. "<dir>/index" maps a session id to the segment
+ * and offset where the session was opened. transcript_dump reads both.
+ */
+
+#ifndef __TRANSCRIPT_H__
+#define __TRANSCRIPT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+#define TRANSCRIPT_COMMIT_MS   50     // longest a record waits for its fsync
+#define TRANSCRIPT_BUF_SIZE    (1 << 20) // bytes buffered per commit, records beyond are dropped
+#define TRANSCRIPT_SEGMENT_MAX (64 << 20) // bytes per segment before rotating
+#define TRANSCRIPT_MAGIC       0x31545254 // "TRT1"
+
+typedef enum { TR_OPEN = 1, TR_MSG, TR_FLAG } transcript_type_t;
+
+/* first bytes of every segment */
+struct transcript_segment_header {
+	uint32_t magic;
+	uint32_t segment;
+};
+
+/* one record, followed by len bytes of text */
+struct transcript_record {
+	uint16_t type;
+	uint16_t len;
+	uint32_t reserved;
+	int64_t time; /* microseconds since the epoch */
+	uint64_t session;
+	char from[NAME_LENGTH];
+};
+
+/* one entry of the index */
+struct transcript_index_entry {
+	uint64_t session;
+	uint32_t segment;
+	uint32_t offset; /* of the TR_OPEN record */
+};
+
+/* totals reported by /stats */
+struct transcript_stats {
+	unsigned long records;
+	unsigned long dropped; /* buffer was full */
+	unsigned long commits; /* write + fdatasync rounds */
+	unsigned long max_batch; /* records in one commit */
+	unsigned long long bytes;
+	double max_commit_ms;
+	unsigned segment; /* written now */
+};
+
+extern struct transcript_stats g_transcript_stats;
+
+/* open a new segment in dir and start the writer, return 0 if success, otherwise -1 */
+int transcript_open(const char *dir);
+
+/* commit what is buffered and stop the writer */
+void transcript_close();
+
+/* a new session id, unique across restarts */
+uint64_t transcript_session();
+
+/* queue one record, never blocks on disk. does nothing when closed */
+void transcript_add(transcript_type_t type, uint64_t session, const char *from,
+		const void *text, size_t len);
+
+#endif /* __TRANSCRIPT_H__ */
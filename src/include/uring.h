@@ -0,0 +1,73 @@
+/*
+ * uring.h - a small io_uring wrapper for the server's I/O loop
+ *
+ * Only what the server needs: one ring, one provided buffer ring for
+ * multishot recv, and helpers to fill the SQEs it uses. Talks to the kernel
+ * through the raw syscalls, so no liburing is needed.
+ */
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES          1024   // submission queue size
+#define URING_BUF_COUNT        512    // provided buffers, a power of 2
+#define URING_BUF_SIZE         4096   // bytes per provided buffer
+#define URING_BUF_GROUP        0
+
+struct uring {
+	int fd;
+	/* submission queue */
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned sq_local_tail; /* SQEs handed out but not yet submitted */
+	struct io_uring_sqe *sqes;
+	/* completion queue */
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* provided buffers for multishot recv */
+	struct io_uring_buf_ring *br;
+	unsigned char *bufs;
+	unsigned short br_tail;
+	unsigned long enters; /* io_uring_enter calls, for /stats */
+	/* mappings to undo in uring_exit() */
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size, br_size;
+};
+
+/* set up the ring and its buffers, return 0 if success, otherwise -1 if the
+ * kernel lacks a feature we rely on */
+int uring_init(struct uring *r);
+void uring_exit(struct uring *r);
+
+/* next free SQE, submits first when the queue is full. never NULL */
+struct io_uring_sqe* uring_get_sqe(struct uring *r);
+
+/* free SQEs before uring_get_sqe() has to submit */
+unsigned uring_sq_space(struct uring *r);
+
+/* submit queued SQEs, return the number submitted or -1 */
+int uring_submit(struct uring *r);
+
+/* wait for a completion for at most timeout seconds (forever if negative),
+ * nothing is submitted. return 0, or -1 with errno ETIME on timeout or EINTR */
+int uring_wait(struct uring *r, double timeout);
+
+/* first unseen CQE or NULL, uring_cqe_seen() releases it */
+struct io_uring_cqe* uring_peek_cqe(struct uring *r);
+void uring_cqe_seen(struct uring *r);
+
+/* data of the provided buffer a recv CQE landed in, and giving it back */
+unsigned char* uring_buf(struct uring *r, unsigned bid);
+void uring_buf_recycle(struct uring *r, unsigned bid);
+
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd, unsigned long long data);
+void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd, unsigned long long data);
+void uring_prep_poll(struct io_uring_sqe *sqe, int fd, unsigned long long data);
+void uring_prep_send(struct io_uring_sqe *sqe, int fd, const void *buf, size_t len,
+		unsigned long long data);
+void uring_prep_cancel(struct io_uring_sqe *sqe, unsigned long long target,
+		unsigned long long data);
+
+#endif /* __URING_H__ */
@@ -0,0 +1,51 @@
+/*
+ * waitqueue.h - users who asked for a partner and have not got one yet
+ *
+ * A "/chat" that finds nobody used to be forgotten, so users kept asking
+ * again. Now the user stays in the queue with the time it first asked, and
+ * the server pairs it as soon as someone is free, the longest waiting first.
+ * Partners are still drawn at random, but a user who has waited counts
+ * 1 + wait / WAIT_AGING_SECONDS times in the draw, so nobody is passed over
+ * for long. The time from asking to being paired is kept for the last
+ * WAIT_SAMPLES pairs and reported as percentiles.
+ */
+
+#ifndef __WAITQUEUE_H__
+#define __WAITQUEUE_H__
+
+#include "common.h"
+
+#define WAIT_AGING_SECONDS     10.0   // a user who waited this long is twice as likely to be drawn
+#define WAIT_SAMPLES           4096   // time to pair samples kept for the percentiles
+
+struct wait_stats {
+	int queued;
+	double longest; /* seconds the oldest user in the queue has waited */
+	unsigned long pairs; /* since start */
+	int samples; /* the percentiles are over the last samples pairs */
+	double p50, p90, p99, max;
+};
+
+/* slot asked for a partner at now, one already in the queue keeps its place */
+void wait_queue_add(int slot, double now);
+
+/* slot leaves the queue, paired at now or gone if now is 0 */
+void wait_queue_leave(int slot, double now);
+
+/* return 1 if slot is in the queue, otherwise 0 */
+int wait_queue_has(int slot);
+
+/* return the number of users in the queue */
+int wait_queue_count();
+
+/* copy the queue to order, the longest waiting first, return its length */
+int wait_queue_order(int order[CLIENT_MAX]);
+
+/* draw one of the n local candidates in slots, aged by their wait, or one of
+ * extra candidates weighing 1 each. return i for slots[i], n + k for the k-th extra */
+int wait_queue_pick(const int slots[], int n, int extra, double now);
+
+/* fill st at now */
+void wait_queue_stats(struct wait_stats *st, double now);
+
+#endif /* __WAITQUEUE_H__ */
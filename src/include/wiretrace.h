@@ -0,0 +1,64 @@
+/*
+ * wiretrace.h - a capture of the frames clients send, for replaying later
+ *
+ * "./server --record file" appends a record for every connection accepted,
+ * every frame read from a client and every socket closed. A record is a 12
+ * byte header and the payload as the client meant it, after decompression,
+ * stamped with the microseconds since the previous record. The connection is
+ * named by its socket, which is only reused after a WT_CLOSE. Records are
+ * gathered in a buffer and written without fsync once it fills or the server
+ * stops, so capturing costs a memcpy per frame. "./replay" reads the file.
+ */
+
+#ifndef __WIRETRACE_H__
+#define __WIRETRACE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WIRETRACE_MAGIC        0x31575254 // "TRW1"
+#define WIRETRACE_BUF_SIZE     (1 << 20)  // bytes gathered per write
+
+typedef enum { WT_CONNECT = 1, WT_FRAME, WT_CLOSE } wiretrace_type_t;
+
+/* first bytes of a trace */
+struct wiretrace_header {
+	uint32_t magic;
+	uint32_t reserved;
+	int64_t start; /* microseconds since the epoch */
+};
+
+/* one record, followed by len bytes of payload */
+struct wiretrace_record {
+	uint32_t delta; /* microseconds since the previous record, saturated */
+	uint32_t conn;
+	uint16_t len;
+	uint8_t type;
+	uint8_t flags; /* FRAME_F_BULK as received */
+};
+
+/* totals reported by /stats */
+struct wiretrace_stats {
+	unsigned long records;
+	unsigned long long bytes;
+	unsigned long failed; /* writes that did not go through, capture stopped */
+};
+
+extern struct wiretrace_stats g_wiretrace_stats;
+
+/* start capturing to path, truncating it. return 0 if success, otherwise -1 */
+int wiretrace_open(const char *path);
+
+/* write what is buffered and stop capturing */
+void wiretrace_close();
+
+/* return 1 while capturing, otherwise 0 */
+int wiretrace_active();
+
+/* append one record, does nothing when not capturing */
+void wiretrace_add(wiretrace_type_t type, int conn, int flags, const void *buf, size_t len);
+
+/* read a whole trace into memory, return its size or -1. *data is the first record */
+long wiretrace_load(const char *path, unsigned char **data, struct wiretrace_header *header);
+
+#endif /* __WIRETRACE_H__ */
@@ -0,0 +1,363 @@
+/*
+ * modstore.c - memory mapped moderation table with an append log
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "modstore.h"
+
+/* first bytes of the table file */
+struct mod_header {
+	uint32_t magic;
+	uint32_t capacity; /* number of slots */
+	uint32_t count; /* slots in use */
+	uint32_t reserved;
+};
+
+static struct mod_header *g_db = NULL; // mapped table
+static size_t g_db_size = 0;
+static int g_db_fd = -1;
+static int g_log_fd = -1;
+static unsigned g_log_entries = 0; // entries appended since last compaction
+static char g_db_path[256];
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER; // admin and event loop threads
+
+static struct mod_record* slots() {
+	return (struct mod_record *)(g_db + 1);
+}
+
+static size_t table_size(uint32_t capacity) {
+	return sizeof(struct mod_header) + (size_t)capacity * sizeof(struct mod_record);
+}
+
+/* FNV-1a */
+static uint32_t hash_key(const char *key) {
+	uint32_t h = 2166136261u;
+	while (*key) {
+		h ^= (unsigned char)*key++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* return the slot holding key, or the free slot where it belongs */
+static struct mod_record* find_slot(struct mod_header *db, const char *key) {
+	struct mod_record *table = (struct mod_record *)(db + 1);
+	uint32_t mask = db->capacity - 1;
+	uint32_t i = hash_key(key) & mask;
+
+	while (table[i].key[0] != '\0' && strcmp(table[i].key, key) != 0) {
+		i = (i + 1) & mask;
+	}
+	return &table[i];
+}
+
+/* create or map a table file, return its fd and mapping through the arguments */
+static int map_table(const char *path, uint32_t capacity, int *fd, struct mod_header **db, size_t *size) {
+	struct stat st;
+	int created = 0;
+
+	*fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (*fd == -1) {
+		perror("open moderation table fails");
+		return -1;
+	}
+	if (fstat(*fd, &st) == -1) {
+		perror("stat moderation table fails");
+		close(*fd);
+		return -1;
+	}
+	if (st.st_size == 0) {
+		if (ftruncate(*fd, table_size(capacity)) == -1) {
+			perror("size moderation table fails");
+			close(*fd);
+			return -1;
+		}
+		st.st_size = table_size(capacity);
+		created = 1;
+	}
+	if (st.st_size < (off_t)sizeof(struct mod_header)) {
+		fprintf(stderr, "%s is not a moderation table\n", path);
+		close(*fd);
+		return -1;
+	}
+	*size = st.st_size;
+	*db = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+	if (*db == MAP_FAILED) {
+		perror("map moderation table fails");
+		close(*fd);
+		return -1;
+	}
+	if (created) {
+		(*db)->magic = MOD_MAGIC;
+		(*db)->capacity = capacity;
+		(*db)->count = 0;
+	}
+	if ((*db)->magic != MOD_MAGIC || table_size((*db)->capacity) != *size) {
+		fprintf(stderr, "%s is not a moderation table\n", path);
+		munmap(*db, *size);
+		close(*fd);
+		return -1;
+	}
+	return 0;
+}
+
+/* rebuild the table with twice the slots in a new file and swap it in */
+static int grow() {
+	char tmp_path[sizeof(g_db_path) + 4];
+	struct mod_header *db;
+	size_t size;
+	int fd;
+	uint32_t i;
+
+	sprintf(tmp_path, "%s.tmp", g_db_path);
+	unlink(tmp_path);
+	if (map_table(tmp_path, g_db->capacity * 2, &fd, &db, &size) == -1) {
+		return -1;
+	}
+	for (i = 0; i < g_db->capacity; i++) {
+		if (slots()[i].key[0] != '\0') {
+			*find_slot(db, slots()[i].key) = slots()[i];
+			db->count++;
+		}
+	}
+	if (msync(db, size, MS_SYNC) == -1 || rename(tmp_path, g_db_path) == -1) {
+		perror("replace moderation table fails");
+		munmap(db, size);
+		close(fd);
+		unlink(tmp_path);
+		return -1;
+	}
+	munmap(g_db, g_db_size);
+	close(g_db_fd);
+	g_db = db;
+	g_db_size = size;
+	g_db_fd = fd;
+	return 0;
+}
+
+/* write the record into the table, growing it past 3/4 load */
+static int upsert(const struct mod_record *rec) {
+	struct mod_record *slot = find_slot(g_db, rec->key);
+
+	if (slot->key[0] == '\0') {
+		if ((g_db->count + 1) * 4 > g_db->capacity * 3) {
+			if (grow() == -1) {
+				return -1;
+			}
+			slot = find_slot(g_db, rec->key);
+		}
+		g_db->count++;
+	}
+	*slot = *rec;
+	return 0;
+}
+
+static int compact_locked() {
+	if (msync(g_db, g_db_size, MS_SYNC) == -1) {
+		perror("flush moderation table fails");
+		return -1;
+	}
+	if (ftruncate(g_log_fd, 0) == -1) {
+		perror("truncate moderation log fails");
+		return -1;
+	}
+	g_log_entries = 0;
+	return 0;
+}
+
+/* log the new state of a record, then apply it to the table */
+static int commit(const struct mod_record *rec) {
+	if (write(g_log_fd, rec, sizeof(*rec)) != sizeof(*rec)) {
+		perror("append moderation log fails");
+		return -1;
+	}
+	if (upsert(rec) == -1) {
+		return -1;
+	}
+	if (++g_log_entries >= MOD_COMPACT_ENTRIES) {
+		compact_locked();
+	}
+	return 0;
+}
+
+/* start from the stored record of key, or a blank one */
+static void load_record(const char *key, struct mod_record *rec) {
+	struct mod_record *slot = find_slot(g_db, key);
+
+	if (slot->key[0] != '\0') {
+		*rec = *slot;
+	} else {
+		memset(rec, 0, sizeof(*rec));
+		strncpy(rec->key, key, MOD_KEY_LEN - 1);
+	}
+}
+
+int mod_open(const char *db_path, const char *log_path) {
+	struct mod_record rec;
+	unsigned replayed = 0;
+
+	pthread_mutex_lock(&g_lock);
+	if (g_db) {
+		pthread_mutex_unlock(&g_lock);
+		return 0;
+	}
+	snprintf(g_db_path, sizeof(g_db_path), "%s", db_path);
+	if (map_table(g_db_path, MOD_INITIAL_SLOTS, &g_db_fd, &g_db, &g_db_size) == -1) {
+		g_db = NULL;
+		pthread_mutex_unlock(&g_lock);
+		return -1;
+	}
+	g_log_fd = open(log_path, O_RDWR | O_CREAT | O_APPEND, 0644);
+	if (g_log_fd == -1) {
+		perror("open moderation log fails");
+		munmap(g_db, g_db_size);
+		close(g_db_fd);
+		g_db = NULL;
+		pthread_mutex_unlock(&g_lock);
+		return -1;
+	}
+
+	/* entries hold whole records, so replaying them over the table is idempotent */
+	while (read(g_log_fd, &rec, sizeof(rec)) == sizeof(rec)) {
+		rec.key[MOD_KEY_LEN - 1] = '\0';
+		if (rec.key[0] != '\0' && upsert(&rec) == 0) {
+			replayed++;
+		}
+	}
+	compact_locked();
+	printf("Loaded %u moderation records (%u from log)\n", g_db->count, replayed);
+	pthread_mutex_unlock(&g_lock);
+	return 0;
+}
+
+void mod_close() {
+	pthread_mutex_lock(&g_lock);
+	if (g_db) {
+		compact_locked();
+		munmap(g_db, g_db_size);
+		close(g_db_fd);
+		close(g_log_fd);
+		g_db = NULL;
+		g_db_fd = g_log_fd = -1;
+	}
+	pthread_mutex_unlock(&g_lock);
+}
+
+int mod_lookup(const char *key, struct mod_record *out) {
+	struct mod_record *slot;
+	int ret = -1;
+
+	pthread_mutex_lock(&g_lock);
+	if (g_db) {
+		slot = find_slot(g_db, key);
+		if (slot->key[0] != '\0') {
+			*out = *slot;
+			ret = 0;
+		}
+	}
+	pthread_mutex_unlock(&g_lock);
+	return ret;
+}
+
+int mod_set_blocked(const char *key, int blocked) {
+	struct mod_record rec;
+	int ret = -1;
+
+	pthread_mutex_lock(&g_lock);
+	if (g_db) {
+		load_record(key, &rec);
+		rec.blocked = blocked;
+		if (blocked) {
+			rec.blocked_at = time(NULL);
+		}
+		ret = commit(&rec);
+	}
+	pthread_mutex_unlock(&g_lock);
+	return ret;
+}
+
+int mod_set_blocked_many(const char *keys[], int count, int blocked) {
+	struct mod_record *recs;
+	time_t now = time(NULL);
+	size_t len, written;
+	ssize_t n;
+	int i, ret = -1;
+
+	if (count == 0) {
+		return 0;
+	}
+	if ((recs = malloc(count * sizeof(*recs))) == NULL) {
+		perror("block records");
+		return -1;
+	}
+	pthread_mutex_lock(&g_lock);
+	if (!g_db) {
+		goto out;
+	}
+	for (i = 0; i < count; i++) {
+		load_record(keys[i], &recs[i]);
+		recs[i].blocked = blocked;
+		if (blocked) {
+			recs[i].blocked_at = now;
+		}
+	}
+	/* one append for the whole batch, then at most one compaction */
+	len = count * sizeof(*recs);
+	for (written = 0; written < len; written += n) {
+		if ((n = write(g_log_fd, (char *)recs + written, len - written)) <= 0) {
+			perror("append moderation log fails");
+			goto out;
+		}
+	}
+	for (i = 0; i < count; i++) {
+		if (upsert(&recs[i]) == -1) {
+			goto out;
+		}
+	}
+	g_log_entries += count;
+	if (g_log_entries >= MOD_COMPACT_ENTRIES) {
+		compact_locked();
+	}
+	ret = 0;
+out:
+	pthread_mutex_unlock(&g_lock);
+	free(recs);
+	return ret;
+}
+
+int mod_add_flag(const char *key) {
+	struct mod_record rec;
+	int ret = -1;
+
+	pthread_mutex_lock(&g_lock);
+	if (g_db) {
+		load_record(key, &rec);
+		rec.flags++;
+		rec.last_flag_at = time(NULL);
+		if (commit(&rec) == 0) {
+			ret = rec.flags;
+		}
+	}
+	pthread_mutex_unlock(&g_lock);
+	return ret;
+}
+
+int mod_compact() {
+	int ret = -1;
+
+	pthread_mutex_lock(&g_lock);
+	if (g_db) {
+		ret = compact_locked();
+	}
+	pthread_mutex_unlock(&g_lock);
+	return ret;
+}
@@ -0,0 +1,140 @@
+/*
+ * ratelimit.c - token buckets for messages, bytes, chat requests and flags
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ratelimit.h"
+
+struct rate_config g_rate_config = {
+	.rate = { RATE_MSG_DEFAULT, RATE_BYTE_DEFAULT, RATE_CHAT_DEFAULT, RATE_FLAG_DEFAULT },
+	.burst = {
+		RATE_MSG_DEFAULT * RATE_BURST_SECONDS,
+		RATE_BYTE_DEFAULT * RATE_BURST_SECONDS,
+		RATE_CHAT_DEFAULT * RATE_BURST_SECONDS,
+		1, /* 0.4 flags would never allow one */
+	},
+	.strikes = RATE_STRIKES_DEFAULT,
+};
+struct rate_stats g_rate_stats;
+
+static const char *kind_names[RATE_KINDS] = { "msgs", "bytes", "chats", "flags" };
+
+double rate_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int rate_configure(const char *spec) {
+	char *line = strdup(spec);
+	char *cursor = line;
+	char *token, *value, *burst;
+	int kind;
+
+	while ((token = strsep(&cursor, ",")) != NULL) {
+		if ((value = strchr(token, '=')) == NULL) {
+			goto fail;
+		}
+		*value++ = '\0';
+		if (strcmp(token, "strikes") == 0) {
+			g_rate_config.strikes = atoi(value);
+			continue;
+		}
+		for (kind = 0; kind < RATE_KINDS; kind++) {
+			if (strcmp(token, kind_names[kind]) == 0) {
+				break;
+			}
+		}
+		if (kind == RATE_KINDS) {
+			goto fail;
+		}
+		if ((burst = strchr(value, '/')) != NULL) {
+			*burst++ = '\0';
+		}
+		g_rate_config.rate[kind] = atof(value);
+		g_rate_config.burst[kind] = burst ? atof(burst) : g_rate_config.rate[kind] * RATE_BURST_SECONDS;
+		if (g_rate_config.rate[kind] < 0) {
+			goto fail;
+		}
+		if (g_rate_config.burst[kind] < 1) {
+			g_rate_config.burst[kind] = 1; /* room for at least one */
+		}
+	}
+	free(line);
+	return 0;
+fail:
+	fprintf(stderr, "rate limit: cannot parse '%s'\n", spec);
+	free(line);
+	return -1;
+}
+
+struct rate_limit* rate_limit_new(double now) {
+	struct rate_limit *rl = calloc(1, sizeof(struct rate_limit));
+	int kind;
+
+	for (kind = 0; kind < RATE_KINDS; kind++) {
+		rl->bucket[kind].tokens = g_rate_config.burst[kind];
+		rl->bucket[kind].last = now;
+	}
+	rl->window_start = now;
+	return rl;
+}
+
+/* add the tokens earned since the last refill */
+static void refill(struct token_bucket *b, rate_kind_t kind, double now) {
+	b->tokens += (now - b->last) * g_rate_config.rate[kind];
+	if (b->tokens > g_rate_config.burst[kind]) {
+		b->tokens = g_rate_config.burst[kind];
+	}
+	b->last = now;
+}
+
+void rate_charge(struct rate_limit *rl, rate_kind_t kind, double n, double now) {
+	if (g_rate_config.rate[kind] == 0) {
+		return;
+	}
+	refill(&rl->bucket[kind], kind, now);
+	rl->bucket[kind].tokens -= n;
+}
+
+double rate_delay(struct rate_limit *rl, double now) {
+	double delay = 0, wait;
+	int kind;
+
+	for (kind = 0; kind < RATE_KINDS; kind++) {
+		if (g_rate_config.rate[kind] == 0) {
+			continue;
+		}
+		refill(&rl->bucket[kind], kind, now);
+		if (rl->bucket[kind].tokens >= 0) {
+			continue;
+		}
+		/* a pause per message would let a steady flood collect strikes */
+		wait = (g_rate_config.burst[kind] * RATE_RESUME_LEVEL - rl->bucket[kind].tokens) /
+				g_rate_config.rate[kind];
+		if (wait > delay) {
+			delay = wait;
+		}
+	}
+	return delay;
+}
+
+int rate_pause(struct rate_limit *rl, double now, double delay) {
+	if (now - rl->window_start > RATE_STRIKE_WINDOW) {
+		rl->window_start = now;
+		rl->strikes = 0;
+	}
+	rl->strikes++;
+	rl->pauses++;
+	rl->paused_until = now + delay;
+	g_rate_stats.pauses++;
+	if (g_rate_config.strikes > 0 && rl->strikes > g_rate_config.strikes) {
+		g_rate_stats.kicks++;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * recvfile.c - preallocated, positional writes of a received file
+ */
+
+#define _GNU_SOURCE // fallocate
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "recvfile.h"
+
+int recv_name_ok(const char *name) {
+	size_t len = strlen(name);
+	size_t i;
+
+	if (len == 0 || len > RECV_NAME_MAX || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+		return 0;
+	}
+	for (i = 0; i < len; i++) {
+		if (name[i] == '/' || (unsigned char)name[i] < 0x20 || name[i] == 0x7f) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int recv_file_open(struct recv_file *rf, const char *dir, const char *name, long long size) {
+	rf->fd = -1;
+	rf->size = size;
+	rf->offset = 0;
+	rf->error = 0;
+
+	if (!recv_name_ok(name)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (size > FILE_SIZE_MAX) {
+		errno = EFBIG; // the peer chose the size, it does not get to fill the disk
+		return -1;
+	}
+	if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+		return -1;
+	}
+	if (snprintf(rf->path, sizeof(rf->path), "%s/%s", dir, name) >= (int)sizeof(rf->path) ||
+			snprintf(rf->tmp, sizeof(rf->tmp), "%s/.%s.XXXXXX", dir, name) >= (int)sizeof(rf->tmp)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	// O_EXCL under a fresh name, whatever already sits in the directory
+	if ((rf->fd = mkostemp(rf->tmp, O_CLOEXEC)) == -1) {
+		return -1;
+	}
+	fchmod(rf->fd, 0644);
+	if (size > 0 && fallocate(rf->fd, 0, 0, size) == -1 && errno != EOPNOTSUPP) {
+		int saved = errno; // ENOSPC: refuse now rather than halfway through
+		recv_file_abort(rf);
+		errno = saved;
+		return -1;
+	}
+	return 0;
+}
+
+int recv_file_write(struct recv_file *rf, const void *buf, size_t len) {
+	const char *p = buf;
+	ssize_t n;
+
+	if (rf->fd == -1 || rf->error) {
+		return -1;
+	}
+	if ((rf->size >= 0 && rf->offset + (off_t)len > rf->size) || rf->offset + (off_t)len > FILE_SIZE_MAX) {
+		rf->error = EFBIG; // more than announced, or than any sender may send
+		return -1;
+	}
+	while (len > 0) {
+		if ((n = pwrite(rf->fd, p, len, rf->offset)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			rf->error = errno;
+			return -1;
+		}
+		p += n;
+		len -= n;
+		rf->offset += n;
+	}
+	return 0;
+}
+
+int recv_file_commit(struct recv_file *rf) {
+	if (rf->fd == -1) {
+		errno = EBADF;
+		return -1;
+	}
+	if (!rf->error && rf->size >= 0 && rf->offset != rf->size) {
+		rf->error = EIO; // the sender stopped short
+	}
+	if (!rf->error && rf->size < 0 && ftruncate(rf->fd, rf->offset) == -1) {
+		rf->error = errno;
+	}
+	if (!rf->error && fdatasync(rf->fd) == -1) {
+		rf->error = errno;
+	}
+	if (!rf->error && rename(rf->tmp, rf->path) == -1) {
+		rf->error = errno;
+	}
+	if (rf->error) {
+		int saved = rf->error;
+		recv_file_abort(rf);
+		errno = saved;
+		return -1;
+	}
+	close(rf->fd);
+	rf->fd = -1;
+	return 0;
+}
+
+void recv_file_abort(struct recv_file *rf) {
+	if (rf->fd == -1) {
+		return;
+	}
+	close(rf->fd);
+	unlink(rf->tmp);
+	rf->fd = -1;
+}
@@ -0,0 +1,449 @@
+/*
+ * replay.c - plays a wire trace recorded by "./server --record" against a server
+ *
+ * ./replay [--speed N | --fast] [--drain seconds] trace host [port]
+ *
+ * Every recorded connection gets a connection of its own (host may be
+ * "unix:/path"), and its frames are sent in the recorded order, none before
+ * the server acked the connection. At --speed N the gaps between records are
+ * divided by N, with --fast there are none and each connection goes as fast
+ * as the server lets it. Chat lines and file chunks are forwarded to the
+ * partner unchanged, so a frame received that matches one sent earlier gives
+ * its delivery latency. The codec is never negotiated, so everything goes
+ * uncompressed; rate limits on the server apply to the replay as to anyone.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+
+#include "common.h"
+#include "control_msg.h"
+#include "frame.h"
+#include "dial.h"
+#include "wiretrace.h"
+
+#define REPLAY_BURST           64     // frames sent between reads
+#define REPLAY_DRAIN_S         2.0    // wait this long for deliveries after the last frame
+#define REPLAY_WAIT_MS         10     // longest poll while connections wait for their ack
+
+typedef enum { CONN_IDLE, CONN_WAITING, CONN_READY, CONN_DEAD } conn_state_t;
+
+struct event {
+	long long time; /* microseconds since the trace started */
+	uint32_t conn;
+	uint16_t len;
+	uint8_t type;
+	uint8_t flags;
+	const unsigned char *payload;
+	int next; /* next queued event of the same connection, -1 for none */
+};
+
+struct conn {
+	conn_state_t state;
+	int sockfd;
+	struct frame_stream *fs;
+	int head, tail; /* events due but not sent yet */
+	long long dialed; /* when the connect started */
+	long long closing; /* when its close came up, 0 if not yet */
+};
+
+/* a frame sent and not seen by its receiver yet */
+struct pending {
+	uint64_t hash;
+	long long sent;
+	int used; /* 0 free, 1 in flight, 2 delivered */
+};
+
+struct samples {
+	long long *v;
+	size_t n, cap;
+};
+
+static struct event *g_events;
+static int g_nevents;
+static struct conn *g_conns;
+static uint32_t g_nconns;
+static struct pending *g_pending;
+static size_t g_pending_mask;
+static unsigned long g_in_flight;
+static long long g_drain_us = REPLAY_DRAIN_S * 1000000;
+static struct samples g_ack_us, g_delivery_us;
+
+static struct {
+	unsigned long sent, received, skipped, tracked;
+	unsigned long long bytes_sent, bytes_received;
+	unsigned long connects, acked, refused, hangups;
+} g_stats;
+
+static long long now_us() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void add_sample(struct samples *s, long long v) {
+	if (s->n == s->cap) {
+		s->cap = s->cap ? s->cap * 2 : 1024;
+		s->v = realloc(s->v, s->cap * sizeof(long long));
+	}
+	s->v[s->n++] = v;
+}
+
+static int compare_ll(const void *a, const void *b) {
+	long long x = *(const long long *)a, y = *(const long long *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void print_percentiles(const char *what, struct samples *s) {
+	if (s->n == 0) {
+		printf("%s: no samples\n", what);
+		return;
+	}
+	qsort(s->v, s->n, sizeof(long long), compare_ll);
+	printf("%s: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms (%zu samples)\n", what,
+			s->v[s->n / 2] / 1000.0, s->v[s->n * 9 / 10] / 1000.0, s->v[s->n * 99 / 100] / 1000.0,
+			s->v[s->n - 1] / 1000.0, s->n);
+}
+
+/* FNV-1a */
+static uint64_t hash_payload(const void *buf, size_t len) {
+	const unsigned char *p = buf;
+	uint64_t h = 14695981039346656037ULL;
+
+	while (len--) {
+		h = (h ^ *p++) * 1099511628211ULL;
+	}
+	return h;
+}
+
+/* remember a frame the server should forward. linear probing keeps equal
+ * payloads in the order they were sent, so the oldest is matched first */
+static void track_sent(const void *buf, size_t len, long long sent) {
+	uint64_t h = hash_payload(buf, len);
+	size_t i = h & g_pending_mask;
+
+	while (g_pending[i].used == 1) {
+		i = (i + 1) & g_pending_mask;
+	}
+	g_pending[i].hash = h;
+	g_pending[i].sent = sent;
+	g_pending[i].used = 1;
+	g_in_flight++;
+	g_stats.tracked++;
+}
+
+static void match_received(const void *buf, size_t len, long long now) {
+	uint64_t h = hash_payload(buf, len);
+	size_t i = h & g_pending_mask;
+
+	for (; g_pending[i].used != 0; i = (i + 1) & g_pending_mask) {
+		if (g_pending[i].used == 1 && g_pending[i].hash == h) {
+			add_sample(&g_delivery_us, now - g_pending[i].sent);
+			g_pending[i].used = 2;
+			g_in_flight--;
+			return;
+		}
+	}
+}
+
+/* split the trace into events, return 0 if success, otherwise -1 */
+static int parse_trace(const unsigned char *data, long size) {
+	struct wiretrace_record rec;
+	long long time = 0;
+	long off = 0;
+	int cap = 0;
+
+	while (off + (long)sizeof(rec) <= size) {
+		memcpy(&rec, data + off, sizeof(rec));
+		off += sizeof(rec);
+		if (off + rec.len > size) {
+			break; // cut short while the server was writing it
+		}
+		if (g_nevents == cap) {
+			cap = cap ? cap * 2 : 4096;
+			g_events = realloc(g_events, cap * sizeof(struct event));
+		}
+		time += rec.delta;
+		g_events[g_nevents].time = time;
+		g_events[g_nevents].conn = rec.conn;
+		g_events[g_nevents].len = rec.len;
+		g_events[g_nevents].type = rec.type;
+		g_events[g_nevents].flags = rec.flags;
+		g_events[g_nevents].payload = data + off;
+		g_events[g_nevents].next = -1;
+		if (rec.conn >= g_nconns) {
+			g_nconns = rec.conn + 1;
+		}
+		g_nevents++;
+		off += rec.len;
+	}
+	return g_nevents > 0 ? 0 : -1;
+}
+
+static void conn_close(struct conn *c, conn_state_t state) {
+	if (c->fs) {
+		frame_stream_free(c->fs);
+		c->fs = NULL;
+	}
+	if (c->sockfd != -1) {
+		close(c->sockfd);
+		c->sockfd = -1;
+	}
+	c->state = state;
+}
+
+static void conn_dial(struct conn *c, const char *host, const char *port) {
+	g_stats.connects++;
+	c->dialed = now_us();
+	if ((c->sockfd = dial(host, port, DIAL_TIMEOUT_MS, NULL, 0)) == -1) {
+		perror("replay: connect");
+		g_stats.refused++;
+		c->state = CONN_DEAD;
+		return;
+	}
+	fcntl(c->sockfd, F_SETFL, fcntl(c->sockfd, F_GETFL) | O_NONBLOCK);
+	c->fs = frame_stream_new(c->sockfd);
+	c->state = CONN_WAITING;
+}
+
+/* play the queued events of c until it has to wait for the server */
+static void conn_flush(struct conn *c, const char *host, const char *port) {
+	int burst = 0;
+
+	while (c->head != -1 && burst < REPLAY_BURST) {
+		struct event *e = &g_events[c->head];
+
+		if (c->state == CONN_WAITING) {
+			return;
+		}
+		if (e->type == WT_CONNECT || (e->type == WT_FRAME && c->state == CONN_IDLE)) {
+			// a frame without a connect was on a socket inherited by --takeover
+			if (c->state != CONN_IDLE) {
+				conn_close(c, CONN_IDLE);
+			}
+			conn_dial(c, host, port);
+			if (e->type == WT_CONNECT) {
+				c->head = e->next;
+			}
+			continue;
+		}
+		if (e->type == WT_CLOSE) {
+			// the client stayed until its partner had its lines, so the replay does too
+			long long now = now_us();
+			if (c->closing == 0) {
+				c->closing = now;
+			}
+			if (g_in_flight > 0 && c->state == CONN_READY && now - c->closing < g_drain_us) {
+				return;
+			}
+			c->closing = 0;
+			c->head = e->next;
+			conn_close(c, CONN_IDLE);
+			continue;
+		}
+		c->head = e->next;
+		if (c->state == CONN_READY) {
+			if (e->len >= strlen(MSG_COMPRESS) && memcmp(e->payload, MSG_COMPRESS, strlen(MSG_COMPRESS)) == 0) {
+				g_stats.skipped++; // the replay stays uncompressed
+				continue;
+			}
+			long long now = now_us();
+			if (frame_send_flags(c->fs, e->payload, e->len, e->flags) == -1) {
+				perror("replay: send");
+				conn_close(c, CONN_DEAD);
+				continue;
+			}
+			g_stats.sent++;
+			g_stats.bytes_sent += e->len;
+			if (e->len > 0 && e->payload[0] != '#') {
+				track_sent(e->payload, e->len, now);
+			}
+			burst++;
+		}
+		// frames of a dead connection are dropped
+	}
+	if (c->head == -1) {
+		c->tail = -1;
+	}
+}
+
+/* read what the server sent on c */
+static void conn_read(struct conn *c) {
+	char buf[FRAME_PAYLOAD_MAX + 1];
+	long long now;
+	int len;
+
+	if ((len = frame_fill(c->fs)) <= 0) {
+		if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return;
+		}
+		g_stats.hangups++;
+		conn_close(c, CONN_DEAD);
+		return;
+	}
+	now = now_us();
+	while (c->fs && (len = frame_next(c->fs, buf)) >= 0) {
+		g_stats.received++;
+		g_stats.bytes_received += len;
+		if (c->state == CONN_WAITING) {
+			if (strncmp(buf, MSG_ACK, strlen(MSG_ACK)) == 0) {
+				add_sample(&g_ack_us, now - c->dialed);
+				g_stats.acked++;
+				c->state = CONN_READY;
+			} else {
+				g_stats.refused++; // queue full or banned
+				conn_close(c, CONN_DEAD);
+			}
+			continue;
+		}
+		match_received(buf, len, now);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	struct wiretrace_header header;
+	unsigned char *data;
+	double speed = 1, seconds;
+	const char *trace = NULL, *host = NULL, *port = PORT;
+	struct pollfd *pfds;
+	struct conn **polled;
+	long long start, now, finished = 0, wait;
+	long size;
+	int next = 0, npoll, busy, backlog, i;
+	uint32_t c;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc && atof(argv[i + 1]) > 0) {
+			speed = atof(argv[++i]);
+		} else if (strcmp(argv[i], "--fast") == 0) {
+			speed = 0;
+		} else if (strcmp(argv[i], "--drain") == 0 && i + 1 < argc) {
+			g_drain_us = atof(argv[++i]) * 1e6;
+		} else if (!trace) {
+			trace = argv[i];
+		} else if (!host) {
+			host = argv[i];
+		} else {
+			port = argv[i];
+		}
+	}
+	if (!trace || !host) {
+		printf("usage: %s [--speed N | --fast] [--drain seconds] trace host [port]\n", argv[0]);
+		exit(1);
+	}
+	signal(SIGPIPE, SIG_IGN);
+	if ((size = wiretrace_load(trace, &data, &header)) == -1 || parse_trace(data, size) == -1) {
+		fprintf(stderr, "%s: nothing to replay\n", trace);
+		exit(1);
+	}
+
+	g_conns = calloc(g_nconns, sizeof(struct conn));
+	for (c = 0; c < g_nconns; c++) {
+		g_conns[c].sockfd = -1;
+		g_conns[c].head = g_conns[c].tail = -1;
+	}
+	for (g_pending_mask = 1023; g_pending_mask < (size_t)g_nevents * 2; g_pending_mask = g_pending_mask * 2 + 1);
+	g_pending = calloc(g_pending_mask + 1, sizeof(struct pending));
+	pfds = malloc(g_nconns * sizeof(struct pollfd));
+	polled = malloc(g_nconns * sizeof(struct conn *));
+
+	if (speed == 0) {
+		printf("replaying %d records, %.1f s recorded, at full speed\n", g_nevents,
+				g_events[g_nevents - 1].time / 1e6);
+	} else {
+		printf("replaying %d records, %.1f s recorded, at %gx\n", g_nevents,
+				g_events[g_nevents - 1].time / 1e6, speed);
+	}
+	start = now_us();
+	while (1) {
+		now = now_us();
+		// hand the events that are due to their connections and play them in trace order,
+		// an event stays queued while its connection waits for the server
+		for (i = 0; i < REPLAY_BURST && next < g_nevents &&
+				(speed == 0 || start + (long long)(g_events[next].time / speed) <= now); i++) {
+			struct conn *conn = &g_conns[g_events[next].conn];
+			if (conn->tail == -1) {
+				conn->head = next;
+			} else {
+				g_events[conn->tail].next = next;
+			}
+			conn->tail = next;
+			next++;
+			conn_flush(conn, host, port);
+		}
+
+		busy = backlog = npoll = 0;
+		for (c = 0; c < g_nconns; c++) {
+			struct conn *conn = &g_conns[c];
+			if (conn->state == CONN_WAITING && now - conn->dialed > DIAL_TIMEOUT_MS * 1000LL) {
+				g_stats.refused++; // never acked
+				conn_close(conn, CONN_DEAD);
+			}
+			conn_flush(conn, host, port);
+			if (conn->head != -1) {
+				busy = 1;
+				backlog |= conn->state != CONN_WAITING;
+			}
+			busy |= conn->state == CONN_WAITING;
+			if (conn->sockfd != -1) {
+				pfds[npoll].fd = conn->sockfd;
+				pfds[npoll].events = POLLIN;
+				polled[npoll++] = conn;
+			}
+		}
+		if (next == g_nevents && !busy) {
+			if (finished == 0) {
+				finished = now_us();
+			}
+			if (g_in_flight == 0 || now - finished >= g_drain_us) {
+				break;
+			}
+		}
+
+		// sleep until the next event is due, data arrives or the drain is over
+		wait = 1000;
+		if (backlog) {
+			wait = 0;
+		} else if (next < g_nevents) {
+			wait = speed == 0 ? 0 : (start + (long long)(g_events[next].time / speed) - now + 999) / 1000;
+		} else if (finished) {
+			wait = (finished + g_drain_us - now + 999) / 1000;
+		}
+		if (busy && wait > REPLAY_WAIT_MS) {
+			wait = REPLAY_WAIT_MS;
+		}
+		if (poll(pfds, npoll, wait < 0 ? 0 : wait > 1000 ? 1000 : wait) == -1 && errno != EINTR) {
+			perror("replay: poll");
+			break;
+		}
+		for (i = 0; i < npoll; i++) {
+			if (pfds[i].revents && polled[i]->sockfd == pfds[i].fd) {
+				conn_read(polled[i]);
+			}
+		}
+	}
+
+	seconds = ((finished ? finished : now_us()) - start) / 1e6;
+	printf("sent %lu frames, %.2f MB in %.3f s: %.0f frames/s, %.2f MB/s (%lu codec requests skipped)\n",
+			g_stats.sent, g_stats.bytes_sent / 1048576.0, seconds, g_stats.sent / seconds,
+			g_stats.bytes_sent / 1048576.0 / seconds, g_stats.skipped);
+	printf("received %lu frames, %.2f MB\n", g_stats.received, g_stats.bytes_received / 1048576.0);
+	printf("connections: %lu dialed, %lu acked, %lu refused, %lu closed by the server\n",
+			g_stats.connects, g_stats.acked, g_stats.refused, g_stats.hangups);
+	print_percentiles("connect to ack", &g_ack_us);
+	print_percentiles("delivery to partner", &g_delivery_us);
+	printf("%lu of %lu forwarded frames seen by a partner\n", g_stats.tracked - g_in_flight, g_stats.tracked);
+	for (c = 0; c < g_nconns; c++) {
+		conn_close(&g_conns[c], CONN_DEAD);
+	}
+	free(data);
+	return 0;
+}
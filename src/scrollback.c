@@ -0,0 +1,118 @@
+/*
+ * scrollback.c - per channel ring of recent chat lines
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scrollback.h"
+
+#define RING_MASK (SCROLLBACK_BYTES - 1)
+
+struct scrollback_stats g_scrollback_stats;
+
+struct scrollback* scrollback_new() {
+	struct scrollback *sb = malloc(sizeof(struct scrollback));
+	if (!sb) {
+		return NULL;
+	}
+	sb->refs = 1;
+	sb->head = sb->tail = 0;
+	sb->lines = 0;
+	g_scrollback_stats.channels++;
+	return sb;
+}
+
+struct scrollback* scrollback_hold(struct scrollback *sb) {
+	if (sb) {
+		sb->refs++;
+	}
+	return sb;
+}
+
+void scrollback_release(struct scrollback *sb) {
+	if (sb && --sb->refs == 0) {
+		g_scrollback_stats.channels--;
+		free(sb);
+	}
+}
+
+/* copy in and out of the ring across its end */
+static void ring_put(struct scrollback *sb, unsigned at, const void *src, size_t n) {
+	size_t first = SCROLLBACK_BYTES - (at & RING_MASK);
+	if (first > n) {
+		first = n;
+	}
+	memcpy(sb->data + (at & RING_MASK), src, first);
+	memcpy(sb->data, (const unsigned char *)src + first, n - first);
+}
+
+static void ring_get(const struct scrollback *sb, unsigned at, void *dst, size_t n) {
+	size_t first = SCROLLBACK_BYTES - (at & RING_MASK);
+	if (first > n) {
+		first = n;
+	}
+	memcpy(dst, sb->data + (at & RING_MASK), first);
+	memcpy((unsigned char *)dst + first, sb->data, n - first);
+}
+
+static unsigned line_len(const struct scrollback *sb, unsigned at) {
+	unsigned char len[2];
+	ring_get(sb, at, len, 2);
+	return (len[0] << 8) | len[1];
+}
+
+void scrollback_add(struct scrollback *sb, const char *name, const char *text, size_t len) {
+	char line[SCROLLBACK_LINE_MAX];
+	unsigned char prefix[2];
+	int n;
+
+	if (!sb) {
+		return;
+	}
+	n = snprintf(line, sizeof(line), "%s: %.*s", name, (int)len, text);
+	if (n >= (int)sizeof(line)) {
+		n = sizeof(line) - 1;
+	}
+
+	/* make room by dropping the oldest lines */
+	while (sb->tail - sb->head + 2 + n > SCROLLBACK_BYTES) {
+		sb->head += 2 + line_len(sb, sb->head);
+		sb->lines--;
+		g_scrollback_stats.dropped++;
+	}
+	prefix[0] = n >> 8;
+	prefix[1] = n & 0xff;
+	ring_put(sb, sb->tail, prefix, 2);
+	ring_put(sb, sb->tail + 2, line, n);
+	sb->tail += 2 + n;
+	sb->lines++;
+	g_scrollback_stats.lines++;
+}
+
+int scrollback_copy(const struct scrollback *sb, int n, unsigned char *out, struct iovec *lines) {
+	unsigned at, len;
+	size_t used = 0;
+	int skip, i;
+
+	if (!sb || n <= 0) {
+		return 0;
+	}
+	if (n > (int)sb->lines) {
+		n = sb->lines;
+	}
+	at = sb->head;
+	for (skip = sb->lines - n; skip > 0; skip--) {
+		at += 2 + line_len(sb, at);
+	}
+	for (i = 0; i < n; i++) {
+		len = line_len(sb, at);
+		ring_get(sb, at + 2, out + used, len);
+		lines[i].iov_base = out + used;
+		lines[i].iov_len = len;
+		used += len;
+		at += 2 + len;
+	}
+	return n;
+}
@@ -2,32 +2,362 @@
  * server.c - Chat server for the Text ChatRoullette program
  */
 
+#define _GNU_SOURCE // accept4
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <sys/time.h>
 #include <signal.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <poll.h>
+#include <fnmatch.h>
 
 #include "common.h"
 #include "control_msg.h"
+#include "frame.h"
+#include "modstore.h"
+#include "handoff.h"
+#include "cluster.h"
+#include "ratelimit.h"
+#include "uring.h"
+#include "scrollback.h"
+#include "transcript.h"
+#include "trace.h"
+#include "counters.h"
+#include "admin.h"
+#include "banlist.h"
+#include "bulk.h"
+#include "tlsconn.h"
+#include "wiretrace.h"
+#include "slotset.h"
+#include "broadcast.h"
+#include "tagindex.h"
+#include "waitqueue.h"
 
 /* global variables for the server */
 server_state_t g_state =  SERVER_INIT;
-struct client_info* g_clients[CLIENT_MAX]; // chat queue
-fd_set g_bitmap;  // bitmap for chat channel
+struct client_info* g_clients[CLIENT_MAX]; // chat queue, the cold part of each client
+struct client_table g_table; // the hot part, see common.h
+struct slot_set g_bitmap;  // occupied slots of the chat queue
+struct slot_set g_in_state[TRANSFERING + 1]; // slots per client_state_t, INIT stays empty
+int g_wake_fd[2] = { -1, -1 }; // written by the admin console and the grace timer to wake the event loop
+struct {
+	pthread_mutex_t lock;
+	char *line[CONSOLE_QUEUE_MAX];
+	int len;
+} g_console = { .lock = PTHREAD_MUTEX_INITIALIZER }; // lines typed on stdin, run by the event loop
+volatile sig_atomic_t g_grace_over = 0; // the grace period timer went off
+volatile sig_atomic_t g_interrupted = 0; // SIGINT arrived, the event loop stops the server
+int g_grace_told = 0; // everyone had the grace notice or could not be told
+double g_stop_started = 0; // when the stop notice went out, 0 before
 fd_set g_master;  // global socket map
 long g_useid = 0;  // global user id
 pthread_t g_connector;
+int g_listener_fd = -1; // listener inherited from a previous server by --takeover
+char *g_port = PORT; // client port, --port
+char *g_unix_path = NULL; // UNIX domain socket for local clients, --unix
+int g_unix_fd = -1; // its listener, inherited by --takeover like the TCP one
+char *g_node_port = NULL; // port other nodes connect to, --node-port
+char *g_node_bind = NULL; // address other nodes connect to, --node-bind, every one if NULL
+char *g_peers[NODE_MAX]; // nodes to link with at start, --peer host:port
+int g_peer_num = 0;
+int g_backlog = LISTEN_BACKLOG; // --backlog
+int g_spare_fd = -1; // given up to accept and shed a connection when out of fds
+int g_transcript = 1; // --no-transcript turns session transcripts off
+char *g_record_path = NULL; // --record captures client traffic here for ./replay
+int g_admin_fd = -1; // admin control socket
+int g_heartbeat = HEARTBEAT_SECONDS; // --heartbeat, 0 leaves dead peers to the kernel defaults
+int g_tag_wait = TAG_WAIT_SECONDS; // --tag-wait, 0 waits for a shared tag however long it takes
+int g_queue_dirty = 0; // someone may be free for the users in the wait queue
+
+/* accept path counters reported by /stats */
+struct accept_stats {
+	unsigned long accepted; /* admitted to the chat queue */
+	unsigned long rejected; /* refused over capacity */
+	unsigned long banned; /* refused for a banned address */
+	unsigned long errors;
+	unsigned long wakeups; /* listener became readable */
+	unsigned long max_batch; /* most connections taken in one wakeup */
+	unsigned long last_total; /* accepted + rejected at the previous /stats */
+	double last_time;
+} g_accept_stats;
+
+/* a TLS connection accepted but not acked yet, the event loop carries its handshake on */
+struct tls_pending {
+	struct tls_conn *tls;
+	int want; /* POLLIN or POLLOUT */
+	double deadline; /* given up after TLS_HANDSHAKE_MS */
+	char addr[INET6_ADDRSTRLEN];
+} *g_handshakes[FD_SETSIZE];
+int g_handshaking = 0; // connections in g_handshakes
+
+/* dead peer counters reported by /stats */
+struct heartbeat_stats {
+	unsigned long pings;
+	unsigned long dead; /* dropped for missing their heartbeats */
+	unsigned long hangups; /* slots reclaimed from clients that closed, reset or timed out */
+} g_heartbeat_stats;
+
+/* interest tag matchmaking counters reported by /stats */
+struct tag_stats {
+	unsigned long matched; /* pairs that share a tag */
+	unsigned long fell_back; /* waits that ran out and went to a random partner */
+} g_tag_stats;
+
+/* io_uring backend, --io-uring. user_data of a recv, poll or accept is
+ * [generation:32][fd:28][op:4], a send carries its struct ring_send */
+#define RING_ACCEPT            1
+#define RING_RECV              2
+#define RING_POLL              3
+#define RING_SEND              4
+#define RING_CANCEL            5
+#define RING_OP_MASK           0xf
+#define RING_CHAIN_MAX         64     // sends linked in one chain
+#define RING_QUIESCE_SECONDS   5      // wait for in-flight operations before a handoff
+#define RING_DATA(fd, op)      (((unsigned long long)g_ring_gen[fd] << 32) | \
+		((unsigned long long)(fd) << 4) | (op))
+
+int g_use_uring = 0;
+struct uring g_ring;
+pthread_mutex_t g_ring_lock = PTHREAD_MUTEX_INITIALIZER; // the admin thread sends too
+unsigned g_ring_gen[FD_SETSIZE]; // bumped when an fd is closed, stale completions are dropped
+int g_ring_armed[FD_SETSIZE]; // recv, poll or accept in flight on an fd, 0 for none
+int g_ring_ops = 0; // armed operations whose last completion has not arrived
+fd_set g_ring_hup; // clients whose recv saw EOF or an error
+fd_set g_ring_polled; // clients sending a file, readable and read by the main loop
+
+/* one frame queued or in flight on the ring */
+struct ring_send {
+	struct ring_send *next;
+	int fd;
+	unsigned gen;
+	size_t len;
+	unsigned char data[];
+};
+
+/* frames to one socket, only one linked chain is in flight so they stay in order */
+struct ring_send_queue {
+	struct ring_send *head, *tail; /* waiting for the chain in flight */
+	int inflight;
+	size_t bytes; /* queued and in flight, at most CLIENT_OUTQ_MAX */
+} g_ring_sends[FD_SETSIZE];
+unsigned long g_ring_inflight = 0; // sends of every socket
+unsigned long g_ring_recvs = 0; // recv completions, for /stats
+
+/* submits the frames queued for fd as one linked chain, ring lock held */
+static void ring_flush_sends(int fd) {
+	struct ring_send_queue *q = &g_ring_sends[fd];
+	struct ring_send *s;
+	struct io_uring_sqe *sqe;
+	int n = 0;
+
+	// a chain must not be split by uring_get_sqe() submitting halfway
+	if (uring_sq_space(&g_ring) < RING_CHAIN_MAX) {
+		uring_submit(&g_ring);
+	}
+	while ((s = q->head) != NULL && n < RING_CHAIN_MAX) {
+		q->head = s->next;
+		sqe = uring_get_sqe(&g_ring);
+		uring_prep_send(sqe, fd, s->data, s->len, (unsigned long long)(uintptr_t)s | RING_SEND);
+		if (q->head && n + 1 < RING_CHAIN_MAX) {
+			sqe->flags |= IOSQE_IO_LINK;
+		}
+		q->inflight++;
+		g_ring_inflight++;
+		n++;
+	}
+	if (!q->head) {
+		q->tail = NULL;
+	}
+}
+
+/* frame writer of client streams on the io_uring backend: the frame is copied
+ * and queued behind the chain in flight on the same socket */
+int ring_write(int sockfd, const void *buf, size_t len) {
+	struct ring_send_queue *q = &g_ring_sends[sockfd];
+	struct ring_send *s = malloc(sizeof(struct ring_send) + len);
+
+	if (!s) {
+		return -1;
+	}
+	s->next = NULL;
+	s->fd = sockfd;
+	s->len = len;
+	memcpy(s->data, buf, len);
+
+	pthread_mutex_lock(&g_ring_lock);
+	if (q->bytes + len > CLIENT_OUTQ_MAX) {
+		shutdown(sockfd, SHUT_RDWR); // the client does not read, recv reports the hangup
+		pthread_mutex_unlock(&g_ring_lock);
+		free(s);
+		errno = ENOBUFS;
+		return -1;
+	}
+	q->bytes += len;
+	s->gen = g_ring_gen[sockfd];
+	if (q->tail) {
+		q->tail->next = s;
+	} else {
+		q->head = s;
+	}
+	q->tail = s;
+	if (q->inflight == 0) {
+		ring_flush_sends(sockfd);
+	}
+	if (!pthread_equal(pthread_self(), g_connector)) {
+		uring_submit(&g_ring); // the loop may be asleep in uring_wait()
+	}
+	pthread_mutex_unlock(&g_ring_lock);
+	return 0;
+}
+
+/* a send finished, start the next chain of its socket */
+static void ring_send_done(struct ring_send *s, int res) {
+	struct ring_send_queue *q = &g_ring_sends[s->fd];
+
+	pthread_mutex_lock(&g_ring_lock);
+	g_ring_inflight--;
+	if (s->gen == g_ring_gen[s->fd]) {
+		q->inflight--;
+		q->bytes -= s->len;
+		if (res != (int)s->len) {
+			shutdown(s->fd, SHUT_RDWR); // recv reports the hangup
+		} else if (q->inflight == 0 && q->head) {
+			ring_flush_sends(s->fd);
+		}
+	}
+	pthread_mutex_unlock(&g_ring_lock);
+	free(s);
+}
+
+/* drops what the ring holds for fd before it is closed */
+void ring_forget(int fd) {
+	struct ring_send_queue *q = &g_ring_sends[fd];
+	struct ring_send *s;
+
+	if (!g_use_uring) {
+		return;
+	}
+	pthread_mutex_lock(&g_ring_lock);
+	if (g_ring_armed[fd]) {
+		uring_prep_cancel(uring_get_sqe(&g_ring), RING_DATA(fd, g_ring_armed[fd]), RING_CANCEL);
+		g_ring_armed[fd] = 0;
+	}
+	uring_submit(&g_ring); // queued sends take their reference to the socket now
+	while ((s = q->head) != NULL) {
+		q->head = s->next;
+		free(s);
+	}
+	q->tail = NULL;
+	q->inflight = 0;
+	q->bytes = 0;
+	g_ring_gen[fd]++;
+	FD_CLR(fd, &g_ring_hup);
+	FD_CLR(fd, &g_ring_polled);
+	pthread_mutex_unlock(&g_ring_lock);
+}
+
+/* cancels what is armed on fd, ring_arm() then arms it for the way its client is read now */
+void ring_rearm(int fd) {
+	if (!g_use_uring) {
+		return;
+	}
+	pthread_mutex_lock(&g_ring_lock);
+	if (g_ring_armed[fd]) {
+		uring_prep_cancel(uring_get_sqe(&g_ring), RING_DATA(fd, g_ring_armed[fd]), RING_CANCEL);
+		g_ring_armed[fd] = 0;
+	}
+	pthread_mutex_unlock(&g_ring_lock);
+}
+
+/* closes a client socket */
+void close_socket(int fd) {
+	wiretrace_add(WT_CLOSE, fd, 0, "", 0);
+	ring_forget(fd);
+	close(fd);
+}
+
+/* returns the slot of the local client on sockfd, -1 if not found */
+int find_client(int sockfd) {
+	int j;
+	SLOT_SET_FOREACH(j, &g_bitmap) {
+		if (g_table.sockfd[j] == sockfd && !(g_table.flags[j] & CLIENT_F_REMOTE)) {
+			return j;
+		}
+	}
+	return -1;
+}
+
+/* returns the slot of a user living on this node, -1 if not found */
+int find_local(const char *name) {
+	int i;
+	SLOT_SET_FOREACH(i, &g_bitmap) {
+		if (!(g_table.flags[i] & CLIENT_F_REMOTE) &&
+				strcmp(g_clients[i]->name, name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* deliver a message to a client, relaying it when the client lives on another node */
+int send_to(struct client_info *client, const void *buf, size_t len) {
+	if (client->node != -1) {
+		return cluster_relay(client->node, client->name, buf, len);
+	}
+	return frame_send(client->stream, buf, len);
+}
+
+/* frame and send a nul terminated message to a client */
+int send_msg(struct client_info *client, const char *msg) {
+	return send_to(client, msg, strlen(msg));
+}
+
+/* store the state of the client in slot index and move it to that state's set */
+void table_set_state(int index, client_state_t state) {
+	if (state != CONNECTING) {
+		tag_index_remove(index); // paired or gone, nobody can match it on its tags
+		if (wait_queue_has(index)) {
+			wait_queue_leave(index, state == CHATTING ? rate_now() : 0);
+		}
+	} else {
+		g_queue_dirty = 1; // a partner for someone in the wait queue
+	}
+	slot_set_del(&g_in_state[g_table.state[index]], index);
+	if (state != INIT) {
+		slot_set_add(&g_in_state[state], index);
+	}
+	g_table.state[index] = state;
+}
+
+/* change the state of a client, a proxy mirrors it to the user's own node */
+void set_state(struct client_info *client, client_state_t state) {
+	TRACE(state, g_table.sockfd[client->slot], client->name, state, 0);
+	if (client->node == -1 && g_table.state[client->slot] != state) {
+		counters_state(g_table.state[client->slot], state);
+	}
+	if (client->node == -1 && (g_table.state[client->slot] == TRANSFERING) != (state == TRANSFERING)) {
+		ring_rearm(g_table.sockfd[client->slot]); // file senders are polled, see ring_arm()
+	}
+	table_set_state(client->slot, state);
+	if (client->node != -1) {
+		cluster_send_state(client->node, client->name, state);
+	}
+}
 
 /* used by cleanup() to handle children */
 void sigchld_handler(int s) {
@@ -56,7 +386,7 @@ int setup() {
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_flags = AI_PASSIVE; // use my IP
 
-	if ((rv = getaddrinfo(NULL, PORT, &hints, &servinfo)) != 0) {
+	if ((rv = getaddrinfo(NULL, g_port, &hints, &servinfo)) != 0) {
 		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
 		exit(1);
 	}
@@ -90,7 +420,7 @@ int setup() {
 
 	freeaddrinfo(servinfo); // all done with this structure
 
-	if (listen(sockfd, CLIENT_MAX) == -1) {
+	if (listen(sockfd, g_backlog) == -1) {
 		perror("listen");
 		exit(1);
 	}
@@ -100,6 +430,45 @@ int setup() {
 	return sockfd;
 }
 
+/* listen on a UNIX domain socket at path, return sockfd or -1 */
+int setup_unix(const char *path) {
+	struct sockaddr_un addr;
+	int sockfd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "server: socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	if ((sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+		perror("server: unix socket");
+		return -1;
+	}
+	// a socket nobody answers on was left by a server that did not exit cleanly
+	if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		fprintf(stderr, "server: %s is served by another process\n", path);
+		close(sockfd);
+		return -1;
+	}
+	if (errno == ECONNREFUSED) {
+		unlink(path);
+	}
+	close(sockfd);
+	if ((sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1 ||
+			bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+			listen(sockfd, g_backlog) == -1) {
+		perror("server: unix bind");
+		if (sockfd != -1) {
+			close(sockfd);
+		}
+		return -1;
+	}
+	printf("listening for local clients on %s\n", path);
+	return sockfd;
+}
+
 /* cleans up current processes */
 void cleanup() {
 	struct sigaction sa;
@@ -113,234 +482,640 @@ void cleanup() {
 	}
 }
 
+/* take an empty slot in chat queue, return its index or -1 if full */
+int alloc_slot() {
+	return slot_set_take(&g_bitmap);
+}
+
 /* Generate a new client node */
-int create_client(int sockfd, struct client_info **node) {
-	char *name;
+int create_client(int sockfd, const char *addr, struct client_info **node) {
+	struct client_info *client;
 	int index;
+	struct mod_record record;
 
 	//find a empty slot in chat queue
-	for (index = 0; index < CLIENT_MAX; index++) {
-		if (!FD_ISSET(index, &g_bitmap)) {
-			FD_SET(index, &g_bitmap);
-			break;
-		}
-	}
+	index = alloc_slot();
 
 	// chat queue is full
-	if (index == CLIENT_MAX) {
+	if (index == -1) {
 		char msg[] = "Chat queue is full, please retry later";
-		if (send(sockfd, msg, strlen(msg), 0) == -1) {
+		if (frame_write(sockfd, 0, msg, strlen(msg)) == -1) {
 			perror("chat queue full fails");
 		}
 		return -1;
 	}
 
-	name = malloc(NAME_LENGTH);
-	*node = malloc(sizeof(struct client_info));
-
-	sprintf(name, "user_%ld", g_useid++);
-
-	(*node)->name = name;
-	(*node)->sockfd = sockfd;
-	(*node)->partner_index = -1;
-	(*node)->state = CONNECTING;
-	(*node)->blocked = 0;
-	(*node)->flag = 0;
+	client = malloc(sizeof(struct client_info));
+	client->slot = index;
+	snprintf(client->name, NAME_LENGTH, "user_%ld", g_useid++);
+	client->addr = strdup(addr);
+	client->stream = frame_stream_new(sockfd);
+	if (g_use_uring) {
+		frame_set_writer(client->stream, ring_write);
+	}
+	frame_set_queue(client->stream, CLIENT_OUTQ_MAX); // a slow reader does not stall the loop
+	client->limit = rate_limit_new(rate_now());
+	client->history = NULL;
+	client->session = 0;
+	client->channel_bytes = 0;
+	client->node = -1;
+	client->flag = 0;
+	client->bulk = bulk_queue_new(client->stream);
+	g_table.sockfd[index] = sockfd;
+	g_table.partner[index] = -1;
+	table_set_state(index, CONNECTING);
+	g_table.flags[index] = 0;
+	g_table.heard[index] = rate_now();
+
+	/* moderation survives reconnects and restarts */
+	if (mod_lookup(addr, &record) == 0) {
+		if (record.blocked) {
+			g_table.flags[index] |= CLIENT_F_BLOCKED;
+		}
+		client->flag = record.flags;
+	}
+	counters_state(INIT, CONNECTING);
+	if (client->flag != 0) {
+		g_counters.flagged++;
+	}
+	g_counters.connections++;
 
+	*node = client;
 	return index;
 }
 
 /* destroys the current client */
 void destroy_client(struct client_info ** client) {
-	free((*client)->name);
-	(*client)->name = NULL;
+	int index = (*client)->slot;
+
+	if ((*client)->node == -1) {
+		counters_leave(g_table.state[index], (*client)->flag != 0);
+	}
+	bulk_queue_free((*client)->bulk);
+	frame_stream_free((*client)->stream);
+	free((*client)->limit);
+	scrollback_release((*client)->history);
+	free((*client)->addr);
 	free(*client);
 	*client = NULL;
+	broadcast_forget(index);
+	g_table.sockfd[index] = -1;
+	g_table.partner[index] = -1;
+	table_set_state(index, INIT);
+	g_table.flags[index] = 0;
+}
+
+/* stand in for a user of the node at link, return its index or -1 if full */
+int create_proxy(int link, const char *name, const char *addr) {
+	struct client_info *proxy;
+	int index = alloc_slot();
+
+	if (index == -1) {
+		return -1;
+	}
+	proxy = malloc(sizeof(struct client_info));
+	proxy->slot = index;
+	snprintf(proxy->name, NAME_LENGTH, "%s", name);
+	proxy->addr = strdup(addr);
+	proxy->stream = NULL;
+	proxy->limit = NULL;
+	proxy->history = NULL;
+	proxy->session = 0;
+	proxy->channel_bytes = 0;
+	proxy->node = link;
+	proxy->flag = 0;
+	proxy->bulk = NULL;
+	g_table.sockfd[index] = -1;
+	g_table.partner[index] = -1;
+	table_set_state(index, CHATTING);
+	g_table.flags[index] = CLIENT_F_REMOTE;
+	g_clients[index] = proxy;
+	return index;
+}
+
+/* frees a slot and its client */
+void release_slot(int index) {
+	destroy_client(&g_clients[index]);
+	slot_set_del(&g_bitmap, index);
 }
 
 /* add client to chat queue, then ack back */
-int send_ack(int sockfd, struct client_info * clients[], fd_set *bitmap) {
+int send_ack(int sockfd, const char *addr, struct tls_conn *tls,
+		struct client_info * clients[], struct slot_set *bitmap) {
 	char ack[BUF_MAX];
 	struct client_info *client;
 
 	/* add new client to chat queue */
-	int index = create_client(sockfd, &client);
+	int index = create_client(sockfd, addr, &client);
 	if (index == -1) {
+		tls_free(tls);
 		return -1;
 	}
 	clients[index] = client;
+	if (tls) {
+		frame_set_tls(client->stream, tls);
+	}
 
-	sprintf(ack, "%s:%s", MSG_ACK, client->name);
-	if (send(sockfd, ack, strlen(ack), 0) == -1) {
+	/* advertise the codecs we accept, the client picks one with MSG_COMPRESS */
+	sprintf(ack, "%s:%s:%s", MSG_ACK, client->name, CODEC_LZ_NAME);
+	if (send_msg(client, ack) == -1) {
 		perror("ack fails");
+		release_slot(index);
 		return -1;
 	}
 	return 0;
 }
 
-/* finds a chat partner for the client */
+/* asks the node holding the r-th sampled remote user to pair it with self,
+ * the session starts when the node answers */
+void request_remote_partner(struct client_info *self, int r) {
+	char name[NAME_LENGTH];
+	char msg[BUF_MAX];
+	int link;
+
+	if (cluster_take_sample(r, &link, name) == -1) {
+		return;
+	}
+	sprintf(msg, "%s:%s:%s:%s", MSG_NODE_PAIR, name, self->name, self->addr);
+	if (cluster_send(link, msg) == -1) {
+		perror("send pair request fails");
+		return;
+	}
+	g_table.partner[self->slot] = CLUSTER_PENDING;
+}
+
+/* finds a chat partner for the client, one waiting on one of the tags if any are given */
 struct client_info* find_partner(int sockfd,
-		struct client_info *clients[], fd_set *bitmap)
+		struct client_info *clients[], struct slot_set *bitmap, char *tags[], int tag_count)
 {
     int i, r;
     int avail_count = 0;
+    int remote_count = cluster_sample_count();
     int client_num = 0;
     int himself;
     struct client_info *self = NULL;
     int available_indices[CLIENT_MAX];
+    struct slot_set eligible;
 
-    // find himself and available indices
-    memset(available_indices, 0, CLIENT_MAX);
-    for (i = 0; i < CLIENT_MAX; i++) {
-	    if (FD_ISSET(i, bitmap)) {
-            client_num++;
-            if (clients[i]->sockfd == sockfd) {
-				self = clients[i];
-				himself = i;
-			} else {
-				if (clients[i]->partner_index == -1) {
-					available_indices[avail_count] = i;
-					avail_count++;
-				}
-			}
-        }
+    // a blocked user is turned down before looking at anyone else
+    if ((himself = find_client(sockfd)) == -1) {
+    	return NULL;
     }
-    if (self->blocked) {
+    self = clients[himself];
+    if (g_table.flags[himself] & CLIENT_F_BLOCKED) {
     	char msg[] = "Blocked user is not allowed to start a new chat";
-    	if (send(self->sockfd, msg, strlen(msg), 0) == -1) {
+    	if (send_msg(self, msg) == -1) {
 			perror("send block fails");
 		}
 		return NULL;
     }
 
+    // a new request replaces the tags the user waited on, but keeps its place in the queue
+    tag_index_remove(himself);
+    wait_queue_add(himself, rate_now());
+
+    // find available indices among the waiting users, blocked users are not offered as partners
+    // and users waiting on their tags only to those who share one
+    client_num = slot_set_count(bitmap);
+    slot_set_zero(&eligible);
+    SLOT_SET_FOREACH(i, &g_in_state[CONNECTING]) {
+        if (i != himself && g_table.partner[i] == -1 &&
+        		!(g_table.flags[i] & (CLIENT_F_REMOTE | CLIENT_F_BLOCKED))) {
+			slot_set_add(&eligible, i);
+			if (!tag_index_waiting(i)) {
+				available_indices[avail_count] = i;
+				avail_count++;
+			}
+		}
+    }
+
+    // a partner on another node is on its way
+    if (g_table.partner[self->slot] == CLUSTER_PENDING) {
+    	return NULL;
+    }
+
+    // someone waiting on a shared tag, otherwise wait for one to come
+    if (tag_count > 0) {
+    	int index = tag_index_match(tags, tag_count, &eligible);
+    	if (index != -1) {
+    		g_tag_stats.matched++;
+    		g_table.partner[self->slot] = index;
+    		g_table.partner[index] = himself;
+    		return self;
+    	}
+    	if (tag_index_add(himself, tags, tag_count, rate_now()) > 0) {
+    		char list[TAG_USER_MAX * (TAG_LENGTH + 2)];
+    		char msg[sizeof(list) + 80]; // every tag and the words around them
+    		tag_index_list(himself, list, sizeof(list));
+    		if (g_tag_wait > 0) {
+    			snprintf(msg, sizeof(msg), "Waiting for a user interested in %s, "
+    					"or a random partner in %d seconds", list, g_tag_wait);
+    		} else {
+    			snprintf(msg, sizeof(msg), "Waiting for a user interested in %s", list);
+    		}
+    		if (send_msg(self, msg) == -1) {
+    			perror("send tag wait fails");
+    		}
+    		return NULL;
+    	}
+    }
+
     // only one user at the time
-    if (client_num == 1) {
-        self->partner_index = -1;
-        char msg[] =  "You are the only user in the system right now.";
-		if (send(self->sockfd, msg, strlen(msg), 0) == -1) {
+    if (client_num == 1 && remote_count == 0) {
+        g_table.partner[self->slot] = -1;
+        char msg[] =  "You are the only user in the system right now, you will be paired when someone comes.";
+		if (send_msg(self, msg) == -1) {
 			perror("send fails");
 		}
         return NULL;
     }
 
-    if (avail_count == 0) {
-    	char msg[] = "All users are chatting now, please try later.";
-		if (send(sockfd, msg, strlen(msg), 0) == -1) {
+    if (avail_count + remote_count == 0) {
+    	char msg[] = "All users are chatting now, you will be paired when one is free.";
+		if (send_msg(self, msg) == -1) {
 			perror("no available fails");
 		}
 		return NULL;
     }
 
-    // find a random parter (other than himself)
+    // bytes carries the number of candidates
+    TRACE(find_partner, sockfd, self->name, g_table.state[self->slot], avail_count + remote_count);
+
+    // find a random parter (other than himself), the longer one has waited the likelier
     srand(clock());
-    r = rand() % avail_count; // not uniformly distributed
+    r = wait_queue_pick(available_indices, avail_count, remote_count, rate_now());
+    if (r >= avail_count) {
+    	request_remote_partner(self, r - avail_count);
+    	return NULL;
+    }
 	if (r > avail_count - 1) {
 		printf("Error: Partner(index:%d) is not in chat queue", r);
 		return NULL;
 	}
 	int index = available_indices[r];
-	self->partner_index = index;
-	clients[index]->partner_index = himself;
+	g_table.partner[self->slot] = index;
+	g_table.partner[index] = himself;
 
     return self;
 }
 
+/* lets the kernel notice a peer that vanished without a FIN, and give up on data the peer
+ * does not acknowledge, within the heartbeat timeout. heartbeats cover the rest */
+void set_keepalive(int fd) {
+	int yes = 1;
+	int idle = g_heartbeat / 3 > 0 ? g_heartbeat / 3 : 1;
+	int intvl = g_heartbeat / 9 > 0 ? g_heartbeat / 9 : 1;
+	int cnt = 3;
+	unsigned int user_timeout = g_heartbeat * 1000;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes)) == -1 ||
+			setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) == -1 ||
+			setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl)) == -1 ||
+			setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt)) == -1 ||
+			setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(user_timeout)) == -1) {
+		perror("keepalive");
+	}
+}
+
+/* refuses a connection over capacity without doing any work for it */
+void reject_connection(int new_fd) {
+	static const char msg[] = "Chat queue is full, please retry later";
+	frame_write(new_fd, 0, msg, strlen(msg)); // non-blocking, best effort
+	close(new_fd);
+	g_accept_stats.rejected++;
+}
+
+/* out of file descriptors: free the spare one to accept and drop a pending
+ * connection, otherwise it stays in the backlog and select never sleeps.
+ * return 0 if one was dropped, -1 if the backlog is empty */
+int shed_connection(int sockfd) {
+	int fd;
+	close(g_spare_fd);
+	fd = accept(sockfd, NULL, NULL);
+	if (fd != -1) {
+		close(fd);
+		g_accept_stats.rejected++;
+	}
+	g_spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	return fd == -1 ? -1 : 0;
+}
+
+/* acks a connection and watches it for the chat, return 0 if success, otherwise -1 */
+int ack_connection(int new_fd, const char *addr, struct tls_conn *tls, int *fdmax,
+		fd_set *master, struct client_info *clients [], struct slot_set *bitmap) {
+	if (send_ack(new_fd, addr, tls, clients, bitmap) == -1) {
+		FD_CLR(new_fd, master);
+		close_socket(new_fd);
+		return -1;
+	}
+	FD_SET(new_fd, master); // add to g_master set
+	if (new_fd > *fdmax) {
+		*fdmax = new_fd; // keep track of the max
+	}
+	g_accept_stats.accepted++;
+	wiretrace_add(WT_CONNECT, new_fd, 0, "", 0);
+	TRACE(accept, new_fd, NULL, CONNECTING, 0);
+	return 0;
+}
+
+/* forgets a pending handshake and closes its socket */
+void abort_handshake(int fd, fd_set *master) {
+	struct tls_pending *pending = g_handshakes[fd];
+
+	g_handshakes[fd] = NULL;
+	g_handshaking--;
+	tls_free(pending->tls);
+	free(pending);
+	FD_CLR(fd, master);
+	close_socket(fd);
+}
+
+/* one step of a pending handshake once its socket is ready, the ack follows when it is done.
+ * return -1 if the connection was closed, otherwise 0 */
+int continue_handshake(int fd, int *fdmax, fd_set *master) {
+	struct tls_pending *pending = g_handshakes[fd];
+	int want = tls_handshake(pending->tls);
+
+	if (want > 0) {
+		pending->want = want;
+		return 0;
+	}
+	if (want == -1) {
+		abort_handshake(fd, master);
+		return -1;
+	}
+	g_handshakes[fd] = NULL;
+	g_handshaking--;
+	ring_rearm(fd); // polled during the handshake, read like any client now
+	want = ack_connection(fd, pending->addr, pending->tls, fdmax, master, g_clients, &g_bitmap);
+	free(pending);
+	return want;
+}
+
+/* gives up on handshakes past their deadline and runs those waiting to write,
+ * return seconds until it has to run again, -1 if no handshake is pending */
+double handshake_sweep(int *fdmax, fd_set *master) {
+	double now = rate_now(), wait = -1;
+	int fd;
+
+	for (fd = 0; g_handshaking > 0 && fd <= *fdmax; fd++) {
+		struct tls_pending *pending = g_handshakes[fd];
+		if (!pending) {
+			continue;
+		}
+		if (now >= pending->deadline) {
+			fprintf(stderr, "tls: handshake with %s takes too long, closing it\n", pending->addr);
+			g_tls_stats.failures++;
+			abort_handshake(fd, master);
+			continue;
+		}
+		if (pending->want == POLLOUT && continue_handshake(fd, fdmax, master) == -1) {
+			continue;
+		}
+		if (g_handshakes[fd] == NULL) {
+			continue; // acked
+		}
+		if (pending->want == POLLOUT) {
+			wait = BULK_POLL_SECONDS; // select() only watches it for reading
+		} else if (wait < 0 || pending->deadline - now < wait) {
+			wait = pending->deadline - now;
+		}
+	}
+	return wait;
+}
+
 /* return 0 if connection sets up, otherwise return -1 */
-int handle_new_connection(int sockfd, int *fdmax, fd_set *master,
-		struct client_info *clients [], fd_set *bitmap) {
-    int new_fd;
-	socklen_t addrlen;
-	struct sockaddr_storage their_addr; // connector's address information
+int admit_connection(int new_fd, struct sockaddr_storage *their_addr, int *fdmax,
+		fd_set *master, struct client_info *clients [], struct slot_set *bitmap) {
 	char remoteIP[INET6_ADDRSTRLEN];
 
-	addrlen = sizeof their_addr;
-	new_fd = accept(sockfd, (struct sockaddr *)&their_addr,
-					&addrlen);
-	if (new_fd == -1) {
-		perror("accept() fails");
+	// banned peers are turned away before anything is set up for them
+	if (ban_check((struct sockaddr *)their_addr)) {
+		static const char msg[] = "You are banned from this server";
+		TRACE(reject, new_fd, NULL, INIT, 0);
+		frame_write(new_fd, 0, msg, strlen(msg)); // non-blocking, best effort
+		close(new_fd);
+		g_accept_stats.banned++;
 		return -1;
+	}
+
+	// select() cannot watch it or no slot is left, handshakes going on count as taken
+	if (new_fd >= FD_SETSIZE || slot_set_full(bitmap) || slot_set_count(bitmap) + g_handshaking >= CLIENT_MAX) {
+		TRACE(reject, new_fd, NULL, INIT, 0);
+		reject_connection(new_fd);
+		return -1;
+	}
+
+	int local = their_addr->ss_family == AF_UNIX;
+	if (local) {
+		// local peers have no address, moderation keys on the user they run as
+		struct ucred cred;
+		socklen_t len = sizeof(cred);
+		if (getsockopt(new_fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) {
+			snprintf(remoteIP, sizeof remoteIP, "unix:%u", (unsigned)cred.uid);
+		} else {
+			snprintf(remoteIP, sizeof remoteIP, "unix");
+		}
 	} else {
-		FD_SET(new_fd, master); // add to g_master set
+		inet_ntop(their_addr->ss_family,
+				get_in_addr((struct sockaddr *)their_addr),
+				remoteIP, sizeof remoteIP);
+
+		// every frame is a whole message, Nagle would hold a chat line back for an ack
+		int yes = 1;
+		setsockopt(new_fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+		if (g_heartbeat > 0) {
+			set_keepalive(new_fd);
+		}
+	}
+
+	// the handshake comes before the ack, a client that does not speak TLS is dropped.
+	// the event loop carries it on, so a slow peer holds nobody up.
+	// a UNIX socket never leaves the machine and is not encrypted
+	if (tls_enabled() && !local) {
+		struct tls_pending *pending = calloc(1, sizeof(struct tls_pending));
+		if (!pending || (pending->tls = tls_accept(new_fd)) == NULL) {
+			free(pending);
+			close(new_fd);
+			return -1;
+		}
+		pending->deadline = rate_now() + TLS_HANDSHAKE_MS / 1000.0;
+		snprintf(pending->addr, sizeof pending->addr, "%s", remoteIP);
+		g_handshakes[new_fd] = pending;
+		g_handshaking++;
+		FD_SET(new_fd, master);
 		if (new_fd > *fdmax) {
-			*fdmax = new_fd; // keep track of the max
+			*fdmax = new_fd;
 		}
-		inet_ntop(their_addr.ss_family,
-				get_in_addr((struct sockaddr *)&their_addr),
-				remoteIP, sizeof remoteIP);
-		printf("selectserver: new connection from %s on "
-			   "socket %d\n", remoteIP, new_fd);
+		return continue_handshake(new_fd, fdmax, master); // the hello may be in already
+	}
+
+	// Acks client and increment current index
+	return ack_connection(new_fd, remoteIP, NULL, fdmax, master, clients, bitmap);
+}
+
+/* keeps the largest accept batch and logs it */
+void account_batch(unsigned long batch, int admitted) {
+	if (batch > g_accept_stats.max_batch) {
+		g_accept_stats.max_batch = batch;
+	}
+	if (batch != 0) {
+		printf("selectserver: %d new connections, %lu refused\n", admitted, batch - admitted);
+	}
+}
+
+/* accepts pending connections until the backlog is drained,
+ * return the number of clients admitted */
+int handle_new_connection(int sockfd, int *fdmax, fd_set *master,
+		struct client_info *clients [], struct slot_set *bitmap) {
+    int new_fd;
+	socklen_t addrlen;
+	struct sockaddr_storage their_addr; // connector's address information
+	unsigned long batch = 0;
+	int admitted = 0;
+
+	g_accept_stats.wakeups++;
+	while (1) {
+		addrlen = sizeof their_addr;
+		new_fd = accept4(sockfd, (struct sockaddr *)&their_addr,
+						&addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (new_fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			if ((errno == EMFILE || errno == ENFILE) && g_spare_fd != -1) {
+				if (shed_connection(sockfd) == -1) {
+					break; // accept4 reports EMFILE even with nothing pending
+				}
+				batch++;
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				perror("accept() fails");
+				g_accept_stats.errors++;
+			}
+			break; // backlog drained
+		}
+		batch++;
+		if (admit_connection(new_fd, &their_addr, fdmax, master, clients, bitmap) == 0) {
+			admitted++;
+		}
+	}
+	account_batch(batch, admitted);
+	return admitted;
+}
+
+/* give a new session a fresh scrollback and a transcript id, shared by the
+ * partners on this node */
+void open_channel(struct client_info *client, struct client_info *partner) {
+	scrollback_release(client->history);
+	client->history = scrollback_new();
+	client->session = transcript_session();
+	client->channel_bytes = 0;
+	if (partner->node == -1) {
+		scrollback_release(partner->history);
+		partner->history = scrollback_hold(client->history);
+		partner->session = client->session;
+		partner->channel_bytes = 0;
+	}
+	g_counters.pairings++;
+	transcript_add(TR_OPEN, client->session, client->name, partner->name, strlen(partner->name));
+}
+
+/* replays the last lines of the client's channel in one write */
+void handle_history(struct client_info *client, const char *count) {
+	unsigned char lines[SCROLLBACK_BYTES];
+	struct iovec line[SCROLLBACK_REPLAY_MAX];
+	int n = *count ? atoi(count) : SCROLLBACK_REPLAY;
 
-		// Acks client and increment current index
-		return send_ack(new_fd, clients, bitmap);
+	if (n > SCROLLBACK_REPLAY_MAX) {
+		n = SCROLLBACK_REPLAY_MAX;
+	}
+	if ((n = scrollback_copy(client->history, n, lines, line)) == 0) {
+		if (send_msg(client, "No chat history") == -1) {
+			perror("send history fails");
+		}
+		return;
+	}
+	if (frame_send_batch(client->stream, line, n) == -1) {
+		perror("send history fails");
 	}
 }
 
 /* handler for chat requests */
 struct client_info * handle_chat_request(int sockfd, fd_set *master,
-		struct client_info *clients [], fd_set *bitmap)
+		struct client_info *clients [], struct slot_set *bitmap, char *tags[], int tag_count)
 {
 	char buf[BUF_MAX]; // buffer for client data
 	struct client_info *client;
 	struct client_info *partner;
 
-	// find a random partner and connect with the client who send the quest
-	client = find_partner(sockfd, clients, bitmap);
+	// find a random partner, or one sharing a tag, and connect with the client who send the quest
+	client = find_partner(sockfd, clients, bitmap, tags, tag_count);
 	if (!client) {
 		return NULL;
 	}
-	partner = clients[client->partner_index];
+	partner = clients[g_table.partner[client->slot]];
+	TRACE(chat_request, g_table.sockfd[client->slot], client->name, g_table.state[client->slot], 0);
+	open_channel(client, partner);
 	// send IN_SESSION message to both clients
 	memset(&buf, 0, BUF_MAX);
 	sprintf(buf, "%s:%s", MSG_IN_SESSION, partner->name);
-	if (FD_ISSET(client->sockfd, master)) {
-		if (send(client->sockfd, buf, strlen(buf), 0) == -1) {
+	if (FD_ISSET(g_table.sockfd[client->slot], master)) {
+		if (send_msg(client, buf) == -1) {
 			perror("send IN_SESSION fails");
 			return NULL;
 		}
 	}
-	client->state = CHATTING;
+	set_state(client, CHATTING);
 	memset(&buf, 0, BUF_MAX);
 	sprintf(buf, "%s:%s", MSG_IN_SESSION, client->name);
-	if (FD_ISSET(partner->sockfd, master)) {
-		if (send(partner->sockfd, buf, strlen(buf), 0) == -1) {
+	if (FD_ISSET(g_table.sockfd[partner->slot], master)) {
+		if (send_msg(partner, buf) == -1) {
 			perror("send IN_SESSION fails");
 			return NULL;
 		}
 	}
-	partner->state = CHATTING;
+	set_state(partner, CHATTING);
 	return partner;
 }
 
-/* handler for transfering files */
-void handle_transfer(const char * file_name, struct client_info *client, struct client_info *partner) {
+/* handler for transfering files, size is NULL from clients that do not announce it */
+void handle_transfer(const char * file_name, const char *size, struct client_info *client, struct client_info *partner) {
 
 	char buf[BUF_MAX];
-	sprintf(buf, "%s:%s", MSG_RECEIVING_FILE, file_name);
-	if (send(partner->sockfd, buf, sizeof(buf), 0) == -1) {
+	TRACE(transfer, g_table.sockfd[client->slot], client->name, g_table.state[client->slot], 0);
+	if (size) {
+		snprintf(buf, sizeof(buf), "%s:%s:%s", MSG_RECEIVING_FILE, file_name, size);
+	} else {
+		snprintf(buf, sizeof(buf), "%s:%s", MSG_RECEIVING_FILE, file_name);
+	}
+	if (send_msg(partner, buf) == -1) {
 		perror("send receiving file fails");
 		return;
 	}
 
-	if (send(client->sockfd, MSG_TRANSFER_ACK, sizeof(MSG_TRANSFER_ACK), 0) == -1) {
+	if (send_msg(client, MSG_TRANSFER_ACK) == -1) {
 		perror("send reponse ack fails");
 		return;
 	}
-	client->state = TRANSFERING;
-	partner->state = TRANSFERING;
+	set_state(client, TRANSFERING);
+	set_state(partner, TRANSFERING);
 }
 
 /* handler for the help command */
 void handle_help(struct client_info *client) {
 	char buf[512];
 	sprintf(buf, "%-10s - connect to TRS server.\n"
-			"%-10s - chat with a random client in the common chat channel.\n"
+			"%-10s - chat with a random client, or one sharing a tag: /chat [tag...]\n"
 			"%-10s - transfer file to current chatting partner.\n"
 			"%-10s - report to TRS server current chatting partner is misbehaving\n"
 			"%-10s - print help information.\n"
+			"%-10s - replay the last n lines of the channel.\n"
 			"%-10s - quit current channel.\n"
 			"%-10s - quit client.\n",
-			CONNECT, CHAT, TRANSFER, FLAG, HELP, QUIT, EXIT);
-	if (send(client->sockfd, buf, strlen(buf), 0) == -1) {
+			CONNECT, CHAT, TRANSFER, FLAG, HELP, HISTORY, QUIT, EXIT);
+	if (send_msg(client, buf) == -1) {
 		perror("send help message fails");
 	}
 }
@@ -355,40 +1130,66 @@ void print_help() {
 	printf("%-10s - kick out specific client from current channel.\n", THROWOUT);
 	printf("%-10s - block specific client from starting a chat.\n", BLOCK);
 	printf("%-10s - unblock specific client from ban list.\n", UNBLOCK);
+	printf("%-10s - print the last lines of a user's channel.\n", HISTORY);
+	printf("%-10s - live view of users, rates and the busiest channels.\n", TOP);
+	printf("%-10s - refuse connections from an address, a range or a user's address.\n", BAN);
+	printf("%-10s - lift a ban.\n", UNBAN);
+	printf("%-10s - list the bans.\n", BANS);
 	printf("%-10s - start server.\n", START);
 	printf("%-10s - stop server with a grace period.\n", END);
 	printf("%-10s - print help information.\n", HELP);
 }
 
-/* handler for a client exiting the program */
-void handle_exit(struct client_info * client,
-	struct client_info *partner, fd_set *bitmap) {
-	FD_CLR(client->partner_index, bitmap);
-	client->partner_index = -1;
-	if (!partner) {
-		partner->partner_index = -1;
+/* closes a local client and frees its slot at once, its partner is told with MSG_QUIT
+ * and goes back to the queue */
+void drop_client(int index, fd_set *master) {
+	int sockfd = g_table.sockfd[index];
+	int other = g_table.partner[index];
+
+	if (other >= 0) {
+		struct client_info *partner = g_clients[other];
+		if (g_table.state[other] == TRANSFERING) {
+			bulk_queue_clear(partner->bulk); // the rest of the file is not coming
+		}
+		g_table.partner[other] = -1;
+		set_state(partner, CONNECTING);
+		if (send_msg(partner, MSG_QUIT) == -1) {
+			perror("quit channel fails");
+		}
 	}
-	free(client);
+	close_socket(sockfd);
+	FD_CLR(sockfd, master);
+	release_slot(index);
+}
+
+/* handler for a client exiting the program, a partner goes back to the queue */
+void handle_exit(struct client_info *client, fd_set *master) {
+	printf("%s exits\n", client->name);
+	drop_client(client->slot, master);
 }
 
 /* handler for the client quitting the current chat channel */
 void handle_quit(struct client_info *client, struct client_info *partner) {
-	partner->partner_index = -1;
-	client->partner_index = -1;
-	client->state = CONNECTING;
-	partner->state = CONNECTING;
-	if (send(partner->sockfd, MSG_QUIT, sizeof(MSG_QUIT), 0) == -1) {
+	g_table.partner[partner->slot] = -1;
+	g_table.partner[client->slot] = -1;
+	set_state(client, CONNECTING);
+	set_state(partner, CONNECTING);
+	if (send_msg(partner, MSG_QUIT) == -1) {
 		perror("quit channel fails");
 	}
-	if (send(client->sockfd, MSG_QUIT, sizeof(MSG_QUIT), 0) == -1) {
+	if (send_msg(client, MSG_QUIT) == -1) {
 		perror("quit channel fails");
 	}
 }
 
 void handle_flag(struct client_info * partner) {
-	partner->flag++;
+	int flags = mod_add_flag(partner->addr);
+	if (partner->flag == 0 && partner->node == -1) {
+		g_counters.flagged++;
+	}
+	partner->flag = flags == -1 ? partner->flag + 1 : flags;
 	char msg[] = "Your partner reported your misbehaving to the server";
-	if (send(partner->sockfd, msg, strlen(msg), 0) == -1) {
+	if (send_msg(partner, msg) == -1) {
 		perror("quit channel fails");
 	}
 }
@@ -396,11 +1197,14 @@ void handle_flag(struct client_info * partner) {
 /* write stat to a file */
 void handle_stat() {
 	int i;
-	int client_num = 0; /* number of clients in chat queue*/
-	int chatter_num = 0; /* number of clients chatting currently */
-	int total_flag = 0; /* total number of users flagged chatting partner */
-	struct client_info *client;
-	char status[30];
+	unsigned long long payload = 0; /* bytes sent to clients before compression */
+	unsigned long long wire = 0; /* bytes sent to clients on the wire */
+	int paused_num = 0; /* clients whose socket is not read right now */
+	int waiting, tags; /* users waiting on interest tags and the distinct tags */
+	struct wait_stats wait;
+	double now = rate_now();
+	unsigned long total = g_accept_stats.accepted + g_accept_stats.rejected + g_accept_stats.banned;
+	struct client_info *client, *partner;
 
 	FILE *fp = fopen(STAT_FILEPATH, "w");
 	if (!fp) {
@@ -408,157 +1212,542 @@ void handle_stat() {
 		return;
 	}
 
-	for (i = 0; i < CLIENT_MAX; i++) {
-		if (FD_ISSET(i, &g_bitmap)) {
-			client = g_clients[i];
-
-			client_num++;
-			if (client->partner_index != -1) {
-				chatter_num++;
-			}
-			if (client->flag != 0) {
-				total_flag++;
-			}
+	/* kept up to date by every transition, no scan needed */
+	fprintf(fp, "Number of clients in chat queue: %ld\n"
+			"Number of clients waiting for a partner: %ld\n"
+			"Number of clients chatting currently: %ld\n"
+			"Total number of users flagged chatting partner: %ld\n"
+			"Forwarded: %llu messages, %llu bytes in %lu pairings\n",
+			g_counters.state[CONNECTING] + g_counters.state[CHATTING] + g_counters.state[TRANSFERING],
+			g_counters.state[CONNECTING],
+			g_counters.state[CHATTING] + g_counters.state[TRANSFERING],
+			g_counters.flagged, g_counters.messages, g_counters.bytes, g_counters.pairings);
+
+	/* one pass for what has to be listed per user and channel */
+	SLOT_SET_FOREACH(i, &g_bitmap) {
+		if (g_table.flags[i] & CLIENT_F_REMOTE) {
+			continue; /* a proxy is listed by its own node */
+		}
+		client = g_clients[i];
+		payload += client->stream->payload_out;
+		wire += client->stream->wire_out;
+		if (client->limit->paused_until != 0) {
+			paused_num++;
 		}
+		partner = g_table.partner[client->slot] >= 0 ? g_clients[g_table.partner[client->slot]] : NULL;
+		if (client->flag != 0) {
+			fprintf(fp, "%s: receive %d flag, %s%s\n", client->name, client->flag,
+					partner ? "chatting with " : "not chatting", partner ? partner->name : "");
+		}
+		if (client->limit->pauses != 0) {
+			fprintf(fp, "%s: throttled %lu times\n", client->name, client->limit->pauses);
+		}
+		/* a local pair is listed once, by the partner in the lower slot */
+		if (partner && (partner->node != -1 || i < g_table.partner[client->slot])) {
+			fprintf(fp, "Channel %s - %s: %llu bytes\n", client->name, partner->name,
+					client->channel_bytes);
+		}
+	}
+
+	int ret = fprintf(fp, "Egress: %llu bytes of messages sent as %llu bytes on the wire\n"
+			"Rate limit: %d clients throttled now, %lu pauses and %lu disconnects in total\n"
+			"Accept: %lu admitted, %lu refused over capacity, %lu banned, %lu errors, %lu wakeups, "
+			"largest batch %lu, %.1f connections/s since last stats\n",
+			payload, wire,
+			paused_num, g_rate_stats.pauses, g_rate_stats.kicks,
+			g_accept_stats.accepted, g_accept_stats.rejected, g_accept_stats.banned, g_accept_stats.errors,
+			g_accept_stats.wakeups, g_accept_stats.max_batch,
+			(total - g_accept_stats.last_total) / (now - g_accept_stats.last_time));
+	g_accept_stats.last_total = total;
+	g_accept_stats.last_time = now;
+	fprintf(fp, "Heartbeat: %d seconds, %lu pings, %lu dead peers dropped, %lu hang-ups reclaimed\n",
+			g_heartbeat, g_heartbeat_stats.pings, g_heartbeat_stats.dead, g_heartbeat_stats.hangups);
+	wait_queue_stats(&wait, now);
+	fprintf(fp, "Wait queue: %d users, the longest for %.1f s; time to pair over the last %d of %lu pairs: "
+			"p50 %.3f s, p90 %.3f s, p99 %.3f s, max %.3f s\n",
+			wait.queued, wait.longest, wait.samples, wait.pairs, wait.p50, wait.p90, wait.p99, wait.max);
+	waiting = tag_index_count(&tags);
+	fprintf(fp, "Tags: %d users waiting on %d tags, %lu pairs shared a tag, %lu waits fell back to random\n",
+			waiting, tags, g_tag_stats.matched, g_tag_stats.fell_back);
+	if (tls_enabled()) {
+		fprintf(fp, "TLS: %lu handshakes, %lu resumed, %lu failed, kTLS on %lu sending and %lu receiving\n",
+				g_tls_stats.handshakes, g_tls_stats.resumed, g_tls_stats.failures,
+				g_tls_stats.ktls_tx, g_tls_stats.ktls_rx);
+	}
+	if (g_transcript) {
+		fprintf(fp, "Transcript: %lu records, %lu dropped, %llu bytes in %lu commits, "
+				"largest batch %lu, slowest commit %.1f ms, segment %u\n",
+				g_transcript_stats.records, g_transcript_stats.dropped, g_transcript_stats.bytes,
+				g_transcript_stats.commits, g_transcript_stats.max_batch,
+				g_transcript_stats.max_commit_ms, g_transcript_stats.segment);
+	}
+	if (g_record_path) {
+		fprintf(fp, "Recording: %lu records, %llu bytes to %s%s\n", g_wiretrace_stats.records,
+				g_wiretrace_stats.bytes, g_record_path, wiretrace_active() ? "" : ", stopped");
+	}
+	fprintf(fp, "File data: %llu bytes in %lu frames over %lu scheduler rounds, %lu waits for a full socket, "
+			"%lu senders held, deepest queue %zu bytes\n",
+			g_bulk_stats.bytes, g_bulk_stats.frames, g_bulk_stats.rounds, g_bulk_stats.outq_waits,
+			g_bulk_stats.holds, g_bulk_stats.max_queued);
+	fprintf(fp, "Scrollback: %lu channels, %lu bytes (%d per channel), %lu lines kept, %lu pushed out\n",
+			g_scrollback_stats.channels, g_scrollback_stats.channels * sizeof(struct scrollback),
+			SCROLLBACK_BYTES, g_scrollback_stats.lines - g_scrollback_stats.dropped,
+			g_scrollback_stats.dropped);
+	if (g_use_uring) {
+		fprintf(fp, "I/O: io_uring, %lu recv completions, %lu io_uring_enter calls\n",
+				g_ring_recvs, g_ring.enters);
+	} else {
+		fprintf(fp, "I/O: select\n");
 	}
-	int ret = fprintf(fp, "Number of clients in chat queue: %d\n"
-			"Number of clients chatting currently: %d\n"
-			"Total number of users flagged chatting partner: %d\n",
-			client_num, chatter_num, total_flag);
-	if (ret < 0) {
+	if (ret < 0 || fclose(fp) != 0) {
 		perror("write stat file fails");
-		fclose(fp);
 		return;
 	}
+	printf("Write data to %s successfully\n", STAT_FILEPATH);
+}
 
-	for (i = 0; i < CLIENT_MAX; i++) {
-		if (FD_ISSET(i, &g_bitmap)) {
-			client = g_clients[i];
-			if (client->flag != 0) {
-				if (client->partner_index != -1) {
-					sprintf(status, "chatting with %s\n", g_clients[client->partner_index]->name);
-				} else {
-					sprintf(status, "not chatting\n");
-				}
-				if (fprintf(fp, "%s: receive %d flag, %s", client->name, client->flag, status) < 0) {
-					perror("write stat file fails");
-					fclose(fp);
-					return;
-				}
-			}
+/* refreshes counters, rates and the busiest channels every second until enter is pressed */
+void handle_top() {
+	struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+	struct server_counters last = g_counters, now;
+	struct top_table top;
+	double then = rate_now(), elapsed;
+	int tty = isatty(STDOUT_FILENO);
+	char line[BUF_MAX];
+	int i, rows, ready;
+
+	printf("Refreshing every second, press enter to stop\n");
+	while ((ready = poll(&pfd, 1, 1000)) == 0 || (ready == -1 && errno == EINTR)) {
+		now = g_counters;
+		elapsed = rate_now() - then;
+		then += elapsed;
+		if (tty) {
+			printf("\033[H\033[2J");
 		}
+		printf("users: %ld connected, %ld waiting, %ld chatting, %ld transferring, %ld flagged\n",
+				now.state[CONNECTING] + now.state[CHATTING] + now.state[TRANSFERING],
+				now.state[CONNECTING], now.state[CHATTING], now.state[TRANSFERING], now.flagged);
+		printf("rates: %.1f msgs/s, %.1f KB/s forwarded, %.1f connections/s, %.1f pairings/s\n",
+				(now.messages - last.messages) / elapsed,
+				(now.bytes - last.bytes) / 1024.0 / elapsed,
+				(now.connections - last.connections) / elapsed,
+				(now.pairings - last.pairings) / elapsed);
+		printf("busiest channels, bytes in the last second:\n");
+		rows = counters_top(&top); // one snapshot for every row
+		for (i = 0; i < rows; i++) {
+			printf("  %-24s %-24s %10llu\n", top.channel[i].names[0], top.channel[i].names[1],
+					top.channel[i].bytes);
+		}
+		fflush(stdout);
+		last = now;
+	}
+	if (!fgets(line, sizeof(line), stdin)) {
+		clearerr(stdin);
 	}
-	fclose(fp);
-	printf("Write data to %s successfully\n", STAT_FILEPATH);
 }
 
-/* kick out specific user from current channel */
-void handle_throwout(char * username) {
-	int i;
+/* ends the channel of a local client
+ * return 0 if it was chatting, otherwise -1 */
+int throwout_client(struct client_info *client) {
+	struct client_info *partner;
 
-	for (i = 0; i < CLIENT_MAX; i++) {
-		if (FD_ISSET(i, &g_bitmap)) {
-			struct client_info * client = g_clients[i];
-			if(strcmp(client->name, username) == 0) {
-				if (client->partner_index != -1) {
-					struct client_info * partner = g_clients[client->partner_index];
-
-					client->partner_index = -1;
-					client->state = CONNECTING;
-					partner->partner_index = -1;
-					partner->state = CONNECTING;
-
-					if (send(client->sockfd, MSG_BE_KICKOUT, strlen(MSG_BE_KICKOUT), 0) == -1) {
-						perror("kickout client fails");
-					}
-					if (send(partner->sockfd, MSG_PARTNER_BE_KICKOUT, strlen(MSG_PARTNER_BE_KICKOUT), 0) == -1) {
-						perror("kickout partner fails");
-					}
-				} else {
-					printf("%s is not chatting now", client->name);
-				}
-				return;
-			}
-		}
+	if (g_table.partner[client->slot] < 0) {
+		return -1;
+	}
+	partner = g_clients[g_table.partner[client->slot]];
+	g_table.partner[client->slot] = -1;
+	set_state(client, CONNECTING);
+	g_table.partner[partner->slot] = -1;
+	set_state(partner, CONNECTING);
+
+	if (send_msg(client, MSG_BE_KICKOUT) == -1) {
+		perror("kickout client fails");
+	}
+	if (send_msg(partner, MSG_PARTNER_BE_KICKOUT) == -1) {
+		perror("kickout partner fails");
 	}
-	printf("'%s' is not found in chat queue\n", username);
+	return 0;
 }
 
-/* handler for the blocking of a user */
-void handle_block(char *username) {
-	int i;
-	for (i = 0; i < CLIENT_MAX; i++) {
-		if (FD_ISSET(i, &g_bitmap)) {
-			struct client_info * client = g_clients[i];
-			if(strcmp(client->name, username) == 0) {
-				client->blocked = 1;
-				if (send(client->sockfd, MSG_BLOCK, strlen(MSG_BLOCK), 0) == -1) {
-					perror("block client fails");
-				}
-				return;
+/* blocks or unblocks a local client and tells it, the caller persists it */
+void block_client(struct client_info *client, int blocked) {
+	if (blocked) {
+		g_table.flags[client->slot] |= CLIENT_F_BLOCKED;
+	} else {
+		g_table.flags[client->slot] &= ~CLIENT_F_BLOCKED;
+		g_queue_dirty = 1;
+	}
+	if (send_msg(client, blocked ? MSG_BLOCK : MSG_UNBLOCK) == -1) {
+		perror(blocked ? "block client fails" : "unblock client fails");
+	}
+}
+
+/* kick out specific user from current channel
+ * return 0 if the user is on this node, otherwise -1 */
+int handle_throwout(char * username) {
+	int i;
+
+	SLOT_SET_FOREACH(i, &g_bitmap) {
+		struct client_info * client = g_clients[i];
+		if(client->node == -1 && strcmp(client->name, username) == 0) {
+			if (throwout_client(client) == -1) {
+				printf("%s is not chatting now", client->name);
 			}
+			return 0;
 		}
 	}
-	printf("'%s' is not found in chat queue\n", username);
+	return -1;
 }
 
-/* handler for unblocking a user */
-void handle_unblock(char *username) {
+/* handler for the blocking of a user
+ * return 0 if the user is on this node, otherwise -1 */
+int handle_block(char *username) {
 	int i;
-	for (i = 0; i < CLIENT_MAX; i++) {
-		if (FD_ISSET(i, &g_bitmap)) {
-			struct client_info * client = g_clients[i];
-			if(strcmp(client->name, username) == 0) {
-				client->blocked = 0;
-				if (send(client->sockfd, MSG_UNBLOCK, strlen(MSG_UNBLOCK), 0) == -1) {
-					perror("unblock client fails");
-				}
-				return;
+	SLOT_SET_FOREACH(i, &g_bitmap) {
+		struct client_info * client = g_clients[i];
+		if(client->node == -1 && strcmp(client->name, username) == 0) {
+			if (mod_set_blocked(client->addr, 1) == -1) {
+				printf("Block of %s is not persisted\n", client->name);
 			}
+			block_client(client, 1);
+			return 0;
 		}
 	}
-	printf("'%s' is not found in chat queue\n", username);
+	return -1;
 }
 
-/* handler for ending the TRS*/
-void handle_end(int signum)
-{
+/* handler for unblocking a user
+ * return 0 if the user is on this node, otherwise -1 */
+int handle_unblock(char *username) {
 	int i;
-	for (i = 0; i < CLIENT_MAX; i++) {
-		if (FD_ISSET(i, &g_bitmap)) {
-			struct client_info * client = g_clients[i];
-			if (send(client->sockfd, MSG_SERVER_STOP, strlen(MSG_SERVER_STOP), 0) == -1) {
-				perror("send end timer fails");
+	SLOT_SET_FOREACH(i, &g_bitmap) {
+		struct client_info * client = g_clients[i];
+		if(client->node == -1 && strcmp(client->name, username) == 0) {
+			if (mod_set_blocked(client->addr, 0) == -1) {
+				printf("Unblock of %s is not persisted\n", client->name);
 			}
-			close(client->sockfd); // close socket();
-			destroy_client(&client);
+			block_client(client, 0);
+			return 0;
+		}
+	}
+	return -1;
+}
 
+/* runs an admin command on a user, the other nodes get it if the user is not ours */
+void handle_admin(const char *cmd, char *username) {
+	char msg[BUF_MAX];
+	int ret = -1;
+
+	if (strcmp(cmd, THROWOUT) == 0) {
+		ret = handle_throwout(username);
+	} else if (strcmp(cmd, BLOCK) == 0) {
+		ret = handle_block(username);
+	} else if (strcmp(cmd, UNBLOCK) == 0) {
+		ret = handle_unblock(username);
+	}
+	if (ret == 0) {
+		return;
+	}
+	snprintf(msg, sizeof(msg), "%s:%s:%s", MSG_NODE_ADMIN, cmd, username);
+	if (cluster_broadcast(msg) > 0) {
+		printf("'%s' is not on this node, asked the other nodes\n", username);
+	} else {
+		printf("'%s' is not found in chat queue\n", username);
+	}
+}
+
+/* bans an address, a range or the address of a local user
+ * return 1 if added, 0 if it was already banned, -1 if text is none of them */
+int add_ban(const char *text) {
+	int index, ret = ban_add(text);
+
+	if (ret == -1 && (index = find_local(text)) != -1) {
+		ret = ban_add(g_clients[index]->addr);
+	}
+	return ret;
+}
+
+/* blocks the local clients whose address is now banned and ends their chats,
+ * a line per client goes to out. return how many were blocked */
+int enforce_bans(FILE *out) {
+	int i, count = 0;
+
+	SLOT_SET_FOREACH(i, &g_bitmap) {
+		struct client_info *client;
+		if ((g_table.flags[i] & (CLIENT_F_REMOTE | CLIENT_F_BLOCKED)) ||
+				!ban_check_text((client = g_clients[i])->addr)) {
+			continue;
 		}
+		throwout_client(client);
+		block_client(client, 1);
+		fprintf(out, "banned %s at %s\n", client->name, client->addr);
+		count++;
 	}
-	FD_ZERO(&g_bitmap);
-	pthread_kill(g_connector, SIGUSR1); // send a user define signal to kill thread
-	g_state = SERVER_INIT;
-	printf("Shutdown server successfully\n");
+	return count;
 }
 
-/* handler for when the server ends the TRS */
-void handle_grace_period() {
+/* applies an admin command to every local user in names or matching pattern in a
+ * single pass over the clients, streaming a line per user to the script.
+ * Names that are not here go to the other nodes like a single command. */
+void admin_bulk(struct admin_conn *conn, const char *cmd, struct name_set *names, const char *pattern) {
+	const char **keys = NULL; // addresses to persist with one append
+	int blocked = strcmp(cmd, BLOCK) == 0;
+	int nkeys = 0, applied = 0, idle = 0, asked = 0, missing = 0;
+	char msg[BUF_MAX];
+	size_t e;
 	int i;
-	char msg[] = "Server will be shutdown in 10 seconds!";
-	for (i = 0; i < CLIENT_MAX; i++) {
-		if (FD_ISSET(i, &g_bitmap)) {
-			struct client_info * client = g_clients[i];
-			if (send(client->sockfd, MSG_GRACE_PERIOD, strlen(MSG_GRACE_PERIOD), 0) == -1) {
-				perror("send grace period timer fails");
+
+	if (strcmp(cmd, THROWOUT) != 0 && (keys = malloc(CLIENT_MAX * sizeof(*keys))) == NULL) {
+		fprintf(conn->out, "error out of memory\n");
+		return;
+	}
+	SLOT_SET_FOREACH(i, &g_bitmap) {
+		struct client_info *client;
+		if (g_table.flags[i] & CLIENT_F_REMOTE) {
+			continue;
+		}
+		client = g_clients[i];
+		/* take the name off the set even when the pattern matches, so it is not sent on */
+		if (name_set_take(names, client->name) == -1 &&
+				(pattern == NULL || fnmatch(pattern, client->name, 0) != 0)) {
+			continue;
+		}
+		if (keys) {
+			block_client(client, blocked);
+			keys[nkeys++] = client->addr;
+			fprintf(conn->out, "%s %s\n", blocked ? "blocked" : "unblocked", client->name);
+		} else if (throwout_client(client) == 0) {
+			fprintf(conn->out, "thrown out %s\n", client->name);
+		} else {
+			fprintf(conn->out, "not chatting %s\n", client->name);
+			idle++;
+			continue;
+		}
+		applied++;
+	}
+	if (keys && mod_set_blocked_many(keys, nkeys, blocked) == -1) {
+		fprintf(conn->out, "warning %d changes are not persisted\n", nkeys);
+	}
+	free(keys);
+
+	for (e = 0; e < names->capacity; e++) {
+		struct name_entry *entry = &names->entries[e];
+		if (entry->name[0] == '\0' || entry->found) {
+			continue;
+		}
+		snprintf(msg, sizeof(msg), "%s:%s:%s", MSG_NODE_ADMIN, cmd, entry->name);
+		if (cluster_broadcast(msg) > 0) {
+			fprintf(conn->out, "asked other nodes %s\n", entry->name);
+			asked++;
+		} else {
+			fprintf(conn->out, "not found %s\n", entry->name);
+			missing++;
+		}
+	}
+	fprintf(conn->out, "ok %d applied, %d not chatting, %d asked other nodes, %d not found\n",
+			applied, idle, asked, missing);
+}
+
+/* adds or lifts every ban listed in args, or in the files they name,
+ * then writes the ban file once and applies the new bans to live clients */
+void admin_bans(struct admin_conn *conn, const char *cmd, char *args) {
+	char entry[BAN_TEXT_MAX + 2];
+	char *token;
+	FILE *fp;
+	int ban = strcmp(cmd, BAN) == 0;
+	int changed = 0, unchanged = 0, invalid = 0, ret;
+
+	while ((token = strsep(&args, " \t")) != NULL) {
+		if (token[0] == '\0') {
+			continue;
+		}
+		fp = NULL;
+		if (strcmp(token, "--file") == 0 && args != NULL) {
+			token = strsep(&args, " \t");
+			if ((fp = fopen(token, "r")) == NULL) {
+				fprintf(conn->out, "error %s: %s\n", token, strerror(errno));
+				continue;
+			}
+		}
+		do {
+			if (fp) {
+				if (!fgets(entry, sizeof(entry), fp)) {
+					break;
+				}
+				entry[strcspn(entry, "\r\n")] = '\0';
+				if (entry[0] == '\0') {
+					continue;
+				}
+				token = entry;
+			}
+			ret = ban ? add_ban(token) : ban_remove(token);
+			if (ret == 1) {
+				changed++;
+			} else if (ret == 0) {
+				unchanged++;
+			} else {
+				fprintf(conn->out, "invalid %s\n", token);
+				invalid++;
+			}
+		} while (fp);
+		if (fp) {
+			fclose(fp);
+		}
+	}
+	if (changed > 0 && ban_save() == -1) {
+		fprintf(conn->out, "warning bans are not persisted\n");
+	}
+	if (ban) {
+		ret = enforce_bans(conn->out);
+		fprintf(conn->out, "ok %d banned, %d already banned, %d invalid, %d clients blocked\n",
+				changed, unchanged, invalid, ret);
+	} else {
+		fprintf(conn->out, "ok %d lifted, %d not banned, %d invalid\n", changed, unchanged, invalid);
+	}
+}
+
+/* runs one line of an admin script, e.g.
+ *     /block user_1 user_2 --file more_users.txt
+ *     /throwout --match 'guest_*'
+ * return 0 if the results reached the script, otherwise -1 */
+int handle_admin_line(struct admin_conn *conn, char *line) {
+	struct name_set names;
+	char *cmd, *token, *pattern = NULL;
+	int loaded;
+
+	while ((cmd = strsep(&line, " \t")) != NULL && cmd[0] == '\0');
+	if (cmd == NULL) {
+		return 0; // blank line
+	}
+	if (strcmp(cmd, BLOCK) == 0 || strcmp(cmd, UNBLOCK) == 0 || strcmp(cmd, THROWOUT) == 0) {
+		if (name_set_init(&names) == -1) {
+			fprintf(conn->out, "error out of memory\n");
+			return fflush(conn->out) == 0 ? 0 : -1;
+		}
+		while ((token = strsep(&line, " \t")) != NULL) {
+			if (token[0] == '\0') {
+				continue;
+			} else if (strcmp(token, "--match") == 0 && line != NULL) {
+				pattern = strsep(&line, " \t");
+			} else if (strcmp(token, "--file") == 0 && line != NULL) {
+				token = strsep(&line, " \t");
+				if ((loaded = name_set_load(&names, token)) == -1) {
+					fprintf(conn->out, "error %s: %s\n", token, strerror(errno));
+					break;
+				}
+				fprintf(conn->out, "read %d names from %s\n", loaded, token);
+			} else if (name_set_add(&names, token) == -1) {
+				fprintf(conn->out, "error '%s' is not a user name\n", token);
+				break;
 			}
 		}
+		if (token != NULL) {
+			fprintf(conn->out, "error %s was not run\n", cmd);
+		} else if (names.count == 0 && pattern == NULL) {
+			fprintf(conn->out, "error usage: %s [username ...] [--file path] [--match pattern]\n", cmd);
+		} else {
+			admin_bulk(conn, cmd, &names, pattern);
+		}
+		name_set_free(&names);
+	} else if (strcmp(cmd, BAN) == 0 || strcmp(cmd, UNBAN) == 0) {
+		admin_bans(conn, cmd, line);
+	} else if (strcmp(cmd, BANS) == 0) {
+		fprintf(conn->out, "ok %d bans\n", ban_list(conn->out));
+	} else if (strcmp(cmd, STATS) == 0) {
+		handle_stat();
+		fprintf(conn->out, "ok wrote %s\n", STAT_FILEPATH);
+	} else if (strcmp(cmd, HELP) == 0) {
+		fprintf(conn->out, "%s|%s|%s [username ...] [--file path] [--match pattern]\n"
+				"%s|%s [address|address/len|username ...] [--file path]\n%s\n%s\nok\n",
+				BLOCK, UNBLOCK, THROWOUT, BAN, UNBAN, BANS, STATS);
+	} else {
+		fprintf(conn->out, "error %s: command not found\n", cmd);
+	}
+	return fflush(conn->out) == 0 ? 0 : -1;
+}
+
+/* handler for /ban and /unban typed by the admin */
+void handle_ban(const char *cmd, const char *text) {
+	int ret = strcmp(cmd, BAN) == 0 ? add_ban(text) : ban_remove(text);
+
+	if (ret == -1) {
+		printf("'%s' is not an address, a range or a user on this node\n", text);
+		return;
+	}
+	if (ret == 0) {
+		printf("'%s' is %s\n", text, strcmp(cmd, BAN) == 0 ? "already banned" : "not banned");
+		return;
+	}
+	if (ban_save() == -1) {
+		printf("Bans are not persisted\n");
+	}
+	if (strcmp(cmd, BAN) == 0) {
+		enforce_bans(stdout);
+	}
+	printf("%s '%s'\n", strcmp(cmd, BAN) == 0 ? "Banned" : "Lifted the ban of", text);
+}
+
+/* wakes the event loop from the admin thread or a signal handler */
+void wake_loop() {
+	if (g_wake_fd[1] != -1 && write(g_wake_fd[1], "", 1) == -1 && errno != EAGAIN) {
+		perror("wake event loop fails");
+	}
+}
+
+/* starts a notice to every local client, the event loop writes it as sockets have room */
+void broadcast_local(const char *msg) {
+	struct frame_stream *streams[CLIENT_MAX];
+	struct slot_set to;
+	int i;
+
+	slot_set_zero(&to);
+	SLOT_SET_FOREACH(i, &g_bitmap) {
+		if (!(g_table.flags[i] & CLIENT_F_REMOTE)) { // remote users keep their own server
+			slot_set_add(&to, i);
+			streams[i] = g_clients[i]->stream;
+		}
+	}
+	if (broadcast_start(msg, &to, streams) == -1) {
+		perror("broadcast fails");
+	}
+	wake_loop();
+}
+
+/* handler for ending the TRS, the clients were sent the stop notice */
+void handle_end()
+{
+	int i;
+	SLOT_SET_FOREACH(i, &g_bitmap) {
+		struct client_info * client = g_clients[i];
+		if (client->node == -1) {
+			close_socket(g_table.sockfd[client->slot]); // close socket();
+		}
+		destroy_client(&client);
+
 	}
+	slot_set_zero(&g_bitmap);
+	mod_close();
+	ban_close();
+	transcript_close();
+	wiretrace_close();
+	pthread_kill(g_connector, SIGUSR1); // send a user define signal to kill thread
+	g_state = SERVER_INIT;
+	printf("Shutdown server successfully\n");
+}
 
+/* the grace period is over, the event loop stops the server */
+void grace_timeout(int signum) {
+	g_grace_over = 1;
+	wake_loop();
+}
+
+/* handler for when the server ends the TRS */
+void handle_grace_period() {
 	struct itimerval timer;
 	struct sigaction sa;
 	/* Install timer_handler as the signal handler for SIGVTALRM. */
 	memset (&sa, 0, sizeof (sa));
-	sa.sa_handler = &handle_end;
+	sa.sa_handler = &grace_timeout;
 	sigaction (SIGALRM, &sa, NULL);
 
 	/* Configure the timer to expire after 10 second... */
@@ -571,34 +1760,63 @@ void handle_grace_period() {
 		return;
 	}
 	g_state = GRACE_PERIOD;
+	broadcast_local(MSG_GRACE_PERIOD); // after the state, the loop then picks it up
 	printf("Server will be shutdown in %d seconds!\n", GRACE_PERIOD_SECONDS);
 }
 
 /* forwards a message from the server to the partner */
-int forward_message(struct client_info *partner, char *buf) {
-	// forwarding packet from client to partner
-	if (send_all_packets(partner->sockfd, buf, BUF_MAX) == -1) {
+int forward_message(struct client_info *partner, char *buf, int len) {
+	// forwarding packet from client to partner, recompressed for its stream
+	TRACE(forward, g_table.sockfd[partner->slot], partner->name, g_table.state[partner->slot], len);
+	if (send_to(partner, buf, len) == -1) {
 		perror("forward_chat_message");
 		return -1;
 	}
-	printf("send '%s' to %s[socket %d]\n", buf, partner->name, partner->sockfd);
+	printf("send '%s' to %s[socket %d]\n", buf, partner->name, g_table.sockfd[partner->slot]);
 	return 0;
 }
 
-/* Helper function */
-int send_all_packets(int socket, void *buffer, size_t length)
-{
-    char *ptr = (char*) buffer;
-    while (length > 0)
-    {
-        int i = send(socket, ptr, length, 0);
-        if (i < 1) {
-        	return -1;
-        }
-        ptr += i;
-        length -= i;
-    }
-    return 0;
+/* counts a message from one partner to the other in the channel's bytes,
+ * which both local partners carry */
+void count_forward(struct client_info *from, struct client_info *to, size_t len) {
+	struct client_info *local = from->node == -1 ? from : to;
+
+	from->channel_bytes += len;
+	to->channel_bytes += len;
+	counters_forward(local->session, from->name, to->name, len);
+}
+
+/* file data from a sender, queued for the scheduler behind the partner's chat.
+ * a sender is not read while its partner has too much queued */
+/* return the file data bytes waiting to reach partner, its queue or its node link */
+size_t bulk_backlog(struct client_info *partner) {
+	return partner->node != -1 ? cluster_backlog(partner->node) : bulk_pending(partner->bulk);
+}
+
+void handle_bulk(struct client_info *client, fd_set *master, char *buf, int len) {
+	struct client_info *partner;
+
+	if (g_table.state[client->slot] != TRANSFERING || g_table.partner[client->slot] < 0) {
+		return; // left over from a transfer that ended
+	}
+	partner = g_clients[g_table.partner[client->slot]];
+	count_forward(client, partner, len);
+	TRACE(forward, g_table.sockfd[partner->slot], partner->name, g_table.state[partner->slot], len);
+	if (partner->node != -1) {
+		// the partner's node schedules it
+		if (cluster_relay_flags(partner->node, partner->name, buf, len, FRAME_F_BULK) == -1) {
+			perror("relay file data fails");
+			return;
+		}
+	} else if (bulk_enqueue(partner->bulk, buf, len, FRAME_F_BULK) == -1) {
+		perror("queue file data fails");
+		return;
+	}
+	if (bulk_backlog(partner) >= BULK_QUEUE_MAX) {
+		g_table.flags[client->slot] |= CLIENT_F_HELD;
+		g_bulk_stats.holds++;
+		FD_CLR(g_table.sockfd[client->slot], master);
+	}
 }
 
 /* sends the file the sockfd, input file */
@@ -653,8 +1871,8 @@ int send_file(int sockfd, const char * input_file) {
 
 /* handler for file transfer completion */
 void handle_transfer_complete(struct client_info *client, struct client_info *partner) {
-	partner->state = CHATTING;
-	client->state = CHATTING;
+	set_state(partner, CHATTING);
+	set_state(client, CHATTING);
 }
 
 /* kills a current thread */
@@ -666,203 +1884,861 @@ void kill_thread(int signum) {
 		}
 	}
 	FD_ZERO(&g_master);
+	admin_close_all(g_admin_fd);
+	g_admin_fd = -1;
 	pthread_exit(NULL);
 }
 
+/* SIGINT, only wakes the event loop, which tells the clients and exits */
 void exit_server(int signum) {
-	int i;
-	for (i = 0; i < CLIENT_MAX; i++) {
-		if (FD_ISSET(i, &g_bitmap)) {
-			struct client_info *client = g_clients[i];
-			if (client->state > INIT) {
-				printf("send exit_server to %s\n", client->name);
-				if (send(client->sockfd, MSG_SERVER_SHUTDOWN, strlen(MSG_SERVER_SHUTDOWN), 0) == -1) {
-					perror("notify client fails");
-				}
-			}
-		}
-	}
-	printf("exit_server\n");
-	exit(1);
+	int saved = errno;
+
+	g_interrupted = 1;
+	wake_loop();
+	errno = saved;
 }
 
-/* main loop to be executed, handles the state transition */
-void * main_loop(void * arg) {
-    int listener_fd;
-	int fdmax;
-	fd_set master;   // master file descriptor list
-	fd_set read_fds; // tmp file descriptor list for select
-	int i, j;
-	pthread_t connector, receiver;
+/* handler for the codec a client picked from the ones advertised in the ack */
+void handle_compress(struct client_info *client, const char *codec) {
+	if (strcmp(codec, CODEC_LZ_NAME) != 0) {
+		printf("%s asks for unknown codec '%s'\n", client->name, codec);
+		return;
+	}
+	if (frame_set_codec(client->stream, CODEC_LZ) == -1) {
+		perror("enable compression fails");
+	}
+}
 
-	FD_ZERO(&master);    // clear the master and temp sets
-	FD_ZERO(&read_fds);
-	FD_ZERO(&g_bitmap);
+/* dispatches one message from a client according to its state */
+void handle_message(struct client_info *client, fd_set *master, char *buf, int len) {
+	char *token;
+	char *params[PARAMS_MAX];
+	int count = 0;
+	char *line = strdup(buf);
+	char *cursor = line;
 
-    // create socket and listen on it
-	listener_fd = setup();
+	while (count < PARAMS_MAX && (token = strsep(&cursor, ":")) != NULL) {
+		params[count] = token;
+		count++;
+	}
 
-	g_state = SERVER_RUNNING;
+	/* handle help first */
+	if (strcmp(params[0], HELP) == 0) {
+		print_help();
+		free(line);
+		return;
+	}
 
-    // add the listener to the g_master set
-    FD_SET(listener_fd, &master);
+	switch (g_table.state[client->slot]) {
+	case INIT:
+		break;
+	case CONNECTING:
+		if (strcmp(params[0], EXIT) == 0) {
+			handle_exit(client, master);
+		} else if (strcmp(params[0], MSG_HELP) == 0) {
+			handle_help(client);
+		} else if (strcmp(params[0], MSG_COMPRESS) == 0) {
+			handle_compress(client, count > 1 ? params[1] : "");
+		} else if (strcmp(params[0], MSG_HISTORY) == 0) {
+			handle_history(client, count > 1 ? params[1] : "");
+		} else if (strcmp(params[0], MSG_CHAT_REQUEST) == 0) {
+			// if client request to chat, server will allocate a partner first
+			rate_charge(client->limit, RATE_CHAT, 1, rate_now());
+			handle_chat_request(g_table.sockfd[client->slot], master, g_clients, &g_bitmap, params + 1, count - 1);
+		}
+		break;
+	case CHATTING:
+	{
+		struct client_info *partner = g_clients[g_table.partner[client->slot]];
+		if (strcmp(params[0], EXIT) == 0) {
+			handle_exit(client, master);
+		} else if (strcmp(params[0], QUIT) == 0) {
+			handle_quit(client, partner);
+		} else if (strcmp(params[0], MSG_HELP) == 0) {
+			handle_help(client);
+		} else if (strcmp(params[0], MSG_FLAG) == 0){
+			rate_charge(client->limit, RATE_FLAG, 1, rate_now());
+			transcript_add(TR_FLAG, client->session, client->name, partner->name, strlen(partner->name));
+			handle_flag(partner);
+		} else if (strcmp(params[0], MSG_SENDING_FILE) == 0 && count > 1) {
+			handle_transfer(params[1], count > 2 ? params[2] : NULL, client, partner);
+		} else if (strcmp(params[0], MSG_HISTORY) == 0) {
+			handle_history(client, count > 1 ? params[1] : "");
+		} else if (strcmp(params[0], MSG_COMPRESS) == 0) {
+			// a queued user is paired as soon as it connects, before its codec request comes in
+			handle_compress(client, count > 1 ? params[1] : "");
+		} else {
+			scrollback_add(client->history, client->name, buf, len);
+			transcript_add(TR_MSG, client->session, client->name, buf, len);
+			count_forward(client, partner, len);
+			forward_message(partner, buf, len);
+		}
+		break;
+	}
+	case TRANSFERING:
+	{
+		struct client_info *partner = g_clients[g_table.partner[client->slot]];
+		if (strcmp(params[0], MSG_RECEIVE_SUCCESS) == 0) {
+			handle_transfer_complete(client, partner);
+		} else if (strcmp(params[0], MSG_HELP) == 0) {
+			handle_help(client);
+		} else if (strcmp(params[0], MSG_HISTORY) == 0) {
+			handle_history(client, count > 1 ? params[1] : "");
+		} else if (strcmp(params[0], QUIT) == 0) {
+			bulk_queue_clear(partner->bulk);
+			bulk_queue_clear(client->bulk);
+			handle_quit(client, partner);
+		} else if (strcmp(params[0], MSG_TRANSFER_COMPLETE) == 0 && bulk_pending(partner->bulk) > 0) {
+			// must not overtake the file data
+			bulk_enqueue(partner->bulk, buf, len, 0);
+		} else {
+			// chat goes ahead of the file data
+			if (strncmp(buf, "##", 2) != 0) {
+				scrollback_add(client->history, client->name, buf, len);
+				transcript_add(TR_MSG, client->session, client->name, buf, len);
+			}
+			count_forward(client, partner, len);
+			forward_message(partner, buf, len);
+		}
+		break;
+	}
+	default:
+		break;
+	}
+	free(line);
+}
 
-	// keep track of the biggest file descriptor
-	fdmax = listener_fd;
+/* prints the last lines of a local user's channel, e.g. to look into a flag */
+void print_history(const char *username, int n) {
+	unsigned char lines[SCROLLBACK_BYTES];
+	struct iovec line[SCROLLBACK_REPLAY_MAX];
+	int i = find_local(username);
 
-	struct sigaction sa;
-	/* Install timer_handler as the signal handler for SIGVTALRM. */
-	memset (&sa, 0, sizeof (sa));
-	sa.sa_handler = &exit_server;
-	sigaction (SIGINT, &sa, NULL);
+	if (i == -1) {
+		printf("'%s' is not found in chat queue\n", username);
+		return;
+	}
+	if (n > SCROLLBACK_REPLAY_MAX) {
+		n = SCROLLBACK_REPLAY_MAX;
+	}
+	n = scrollback_copy(g_clients[i]->history, n, lines, line);
+	printf("last %d lines of %s's channel:\n", n, username);
+	for (i = 0; i < n; i++) {
+		printf("  %.*s\n", (int)line[i].iov_len, (char *)line[i].iov_base);
+	}
+}
 
-	while(1) {  
-	    read_fds = master; // copy it
-		if (select(fdmax + 1, &read_fds, NULL, NULL, NULL) == -1 ) {
-            perror("select() fails");
-			exit(4);
-		}
+/* pairs a local user with the proxy of a remote user */
+void start_remote_session(int index, int proxy_index) {
+	char buf[BUF_MAX];
+	struct client_info *client = g_clients[index];
+	struct client_info *proxy = g_clients[proxy_index];
+
+	g_table.partner[client->slot] = proxy_index;
+	g_table.partner[proxy->slot] = index;
+	set_state(client, CHATTING);
+	open_channel(client, proxy);
+	sprintf(buf, "%s:%s", MSG_IN_SESSION, proxy->name);
+	if (send_msg(client, buf) == -1) {
+		perror("send IN_SESSION fails");
+	}
+}
 
-		// run through the existing connections looking for data to read
-		for (i = 0; i <= fdmax; i++) {
-            if (FD_ISSET(i, &read_fds)) {
-                if (i == listener_fd) {
-                	// getting new incoming connection
-                	handle_new_connection(listener_fd, &fdmax, &master, g_clients, &g_bitmap);
-				} else {
-					// handling data from client
-					struct client_info * client;
-					for (j = 0; j < CLIENT_MAX; j++) {
-						if (FD_ISSET(j, &g_bitmap)) {
-							if (i == g_clients[j]->sockfd) {
-								client = g_clients[j];
-								break;
-							}
-						}
-					}
+/* the node at link asks to pair our user target with its user requester */
+void handle_node_pair(int link, char *target, char *requester, char *addr) {
+	char msg[BUF_MAX];
+	int index = find_local(target);
+	int proxy_index = -1;
+	struct client_info *client = index == -1 ? NULL : g_clients[index];
 
-					int nbytes;
-				    char *buf = malloc(BUF_MAX + 1); // buffer for client data
-					if ((nbytes = recv(i, buf, BUF_MAX, 0)) <= 0) {
-						// got error or connection closed by client
-						if (nbytes == 0) {
-							// connection closed
-							printf("selectserver: socket %d hung up\n", i);
-						} else {
-							perror("recv() client data fails");
-						}
-						close(i); // bye!
-						FD_CLR(i, &master); // remove from g_master set
-						continue;
-					} else {
-						buf[nbytes + 1] = '\0';
-						printf("receive '%s' from %s[socket %d]\n", buf, client->name, client->sockfd);
+	if (client && g_table.partner[client->slot] == -1 && g_table.state[client->slot] == CONNECTING &&
+			!(g_table.flags[client->slot] & CLIENT_F_BLOCKED) && !tag_index_waiting(client->slot)) {
+		proxy_index = create_proxy(link, requester, addr);
+	}
+	if (proxy_index == -1) {
+		sprintf(msg, "%s:%s", MSG_NODE_PAIR_FAIL, requester);
+		cluster_send(link, msg);
+		return;
+	}
+	start_remote_session(index, proxy_index);
+	sprintf(msg, "%s:%s:%s:%s", MSG_NODE_PAIR_OK, requester, target, client->addr);
+	cluster_send(link, msg);
+}
 
-						char *token;
-						char *params[PARAMS_MAX];
-						int count = 0;
+/* the node at link paired its user target with our user requester */
+void handle_node_pair_ok(int link, char *requester, char *target, char *addr) {
+	int index = find_local(requester);
+	int proxy_index = -1;
 
-						while ((token = strsep(&buf, ":")) != NULL) {
-							params[count] = strdup(token);
-							count++;
-						}
+	if (index != -1 && g_table.partner[index] == CLUSTER_PENDING) {
+		proxy_index = create_proxy(link, target, addr);
+	}
+	if (proxy_index == -1) {
+		/* requester is gone or chat queue is full, end the remote half again */
+		cluster_relay(link, target, MSG_QUIT, strlen(MSG_QUIT));
+		cluster_send_state(link, target, CONNECTING);
+		if (index != -1 && g_table.partner[index] == CLUSTER_PENDING) {
+			g_table.partner[index] = -1;
+		}
+		return;
+	}
+	start_remote_session(index, proxy_index);
+}
 
-						/* handle help first */
-						if (strcmp(params[0], HELP) == 0) {
-							print_help();
-							continue;
-						}
+/* the node we asked had nobody left for our user requester */
+void handle_node_pair_fail(char *requester) {
+	char msg[] = "All users are chatting now, you will be paired when one is free.";
+	int index = find_local(requester);
 
-						switch (client->state) {
-						case INIT:
-							break;
-						case CONNECTING:
-							if (strcmp(params[0], EXIT) == 0) {
-								handle_exit(client, NULL, &g_bitmap);
-							} else if (strcmp(params[0], MSG_HELP) == 0) {
-								handle_help(client);
-							} else if (strcmp(params[0], MSG_CHAT_REQUEST) == 0) {
-								// if client request to chat, server will allocate a partner first
-								handle_chat_request(i, &master, g_clients, &g_bitmap);
-								break;
-							}
-							break;
-						case CHATTING:
-						{
-                            struct client_info *partner = g_clients[client->partner_index];
-                            if (strcmp(params[0], EXIT) == 0) {
-                            	handle_exit(client, partner, &g_bitmap);
-                            } else if (strcmp(params[0], QUIT) == 0) {
-								handle_quit(client, partner);
-                            } else if (strcmp(params[0], MSG_HELP) == 0) {
-								handle_help(client);
-							} else if (strcmp(params[0], MSG_FLAG) == 0){
-                            	handle_flag(partner);
-                            } else if (strcmp(params[0], MSG_SENDING_FILE) == 0) {
-                            	handle_transfer(params[1], client, partner);
-                            } else {
-                            	forward_message(partner, params[0]);
-                            }
-							break;
-						}
-						case TRANSFERING:
-						{
-							struct client_info *partner = g_clients[client->partner_index];
-							if (strcmp(params[0], MSG_RECEIVE_SUCCESS) == 0) {
-								handle_transfer_complete(client, partner);
-							} else if (strcmp(params[0], MSG_HELP) == 0) {
-								handle_help(client);
-							} else {
-								forward_message(partner, params[0]);
-							}
-							break;
-						}
-						default:
-							break;
-						}
-						int k;
-						for(k = 0; k < count; k++) {
-							free(params[k]);
-						}
-					}
-					free(buf);
-				}
-			}
+	if (index != -1 && g_table.partner[index] == CLUSTER_PENDING) {
+		g_table.partner[index] = -1;
+		if (send_msg(g_clients[index], msg) == -1) {
+			perror("no available fails");
 		}
 	}
-	return 0;
 }
 
-/* parses control commands entered by the admin */
-void parse_control_command(char * cmd) {
-	char *params[PARAMS_MAX];
-	char *token;
-	char delim[2] = " ";
-	int count = 0;
+/* the node of our user's partner changed our user's state */
+void handle_node_state(char *name, int state) {
+	int index = find_local(name);
+	struct client_info *client;
 
-	while ((token = strsep(&cmd, delim)) != NULL) {
-		params[count] = strdup(token);
-		count++;
+	if (index == -1) {
+		return;
+	}
+	client = g_clients[index];
+	set_state(client, state);
+	if (state == CONNECTING && g_table.partner[client->slot] >= 0) {
+		/* session is over, reap_proxies() frees the proxy */
+		g_table.partner[g_table.partner[client->slot]] = -1;
+		g_table.partner[client->slot] = -1;
 	}
+}
 
-	switch (g_state) {
-	case SERVER_INIT:
-		if (strcmp(params[0], STATS) == 0    ||
-			strcmp(params[0], THROWOUT) == 0 ||
-			strcmp(params[0], BLOCK) == 0    ||
-			strcmp(params[0], UNBLOCK) == 0) {
-			printf("You need start server first\n");
-		} else if (strcmp(params[0], START) == 0) {
-			pthread_create(&g_connector, NULL, &main_loop, NULL);
-		} else if (strcmp(params[0], END) == 0) {
-			/* server has not started yet, don't need grace period */
-			printf("Server hasn't started yet\n");
-		} else if (strcmp(params[0], HELP) == 0) {
-			print_help();
+/* delivers [NODE_RELAY:user:payload] to our user */
+void handle_node_relay(char *buf, int len, int bulk) {
+	int prefix = strlen(MSG_NODE_RELAY) + 1;
+	char *name = buf + prefix;
+	char *payload;
+	struct client_info *client;
+	int index;
+
+	if (len <= prefix || (payload = memchr(name, ':', len - prefix)) == NULL) {
+		return;
+	}
+	*payload++ = '\0';
+	if ((index = find_local(name)) == -1) {
+		return;
+	}
+	client = g_clients[index];
+	if (g_table.partner[client->slot] >= 0) {
+		count_forward(g_clients[g_table.partner[client->slot]], client, len - (payload - buf));
+	}
+	if (g_table.state[client->slot] == CHATTING && g_table.partner[client->slot] >= 0 && strncmp(payload, "##", 2) != 0) {
+		scrollback_add(client->history, g_clients[g_table.partner[client->slot]]->name,
+				payload, len - (payload - buf));
+		transcript_add(TR_MSG, client->session, g_clients[g_table.partner[client->slot]]->name,
+				payload, len - (payload - buf));
+	}
+	// file data, and the end of it, goes through the scheduler like a local transfer
+	if (bulk || (strcmp(payload, MSG_TRANSFER_COMPLETE) == 0 && bulk_pending(client->bulk) > 0)) {
+		if (bulk_enqueue(client->bulk, payload, len - (payload - buf), bulk) == -1) {
+			perror("queue file data fails");
+		}
+	} else if (frame_send(client->stream, payload, len - (payload - buf)) == -1) {
+		perror("relay message fails");
+	}
+}
+
+/* dispatches one message from another node,
+ * return 0 if success, -1 if the link must be dropped */
+int handle_node_message(int link, char *buf, int len) {
+	char *token;
+	char *params[PARAMS_MAX];
+	int count = 0, max = PARAMS_MAX, ret = 0;
+	char *line, *cursor;
+
+	/* nothing but the handshake until the node proved it knows the secret */
+	if (!g_links[link].authed && strncmp(buf, MSG_NODE_HELLO ":", strlen(MSG_NODE_HELLO) + 1) != 0 &&
+			strncmp(buf, MSG_NODE_AUTH ":", strlen(MSG_NODE_AUTH) + 1) != 0) {
+		printf("cluster: node on socket %d sent a message before authenticating\n", g_links[link].sockfd);
+		return -1;
+	}
+
+	/* relayed payloads are binary, don't tokenize them */
+	if (strncmp(buf, MSG_NODE_RELAY ":", strlen(MSG_NODE_RELAY) + 1) == 0) {
+		handle_node_relay(buf, len, g_links[link].stream->rflags);
+		return 0;
+	}
+
+	/* the address comes last and may hold colons, e.g. IPv6 or unix:<uid> */
+	if (strncmp(buf, MSG_NODE_PAIR ":", strlen(MSG_NODE_PAIR) + 1) == 0 ||
+			strncmp(buf, MSG_NODE_PAIR_OK ":", strlen(MSG_NODE_PAIR_OK) + 1) == 0) {
+		max = 4;
+	}
+
+	line = cursor = strdup(buf);
+	while (count < max && (token = strsep(&cursor, count == max - 1 ? "" : ":")) != NULL) {
+		params[count] = token;
+		count++;
+	}
+
+	if (strcmp(params[0], MSG_NODE_HELLO) == 0 && count == 3) {
+		g_links[link].node_id = atoi(params[1]);
+		if (cluster_answer(link, params[2]) == -1) {
+			ret = -1;
+		}
+	} else if (strcmp(params[0], MSG_NODE_AUTH) == 0 && count == 2) {
+		if (cluster_verify(link, params[1]) == -1) {
+			printf("cluster: node %d does not know the secret\n", g_links[link].node_id);
+			ret = -1;
 		} else {
-			printf("%s: Command not found. Type '%s' for more information.\n", params[0], HELP);
+			printf("cluster: linked with node %d\n", g_links[link].node_id);
 		}
-		break;
+	} else if (!g_links[link].authed) {
+		ret = -1;
+	} else if (strcmp(params[0], MSG_NODE_POOL) == 0 && count >= 2) {
+		cluster_set_pool(link, atoi(params[1]), count > 2 ? params[2] : "");
+	} else if (strcmp(params[0], MSG_NODE_PAIR) == 0 && count == 4) {
+		handle_node_pair(link, params[1], params[2], params[3]);
+	} else if (strcmp(params[0], MSG_NODE_PAIR_OK) == 0 && count == 4) {
+		handle_node_pair_ok(link, params[1], params[2], params[3]);
+	} else if (strcmp(params[0], MSG_NODE_PAIR_FAIL) == 0 && count == 2) {
+		handle_node_pair_fail(params[1]);
+	} else if (strcmp(params[0], MSG_NODE_STATE) == 0 && count == 3) {
+		handle_node_state(params[1], atoi(params[2]));
+	} else if (strcmp(params[0], MSG_NODE_ADMIN) == 0 && count == 3) {
+		/* run it only if the user is ours, never pass it on */
+		if (strcmp(params[1], THROWOUT) == 0) {
+			handle_throwout(params[2]);
+		} else if (strcmp(params[1], BLOCK) == 0) {
+			handle_block(params[2]);
+		} else if (strcmp(params[1], UNBLOCK) == 0) {
+			handle_unblock(params[2]);
+		}
+	} else {
+		printf("cluster: unknown message '%s' from node %d\n", params[0], g_links[link].node_id);
+	}
+	free(line);
+	return ret;
+}
+
+/* ends the sessions that went through a lost node link */
+void handle_link_down(int link) {
+	int i;
+
+	printf("cluster: lost node %d\n", g_links[link].node_id);
+	SLOT_SET_FOREACH(i, &g_bitmap) {
+		struct client_info *client = g_clients[i];
+		if (client->node == link) {
+			if (g_table.partner[client->slot] >= 0) {
+				struct client_info *partner = g_clients[g_table.partner[client->slot]];
+				g_table.partner[partner->slot] = -1;
+				set_state(partner, CONNECTING);
+				if (send_msg(partner, MSG_QUIT) == -1) {
+					perror("quit channel fails");
+				}
+			}
+			release_slot(i);
+		} else if (g_table.partner[client->slot] == CLUSTER_PENDING) {
+			g_table.partner[client->slot] = -1;
+		}
+	}
+	cluster_drop_link(link);
+}
+
+/* frees proxies whose session has ended */
+void reap_proxies() {
+	int i;
+	SLOT_SET_FOREACH(i, &g_bitmap) {
+		if ((g_table.flags[i] & CLIENT_F_REMOTE) &&
+				g_table.partner[i] == -1) {
+			release_slot(i);
+		}
+	}
+}
+
+/* tells the other nodes how many users wait here and who some of them are */
+void publish_pool() {
+	char names[CLUSTER_POOL_SAMPLE * (NAME_LENGTH + 1) + 1] = "";
+	char msg[sizeof(names) + BUF_MAX];
+	int i, count = 0;
+
+	SLOT_SET_FOREACH(i, &g_in_state[CONNECTING]) {
+		if (g_table.partner[i] == -1 && !(g_table.flags[i] & (CLIENT_F_REMOTE | CLIENT_F_BLOCKED)) &&
+				!tag_index_waiting(i)) {
+			if (count < CLUSTER_POOL_SAMPLE) {
+				strcat(names, g_clients[i]->name);
+				strcat(names, ",");
+			}
+			count++;
+		}
+	}
+	sprintf(msg, "%s:%d:%s", MSG_NODE_POOL, count, names);
+	cluster_broadcast(msg);
+}
+
+/* disconnects a client that keeps flooding, its partner goes back to the queue */
+void kick_client(int index, fd_set *master) {
+	struct client_info *client = g_clients[index];
+	char msg[] = "You are disconnected for flooding the server";
+
+	printf("%s is disconnected for flooding\n", client->name);
+	TRACE(kick, g_table.sockfd[client->slot], client->name, g_table.state[client->slot], 0);
+	if (send_msg(client, msg) == -1) {
+		perror("kick message fails");
+	}
+	drop_client(index, master);
+}
+
+/* a TLS session that OpenSSL runs in user space cannot be handed to another process,
+ * those clients are let go before a takeover and resume their session on reconnect */
+void drop_tls_clients(fd_set *master) {
+	struct client_info *client;
+	int i;
+
+	SLOT_SET_FOREACH(i, &g_bitmap) {
+		if (frame_raw(g_clients[i]->stream)) {
+			continue;
+		}
+		client = g_clients[i];
+		printf("%s is disconnected for the takeover, TLS is not offloaded\n", client->name);
+		drop_client(i, master);
+	}
+	for (i = 0; g_handshaking > 0 && i < FD_SETSIZE; i++) {
+		if (g_handshakes[i]) {
+			abort_handshake(i, master); // it may reconnect to the new server
+		}
+	}
+}
+
+/* handles the frames a client has buffered until a bucket runs dry,
+ * then stops reading its socket until the bucket is refilled */
+void serve_client(int index, fd_set *master) {
+	struct client_info *client = g_clients[index];
+	char buf[FRAME_PAYLOAD_MAX + 1]; // buffer for client data
+	double now, delay;
+	int len;
+
+	g_table.heard[index] = rate_now();
+	g_table.flags[index] &= ~CLIENT_F_PINGED;
+	while (!(g_table.flags[client->slot] & CLIENT_F_HELD) && (len = frame_next(client->stream, buf)) >= 0) {
+		TRACE(receive, g_table.sockfd[client->slot], client->name, g_table.state[client->slot], len);
+		wiretrace_add(WT_FRAME, g_table.sockfd[client->slot], client->stream->rflags & FRAME_F_BULK, buf, len);
+		now = rate_now();
+		// file data in a transfer is paced by holding the sender, the chat buckets would kick it mid transfer
+		if (!(client->stream->rflags & FRAME_F_BULK) || g_table.state[client->slot] != TRANSFERING) {
+			rate_charge(client->limit, RATE_MSG, 1, now);
+			rate_charge(client->limit, RATE_BYTE, len, now);
+		}
+		if (client->stream->rflags & FRAME_F_BULK) {
+			handle_bulk(client, master, buf, len);
+		} else if (strcmp(buf, MSG_PONG) != 0) { // a heartbeat answer only says it is alive
+			printf("receive '%s' from %s[socket %d]\n", buf, client->name, g_table.sockfd[client->slot]);
+			handle_message(client, master, buf, len);
+			if (!slot_set_has(&g_bitmap, index) || g_clients[index] != client) {
+				return; // it exited
+			}
+		}
+
+		if ((delay = rate_delay(client->limit, now)) > 0) {
+			// bytes carries the pause in ms
+			TRACE(throttle, g_table.sockfd[client->slot], client->name, g_table.state[client->slot], delay * 1000);
+			if (rate_pause(client->limit, now, delay) == -1) {
+				kick_client(index, master);
+			} else {
+				FD_CLR(g_table.sockfd[client->slot], master);
+			}
+			return;
+		}
+	}
+	if (len == FRAME_ERROR) {
+		printf("selectserver: malformed frame on socket %d\n", g_table.sockfd[client->slot]);
+		drop_client(index, master);
+		return;
+	}
+	// records OpenSSL already took off the socket are not reported by select()
+	if (slot_set_has(&g_bitmap, index) && g_clients[index] == client && !(g_table.flags[client->slot] & CLIENT_F_HELD) &&
+			frame_buffered(client->stream) && frame_fill(client->stream) > 0) {
+		serve_client(index, master);
+	}
+}
+
+/* reads again from throttled clients whose buckets are refilled,
+ * return seconds until the next one may resume, -1 if none is paused */
+double resume_clients(fd_set *master) {
+	double now = rate_now();
+	double next = -1;
+	int i;
+
+	SLOT_SET_FOREACH(i, &g_bitmap) {
+		if (g_table.flags[i] & CLIENT_F_REMOTE) {
+			continue;
+		}
+		struct client_info *client = g_clients[i];
+		if (g_table.flags[i] & CLIENT_F_HELD) {
+			// the partner's file data queue or node link drained, or the transfer is over
+			if (g_table.partner[client->slot] >= 0 && g_table.state[client->slot] == TRANSFERING &&
+					bulk_backlog(g_clients[g_table.partner[client->slot]]) >= BULK_QUEUE_RESUME) {
+				continue;
+			}
+			g_table.flags[i] &= ~CLIENT_F_HELD;
+			if (client->limit->paused_until == 0) {
+				FD_SET(g_table.sockfd[client->slot], master);
+				serve_client(i, master); // frames left in its buffer
+			}
+		}
+		if (!slot_set_has(&g_bitmap, i) || client->limit->paused_until == 0) {
+			continue;
+		}
+		if (now >= client->limit->paused_until) {
+			client->limit->paused_until = 0;
+			FD_SET(g_table.sockfd[client->slot], master);
+			serve_client(i, master); // frames left in its buffer
+		}
+		if (slot_set_has(&g_bitmap, i) && client->limit->paused_until != 0 &&
+				(next < 0 || client->limit->paused_until - now < next)) {
+			next = client->limit->paused_until - now;
+		}
+	}
+	return next;
+}
+
+/* pings clients that went quiet and drops the ones still silent after g_heartbeat seconds,
+ * which frees the slots of peers that vanished without a FIN */
+void heartbeat_sweep(fd_set *master) {
+	double now = rate_now();
+	int i;
+
+	SLOT_SET_FOREACH(i, &g_bitmap) {
+		if (g_table.flags[i] & CLIENT_F_REMOTE) {
+			continue; // its node watches the connection
+		}
+		struct client_info *client = g_clients[i];
+		if ((g_table.flags[i] & CLIENT_F_HELD) || client->limit->paused_until != 0) {
+			g_table.heard[i] = now; // we are not reading it, so its silence means nothing
+			continue;
+		}
+		double silent = now - g_table.heard[i];
+		if (silent >= g_heartbeat) {
+			printf("%s is disconnected, nothing heard for %.0f seconds\n", client->name, silent);
+			g_heartbeat_stats.dead++;
+			g_heartbeat_stats.hangups++;
+			drop_client(i, master);
+		} else if (silent >= g_heartbeat / 3.0 && !(g_table.flags[i] & CLIENT_F_PINGED)) {
+			// a full socket means the peer is not reading, the ping must not block on it
+			struct pollfd pfd = { .fd = g_table.sockfd[i], .events = POLLOUT };
+			if (poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLOUT) && send_msg(client, MSG_PING) == 0) {
+				g_heartbeat_stats.pings++;
+			}
+			g_table.flags[i] |= CLIENT_F_PINGED;
+		}
+	}
+}
+
+/* gives the users who waited g_tag_wait seconds for a shared tag a random partner */
+void tag_sweep(fd_set *master) {
+	struct slot_set expired;
+	int i;
+
+	if (g_tag_wait <= 0 || tag_index_expired(rate_now(), g_tag_wait, &expired) == 0) {
+		return;
+	}
+	// all of them first, so they may be paired with each other
+	SLOT_SET_FOREACH(i, &expired) {
+		tag_index_remove(i);
+	}
+	SLOT_SET_FOREACH(i, &expired) {
+		if (slot_set_has(&g_in_state[CONNECTING], i) && g_table.partner[i] == -1) {
+			g_tag_stats.fell_back++;
+			handle_chat_request(g_table.sockfd[i], master, g_clients, &g_bitmap, NULL, 0);
+		}
+	}
+}
+
+/* pairs the users in the wait queue, the longest waiting first, with whoever is free here */
+void queue_match(fd_set *master) {
+	int order[CLIENT_MAX];
+	int i, j, n = wait_queue_order(order);
+
+	for (i = 0; i < n; i++) {
+		int slot = order[i];
+		if (!slot_set_has(&g_in_state[CONNECTING], slot) || g_table.partner[slot] != -1 ||
+				tag_index_waiting(slot)) {
+			continue; // paired meanwhile, asking another node or waiting on its tags
+		}
+		if (g_table.flags[slot] & CLIENT_F_BLOCKED) {
+			wait_queue_leave(slot, 0);
+			continue;
+		}
+		SLOT_SET_FOREACH(j, &g_in_state[CONNECTING]) {
+			if (j != slot && g_table.partner[j] == -1 && !tag_index_waiting(j) &&
+					!(g_table.flags[j] & (CLIENT_F_REMOTE | CLIENT_F_BLOCKED))) {
+				break;
+			}
+		}
+		if (j == -1) {
+			return; // nobody is free, not for the rest of the queue either
+		}
+		handle_chat_request(g_table.sockfd[slot], master, g_clients, &g_bitmap, NULL, 0);
+	}
+}
+
+/* arms an accept, recv or poll for every fd select() would watch and
+ * cancels the ones no longer watched, ring lock held */
+static void ring_arm(int listener_fd, fd_set *master, int fdmax) {
+	struct io_uring_sqe *sqe;
+	int fd, index;
+
+	for (fd = 0; fd <= fdmax; fd++) {
+		int watched = FD_ISSET(fd, master) ? 1 : 0;
+		if (watched == (g_ring_armed[fd] != 0)) {
+			continue;
+		}
+		sqe = uring_get_sqe(&g_ring);
+		if (!watched) {
+			// a throttled client, its data waits in the socket again
+			uring_prep_cancel(sqe, RING_DATA(fd, g_ring_armed[fd]), RING_CANCEL);
+			g_ring_armed[fd] = 0;
+			continue;
+		}
+		if (fd == listener_fd || fd == g_unix_fd) {
+			g_ring_armed[fd] = RING_ACCEPT;
+			uring_prep_accept_multishot(sqe, fd, RING_DATA(fd, RING_ACCEPT));
+		} else if ((index = find_client(fd)) != -1 && g_table.state[index] != TRANSFERING &&
+				frame_raw(g_clients[index]->stream)) {
+			g_ring_armed[fd] = RING_RECV;
+			uring_prep_recv_multishot(sqe, fd, RING_DATA(fd, RING_RECV));
+		} else {
+			// node links, the handoff socket, file senders and TLS without kTLS are read the
+			// usual way, a sender that is held then leaves its data in the socket
+			g_ring_armed[fd] = RING_POLL;
+			uring_prep_poll(sqe, fd, RING_DATA(fd, RING_POLL));
+		}
+		g_ring_ops++;
+	}
+}
+
+/* handles every completion and marks the fds that have work in read_fds,
+ * data received by a client is fed to its stream */
+static void ring_reap(int *fdmax, fd_set *master, fd_set *read_fds) {
+	struct io_uring_cqe *cqe;
+	unsigned long batch = 0;
+	int admitted = 0;
+
+	while ((cqe = uring_peek_cqe(&g_ring)) != NULL) {
+		unsigned long long data = cqe->user_data;
+		int op = data & RING_OP_MASK;
+		int fd = (data >> 4) & 0xfffffff;
+		int res = cqe->res;
+		unsigned flags = cqe->flags;
+		int current;
+		uring_cqe_seen(&g_ring);
+
+		if (op == RING_SEND) {
+			ring_send_done((struct ring_send *)(uintptr_t)(data & ~(unsigned long long)RING_OP_MASK), res);
+			continue;
+		}
+		if (op == RING_CANCEL) {
+			continue;
+		}
+		if (!(flags & IORING_CQE_F_MORE)) {
+			g_ring_ops--;
+		}
+		current = (unsigned)(data >> 32) == g_ring_gen[fd];
+		if (current && !(flags & IORING_CQE_F_MORE) && g_ring_armed[fd] == op) {
+			g_ring_armed[fd] = 0; // ring_arm() arms it again if still watched
+		}
+
+		if (op == RING_RECV) {
+			unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+			int index = current && res >= 0 ? find_client(fd) : -1;
+			if (res > 0 && index != -1) {
+				g_ring_recvs++;
+				if (frame_feed(g_clients[index]->stream, uring_buf(&g_ring, bid), res) == 0) {
+					FD_SET(fd, read_fds);
+				} else {
+					kick_client(index, master); // kept sending while throttled
+				}
+			} else if (current && (res == 0 || (res != -ENOBUFS && res != -ECANCELED))) {
+				FD_SET(fd, &g_ring_hup);
+				FD_SET(fd, read_fds);
+			}
+			if (flags & IORING_CQE_F_BUFFER) {
+				uring_buf_recycle(&g_ring, bid);
+			}
+		} else if (op == RING_POLL) {
+			if (current && res >= 0) {
+				FD_SET(fd, read_fds);
+				if (find_client(fd) != -1) {
+					FD_SET(fd, &g_ring_polled);
+				}
+			}
+		} else if (op == RING_ACCEPT && current) {
+			if (res >= 0) {
+				struct sockaddr_storage their_addr;
+				socklen_t addrlen = sizeof their_addr;
+				batch++;
+				getpeername(res, (struct sockaddr *)&their_addr, &addrlen);
+				if (admit_connection(res, &their_addr, fdmax, master, g_clients, &g_bitmap) == 0) {
+					admitted++;
+				}
+			} else if ((res == -EMFILE || res == -ENFILE) && g_spare_fd != -1) {
+				shed_connection(fd);
+			} else if (res != -ECANCELED) {
+				errno = -res;
+				perror("accept() fails");
+				g_accept_stats.errors++;
+			}
+		}
+	}
+	if (batch != 0) {
+		g_accept_stats.wakeups++;
+		account_batch(batch, admitted);
+	}
+}
+
+/* io_uring counterpart of select(): arms the watched fds, waits up to timeout
+ * seconds and fills read_fds. return 0 if success, otherwise -1 */
+int ring_select(int listener_fd, int *fdmax, fd_set *master, fd_set *read_fds, double timeout) {
+	pthread_mutex_lock(&g_ring_lock);
+	ring_arm(listener_fd, master, *fdmax);
+	uring_submit(&g_ring);
+	pthread_mutex_unlock(&g_ring_lock);
+
+	if (uring_wait(&g_ring, timeout) == -1 && errno != ETIME && errno != EINTR) {
+		return -1;
+	}
+	FD_ZERO(read_fds);
+	ring_reap(fdmax, master, read_fds);
+	return 0;
+}
+
+/* cancels every armed operation and waits for the sends in flight, so the
+ * sockets can be handed to another process */
+void ring_quiesce(int *fdmax, fd_set *master) {
+	fd_set read_fds;
+	double deadline = rate_now() + RING_QUIESCE_SECONDS;
+	int fd;
+
+	pthread_mutex_lock(&g_ring_lock);
+	for (fd = 0; fd <= *fdmax; fd++) {
+		if (g_ring_armed[fd]) {
+			uring_prep_cancel(uring_get_sqe(&g_ring), RING_DATA(fd, g_ring_armed[fd]), RING_CANCEL);
+			g_ring_armed[fd] = 0;
+		}
+	}
+	uring_submit(&g_ring);
+	pthread_mutex_unlock(&g_ring_lock);
+
+	while ((g_ring_ops > 0 || g_ring_inflight > 0) && rate_now() < deadline) {
+		uring_wait(&g_ring, 0.1);
+		ring_reap(fdmax, master, &read_fds);
+	}
+}
+
+/* writes what client sockets took no room for yet and marks those still behind
+ * in write_fds, return 1 if any is, otherwise 0. a client whose stream broke
+ * is dropped once its read sees the shutdown */
+int flush_clients(fd_set *write_fds) {
+	int j, behind = 0;
+
+	FD_ZERO(write_fds);
+	SLOT_SET_FOREACH(j, &g_bitmap) {
+		struct frame_stream *fs = g_clients[j]->stream; // NULL for users on other nodes
+		if (fs && frame_unsent(fs) > 0 && frame_flush(fs) > 0) {
+			FD_SET(g_table.sockfd[j], write_fds);
+			behind = 1;
+		}
+	}
+	return behind;
+}
+
+/* waits up to RING_QUIESCE_SECONDS for the clients to take what is kept for them,
+ * before the server exits or hands the sockets over with empty streams */
+void drain_clients(int fdmax) {
+	double deadline = rate_now() + RING_QUIESCE_SECONDS;
+	fd_set write_fds;
+	struct timeval tv;
+
+	while (flush_clients(&write_fds) && rate_now() < deadline) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 100000;
+		select(fdmax + 1, NULL, &write_fds, NULL, &tv);
+	}
+}
+
+/* called by the event loop during the grace period: writes the notices, then sends the
+ * stop notice once the timer went off, or earlier when everyone was told and nobody is
+ * in a session, and ends the server once that is out or BROADCAST_DRAIN_SECONDS passed.
+ * return seconds until it has to run again, -1 to wait for the timer */
+double grace_step(int *fdmax, fd_set *master) {
+	struct broadcast_status st;
+	int pending = broadcast_run(0);
+
+	if (g_stop_started == 0) {
+		if (pending == 0 && !g_grace_told) {
+			broadcast_status(&st);
+			printf("Told %d users of the shutdown in %.1f ms, %d could not be told\n",
+					st.told, st.seconds * 1000, st.failed);
+			g_grace_told = 1;
+		}
+		if (!g_grace_over && (pending > 0 ||
+				g_counters.state[CHATTING] + g_counters.state[TRANSFERING] > 0)) {
+			return pending > 0 ? BROADCAST_POLL_SECONDS : -1;
+		}
+		broadcast_local(MSG_SERVER_STOP);
+		g_stop_started = rate_now();
+		pending = broadcast_run(0);
+	}
+	if (pending > 0 && rate_now() - g_stop_started < BROADCAST_DRAIN_SECONDS) {
+		return BROADCAST_POLL_SECONDS;
+	}
+	broadcast_status(&st);
+	printf("Sent the stop notice to %d of %d users\n", st.told, st.total);
+	if (g_use_uring) {
+		ring_quiesce(fdmax, master); // the notices are still queued on the ring
+	}
+	drain_clients(*fdmax);
+	handle_end();
+	return -1;
+}
+
+/* tells the local clients the server is gone and exits, on the event loop after SIGINT */
+void stop_server(int *fdmax, fd_set *master) {
+	double deadline = rate_now() + BROADCAST_DRAIN_SECONDS;
+	struct broadcast_status st;
+
+	broadcast_local(MSG_SERVER_SHUTDOWN);
+	while (broadcast_run(100) > 0 && rate_now() < deadline);
+	broadcast_status(&st);
+	printf("send exit_server to %d of %d users\n", st.told, st.total);
+	if (g_use_uring) {
+		ring_quiesce(fdmax, master); // the notices are still queued on the ring
+	}
+	drain_clients(*fdmax);
+	mod_close();
+	ban_close();
+	transcript_close();
+	wiretrace_close();
+	printf("exit_server\n");
+	exit(1);
+}
+
+/* runs a control command the admin typed, on the event loop like the admin socket's,
+ * so it never walks the clients while the loop frees one */
+void parse_control_command(char * cmd) {
+	char *params[PARAMS_MAX];
+	char *token;
+	char delim[2] = " ";
+	int count = 0;
+
+	while ((token = strsep(&cmd, delim)) != NULL && count < PARAMS_MAX) {
+		params[count] = token;
+		count++;
+	}
+
+	switch (g_state) {
 	case SERVER_RUNNING:
 		if (strcmp(params[0], STATS) == 0) {
 			handle_stat();
@@ -873,19 +2749,33 @@ void parse_control_command(char * cmd) {
 				printf("Usage: %s [username]\n", THROWOUT);
 				return;
 			}
-			handle_throwout(params[1]);
+			handle_admin(THROWOUT, params[1]);
 		} else if (strcmp(params[0], BLOCK) == 0) {
 			if (count != 2) {
 				printf("Usage: %s [username]\n", BLOCK);
 				return;
 			}
-			handle_block(params[1]);
+			handle_admin(BLOCK, params[1]);
 		} else if (strcmp(params[0], UNBLOCK) == 0) {
 			if (count != 2) {
 				printf("Usage: %s [username]\n", UNBLOCK);
 				return;
 			}
-			handle_unblock(params[1]);
+			handle_admin(UNBLOCK, params[1]);
+		} else if (strcmp(params[0], BAN) == 0 || strcmp(params[0], UNBAN) == 0) {
+			if (count != 2) {
+				printf("Usage: %s [address|address/len|username]\n", params[0]);
+				return;
+			}
+			handle_ban(params[0], params[1]);
+		} else if (strcmp(params[0], BANS) == 0) {
+			printf("%d bans\n", ban_list(stdout));
+		} else if (strcmp(params[0], HISTORY) == 0) {
+			if (count != 2 && count != 3) {
+				printf("Usage: %s [username] [lines]\n", HISTORY);
+				return;
+			}
+			print_history(params[1], count == 3 ? atoi(params[2]) : SCROLLBACK_REPLAY);
 		} else if (strcmp(params[0], START) == 0) {
 			printf("Server has already started.\n");
 		} else if (strcmp(params[0], END) == 0) {
@@ -904,8 +2794,463 @@ void parse_control_command(char * cmd) {
 
 }
 
+/* takes a line typed on stdin to the event loop, return 0 if success, otherwise -1 */
+int console_post(const char *line) {
+	char *copy;
+
+	pthread_mutex_lock(&g_console.lock);
+	if (g_console.len == CONSOLE_QUEUE_MAX || (copy = strdup(line)) == NULL) {
+		pthread_mutex_unlock(&g_console.lock);
+		return -1;
+	}
+	g_console.line[g_console.len++] = copy;
+	pthread_mutex_unlock(&g_console.lock);
+	wake_loop();
+	return 0;
+}
+
+/* runs the lines typed since the last call, on the event loop */
+void console_run() {
+	char *line[CONSOLE_QUEUE_MAX];
+	int i, n;
+
+	pthread_mutex_lock(&g_console.lock);
+	n = g_console.len;
+	memcpy(line, g_console.line, n * sizeof(line[0]));
+	g_console.len = 0;
+	pthread_mutex_unlock(&g_console.lock);
+	for (i = 0; i < n; i++) {
+		parse_control_command(line[i]);
+		free(line[i]);
+	}
+}
+
+/* main loop to be executed, handles the state transition */
+void * main_loop(void * arg) {
+    int listener_fd;
+    int handoff_fd;
+    int node_listener_fd = -1;
+    int link;
+    time_t last_pool = 0;
+    time_t last_sweep = 0;
+    struct timeval tv;
+    double timeout = -1;
+	int fdmax;
+	fd_set master;   // master file descriptor list
+	fd_set read_fds; // tmp file descriptor list for select
+	fd_set write_fds; // clients with bytes their socket had no room for
+	int i, j, behind;
+	pthread_t connector, receiver;
+	struct admin_conn *conn;
+
+	FD_ZERO(&master);    // clear the master and temp sets
+	FD_ZERO(&read_fds);
+
+	// load moderation state kept from previous runs
+	if (mod_open(MODERATION_DB_FILEPATH, MODERATION_LOG_FILEPATH) == -1) {
+		printf("Moderation state will not be persisted\n");
+	}
+	if ((i = ban_open(BANS_FILEPATH)) == -1) {
+		printf("Bans will not be enforced\n");
+	} else if (i > 0) {
+		printf("Loaded %d bans\n", i);
+	}
+	if (g_transcript && transcript_open(TRANSCRIPT_DIR) == -1) {
+		printf("Sessions will not be transcribed\n");
+	}
+	if (g_record_path && wiretrace_open(g_record_path) == -1) {
+		printf("Traffic will not be recorded\n");
+	}
+
+    // create socket and listen on it, unless a previous server handed it over
+	if (g_listener_fd == -1) {
+		slot_set_zero(&g_bitmap);
+		listener_fd = setup();
+	} else {
+		listener_fd = g_listener_fd;
+	}
+
+	g_state = SERVER_RUNNING;
+
+	// accept4 drains the backlog until EAGAIN
+	fcntl(listener_fd, F_SETFL, fcntl(listener_fd, F_GETFL) | O_NONBLOCK);
+	g_spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	g_accept_stats.last_time = rate_now();
+
+	if (g_use_uring && uring_init(&g_ring) == -1) {
+		perror("io_uring is not available, using select()");
+		g_use_uring = 0;
+	}
+
+    // add the listener to the g_master set
+    FD_SET(listener_fd, &master);
+
+	// keep track of the biggest file descriptor
+	fdmax = listener_fd;
+
+	// local clients connect here, unless a previous server handed its socket over
+	if (g_unix_fd == -1 && g_unix_path) {
+		g_unix_fd = setup_unix(g_unix_path);
+	}
+	if (g_unix_fd != -1) {
+		fcntl(g_unix_fd, F_SETFL, fcntl(g_unix_fd, F_GETFL) | O_NONBLOCK);
+		FD_SET(g_unix_fd, &master);
+		if (g_unix_fd > fdmax) {
+			fdmax = g_unix_fd;
+		}
+	}
+
+	// the admin thread and the grace timer need the loop to run, e.g. to send notices
+	if (pipe2(g_wake_fd, O_NONBLOCK | O_CLOEXEC) == 0) {
+		FD_SET(g_wake_fd[0], &master);
+		if (g_wake_fd[0] > fdmax) {
+			fdmax = g_wake_fd[0];
+		}
+	} else {
+		perror("wake pipe fails");
+	}
+
+	// sessions inherited from a previous server carry on
+	SLOT_SET_FOREACH(j, &g_bitmap) {
+		if (g_use_uring) {
+			frame_set_writer(g_clients[j]->stream, ring_write);
+		}
+		frame_set_queue(g_clients[j]->stream, CLIENT_OUTQ_MAX);
+		counters_state(INIT, g_table.state[j]);
+		slot_set_add(&g_in_state[g_table.state[j]], j);
+		g_table.heard[j] = rate_now(); // the old server's clock is not ours
+		if (g_clients[j]->flag != 0) {
+			g_counters.flagged++;
+		}
+		FD_SET(g_table.sockfd[j], &master);
+		if (g_table.sockfd[j] > fdmax) {
+			fdmax = g_table.sockfd[j];
+		}
+	}
+
+	// a newer server process may ask for our sockets here
+	handoff_fd = handoff_listen(HANDOFF_SOCKPATH);
+	if (handoff_fd != -1) {
+		FD_SET(handoff_fd, &master);
+		if (handoff_fd > fdmax) {
+			fdmax = handoff_fd;
+		}
+	}
+
+	// scripts send admin commands here
+	g_admin_fd = admin_listen(ADMIN_SOCKPATH);
+	if (g_admin_fd != -1) {
+		FD_SET(g_admin_fd, &master);
+		if (g_admin_fd > fdmax) {
+			fdmax = g_admin_fd;
+		}
+	}
+
+	// join the cluster: listen for other nodes and link with the known ones
+	if (g_node_port) {
+		node_listener_fd = cluster_listen(g_node_bind, g_node_port);
+		if (node_listener_fd != -1) {
+			FD_SET(node_listener_fd, &master);
+			if (node_listener_fd > fdmax) {
+				fdmax = node_listener_fd;
+			}
+		}
+	}
+	for (j = 0; j < g_peer_num; j++) {
+		if ((link = cluster_connect(g_peers[j])) != -1) {
+			FD_SET(g_links[link].sockfd, &master);
+			if (g_links[link].sockfd > fdmax) {
+				fdmax = g_links[link].sockfd;
+			}
+		}
+	}
+
+	struct sigaction sa;
+	/* Install timer_handler as the signal handler for SIGVTALRM. */
+	memset (&sa, 0, sizeof (sa));
+	sa.sa_handler = &exit_server;
+	sigaction (SIGINT, &sa, NULL);
+
+	while(1) {  
+	    read_fds = master; // copy it
+	    if (node_listener_fd != -1 || cluster_active()) {
+	    	// wake up to publish the waiting pool
+	    	if (timeout < 0 || timeout > CLUSTER_POOL_INTERVAL) {
+	    		timeout = CLUSTER_POOL_INTERVAL;
+	    	}
+	    }
+	    // select() wakes when they have room, the ring only looks again soon
+	    behind = flush_clients(&write_fds);
+	    if (behind && g_use_uring && (timeout < 0 || timeout > BULK_POLL_SECONDS)) {
+	    	timeout = BULK_POLL_SECONDS;
+	    }
+	    if (g_use_uring) {
+	    	if (ring_select(listener_fd, &fdmax, &master, &read_fds, timeout) == -1) {
+	    		perror("io_uring_enter() fails");
+	    		exit(4);
+	    	}
+	    } else {
+	    tv.tv_sec = (time_t)timeout;
+	    tv.tv_usec = (suseconds_t)((timeout - tv.tv_sec) * 1e6);
+		if (select(fdmax + 1, &read_fds, behind ? &write_fds : NULL, NULL, timeout < 0 ? NULL : &tv) == -1 ) {
+			if (errno != EINTR) {
+				perror("select() fails");
+				exit(4);
+			}
+			FD_ZERO(&read_fds); // a signal, its flag is looked at below
+		}
+	    }
+
+		// run through the existing connections looking for data to read
+		for (i = 0; i <= fdmax; i++) {
+            if (FD_ISSET(i, &read_fds)) {
+                if (i == listener_fd || i == g_unix_fd) {
+                	// getting new incoming connection
+                	handle_new_connection(i, &fdmax, &master, g_clients, &g_bitmap);
+				} else if (i == node_listener_fd) {
+					// another node joins the cluster
+					if ((link = cluster_accept(node_listener_fd)) != -1) {
+						FD_SET(g_links[link].sockfd, &master);
+						if (g_links[link].sockfd > fdmax) {
+							fdmax = g_links[link].sockfd;
+						}
+					}
+				} else if ((link = cluster_find_link(i)) != -1) {
+					// handling data from another node
+					int nbytes, len;
+					char buf[FRAME_PAYLOAD_MAX + 1];
+					if ((nbytes = frame_fill(g_links[link].stream)) <= 0) {
+						FD_CLR(i, &master);
+						ring_forget(i);
+						handle_link_down(link);
+						continue;
+					}
+					while ((len = frame_next(g_links[link].stream, buf)) >= 0) {
+						if (handle_node_message(link, buf, len) == -1) {
+							len = FRAME_ERROR;
+							break;
+						}
+					}
+					if (len == FRAME_ERROR) {
+						FD_CLR(i, &master);
+						ring_forget(i);
+						handle_link_down(link);
+					}
+				} else if (g_handshakes[i]) {
+					continue_handshake(i, &fdmax, &master);
+				} else if (i == g_wake_fd[0]) {
+					char drain[64];
+					while (read(g_wake_fd[0], drain, sizeof(drain)) > 0);
+				} else if (i == g_admin_fd) {
+					int fd;
+					if ((fd = admin_accept(g_admin_fd)) != -1) {
+						FD_SET(fd, &master);
+						if (fd > fdmax) {
+							fdmax = fd;
+						}
+					}
+				} else if ((conn = admin_find(i)) != NULL) {
+					// commands of an admin script, run as they arrive
+					char *line;
+					int nbytes = admin_fill(conn);
+					if (nbytes == -1 && errno == EAGAIN) {
+						continue;
+					}
+					while ((line = admin_next_line(conn)) != NULL) {
+						if (handle_admin_line(conn, line) == -1) {
+							nbytes = -1; // the script stopped reading
+							break;
+						}
+					}
+					if (nbytes <= 0) {
+						FD_CLR(i, &master);
+						ring_forget(i);
+						admin_close(conn);
+					}
+				} else if (i == handoff_fd) {
+					// hot restart, the new server carries on with our clients
+					bulk_flush();
+					drop_tls_clients(&master);
+					if (g_use_uring) {
+						ring_quiesce(&fdmax, &master);
+					}
+					drain_clients(fdmax);
+					if (handoff_send(handoff_fd, listener_fd, g_unix_fd, &g_table, g_clients, &g_bitmap, g_useid) == 0) {
+						transcript_close();
+						wiretrace_close();
+						exit(0);
+					}
+				} else {
+					// handling data from client
+					struct client_info * client = NULL;
+					SLOT_SET_FOREACH(j, &g_bitmap) {
+						if (i == g_table.sockfd[j]) {
+							client = g_clients[j];
+							break;
+						}
+					}
+					if (!client) {
+						continue;
+					}
+
+					if (g_use_uring && FD_ISSET(i, &g_ring_polled)) {
+						FD_CLR(i, &g_ring_polled);
+						// bytes fed before it was polled go first, a held sender is not read
+						if (client->stream->spill_len > 0 || (g_table.flags[client->slot] & CLIENT_F_HELD) ||
+								client->limit->paused_until != 0) {
+							serve_client(j, &master);
+							continue;
+						}
+					} else if (g_use_uring) {
+						// the ring already fed the data to the stream
+						int hup = FD_ISSET(i, &g_ring_hup);
+						if (client->limit->paused_until == 0) {
+							serve_client(j, &master);
+						}
+						if (hup && slot_set_has(&g_bitmap, j) && g_clients[j] == client) {
+							printf("selectserver: socket %d hung up\n", i);
+							TRACE(hangup, i, client->name, g_table.state[client->slot], client->stream->payload_in);
+							g_heartbeat_stats.hangups++;
+							drop_client(j, &master);
+						}
+						continue;
+					}
+
+					int nbytes;
+					if ((nbytes = frame_fill(client->stream)) == -1 && errno == EAGAIN) {
+						continue; // client sockets are non-blocking
+					}
+					if (nbytes <= 0) {
+						TRACE(hangup, i, client->name, g_table.state[client->slot], client->stream->payload_in);
+						// got error or connection closed by client
+						if (nbytes == 0) {
+							// connection closed
+							printf("selectserver: socket %d hung up\n", i);
+						} else {
+							perror("recv() client data fails");
+						}
+						g_heartbeat_stats.hangups++;
+						drop_client(j, &master); // bye! the partner is told and the slot freed
+						continue;
+					}
+					serve_client(j, &master);
+				}
+			}
+		}
+
+		// commands typed on stdin run here, between reads, and so does the SIGINT exit
+		console_run();
+		if (g_interrupted) {
+			stop_server(&fdmax, &master);
+		}
+
+		// file data goes out between reads, the sockets are then resumed if it drained
+		double bulk_wait = bulk_run(rate_now());
+		cluster_flush(); // a sender held on a node link resumes once it drained
+		timeout = resume_clients(&master);
+		if (bulk_wait >= 0 && (timeout < 0 || bulk_wait < timeout)) {
+			timeout = bulk_wait;
+		}
+
+		// what a slow node did not take yet
+		if (cluster_flush() && (timeout < 0 || timeout > CLUSTER_POLL_SECONDS)) {
+			timeout = CLUSTER_POLL_SECONDS;
+		}
+
+		// TLS handshakes that wait to write or ran out of time
+		if (g_handshaking > 0) {
+			double tls_wait = handshake_sweep(&fdmax, &master);
+			if (tls_wait >= 0 && (timeout < 0 || tls_wait < timeout)) {
+				timeout = tls_wait;
+			}
+		}
+
+		// shutdown notices go out between reads too
+		if (g_state == GRACE_PERIOD) {
+			double grace_wait = grace_step(&fdmax, &master);
+			if (grace_wait >= 0 && (timeout < 0 || grace_wait < timeout)) {
+				timeout = grace_wait;
+			}
+		}
+
+		// dead peers give their slots back, tag waits run out and the wait queue is looked at again,
+		// e.g. for a user unblocked meanwhile, the loop wakes once a second for it
+		if (g_heartbeat > 0 || (g_tag_wait > 0 && tag_index_count(NULL) > 0) || wait_queue_count() > 0) {
+			if (time(NULL) != last_sweep) {
+				if (g_heartbeat > 0) {
+					heartbeat_sweep(&master);
+				}
+				tag_sweep(&master);
+				g_queue_dirty = 1;
+				last_sweep = time(NULL);
+			}
+			if (timeout < 0 || timeout > 1) {
+				timeout = 1;
+			}
+		}
+
+		// users in the wait queue are paired as soon as someone is free, they do not ask again
+		if (g_queue_dirty) {
+			g_queue_dirty = 0;
+			queue_match(&master);
+		}
+
+		if (cluster_active()) {
+			reap_proxies();
+			if (time(NULL) - last_pool >= CLUSTER_POOL_INTERVAL) {
+				publish_pool();
+				last_pool = time(NULL);
+			}
+		}
+	}
+	return 0;
+}
+
+/* handles a control command typed on stdin. the event loop runs the ones for a running
+ * server, except /top, which only reads counters and waits on stdin itself */
+void parse_console_command(char * cmd) {
+	char *params[PARAMS_MAX];
+	char *token;
+	char delim[2] = " ";
+	int count = 0;
+
+	if (g_state != SERVER_INIT && strcmp(cmd, TOP) != 0) {
+		if (console_post(cmd) == -1) {
+			printf("The server is busy, '%s' is not run\n", cmd);
+		}
+		return;
+	}
+	while ((token = strsep(&cmd, delim)) != NULL && count < PARAMS_MAX) {
+		params[count] = token;
+		count++;
+	}
+
+	if (strcmp(params[0], TOP) == 0 && g_state != SERVER_INIT) {
+		handle_top();
+	} else if (strcmp(params[0], STATS) == 0    ||
+		strcmp(params[0], HISTORY) == 0  ||
+		strcmp(params[0], TOP) == 0      ||
+		strcmp(params[0], BAN) == 0      ||
+		strcmp(params[0], UNBAN) == 0    ||
+		strcmp(params[0], BANS) == 0     ||
+		strcmp(params[0], THROWOUT) == 0 ||
+		strcmp(params[0], BLOCK) == 0    ||
+		strcmp(params[0], UNBLOCK) == 0) {
+		printf("You need start server first\n");
+	} else if (strcmp(params[0], START) == 0) {
+		pthread_create(&g_connector, NULL, &main_loop, NULL);
+	} else if (strcmp(params[0], END) == 0) {
+		/* server has not started yet, don't need grace period */
+		printf("Server hasn't started yet\n");
+	} else if (strcmp(params[0], HELP) == 0) {
+		print_help();
+	} else {
+		printf("%s: Command not found. Type '%s' for more information.\n", params[0], HELP);
+	}
+}
+
 /* main function */
-int main(void) {
+int main(int argc, char *argv[]) {
     int listener_fd;
 	int fdmax;
 	fd_set master;   // master file descriptor list
@@ -916,20 +3261,109 @@ int main(void) {
 	int client_num = 0;  // # of clients currently log in
 	pthread_t connector, receiver;
 	char user_input[BUF_MAX];
+	int takeover = 0;
+	const char *tls_cert = NULL, *tls_key = NULL;
+	const char *node_secret = NULL;
 
 	// reap all dead processes
 //	cleanup();
 
 	print_ascii_art();
 
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--takeover") == 0) {
+			takeover = 1;
+		} else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+			g_port = argv[++i];
+		} else if (strcmp(argv[i], "--unix") == 0 && i + 1 < argc) {
+			g_unix_path = argv[++i];
+		} else if (strcmp(argv[i], "--node-id") == 0 && i + 1 < argc) {
+			g_node_id = atoi(argv[++i]);
+			g_useid = (long)g_node_id * CLUSTER_ID_STRIDE;
+		} else if (strcmp(argv[i], "--node-port") == 0 && i + 1 < argc) {
+			g_node_port = argv[++i];
+		} else if (strcmp(argv[i], "--peer") == 0 && i + 1 < argc && g_peer_num < NODE_MAX) {
+			g_peers[g_peer_num++] = argv[++i];
+		} else if (strcmp(argv[i], "--node-bind") == 0 && i + 1 < argc) {
+			g_node_bind = argv[++i];
+		} else if (strcmp(argv[i], "--node-secret-file") == 0 && i + 1 < argc) {
+			node_secret = argv[++i];
+		} else if (strcmp(argv[i], "--rate-limit") == 0 && i + 1 < argc &&
+				rate_configure(argv[++i]) == 0) {
+			continue;
+		} else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+			g_record_path = argv[++i];
+		} else if (strcmp(argv[i], "--no-transcript") == 0) {
+			g_transcript = 0;
+		} else if (strcmp(argv[i], "--file-rate") == 0 && i + 1 < argc &&
+				bulk_configure(argv[++i]) == 0) {
+			continue;
+		} else if (strcmp(argv[i], "--tls-cert") == 0 && i + 1 < argc) {
+			tls_cert = argv[++i];
+		} else if (strcmp(argv[i], "--tls-key") == 0 && i + 1 < argc) {
+			tls_key = argv[++i];
+		} else if (strcmp(argv[i], "--io-uring") == 0) {
+			g_use_uring = 1;
+		} else if (strcmp(argv[i], "--backlog") == 0 && i + 1 < argc) {
+			g_backlog = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--heartbeat") == 0 && i + 1 < argc) {
+			g_heartbeat = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--tag-wait") == 0 && i + 1 < argc) {
+			g_tag_wait = atoi(argv[++i]);
+		} else {
+			printf("Usage: %s [--takeover] [--port port] [--unix path] [--node-id id] "
+					"[--node-port port] [--node-bind address] [--peer host:port ...] [--node-secret-file file] "
+					"[--rate-limit msgs=N,bytes=N,chats=N,flags=N[/burst],strikes=N] "
+					"[--file-rate per=N,total=N] [--tls-cert file --tls-key file] "
+					"[--backlog N] [--heartbeat seconds] [--tag-wait seconds] [--io-uring] [--no-transcript] "
+					"[--record file]\n",
+					argv[0]);
+			exit(1);
+		}
+	}
+
+	// a node link can block and throw out any user, only nodes that know the secret get one
+	if ((g_node_port || g_peer_num > 0) && (!node_secret || cluster_set_secret(node_secret) == -1)) {
+		printf("Joining a cluster needs --node-secret-file with the secret shared by the nodes\n");
+		exit(1);
+	}
+
+	if (tls_cert || tls_key) {
+		if (!tls_cert || !tls_key || tls_server_init(tls_cert, tls_key) == -1) {
+			printf("TLS needs --tls-cert and --tls-key with a matching certificate and key\n");
+			exit(1);
+		}
+	}
+
+	/* ./server --takeover replaces a running server without dropping its clients */
+	if (takeover) {
+		g_listener_fd = handoff_receive(HANDOFF_SOCKPATH, &g_unix_fd, &g_table, g_clients, &g_bitmap, &g_useid);
+		if (g_listener_fd == -1) {
+			printf("Takeover failed, the running server keeps its clients\n");
+			exit(1);
+		}
+		pthread_create(&g_connector, NULL, &main_loop, NULL);
+	}
+
 	while (1) {
 		printf("admin> "); // prompt
-		fgets(user_input, BUF_MAX, stdin);
-		user_input[strlen(user_input) - 1] = '\0';
+		if (fgets(user_input, BUF_MAX, stdin) == NULL) {
+			if (ferror(stdin) && errno == EINTR) {
+				clearerr(stdin); // the grace timer or SIGINT landed on this thread
+				continue;
+			}
+			// nobody types any more, the server runs until it is stopped another way
+			if (g_state != SERVER_INIT) {
+				pthread_join(g_connector, NULL);
+			}
+			break;
+		}
+		user_input[strcspn(user_input, "\n")] = '\0';
 
 		char * input_copy = strdup(user_input); // copy user input
 		if (input_copy[0] == '/') {
-			parse_control_command(input_copy);
+			parse_console_command(input_copy);
+			free(input_copy);
 		} else {
 			if (strcmp(strip(input_copy), "") == 0) {
 				continue;
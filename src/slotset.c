@@ -0,0 +1,83 @@
+/*
+ * slotset.c - word at a time operations on sets of chat queue slots
+ */
+
+#include <string.h>
+
+#include "slotset.h"
+
+/* the bits of the last word that stand for real slots */
+#define LAST_WORD_MASK (CLIENT_MAX % 64 == 0 ? ~0ULL : (1ULL << (CLIENT_MAX % 64)) - 1)
+
+void slot_set_zero(struct slot_set *set) {
+	memset(set, 0, sizeof(*set));
+}
+
+void slot_set_add(struct slot_set *set, int slot) {
+	set->word[slot >> 6] |= 1ULL << (slot & 63);
+}
+
+void slot_set_del(struct slot_set *set, int slot) {
+	set->word[slot >> 6] &= ~(1ULL << (slot & 63));
+}
+
+int slot_set_has(const struct slot_set *set, int slot) {
+	if (slot < 0 || slot >= CLIENT_MAX) {
+		return 0; // partner fields hold -1 and CLUSTER_PENDING
+	}
+	return (set->word[slot >> 6] >> (slot & 63)) & 1;
+}
+
+int slot_set_next(const struct slot_set *set, int from) {
+	int w = from >> 6;
+	uint64_t bits;
+
+	if (from >= CLIENT_MAX) {
+		return -1;
+	}
+	bits = set->word[w] & (~0ULL << (from & 63));
+	while (bits == 0) {
+		if (++w == SLOT_SET_WORDS) {
+			return -1;
+		}
+		bits = set->word[w];
+	}
+	return w * 64 + __builtin_ctzll(bits);
+}
+
+int slot_set_take(struct slot_set *set) {
+	int w, slot;
+
+	for (w = 0; w < SLOT_SET_WORDS; w++) {
+		uint64_t free_bits = ~set->word[w];
+		if (w == SLOT_SET_WORDS - 1) {
+			free_bits &= LAST_WORD_MASK;
+		}
+		if (free_bits != 0) {
+			slot = w * 64 + __builtin_ctzll(free_bits);
+			set->word[w] |= free_bits & -free_bits;
+			return slot;
+		}
+	}
+	return -1;
+}
+
+int slot_set_count(const struct slot_set *set) {
+	int w, count = 0;
+
+	for (w = 0; w < SLOT_SET_WORDS; w++) {
+		count += __builtin_popcountll(set->word[w]);
+	}
+	return count;
+}
+
+int slot_set_full(const struct slot_set *set) {
+	int w;
+
+	for (w = 0; w < SLOT_SET_WORDS - 1; w++) {
+		if (set->word[w] != ~0ULL) {
+			return 0;
+		}
+	}
+	return (set->word[w] & LAST_WORD_MASK) == LAST_WORD_MASK;
+}
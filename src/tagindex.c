@@ -0,0 +1,190 @@
+/*
+ * tagindex.c - inverted index from interest tags to waiting users
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tagindex.h"
+
+#define TAG_MASK (TAG_TABLE_SIZE - 1)
+
+struct tag_entry {
+	char name[TAG_LENGTH]; /* empty for a free bucket */
+	unsigned int hash;
+	struct slot_set users;
+};
+
+static struct {
+	struct tag_entry table[TAG_TABLE_SIZE]; /* linear probing, no tombstones */
+	int tags; /* buckets in use */
+	struct slot_set waiting;
+	char name[CLIENT_MAX][TAG_USER_MAX][TAG_LENGTH]; /* what each slot waits on */
+	int count[CLIENT_MAX];
+	double since[CLIENT_MAX];
+} g_tags;
+
+/* FNV-1a */
+static unsigned int tag_hash(const char *name) {
+	unsigned int h = 2166136261u;
+
+	while (*name) {
+		h = (h ^ (unsigned char)*name++) * 16777619u;
+	}
+	return h;
+}
+
+/* lower case copy of tag cut to fit out, return its length */
+static int tag_norm(const char *tag, char out[TAG_LENGTH]) {
+	int i;
+
+	for (i = 0; tag[i] && i < TAG_LENGTH - 1; i++) {
+		out[i] = tolower((unsigned char)tag[i]);
+	}
+	out[i] = '\0';
+	return i;
+}
+
+/* return the bucket of name, or of the free bucket it would go in */
+static int tag_find(const char *name, unsigned int hash) {
+	int b = hash & TAG_MASK;
+
+	while (g_tags.table[b].name[0] && (g_tags.table[b].hash != hash || strcmp(g_tags.table[b].name, name) != 0)) {
+		b = (b + 1) & TAG_MASK;
+	}
+	return b;
+}
+
+/* empty bucket b, moving later entries of its run back so lookups need no tombstones */
+static void tag_erase(int b) {
+	int next;
+
+	for (next = (b + 1) & TAG_MASK; g_tags.table[next].name[0]; next = (next + 1) & TAG_MASK) {
+		int home = g_tags.table[next].hash & TAG_MASK;
+		// the entry may move to b unless its home lies after b on the way to next
+		if (((next - home) & TAG_MASK) >= ((next - b) & TAG_MASK)) {
+			g_tags.table[b] = g_tags.table[next];
+			b = next;
+		}
+	}
+	g_tags.table[b].name[0] = '\0';
+	g_tags.tags--;
+}
+
+int tag_index_add(int slot, char *tags[], int n, double now) {
+	char name[TAG_LENGTH];
+	int i, j, b, kept = 0;
+
+	tag_index_remove(slot);
+	for (i = 0; i < n && kept < TAG_USER_MAX; i++) {
+		if (tag_norm(tags[i], name) == 0) {
+			continue;
+		}
+		for (j = 0; j < kept && strcmp(g_tags.name[slot][j], name) != 0; j++);
+		if (j < kept) {
+			continue; // named twice
+		}
+		unsigned int hash = tag_hash(name);
+		b = tag_find(name, hash);
+		if (!g_tags.table[b].name[0]) {
+			strcpy(g_tags.table[b].name, name);
+			g_tags.table[b].hash = hash;
+			slot_set_zero(&g_tags.table[b].users);
+			g_tags.tags++;
+		}
+		slot_set_add(&g_tags.table[b].users, slot);
+		strcpy(g_tags.name[slot][kept++], name);
+	}
+	if (kept > 0) {
+		g_tags.count[slot] = kept;
+		g_tags.since[slot] = now;
+		slot_set_add(&g_tags.waiting, slot);
+	}
+	return kept;
+}
+
+void tag_index_remove(int slot) {
+	int i, b;
+
+	if (!slot_set_has(&g_tags.waiting, slot)) {
+		return;
+	}
+	for (i = 0; i < g_tags.count[slot]; i++) {
+		b = tag_find(g_tags.name[slot][i], tag_hash(g_tags.name[slot][i]));
+		slot_set_del(&g_tags.table[b].users, slot);
+		if (slot_set_count(&g_tags.table[b].users) == 0) {
+			tag_erase(b);
+		}
+	}
+	g_tags.count[slot] = 0;
+	slot_set_del(&g_tags.waiting, slot);
+}
+
+int tag_index_match(char *tags[], int n, const struct slot_set *eligible) {
+	struct slot_set found;
+	char name[TAG_LENGTH];
+	int i, w, b, r;
+
+	slot_set_zero(&found);
+	for (i = 0; i < n && i < TAG_USER_MAX; i++) {
+		if (tag_norm(tags[i], name) == 0) {
+			continue;
+		}
+		b = tag_find(name, tag_hash(name));
+		if (!g_tags.table[b].name[0]) {
+			continue;
+		}
+		for (w = 0; w < SLOT_SET_WORDS; w++) {
+			found.word[w] |= g_tags.table[b].users.word[w] & eligible->word[w];
+		}
+	}
+	if ((n = slot_set_count(&found)) == 0) {
+		return -1;
+	}
+
+	// the r-th member, found a word at a time
+	r = rand() % n;
+	for (w = 0; __builtin_popcountll(found.word[w]) <= r; w++) {
+		r -= __builtin_popcountll(found.word[w]);
+	}
+	for (i = slot_set_next(&found, w * 64); r > 0; r--) {
+		i = slot_set_next(&found, i + 1);
+	}
+	return i;
+}
+
+int tag_index_waiting(int slot) {
+	return slot_set_has(&g_tags.waiting, slot);
+}
+
+int tag_index_expired(double now, double wait, struct slot_set *out) {
+	int i, count = 0;
+
+	slot_set_zero(out);
+	SLOT_SET_FOREACH(i, &g_tags.waiting) {
+		if (now - g_tags.since[i] >= wait) {
+			slot_set_add(out, i);
+			count++;
+		}
+	}
+	return count;
+}
+
+char *tag_index_list(int slot, char *buf, int size) {
+	int i, len = 0;
+
+	buf[0] = '\0';
+	for (i = 0; i < g_tags.count[slot] && len < size; i++) {
+		len += snprintf(buf + len, size - len, "%s%s", i ? ", " : "", g_tags.name[slot][i]);
+	}
+	return buf;
+}
+
+int tag_index_count(int *tags) {
+	if (tags) {
+		*tags = g_tags.tags;
+	}
+	return slot_set_count(&g_tags.waiting);
+}
@@ -0,0 +1,240 @@
+/*
+ * tls_bench.c - throughput of plaintext, user-space TLS and kTLS over loopback TCP
+ *
+ * usage: ./tls_bench [megabytes]
+ *
+ * A writer thread pushes frame-sized chunks through a TCP connection on
+ * 127.0.0.1 and the reader counts them, once in the clear, once through
+ * SSL_write/SSL_read and once with SSL_OP_ENABLE_KTLS. The certificate is a
+ * throwaway made at start. kTLS needs the "tls" module and a cipher the kernel
+ * knows; when either is missing OpenSSL falls back to user space, and the kTLS
+ * row says so instead of timing user space twice.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#include "frame.h"
+
+#define BENCH_CHUNK   FRAME_CHUNK_MAX  // what the client sends per file frame
+#define BENCH_MB      256
+
+enum mode { PLAIN, USER_TLS, KTLS };
+
+struct side {
+	int fd;
+	SSL *ssl;
+	long long bytes;
+	int ktls; /* writer: send offloaded, reader: receive offloaded */
+};
+
+static EVP_PKEY *g_key;
+static X509 *g_cert;
+
+static double now_sec() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* a self-signed certificate that lives as long as the benchmark */
+static int make_cert() {
+	if ((g_key = EVP_EC_gen("P-256")) == NULL || (g_cert = X509_new()) == NULL) {
+		return -1;
+	}
+	ASN1_INTEGER_set(X509_get_serialNumber(g_cert), 1);
+	X509_gmtime_adj(X509_getm_notBefore(g_cert), 0);
+	X509_gmtime_adj(X509_getm_notAfter(g_cert), 3600);
+	X509_set_pubkey(g_cert, g_key);
+	X509_NAME_add_entry_by_txt(X509_get_subject_name(g_cert), "CN", MBSTRING_ASC,
+			(const unsigned char *)"tls_bench", -1, -1, 0);
+	X509_set_issuer_name(g_cert, X509_get_subject_name(g_cert));
+	return X509_sign(g_cert, g_key, EVP_sha256()) > 0 ? 0 : -1;
+}
+
+/* a connected pair of TCP sockets on loopback, return 0 if success, otherwise -1 */
+static int tcp_pair(int fds[2]) {
+	struct sockaddr_in addr = { .sin_family = AF_INET };
+	socklen_t len = sizeof(addr);
+	int listener, yes = 1;
+
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((listener = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+			bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+			listen(listener, 1) == -1 ||
+			getsockname(listener, (struct sockaddr *)&addr, &len) == -1 ||
+			(fds[0] = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+			connect(fds[0], (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+			(fds[1] = accept(listener, NULL, NULL)) == -1) {
+		perror("tls_bench: loopback");
+		return -1;
+	}
+	close(listener);
+	setsockopt(fds[0], IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	setsockopt(fds[1], IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	return 0;
+}
+
+static SSL_CTX* bench_ctx(int server, enum mode mode) {
+	SSL_CTX *ctx = SSL_CTX_new(server ? TLS_server_method() : TLS_client_method());
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	if (mode == KTLS) {
+		SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+		// kernels offload the TLS 1.3 receive side later than TLS 1.2
+		SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+		SSL_CTX_set_cipher_list(ctx, "ECDHE-ECDSA-AES128-GCM-SHA256");
+	} else {
+		SSL_CTX_clear_options(ctx, SSL_OP_ENABLE_KTLS);
+	}
+	if (server) {
+		SSL_CTX_use_certificate(ctx, g_cert);
+		SSL_CTX_use_PrivateKey(ctx, g_key);
+	}
+	return ctx;
+}
+
+static void* handshake_thread(void *arg) {
+	SSL *ssl = arg;
+
+	return SSL_accept(ssl) == 1 ? ssl : NULL;
+}
+
+static void* writer_thread(void *arg) {
+	struct side *w = arg;
+	char *buf = calloc(1, BENCH_CHUNK);
+	long long left = w->bytes;
+	ssize_t n;
+	size_t sent;
+
+	while (left > 0) {
+		size_t len = left < BENCH_CHUNK ? left : BENCH_CHUNK;
+		if (w->ssl && !w->ktls) {
+			n = SSL_write_ex(w->ssl, buf, len, &sent) == 1 ? (ssize_t)sent : -1;
+		} else if (w->ssl) {
+			n = SSL_write(w->ssl, buf, len); // offloaded, OpenSSL only calls send()
+		} else {
+			n = send(w->fd, buf, len, 0);
+		}
+		if (n <= 0) {
+			perror("tls_bench: write");
+			break;
+		}
+		left -= n;
+	}
+	shutdown(w->fd, SHUT_WR);
+	free(buf);
+	return NULL;
+}
+
+/* return MB/s, 0 if the mode could not run */
+static double run(enum mode mode, long long bytes, int *offloaded) {
+	struct side w = { .bytes = bytes }, r = { 0 };
+	SSL_CTX *sctx = NULL, *cctx = NULL;
+	char *buf = malloc(BENCH_CHUNK);
+	pthread_t thread;
+	double start, elapsed = 0; // stays 0 when kTLS was not offloaded and nothing ran
+	int fds[2];
+	ssize_t n;
+
+	*offloaded = 0;
+	if (tcp_pair(fds) == -1) {
+		free(buf);
+		return 0;
+	}
+	w.fd = fds[0];
+	r.fd = fds[1];
+	if (mode != PLAIN) {
+		sctx = bench_ctx(1, mode);
+		cctx = bench_ctx(0, mode);
+		r.ssl = SSL_new(sctx);
+		w.ssl = SSL_new(cctx);
+		SSL_set_fd(r.ssl, r.fd);
+		SSL_set_fd(w.ssl, w.fd);
+		pthread_create(&thread, NULL, handshake_thread, r.ssl);
+		if (SSL_connect(w.ssl) != 1) {
+			ERR_print_errors_fp(stderr);
+		}
+		pthread_join(thread, NULL);
+		w.ktls = BIO_get_ktls_send(SSL_get_wbio(w.ssl));
+		r.ktls = BIO_get_ktls_recv(SSL_get_rbio(r.ssl));
+		*offloaded = w.ktls && r.ktls;
+		if (mode == KTLS && !*offloaded) {
+			goto out;
+		}
+	}
+
+	start = now_sec();
+	pthread_create(&thread, NULL, writer_thread, &w);
+	while (1) {
+		if (r.ssl) {
+			size_t got;
+			n = SSL_read_ex(r.ssl, buf, BENCH_CHUNK, &got) == 1 ? (ssize_t)got : 0;
+		} else {
+			n = recv(r.fd, buf, BENCH_CHUNK, 0);
+		}
+		if (n <= 0) {
+			break;
+		}
+		r.bytes += n;
+	}
+	pthread_join(thread, NULL);
+	elapsed = now_sec() - start;
+
+out:
+	SSL_free(w.ssl);
+	SSL_free(r.ssl);
+	SSL_CTX_free(sctx);
+	SSL_CTX_free(cctx);
+	close(fds[0]);
+	close(fds[1]);
+	free(buf);
+	if (r.bytes != bytes || elapsed <= 0) {
+		return 0;
+	}
+	return bytes / (1024.0 * 1024.0) / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+	long long mb = argc > 1 ? atoll(argv[1]) : BENCH_MB;
+	const char *names[] = { "plaintext", "user-space TLS", "kTLS" };
+	double rate;
+	int mode, offloaded;
+
+	if (mb <= 0) {
+		printf("usage: %s [megabytes]\n", argv[0]);
+		exit(1);
+	}
+	signal(SIGPIPE, SIG_IGN);
+	if (make_cert() == -1) {
+		ERR_print_errors_fp(stderr);
+		exit(1);
+	}
+	printf("%lld MB in %d byte chunks over loopback TCP\n", mb, BENCH_CHUNK);
+	for (mode = PLAIN; mode <= KTLS; mode++) {
+		rate = run(mode, mb << 20, &offloaded);
+		if (mode == KTLS && !offloaded) {
+			printf("%-16s unavailable, the kernel did not take the connection (modprobe tls?)\n",
+					names[mode]);
+		} else if (rate == 0) {
+			printf("%-16s failed\n", names[mode]);
+		} else {
+			printf("%-16s %8.1f MB/s\n", names[mode], rate);
+		}
+	}
+	return 0;
+}
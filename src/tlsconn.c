@@ -0,0 +1,427 @@
+/*
+ * tlsconn.c - OpenSSL handshakes, kTLS offload and session resumption
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#include <openssl/evp.h>
+
+#include "tlsconn.h"
+
+#define TLS_SESSION_ID_CONTEXT "chatroulette"
+
+struct tls_conn {
+	SSL *ssl;
+	int sockfd;
+	int flags; /* of the socket before the handshake made it non-blocking */
+	int blocking; /* reads wait like recv() on a blocking socket */
+	int ktls;
+	int raw; /* the kernel does the crypto both ways, use the socket directly */
+	pthread_mutex_t lock; /* one SSL is never used by two threads at once */
+};
+
+struct tls_stats g_tls_stats;
+
+static SSL_CTX *g_ctx = NULL;
+static int g_server = 0;
+static SSL_SESSION *g_session = NULL; // client: offered by the next tls_connect()
+
+static long long now_ms() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void report(const char *what) {
+	char reason[256];
+	unsigned long e = ERR_get_error();
+
+	if (e) {
+		ERR_error_string_n(e, reason, sizeof(reason));
+	} else {
+		snprintf(reason, sizeof(reason), "%s", errno ? strerror(errno) : "connection closed");
+	}
+	fprintf(stderr, "tls: %s: %s\n", what, reason);
+	ERR_clear_error();
+}
+
+/* wait for events until deadline, -1 for none, return 1 if ready, otherwise 0 */
+static int wait_socket(int sockfd, short events, long long deadline) {
+	struct pollfd pfd = { .fd = sockfd, .events = events };
+	long long left;
+	int rv;
+
+	while (1) {
+		left = deadline < 0 ? -1 : deadline - now_ms();
+		if (deadline >= 0 && left <= 0) {
+			errno = ETIMEDOUT;
+			return 0;
+		}
+		if ((rv = poll(&pfd, 1, left)) == -1 && errno == EINTR) {
+			continue;
+		}
+		if (rv == 0) {
+			errno = ETIMEDOUT;
+		}
+		return rv > 0;
+	}
+}
+
+static SSL_CTX* new_ctx(const SSL_METHOD *method) {
+	SSL_CTX *ctx = SSL_CTX_new(method);
+
+	if (ctx == NULL) {
+		return NULL;
+	}
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF); // a peer that hangs up is not an error
+#ifdef SSL_OP_ENABLE_KTLS
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+	signal(SIGPIPE, SIG_IGN); // OpenSSL writes with write(), a closed peer must not kill us
+	return ctx;
+}
+
+/* session tickets are sealed with keys derived from the private key, so the server
+ * that takes over from us still opens them and reconnects resume */
+static int set_ticket_keys(SSL_CTX *ctx) {
+	unsigned char keys[80], digest[EVP_MAX_MD_SIZE];
+	unsigned char *der = NULL, *p;
+	EVP_PKEY *pkey = SSL_CTX_get0_privatekey(ctx);
+	unsigned int len;
+	int der_len, ok;
+
+	if ((der_len = i2d_PrivateKey(pkey, &der)) <= 0) {
+		return -1;
+	}
+	// 16 bytes of key name, then the HMAC and AES keys
+	if ((p = malloc(der_len + 8)) == NULL) {
+		OPENSSL_free(der);
+		return -1;
+	}
+	memcpy(p, "tickets", 8);
+	memcpy(p + 8, der, der_len);
+	ok = EVP_Digest(p, der_len + 8, digest, &len, EVP_sha512(), NULL);
+	memcpy(keys + 16, digest, 64);
+	p[0] = 'T';
+	ok = ok && EVP_Digest(p, der_len + 8, digest, &len, EVP_sha256(), NULL);
+	memcpy(keys, digest, 16);
+	OPENSSL_cleanse(p, der_len + 8);
+	OPENSSL_clear_free(der, der_len);
+	free(p);
+	ok = ok && SSL_CTX_set_tlsext_ticket_keys(ctx, keys, sizeof(keys)) == 1;
+	OPENSSL_cleanse(keys, sizeof(keys));
+	OPENSSL_cleanse(digest, sizeof(digest));
+	return ok ? 0 : -1;
+}
+
+int tls_server_init(const char *cert_file, const char *key_file) {
+	if ((g_ctx = new_ctx(TLS_server_method())) == NULL) {
+		report("server context");
+		return -1;
+	}
+	if (SSL_CTX_use_certificate_chain_file(g_ctx, cert_file) != 1 ||
+			SSL_CTX_use_PrivateKey_file(g_ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+			SSL_CTX_check_private_key(g_ctx) != 1) {
+		report("certificate");
+		SSL_CTX_free(g_ctx);
+		g_ctx = NULL;
+		return -1;
+	}
+	/* resumption: a session cache for TLS 1.2, one ticket per handshake for TLS 1.3 */
+	SSL_CTX_set_session_cache_mode(g_ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_set_session_id_context(g_ctx, (const unsigned char *)TLS_SESSION_ID_CONTEXT,
+			strlen(TLS_SESSION_ID_CONTEXT));
+	SSL_CTX_set_num_tickets(g_ctx, 1);
+	if (set_ticket_keys(g_ctx) == -1) {
+		report("ticket keys");
+	}
+	g_server = 1;
+	return 0;
+}
+
+int tls_client_init(const char *ca_file) {
+	if ((g_ctx = new_ctx(TLS_client_method())) == NULL) {
+		report("client context");
+		return -1;
+	}
+	if (ca_file) {
+		if (SSL_CTX_load_verify_locations(g_ctx, ca_file, NULL) != 1) {
+			report(ca_file);
+			SSL_CTX_free(g_ctx);
+			g_ctx = NULL;
+			return -1;
+		}
+		SSL_CTX_set_verify(g_ctx, SSL_VERIFY_PEER, NULL);
+	}
+	SSL_CTX_set_session_cache_mode(g_ctx, SSL_SESS_CACHE_CLIENT);
+	g_server = 0;
+	return 0;
+}
+
+int tls_enabled() {
+	return g_ctx != NULL;
+}
+
+/* a connection to shake hands on, its socket is non-blocking meanwhile */
+static struct tls_conn* tls_new(int sockfd, SSL *ssl) {
+	struct tls_conn *conn = calloc(1, sizeof(struct tls_conn));
+
+	if (conn == NULL) {
+		SSL_free(ssl);
+		return NULL;
+	}
+	conn->ssl = ssl;
+	conn->sockfd = sockfd;
+	conn->flags = fcntl(sockfd, F_GETFL);
+	conn->blocking = !(conn->flags & O_NONBLOCK);
+	pthread_mutex_init(&conn->lock, NULL);
+	SSL_set_fd(ssl, sockfd); // BIO_NOCLOSE, the socket stays ours
+	fcntl(sockfd, F_SETFL, conn->flags | O_NONBLOCK);
+	return conn;
+}
+
+int tls_handshake(struct tls_conn *conn) {
+	int ret, err;
+
+	if ((ret = SSL_do_handshake(conn->ssl)) != 1) {
+		err = SSL_get_error(conn->ssl, ret);
+		if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+			return err == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT;
+		}
+		report("handshake");
+		g_tls_stats.failures++;
+		return -1;
+	}
+#ifdef BIO_get_ktls_send
+	if (BIO_get_ktls_send(SSL_get_wbio(conn->ssl))) {
+		conn->ktls |= TLS_KTLS_TX;
+		g_tls_stats.ktls_tx++;
+	}
+	if (BIO_get_ktls_recv(SSL_get_rbio(conn->ssl))) {
+		conn->ktls |= TLS_KTLS_RX;
+		g_tls_stats.ktls_rx++;
+	}
+#endif
+	/* a client still has the session tickets to read, which only OpenSSL understands */
+	conn->raw = g_server && conn->ktls == (TLS_KTLS_TX | TLS_KTLS_RX) && !SSL_has_pending(conn->ssl);
+	if (conn->raw) {
+		fcntl(conn->sockfd, F_SETFL, conn->flags);
+	}
+	g_tls_stats.handshakes++;
+	if (SSL_session_reused(conn->ssl)) {
+		g_tls_stats.resumed++;
+	}
+	return 0;
+}
+
+/* the whole handshake within TLS_HANDSHAKE_MS */
+static struct tls_conn* handshake(int sockfd, SSL *ssl) {
+	long long deadline = now_ms() + TLS_HANDSHAKE_MS;
+	struct tls_conn *conn = tls_new(sockfd, ssl);
+	int want;
+
+	if (conn == NULL) {
+		return NULL;
+	}
+	while ((want = tls_handshake(conn)) > 0) {
+		if (!wait_socket(sockfd, want, deadline)) {
+			report("handshake");
+			g_tls_stats.failures++;
+			want = -1;
+			break;
+		}
+	}
+	if (want == -1) {
+		fcntl(sockfd, F_SETFL, conn->flags);
+		tls_free(conn);
+		return NULL;
+	}
+	return conn;
+}
+
+struct tls_conn* tls_accept(int sockfd) {
+	SSL *ssl;
+
+	if (g_ctx == NULL || (ssl = SSL_new(g_ctx)) == NULL) {
+		return NULL;
+	}
+	SSL_set_accept_state(ssl);
+	return tls_new(sockfd, ssl);
+}
+
+struct tls_conn* tls_connect(int sockfd, const char *host) {
+	struct in6_addr addr;
+	SSL *ssl;
+
+	if (g_ctx == NULL || (ssl = SSL_new(g_ctx)) == NULL) {
+		return NULL;
+	}
+	SSL_set_connect_state(ssl);
+	if (inet_pton(AF_INET, host, &addr) == 1 || inet_pton(AF_INET6, host, &addr) == 1) {
+		X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host);
+	} else {
+		SSL_set_tlsext_host_name(ssl, host);
+		SSL_set1_host(ssl, host);
+	}
+	if (g_session) {
+		SSL_set_session(ssl, g_session);
+	}
+	return handshake(sockfd, ssl);
+}
+
+void tls_remember(struct tls_conn *conn) {
+	SSL_SESSION *session = SSL_get1_session(conn->ssl);
+
+	if (session == NULL) {
+		return;
+	}
+	SSL_SESSION_free(g_session);
+	g_session = session;
+}
+
+int tls_resumed(struct tls_conn *conn) {
+	return SSL_session_reused(conn->ssl);
+}
+
+int tls_ktls(struct tls_conn *conn) {
+	return conn->ktls;
+}
+
+int tls_offloaded(struct tls_conn *conn) {
+	return conn->raw;
+}
+
+const char* tls_describe(struct tls_conn *conn) {
+	static char text[128];
+
+	snprintf(text, sizeof(text), "%s %s, kTLS %s%s", SSL_get_version(conn->ssl),
+			SSL_get_cipher_name(conn->ssl),
+			conn->ktls == (TLS_KTLS_TX | TLS_KTLS_RX) ? "tx+rx" :
+			conn->ktls == TLS_KTLS_TX ? "tx" : conn->ktls == TLS_KTLS_RX ? "rx" : "off",
+			SSL_session_reused(conn->ssl) ? ", resumed" : "");
+	return text;
+}
+
+int tls_read(struct tls_conn *conn, void *buf, size_t len) {
+	size_t n;
+	int ret, err;
+
+	if (conn->raw) {
+		return recv(conn->sockfd, buf, len, 0);
+	}
+	while (1) {
+		pthread_mutex_lock(&conn->lock);
+		ret = SSL_read_ex(conn->ssl, buf, len, &n);
+		err = ret == 1 ? SSL_ERROR_NONE : SSL_get_error(conn->ssl, ret);
+		pthread_mutex_unlock(&conn->lock);
+
+		if (err == SSL_ERROR_NONE) {
+			return n;
+		}
+		if (err == SSL_ERROR_ZERO_RETURN) {
+			return 0;
+		}
+		if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+			if (!conn->blocking) {
+				errno = EAGAIN;
+				return -1;
+			}
+			// the lock is not held here, so writers go on while we wait
+			wait_socket(conn->sockfd, err == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT, -1);
+			continue;
+		}
+		ERR_clear_error();
+		if (err != SSL_ERROR_SYSCALL || errno == 0) {
+			errno = EPROTO;
+		}
+		return -1;
+	}
+}
+
+int tls_write(struct tls_conn *conn, const void *buf, size_t len) {
+	long long deadline = now_ms() + TLS_WRITE_TIMEOUT_MS;
+	const char *p = buf;
+	size_t n;
+	int ret, err;
+
+	while (len > 0) {
+		pthread_mutex_lock(&conn->lock);
+		ret = SSL_write_ex(conn->ssl, p, len, &n);
+		err = ret == 1 ? SSL_ERROR_NONE : SSL_get_error(conn->ssl, ret);
+		pthread_mutex_unlock(&conn->lock);
+
+		if (err == SSL_ERROR_NONE) {
+			p += n;
+			len -= n;
+		} else if ((err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) &&
+				wait_socket(conn->sockfd, err == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT, deadline)) {
+			continue; // the same buffer again, as OpenSSL requires
+		} else {
+			ERR_clear_error();
+			if (err != SSL_ERROR_SYSCALL && err != SSL_ERROR_WANT_WRITE && err != SSL_ERROR_WANT_READ) {
+				errno = EPROTO;
+			}
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int tls_write_some(struct tls_conn *conn, const void *buf, size_t len) {
+	size_t n;
+	int ret, err;
+
+	pthread_mutex_lock(&conn->lock);
+	ret = SSL_write_ex(conn->ssl, buf, len, &n);
+	err = ret == 1 ? SSL_ERROR_NONE : SSL_get_error(conn->ssl, ret);
+	pthread_mutex_unlock(&conn->lock);
+
+	if (err == SSL_ERROR_NONE) {
+		return n;
+	}
+	if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) {
+		return 0;
+	}
+	ERR_clear_error();
+	if (err != SSL_ERROR_SYSCALL || errno == 0) {
+		errno = EPROTO;
+	}
+	return -1;
+}
+
+int tls_pending(struct tls_conn *conn) {
+	int pending;
+
+	if (conn->raw) {
+		return 0;
+	}
+	pthread_mutex_lock(&conn->lock);
+	pending = SSL_pending(conn->ssl) > 0;
+	pthread_mutex_unlock(&conn->lock);
+	return pending;
+}
+
+void tls_free(struct tls_conn *conn) {
+	if (conn == NULL) {
+		return;
+	}
+	SSL_free(conn->ssl);
+	pthread_mutex_destroy(&conn->lock);
+	free(conn);
+}
@@ -0,0 +1,295 @@
+/*
+ * transcript.c - transcript buffer, group commit writer and segment rotation
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "transcript.h"
+
+struct transcript_stats g_transcript_stats;
+
+static struct {
+	pthread_t writer;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	int running;
+	unsigned char *buf[2]; /* the I/O thread fills one while the writer commits the other */
+	size_t len;
+	unsigned count; /* records in buf[active] */
+	int active;
+	char dir[BUF_MAX];
+	int fd, index_fd;
+	uint32_t segment;
+	size_t segment_size;
+} g_tr = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER,
+		.fd = -1, .index_fd = -1 };
+
+static uint64_t g_next_session = 0;
+
+static double now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* the next segment number after those already in dir */
+static uint32_t last_segment() {
+	struct transcript_index_entry entry;
+	uint32_t last = 0;
+	char path[BUF_MAX + 16];
+	struct stat st;
+
+	/* the newest segment may not be in the index yet, so look for files too */
+	while (read(g_tr.index_fd, &entry, sizeof(entry)) == sizeof(entry)) {
+		if (entry.segment > last) {
+			last = entry.segment;
+		}
+	}
+	for (;;) {
+		snprintf(path, sizeof(path), "%s/%06u.seg", g_tr.dir, last + 1);
+		if (stat(path, &st) == -1) {
+			return last;
+		}
+		last++;
+	}
+}
+
+/* start a new segment, return 0 if success, otherwise -1 */
+static int open_segment() {
+	struct transcript_segment_header header;
+	char path[BUF_MAX + 16];
+	int fd;
+
+	/* another server in the same directory may have taken the number */
+	do {
+		g_tr.segment++;
+		snprintf(path, sizeof(path), "%s/%06u.seg", g_tr.dir, g_tr.segment);
+	} while ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644)) == -1 &&
+			errno == EEXIST);
+	if (fd == -1) {
+		perror("transcript: open segment");
+		return -1;
+	}
+	header.magic = TRANSCRIPT_MAGIC;
+	header.segment = g_tr.segment;
+	if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+		perror("transcript: write segment header");
+		close(fd);
+		return -1;
+	}
+	if (g_tr.fd != -1) {
+		fdatasync(g_tr.fd);
+		close(g_tr.fd);
+	}
+	g_tr.fd = fd;
+	g_tr.segment_size = sizeof(header);
+	g_transcript_stats.segment = g_tr.segment;
+	return 0;
+}
+
+/* write a batch of whole records and make it durable */
+static void commit(const unsigned char *batch, size_t len, unsigned count) {
+	static struct transcript_index_entry entries[TRANSCRIPT_BUF_SIZE / sizeof(struct transcript_record)];
+	struct transcript_record rec;
+	double start = now_ms(), took;
+	size_t at, written;
+	ssize_t n;
+	int nentries = 0;
+
+	if (g_tr.segment_size + len > TRANSCRIPT_SEGMENT_MAX &&
+			g_tr.segment_size > sizeof(struct transcript_segment_header)) {
+		open_segment();
+	}
+
+	/* sessions opened in this batch go to the index */
+	for (at = 0; at < len; at += sizeof(rec) + rec.len) {
+		memcpy(&rec, batch + at, sizeof(rec));
+		if (rec.type == TR_OPEN) {
+			entries[nentries].session = rec.session;
+			entries[nentries].segment = g_tr.segment;
+			entries[nentries].offset = g_tr.segment_size + at;
+			nentries++;
+		}
+	}
+
+	for (written = 0; written < len; written += n) {
+		if ((n = write(g_tr.fd, batch + written, len - written)) == -1) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			perror("transcript: write");
+			return;
+		}
+	}
+	g_tr.segment_size += len;
+	if (nentries > 0 && write(g_tr.index_fd, entries, nentries * sizeof(entries[0])) == -1) {
+		perror("transcript: write index");
+	}
+
+	/* one flush covers every record of the interval */
+	fdatasync(g_tr.fd);
+	if (nentries > 0) {
+		fdatasync(g_tr.index_fd);
+	}
+
+	took = now_ms() - start;
+	g_transcript_stats.commits++;
+	g_transcript_stats.bytes += len;
+	if (count > g_transcript_stats.max_batch) {
+		g_transcript_stats.max_batch = count;
+	}
+	if (took > g_transcript_stats.max_commit_ms) {
+		g_transcript_stats.max_commit_ms = took;
+	}
+}
+
+/* wakes every TRANSCRIPT_COMMIT_MS, or when the buffer is half full */
+static void* writer_thread(void *arg) {
+	struct timespec deadline;
+	unsigned char *batch;
+	size_t len;
+	unsigned count;
+
+	(void)arg; // all its state is in g_tr
+	pthread_mutex_lock(&g_tr.lock);
+	while (g_tr.running || g_tr.len > 0) {
+		if (g_tr.running && g_tr.len < TRANSCRIPT_BUF_SIZE / 2) {
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += TRANSCRIPT_COMMIT_MS * 1000000L;
+			deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+			deadline.tv_nsec %= 1000000000L;
+			pthread_cond_timedwait(&g_tr.wake, &g_tr.lock, &deadline);
+		}
+		if (g_tr.len == 0) {
+			continue;
+		}
+		batch = g_tr.buf[g_tr.active];
+		len = g_tr.len;
+		count = g_tr.count;
+		g_tr.active ^= 1;
+		g_tr.len = 0;
+		g_tr.count = 0;
+		pthread_mutex_unlock(&g_tr.lock);
+
+		commit(batch, len, count);
+
+		pthread_mutex_lock(&g_tr.lock);
+	}
+	pthread_mutex_unlock(&g_tr.lock);
+	return NULL;
+}
+
+int transcript_open(const char *dir) {
+	char path[BUF_MAX + 16];
+
+	if (g_tr.running) {
+		return 0;
+	}
+	snprintf(g_tr.dir, sizeof(g_tr.dir), "%s", dir);
+	if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+		perror("transcript: mkdir");
+		return -1;
+	}
+	snprintf(path, sizeof(path), "%s/index", dir);
+	if ((g_tr.index_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) == -1) {
+		perror("transcript: open index");
+		return -1;
+	}
+	g_tr.segment = last_segment();
+	if (open_segment() == -1) {
+		close(g_tr.index_fd);
+		g_tr.index_fd = -1;
+		return -1;
+	}
+	g_tr.buf[0] = malloc(TRANSCRIPT_BUF_SIZE);
+	g_tr.buf[1] = malloc(TRANSCRIPT_BUF_SIZE);
+	g_tr.len = 0;
+	g_tr.count = 0;
+	g_tr.running = 1;
+	if (pthread_create(&g_tr.writer, NULL, &writer_thread, NULL) != 0) {
+		perror("transcript: writer thread");
+		g_tr.running = 0;
+		transcript_close();
+		return -1;
+	}
+	return 0;
+}
+
+void transcript_close() {
+	int joined = g_tr.running;
+
+	pthread_mutex_lock(&g_tr.lock);
+	g_tr.running = 0;
+	pthread_cond_signal(&g_tr.wake);
+	pthread_mutex_unlock(&g_tr.lock);
+	if (joined) {
+		pthread_join(g_tr.writer, NULL);
+	}
+	if (g_tr.fd != -1) {
+		close(g_tr.fd);
+		g_tr.fd = -1;
+	}
+	if (g_tr.index_fd != -1) {
+		close(g_tr.index_fd);
+		g_tr.index_fd = -1;
+	}
+	free(g_tr.buf[0]);
+	free(g_tr.buf[1]);
+	g_tr.buf[0] = g_tr.buf[1] = NULL;
+}
+
+uint64_t transcript_session() {
+	/* start time and pid keep ids apart across restarts and servers sharing the directory */
+	if (g_next_session == 0) {
+		g_next_session = ((uint64_t)time(NULL) << 32) | ((uint64_t)(getpid() & 0xfff) << 20);
+	}
+	return ++g_next_session;
+}
+
+void transcript_add(transcript_type_t type, uint64_t session, const char *from,
+		const void *text, size_t len) {
+	struct transcript_record rec;
+	struct timespec ts;
+
+	if (len > UINT16_MAX) {
+		len = UINT16_MAX;
+	}
+	pthread_mutex_lock(&g_tr.lock);
+	if (!g_tr.running) {
+		pthread_mutex_unlock(&g_tr.lock);
+		return;
+	}
+	if (g_tr.len + sizeof(rec) + len > TRANSCRIPT_BUF_SIZE) {
+		/* the disk is behind, losing a record beats stalling every chat */
+		g_transcript_stats.dropped++;
+		pthread_cond_signal(&g_tr.wake);
+		pthread_mutex_unlock(&g_tr.lock);
+		return;
+	}
+	memset(&rec, 0, sizeof(rec));
+	clock_gettime(CLOCK_REALTIME, &ts);
+	rec.type = type;
+	rec.len = len;
+	rec.time = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+	rec.session = session;
+	strncpy(rec.from, from, NAME_LENGTH - 1);
+	memcpy(g_tr.buf[g_tr.active] + g_tr.len, &rec, sizeof(rec));
+	memcpy(g_tr.buf[g_tr.active] + g_tr.len + sizeof(rec), text, len);
+	g_tr.len += sizeof(rec) + len;
+	g_tr.count++;
+	g_transcript_stats.records++;
+	if (g_tr.len >= TRANSCRIPT_BUF_SIZE / 2) {
+		pthread_cond_signal(&g_tr.wake);
+	}
+	pthread_mutex_unlock(&g_tr.lock);
+}
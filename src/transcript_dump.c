@@ -0,0 +1,130 @@
+/*
+ * transcript_dump.c - prints session transcripts written by the TRS server
+ *
+ * ./transcript_dump [--session id] [dir]
+ * Without a session every segment is printed in order. With one, the index
+ * gives the segment and offset where the session was opened, and only its
+ * records from there on are printed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "transcript.h"
+
+/* print one record, text is nul terminated */
+static void print_record(const struct transcript_record *rec, const char *text) {
+	char stamp[32];
+	time_t seconds = rec->time / 1000000;
+	struct tm tm;
+
+	localtime_r(&seconds, &tm);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+	printf("%s.%03d %llu ", stamp, (int)(rec->time / 1000 % 1000), (unsigned long long)rec->session);
+	switch (rec->type) {
+	case TR_OPEN:
+		printf("%.*s is chatting with %s\n", NAME_LENGTH, rec->from, text);
+		break;
+	case TR_MSG:
+		printf("%.*s: %s\n", NAME_LENGTH, rec->from, text);
+		break;
+	case TR_FLAG:
+		printf("%.*s flagged %s\n", NAME_LENGTH, rec->from, text);
+		break;
+	default:
+		printf("unknown record %u\n", rec->type);
+		break;
+	}
+}
+
+/* print the records of one segment from offset on, only those of session unless it is 0
+ * return 0 if the segment exists, otherwise -1 */
+static int dump_segment(const char *dir, unsigned segment, long offset, unsigned long long session) {
+	struct transcript_segment_header header;
+	struct transcript_record rec;
+	char path[512];
+	char text[UINT16_MAX + 1];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%06u.seg", dir, segment);
+	if ((fp = fopen(path, "rb")) == NULL) {
+		return -1;
+	}
+	if (fread(&header, sizeof(header), 1, fp) != 1 || header.magic != TRANSCRIPT_MAGIC) {
+		fprintf(stderr, "%s: not a transcript segment\n", path);
+		fclose(fp);
+		return 0;
+	}
+	if (offset > 0) {
+		fseek(fp, offset, SEEK_SET);
+	}
+	while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+		if (fread(text, 1, rec.len, fp) != rec.len) {
+			fprintf(stderr, "%s: record cut short, the server stopped while writing it\n", path);
+			break;
+		}
+		text[rec.len] = '\0';
+		if (session == 0 || rec.session == session) {
+			print_record(&rec, text);
+		}
+	}
+	fclose(fp);
+	return 0;
+}
+
+/* find where session was opened, return 0 if found */
+static int lookup(const char *dir, unsigned long long session, struct transcript_index_entry *found) {
+	struct transcript_index_entry entry;
+	char path[512];
+	FILE *fp;
+	int ret = -1;
+
+	snprintf(path, sizeof(path), "%s/index", dir);
+	if ((fp = fopen(path, "rb")) == NULL) {
+		perror(path);
+		return -1;
+	}
+	while (fread(&entry, sizeof(entry), 1, fp) == 1) {
+		if (entry.session == session) {
+			*found = entry;
+			ret = 0;
+			break;
+		}
+	}
+	fclose(fp);
+	return ret;
+}
+
+int main(int argc, char *argv[]) {
+	const char *dir = TRANSCRIPT_DIR;
+	unsigned long long session = 0;
+	struct transcript_index_entry entry = { 0, 1, 0 };
+	unsigned segment;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--session") == 0 && i + 1 < argc) {
+			session = strtoull(argv[++i], NULL, 10);
+		} else if (argv[i][0] != '-') {
+			dir = argv[i];
+		} else {
+			printf("Usage: %s [--session id] [dir]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (session != 0 && lookup(dir, session, &entry) == -1) {
+		fprintf(stderr, "session %llu is not in the index\n", session);
+		return 1;
+	}
+	/* a session may go on in the segments after the one it was opened in */
+	segment = entry.segment;
+	if (dump_segment(dir, segment, entry.offset, session) == -1) {
+		fprintf(stderr, "no transcript segment %u in %s\n", segment, dir);
+		return 1;
+	}
+	while (dump_segment(dir, ++segment, 0, session) == 0);
+	return 0;
+}
@@ -0,0 +1,248 @@
+/*
+ * uring.c - raw io_uring setup, submission and completion rings
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags, void *arg, size_t size) {
+	return syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, size);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned nr) {
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+/* hand all provided buffers to the kernel */
+static int setup_buffers(struct uring *r) {
+	struct io_uring_buf_reg reg;
+	unsigned i;
+
+	r->br_size = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+	r->br = mmap(NULL, r->br_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (r->br == MAP_FAILED) {
+		r->br = NULL;
+		return -1;
+	}
+	r->bufs = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+	if (!r->bufs) {
+		return -1;
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)r->br;
+	reg.ring_entries = URING_BUF_COUNT;
+	reg.bgid = URING_BUF_GROUP;
+	if (sys_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+		return -1; /* needs 5.19 */
+	}
+	for (i = 0; i < URING_BUF_COUNT; i++) {
+		uring_buf_recycle(r, i);
+	}
+	return 0;
+}
+
+int uring_init(struct uring *r) {
+	struct io_uring_params p;
+	unsigned char *sq, *cq;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+	if ((r->fd = sys_setup(URING_ENTRIES, &p)) == -1) {
+		return -1;
+	}
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP) ||
+			!(p.features & IORING_FEAT_EXT_ARG)) {
+		close(r->fd);
+		errno = ENOSYS;
+		return -1;
+	}
+
+	/* one mapping holds both rings */
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (r->cq_ring_size > r->sq_ring_size) {
+		r->sq_ring_size = r->cq_ring_size;
+	}
+	r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED) {
+		close(r->fd);
+		return -1;
+	}
+	r->cq_ring = r->sq_ring;
+	r->cq_ring_size = 0;
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		uring_exit(r);
+		return -1;
+	}
+
+	sq = r->sq_ring;
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->sq_local_tail = *r->sq_tail;
+	cq = r->cq_ring;
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	if (setup_buffers(r) == -1) {
+		uring_exit(r);
+		return -1;
+	}
+	return 0;
+}
+
+void uring_exit(struct uring *r) {
+	if (r->br) {
+		munmap(r->br, r->br_size);
+	}
+	free(r->bufs);
+	if (r->sqes) {
+		munmap(r->sqes, r->sqes_size);
+	}
+	munmap(r->sq_ring, r->sq_ring_size);
+	close(r->fd);
+	r->fd = -1;
+}
+
+struct io_uring_sqe* uring_get_sqe(struct uring *r) {
+	struct io_uring_sqe *sqe;
+	unsigned index;
+
+	while (r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= *r->sq_mask + 1) {
+		uring_submit(r);
+	}
+	index = r->sq_local_tail & *r->sq_mask;
+	sqe = &r->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[index] = index;
+	r->sq_local_tail++;
+	return sqe;
+}
+
+unsigned uring_sq_space(struct uring *r) {
+	return *r->sq_mask + 1 - (r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE));
+}
+
+int uring_submit(struct uring *r) {
+	unsigned pending = r->sq_local_tail - *r->sq_tail;
+	int ret;
+
+	if (pending == 0) {
+		return 0;
+	}
+	__atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+	r->enters++;
+	while ((ret = sys_enter(r->fd, pending, 0, 0, NULL, 0)) == -1 && errno == EINTR);
+	return ret;
+}
+
+int uring_wait(struct uring *r, double timeout) {
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+
+	if (uring_peek_cqe(r)) {
+		return 0;
+	}
+	memset(&arg, 0, sizeof(arg));
+	if (timeout >= 0) {
+		ts.tv_sec = (long long)timeout;
+		ts.tv_nsec = (long long)((timeout - ts.tv_sec) * 1e9);
+		arg.ts = (unsigned long)&ts;
+	}
+	r->enters++;
+	if (sys_enter(r->fd, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+			&arg, sizeof(arg)) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+struct io_uring_cqe* uring_peek_cqe(struct uring *r) {
+	unsigned head = *r->cq_head;
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+	return &r->cqes[head & *r->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *r) {
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+unsigned char* uring_buf(struct uring *r, unsigned bid) {
+	return r->bufs + (size_t)bid * URING_BUF_SIZE;
+}
+
+void uring_buf_recycle(struct uring *r, unsigned bid) {
+	struct io_uring_buf *buf = &r->br->bufs[r->br_tail & (URING_BUF_COUNT - 1)];
+
+	buf->addr = (unsigned long)uring_buf(r, bid);
+	buf->len = URING_BUF_SIZE;
+	buf->bid = bid;
+	r->br_tail++;
+	__atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+}
+
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd, unsigned long long data) {
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data = data;
+}
+
+void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd, unsigned long long data) {
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUF_GROUP;
+	sqe->user_data = data;
+}
+
+void uring_prep_poll(struct io_uring_sqe *sqe, int fd, unsigned long long data) {
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = data;
+}
+
+void uring_prep_send(struct io_uring_sqe *sqe, int fd, const void *buf, size_t len,
+		unsigned long long data) {
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL; /* no short sends on a stream */
+	sqe->user_data = data;
+}
+
+void uring_prep_cancel(struct io_uring_sqe *sqe, unsigned long long target,
+		unsigned long long data) {
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = target;
+	sqe->user_data = data;
+}
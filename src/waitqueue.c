@@ -0,0 +1,113 @@
+/*
+ * waitqueue.c - wait queue for a chat partner with aging and time to pair
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "waitqueue.h"
+
+static struct {
+	int order[CLIENT_MAX]; /* slots by the time they asked */
+	int len;
+	double since[CLIENT_MAX];
+	float sample[WAIT_SAMPLES]; /* seconds to pair, a ring */
+	unsigned long pairs;
+} g_wait;
+
+static int cmp_float(const void *a, const void *b) {
+	float x = *(const float *)a, y = *(const float *)b;
+	return (x > y) - (x < y);
+}
+
+/* return the position of slot in the queue, -1 if it is not there */
+static int wait_find(int slot) {
+	int i;
+
+	for (i = 0; i < g_wait.len; i++) {
+		if (g_wait.order[i] == slot) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+void wait_queue_add(int slot, double now) {
+	if (wait_find(slot) != -1) {
+		return;
+	}
+	g_wait.since[slot] = now;
+	g_wait.order[g_wait.len++] = slot;
+}
+
+void wait_queue_leave(int slot, double now) {
+	int i = wait_find(slot);
+
+	if (i == -1) {
+		return;
+	}
+	memmove(&g_wait.order[i], &g_wait.order[i + 1], (g_wait.len - i - 1) * sizeof(g_wait.order[0]));
+	g_wait.len--;
+	if (now > 0) {
+		g_wait.sample[g_wait.pairs++ % WAIT_SAMPLES] = now - g_wait.since[slot];
+	}
+}
+
+int wait_queue_has(int slot) {
+	return wait_find(slot) != -1;
+}
+
+int wait_queue_count() {
+	return g_wait.len;
+}
+
+int wait_queue_order(int order[CLIENT_MAX]) {
+	memcpy(order, g_wait.order, g_wait.len * sizeof(g_wait.order[0]));
+	return g_wait.len;
+}
+
+int wait_queue_pick(const int slots[], int n, int extra, double now) {
+	double weight[CLIENT_MAX];
+	double total = extra;
+	double r;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		weight[i] = 1;
+		if (wait_find(slots[i]) != -1) {
+			weight[i] += (now - g_wait.since[slots[i]]) / WAIT_AGING_SECONDS;
+		}
+		total += weight[i];
+	}
+	r = rand() / (RAND_MAX + 1.0) * total;
+	for (i = 0; i < n; i++) {
+		if ((r -= weight[i]) < 0) {
+			return i;
+		}
+	}
+	// past the local ones, each extra candidate weighs 1
+	i = n + (int)r;
+	return i < n + extra ? i : n + extra - 1;
+}
+
+void wait_queue_stats(struct wait_stats *st, double now) {
+	static float sorted[WAIT_SAMPLES];
+	int n = g_wait.pairs < WAIT_SAMPLES ? g_wait.pairs : WAIT_SAMPLES;
+
+	memset(st, 0, sizeof(*st));
+	st->queued = g_wait.len;
+	if (g_wait.len > 0) {
+		st->longest = now - g_wait.since[g_wait.order[0]];
+	}
+	st->pairs = g_wait.pairs;
+	st->samples = n;
+	if (n == 0) {
+		return;
+	}
+	memcpy(sorted, g_wait.sample, n * sizeof(sorted[0]));
+	qsort(sorted, n, sizeof(sorted[0]), cmp_float);
+	st->p50 = sorted[n * 50 / 100];
+	st->p90 = sorted[n * 90 / 100];
+	st->p99 = sorted[n * 99 / 100];
+	st->max = sorted[n - 1];
+}
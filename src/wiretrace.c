@@ -0,0 +1,160 @@
+/*
+ * wiretrace.c - buffered capture of client frames and loading it back
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "wiretrace.h"
+
+struct wiretrace_stats g_wiretrace_stats;
+
+static struct {
+	pthread_mutex_t lock; /* the admin shell closes sockets too */
+	int fd;
+	unsigned char *buf;
+	size_t len;
+	long long last; /* monotonic microseconds of the previous record */
+} g_trace = { PTHREAD_MUTEX_INITIALIZER, -1, NULL, 0, 0 };
+
+static long long now_us(clockid_t clock) {
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* write the buffer out, lock held. a failed write stops the capture */
+static void flush_locked() {
+	unsigned char *p = g_trace.buf;
+	size_t left = g_trace.len;
+	ssize_t n;
+
+	while (left > 0) {
+		if ((n = write(g_trace.fd, p, left)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("wiretrace: write");
+			g_wiretrace_stats.failed++;
+			close(g_trace.fd);
+			g_trace.fd = -1;
+			break;
+		}
+		p += n;
+		left -= n;
+	}
+	g_trace.len = 0;
+}
+
+int wiretrace_open(const char *path) {
+	struct wiretrace_header header;
+
+	if ((g_trace.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1) {
+		perror(path);
+		return -1;
+	}
+	if ((g_trace.buf = malloc(WIRETRACE_BUF_SIZE)) == NULL) {
+		close(g_trace.fd);
+		g_trace.fd = -1;
+		return -1;
+	}
+	memset(&header, 0, sizeof(header));
+	header.magic = WIRETRACE_MAGIC;
+	header.start = now_us(CLOCK_REALTIME);
+	memcpy(g_trace.buf, &header, sizeof(header));
+	g_trace.len = sizeof(header);
+	g_trace.last = now_us(CLOCK_MONOTONIC);
+	return 0;
+}
+
+void wiretrace_close() {
+	pthread_mutex_lock(&g_trace.lock);
+	if (g_trace.fd != -1) {
+		flush_locked();
+		if (g_trace.fd != -1) {
+			close(g_trace.fd);
+			g_trace.fd = -1;
+		}
+	}
+	free(g_trace.buf);
+	g_trace.buf = NULL;
+	pthread_mutex_unlock(&g_trace.lock);
+}
+
+int wiretrace_active() {
+	return g_trace.fd != -1;
+}
+
+void wiretrace_add(wiretrace_type_t type, int conn, int flags, const void *buf, size_t len) {
+	struct wiretrace_record rec;
+	long long now, delta;
+
+	if (g_trace.fd == -1) {
+		return;
+	}
+	pthread_mutex_lock(&g_trace.lock);
+	if (g_trace.fd == -1) {
+		pthread_mutex_unlock(&g_trace.lock);
+		return;
+	}
+	if (g_trace.len + sizeof(rec) + len > WIRETRACE_BUF_SIZE) {
+		flush_locked();
+	}
+	now = now_us(CLOCK_MONOTONIC);
+	delta = now - g_trace.last;
+	g_trace.last = now;
+	rec.delta = delta > UINT32_MAX ? UINT32_MAX : delta; // an idle hour replays as 71 minutes
+	rec.conn = conn;
+	rec.len = len;
+	rec.type = type;
+	rec.flags = flags;
+	memcpy(g_trace.buf + g_trace.len, &rec, sizeof(rec));
+	memcpy(g_trace.buf + g_trace.len + sizeof(rec), buf, len);
+	g_trace.len += sizeof(rec) + len;
+	g_wiretrace_stats.records++;
+	g_wiretrace_stats.bytes += sizeof(rec) + len;
+	pthread_mutex_unlock(&g_trace.lock);
+}
+
+long wiretrace_load(const char *path, unsigned char **data, struct wiretrace_header *header) {
+	struct stat st;
+	unsigned char *buf;
+	long size, got = 0;
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1 || fstat(fd, &st) == -1) {
+		perror(path);
+		if (fd != -1) {
+			close(fd);
+		}
+		return -1;
+	}
+	size = st.st_size;
+	if (size < (long)sizeof(*header) || (buf = malloc(size)) == NULL) {
+		fprintf(stderr, "%s: not a wire trace\n", path);
+		close(fd);
+		return -1;
+	}
+	while (got < size && (n = read(fd, buf + got, size - got)) > 0) {
+		got += n;
+	}
+	close(fd);
+	memcpy(header, buf, sizeof(*header));
+	if (got != size || header->magic != WIRETRACE_MAGIC) {
+		fprintf(stderr, "%s: not a wire trace\n", path);
+		free(buf);
+		return -1;
+	}
+	memmove(buf, buf + sizeof(*header), size - sizeof(*header));
+	*data = buf;
+	return size - sizeof(*header);
+}
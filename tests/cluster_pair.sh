@@ -0,0 +1,51 @@
+#!/bin/bash
+# users on two nodes are paired across the link when their addresses hold colons,
+# both connect over a UNIX domain socket so their address is "unix:<uid>".
+# a node with the wrong secret gets no link.
+# run from the top directory after make: tests/cluster_pair.sh
+cd "$(dirname "$0")/.." || exit 1
+DIR=$(mktemp -d /tmp/trs_cluster.XXXXXX)
+# the pipelines' last process is the server or client itself, $! names it
+PIDS=
+trap 'kill $PIDS $(jobs -p) 2>/dev/null; wait $PIDS 2>/dev/null; [ -n "$KEEP" ] || rm -rf "$DIR"' EXIT
+echo "cluster secret for the test" > "$DIR/secret"
+echo "some other secret" > "$DIR/wrong"
+mkdir -p recv log
+
+(echo /start; sleep 30) | stdbuf -oL ./server --port 3593 --unix "$DIR/n1.sock" --node-id 1 --node-port 4590 \
+	--node-secret-file "$DIR/secret" > "$DIR/n1.log" 2>&1 &
+PIDS="$PIDS $!"
+sleep 0.5
+(echo /start; sleep 30) | stdbuf -oL ./server --port 3591 --unix "$DIR/n2.sock" --node-id 2 --peer localhost:4590 \
+	--node-secret-file "$DIR/secret" > "$DIR/n2.log" 2>&1 &
+PIDS="$PIDS $!"
+(echo /start; sleep 30) | stdbuf -oL ./server --port 3592 --node-id 3 --peer localhost:4590 \
+	--node-secret-file "$DIR/wrong" > "$DIR/n3.log" 2>&1 &
+PIDS="$PIDS $!"
+sleep 1
+(echo "/connect unix:$DIR/n2.sock"; sleep 30) | stdbuf -oL ./client > "$DIR/c2.log" 2>&1 &
+PIDS="$PIDS $!"
+sleep 2.5 # a pool summary names the user on node 2
+(echo "/connect unix:$DIR/n1.sock"; sleep 1; echo "/chat"; sleep 30) | stdbuf -oL ./client > "$DIR/c1.log" 2>&1 &
+PIDS="$PIDS $!"
+
+fail=0
+for i in $(seq 1 10); do
+	sleep 1
+	if grep -q "You are chatting with" "$DIR/c1.log" && grep -q "You are chatting with" "$DIR/c2.log"; then
+		break
+	fi
+done
+if ! grep -q "You are chatting with" "$DIR/c1.log" || ! grep -q "You are chatting with" "$DIR/c2.log"; then
+	echo "FAIL UNIX socket users were not paired across nodes"
+	fail=1
+fi
+if ! grep -q "does not know the secret" "$DIR/n1.log" || grep -q "linked with node" "$DIR/n3.log"; then
+	echo "FAIL a node with the wrong secret was linked"
+	fail=1
+fi
+if [ $fail -ne 0 ]; then
+	tail -n 5 "$DIR"/*.log
+	exit 1
+fi
+echo "PASS cluster pairing and authentication"
@@ -0,0 +1,35 @@
+#!/bin/bash
+# a multi-MB /transfer under the default rate limits lands whole in recv/
+# run from the top directory after make: tests/transfer_big.sh
+cd "$(dirname "$0")/.." || exit 1
+SIZE_MB=${SIZE_MB:-8}
+FILE=$(mktemp /tmp/trs_big.XXXXXX)
+NAME=$(basename "$FILE")
+# the pipelines' last process is the server or client itself, $! names it
+PIDS=
+trap 'kill $PIDS $(jobs -p) 2>/dev/null; wait $PIDS 2>/dev/null; rm -f "$FILE" recv/"$NAME"' EXIT
+
+head -c $((SIZE_MB << 20)) /dev/urandom > "$FILE"
+rm -f recv/"$NAME"
+mkdir -p recv log
+
+(echo /start; sleep 60) | ./server $SERVER_ARGS > /tmp/trs_big_server.log 2>&1 &
+PIDS="$PIDS $!"
+sleep 0.5
+(echo "/connect localhost"; sleep 1; echo "/chat"; sleep 1; echo "/transfer $FILE"; sleep 60) | ./client > /dev/null 2>&1 &
+PIDS="$PIDS $!"
+(echo "/connect localhost"; sleep 60) | ./client > /dev/null 2>&1 &
+PIDS="$PIDS $!"
+
+for i in $(seq 1 60); do
+	sleep 1
+	if cmp -s "$FILE" recv/"$NAME"; then
+		echo "PASS ${SIZE_MB} MB transfer"
+		exit 0
+	fi
+	if grep -q "disconnected for flooding" /tmp/trs_big_server.log; then
+		break
+	fi
+done
+echo "FAIL ${SIZE_MB} MB transfer, see /tmp/trs_big_server.log"
+exit 1